@@ -1,21 +1,22 @@
 #include "beginner.h"
 
-#define DATA_BUFFER_STRING "NVMe Demo Started!"
-
-struct nvme_demo_sequence {
-	struct ns_entry	*ns_entry;
-	char			*buf;
-	int				is_completed;
-};
-
-static void
-nvme_demo(void);
+// Pre-flight check of every namespace on the host: a pipelined write/read-verify
+// over a sample of LBAs spread over each namespace, then the same LBAs at queue
+// depth 1 for the unloaded latency. All namespaces run at once, spread over the
+// cores of -c, so the check takes about as long for 24 drives as for one.
 
 int
 main(int argc, char **argv)
-{	
+{
 	// Return value
 	int rc;
+	uint32_t i, main_core, num_cores = 0;
+	struct ns_entry *ns_entry;
+
+	rc = parse_args(argc, argv);
+	if (rc != 0) {
+		return rc;
+	}
 
 	// Initialize the SPDK environment options structure
 	struct spdk_env_opts opts;
@@ -23,6 +24,7 @@ main(int argc, char **argv)
 	spdk_env_opts_init(&opts);
 
 	opts.name = "beginner";
+	opts.core_mask = g_health.core_mask;
 
 	printf("Initializing SPDK Environment\n");
 
@@ -42,23 +44,52 @@ main(int argc, char **argv)
 	/* cb == callback. The second paramenter is cb_ctx. ctx == context. */
 	/* spdk_nvme_probe() is a synchronized function. */
 	/* It use underlying spdk_nvme_probe_async() and spdk_nvme_probe_poll_async() */
-	
+	/* The controllers are initialized in parallel, not one after the other. */
+
 	// Check if all the preparations are done
 	if (rc != 0) {
 		fprintf(stderr, "spdk_nvme_probe() failed\n");
 		rc = 1;
 		goto exit;
 	}
-	if (TAILQ_EMPTY(&g_controllers)) {
-		fprintf(stderr, "no NVMe controllers found\n");
+	if (TAILQ_EMPTY(&g_namespaces)) {
+		fprintf(stderr, "no NVMe namespaces found\n");
 		rc = 1;
 		goto exit;
 	}
 
 	printf("Initialization complete.\n");
+	g_health.seed = spdk_get_ticks();
+
+	// Round robin the namespaces over the cores, each core polls only its own
+	SPDK_ENV_FOREACH_CORE(i) {
+		num_cores++;
+	}
+	i = spdk_env_get_first_core();
+	TAILQ_FOREACH(ns_entry, &g_namespaces, link) {
+		ns_entry->lcore = i;
+		i = spdk_env_get_next_core(i);
+		if (i == UINT32_MAX) {
+			i = spdk_env_get_first_core();
+		}
+	}
+	printf("Checking %u LBAs of every namespace on %u core%s\n", g_health.num_samples,
+	       num_cores, num_cores > 1 ? "s" : "");
+
+	main_core = spdk_env_get_current_core();
+	SPDK_ENV_FOREACH_CORE(i) {
+		if (i != main_core) {
+			spdk_env_thread_launch_pinned(i, health_worker_fn, NULL);
+		}
+	}
+	health_worker_fn(NULL);
+	spdk_env_thread_wait_all();
+
+	rc = health_report();
+	if (g_health.json_out != NULL && health_write_json() != 0) {
+		rc = 1;
+	}
 
-	nvme_demo();
-	
 exit:
 	fflush(stdout);
 	cleanup();
@@ -68,58 +99,76 @@ exit:
 }
 
 static void
-nvme_demo(void)
+usage(const char *program_name)
 {
-	struct ns_entry				*ns_entry;
-	struct nvme_demo_sequence	sequence;
-	int							rc;
-
-	TAILQ_FOREACH(ns_entry, &g_namespaces, link) {
-		// Any I/O qpair allocated for a controller can submit I/O to any namespace on that controller
-		ns_entry->qpair = spdk_nvme_ctrlr_alloc_io_qpair(ns_entry->ctrlr, NULL, 0);
-		if (ns_entry->qpair == NULL) {
-			printf("ERROR: spdk_nvme_ctrlr_alloc_io_qpair() failed\n");
-			return;
-		}
-
-		sequence.ns_entry = ns_entry;
-
-		// The device in this experiment does not support CMB (Controller Memory Buffer). Skip trying spdk_nvme_ctrlr_map_cmb()
-		printf("INFO: using host memory buffer for IO\n");
-
-		// Use spdk_dma_zmalloc() to allocate a 4KB zeroed buffer
-		/* SPDK_MALLOC_DMA flags means the allocated memory will be pinned and safe for DMA */
-		sequence.buf = spdk_zmalloc(0x1000, 0x1000, NULL, SPDK_ENV_NUMA_ID_ANY, SPDK_MALLOC_DMA);
-		snprintf(sequence.buf, 0x1000, "%s", DATA_BUFFER_STRING);
-
-		sequence.is_completed = 0;
-
-		// The active namespace of the device is not a Zoned Namespace. Skip trying reset_zone_and_wait_for_completion()
+	printf("%s options", program_name);
+	printf("\n");
+	printf("\t[-c core mask, the namespaces are spread over its cores, default: 0x1]\n");
+	printf("\t[-n LBAs checked in each namespace, spread over all of it, default: 64]\n");
+	printf("\t[-q write/read-verify sequences in flight per namespace, default: 8]\n");
+	printf("\t[-s I/O size in bytes, default: 4096]\n");
+	printf("\t[-R read only, nothing is written and the data is not verified]\n");
+	printf("\t[-l fail a namespace whose mean QD1 read latency is above this in us, default: 0 (no limit)]\n");
+	printf("\t[-t fail a namespace which has not finished after this many seconds, default: 10]\n");
+	printf("\t[-o write the results as JSON, the --unloaded reference of nvme_wrr_demo]\n");
+	printf("\tExit code 2 when a namespace fails\n");
+	printf("\tWARNING: without -R, the sampled LBAs of every namespace are overwritten\n");
+}
 
-		// Write the data buffer to LBA 0 of this namespace
-		// Because of nvme_demo() is polling before the write I/O is completed, so passing &sequence (a local variable on the stack) is legal
-		rc = spdk_nvme_ns_cmd_write(ns_entry->ns, ns_entry->qpair, sequence.buf,
-					    0, /* LBA start */
-					    1, /* number of LBAs */
-					    write_complete, &sequence, 0);
-		/* &sequence is the argument of callback (cb_arg) function write_complete() */				
-		if (rc != 0) {
-			fprintf(stderr, "starting write I/O failed\n");
-			exit(1);
-		}
-		/* spdk_nvme_ns_cmd_write() is an asynchronized function */
-
-		// Poll for completions
-		// The SPDK NVMe driver will only check for completions when the application calls spdk_nvme_qpair_process_completions().
-		while (!sequence.is_completed) {
-			spdk_nvme_qpair_process_completions(ns_entry->qpair, 0 /* Process all available completions */);
-			/* spdk_nvme_qpair_process_completions() is an asynchronized function. */
-			/* This function may be called at any point while the controller is attached to the SPDK NVMe driver.*/
+static int
+parse_args(int argc, char **argv)
+{
+	int op;
+	long int val;
+
+	while ((op = getopt(argc, argv, "c:l:n:o:q:Rs:t:h")) != -1) {
+		switch (op) {
+		case 'c':
+			g_health.core_mask = optarg;
+			break;
+		case 'o':
+			g_health.json_out = optarg;
+			break;
+		case 'R':
+			g_health.read_only = true;
+			break;
+		case 'l':
+		case 'n':
+		case 'q':
+		case 's':
+		case 't':
+			val = spdk_strtol(optarg, 10);
+			if (val < 0 || (val == 0 && op != 'l')) {
+				fprintf(stderr, "Invalid value %s of -%c\n", optarg, op);
+				usage(argv[0]);
+				return 1;
+			}
+			switch (op) {
+			case 'l':
+				g_health.max_read_us = val;
+				break;
+			case 'n':
+				g_health.num_samples = val;
+				break;
+			case 'q':
+				g_health.queue_depth = val;
+				break;
+			case 's':
+				g_health.io_size_bytes = val;
+				break;
+			case 't':
+				g_health.timeout_sec = val;
+				break;
+			}
+			break;
+		case 'h':
+		default:
+			usage(argv[0]);
+			return 1;
 		}
-
-		// It is the responsibility of the caller to ensure all pending I/O are completed before trying to free the qpair.
-		spdk_nvme_ctrlr_free_io_qpair(ns_entry->qpair);
 	}
+
+	return 0;
 }
 
 // probe_cb will be called for each NVMe controller found
@@ -140,13 +189,13 @@ attach_cb(void *cb_ctx, const struct spdk_nvme_transport_id *trid,
 {
 	struct ctrlr_entry *entry;
 	const struct spdk_nvme_ctrlr_data *cdata;
-	
+
 	int nsid;
 	struct spdk_nvme_ns *ns;
-	
+
 	printf("Attached to %s ", trid->traddr);
 
-	entry = malloc(sizeof(struct ctrlr_entry));
+	entry = calloc(1, sizeof(struct ctrlr_entry));
 	if (entry == NULL) {
 		perror("ctrlr_entry malloc");
 		exit(1);
@@ -160,6 +209,15 @@ attach_cb(void *cb_ctx, const struct spdk_nvme_transport_id *trid,
 	// cdata->mn == Model Number  cdata->sn == Serial Number
 	snprintf(entry->name, sizeof(entry->name), "%-20.20s (%-20.20s)", cdata->mn, cdata->sn);
 	printf("%s\n", entry->name);
+	// Identify pads both with spaces, the serial number is what nvme_wrr_demo matches
+	snprintf(entry->mn, sizeof(entry->mn), "%.*s", (int)sizeof(cdata->mn), (const char *)cdata->mn);
+	snprintf(entry->sn, sizeof(entry->sn), "%.*s", (int)sizeof(cdata->sn), (const char *)cdata->sn);
+	for (int i = strlen(entry->mn) - 1; i >= 0 && entry->mn[i] == ' '; i--) {
+		entry->mn[i] = '\0';
+	}
+	for (int i = strlen(entry->sn) - 1; i >= 0 && entry->sn[i] == ' '; i--) {
+		entry->sn[i] = '\0';
+	}
 
 	TAILQ_INSERT_TAIL(&g_controllers, entry, link);
 
@@ -170,12 +228,12 @@ attach_cb(void *cb_ctx, const struct spdk_nvme_transport_id *trid,
 		if (ns == NULL) {
 			continue;
 		}
-		register_ns(ctrlr, ns);
+		register_ns(entry, ns);
 	}
 }
 
 static void
-register_ns(struct spdk_nvme_ctrlr *ctrlr, struct spdk_nvme_ns *ns)
+register_ns(struct ctrlr_entry *ctrlr_entry, struct spdk_nvme_ns *ns)
 {
 	struct ns_entry *entry;
 
@@ -183,13 +241,18 @@ register_ns(struct spdk_nvme_ctrlr *ctrlr, struct spdk_nvme_ns *ns)
 		return;
 	}
 
-	entry = malloc(sizeof(struct ns_entry));
+	entry = calloc(1, sizeof(struct ns_entry));
 	if (entry == NULL) {
 		perror("ns_entry malloc");
 		exit(1);
 	}
-	entry->ctrlr = ctrlr;
+	entry->ctrlr = ctrlr_entry->ctrlr;
+	entry->ctrlr_entry = ctrlr_entry;
 	entry->ns = ns;
+	entry->nsid = spdk_nvme_ns_get_id(ns);
+	entry->num_blocks = spdk_nvme_ns_get_num_sectors(ns);
+	entry->block_size = spdk_nvme_ns_get_extended_sector_size(ns);
+	entry->io_blocks = spdk_max(g_health.io_size_bytes / spdk_nvme_ns_get_sector_size(ns), 1);
 
 	TAILQ_INSERT_TAIL(&g_namespaces, entry, link);
 
@@ -197,63 +260,400 @@ register_ns(struct spdk_nvme_ctrlr *ctrlr, struct spdk_nvme_ns *ns)
 	       spdk_nvme_ns_get_size(ns) / 1000000000);
 }
 
+// Called on the core of the namespace, the queue pair belongs to that thread
+static int
+health_ns_init(struct ns_entry *ns_entry)
+{
+	uint64_t stretch, state;
+
+	ns_entry->write_qd1.min_tsc = UINT64_MAX;
+	ns_entry->read_qd1.min_tsc = UINT64_MAX;
+	ns_entry->start_tsc = spdk_get_ticks();
+
+	// Any I/O qpair allocated for a controller can submit I/O to any namespace on that controller
+	ns_entry->qpair = spdk_nvme_ctrlr_alloc_io_qpair(ns_entry->ctrlr, NULL, 0);
+	if (ns_entry->qpair == NULL) {
+		ns_entry->failure = "no I/O queue pair";
+		return -1;
+	}
+
+	// Evenly spread, at a random I/O of each stretch of the namespace
+	stretch = ns_entry->num_blocks / ns_entry->io_blocks / g_health.num_samples;
+	if (stretch == 0) {
+		ns_entry->failure = "smaller than the sample";
+		return -1;
+	}
+	ns_entry->lbas = calloc(g_health.num_samples, sizeof(*ns_entry->lbas));
+	if (ns_entry->lbas == NULL) {
+		ns_entry->failure = "out of memory";
+		return -1;
+	}
+	state = g_health.seed ^ ((uint64_t)ns_entry->nsid << 32) ^ (uintptr_t)ns_entry;
+	for (uint32_t i = 0; i < g_health.num_samples; i++) {
+		// xorshift64
+		state ^= state << 13;
+		state ^= state >> 7;
+		state ^= state << 17;
+		ns_entry->lbas[i] = (i * stretch + state % stretch) * ns_entry->io_blocks;
+	}
+
+	// The buffers are allocated once and reused by every sequence of the slot
+	/* SPDK_MALLOC_DMA flags means the allocated memory will be pinned and safe for DMA */
+	ns_entry->num_slots = spdk_min(g_health.queue_depth, g_health.num_samples);
+	ns_entry->slots = calloc(ns_entry->num_slots, sizeof(*ns_entry->slots));
+	if (ns_entry->slots == NULL) {
+		ns_entry->failure = "out of memory";
+		return -1;
+	}
+	for (uint32_t i = 0; i < ns_entry->num_slots; i++) {
+		ns_entry->slots[i].ns_entry = ns_entry;
+		ns_entry->slots[i].buf = spdk_zmalloc((size_t)ns_entry->io_blocks * ns_entry->block_size, 0x1000,
+						      NULL, SPDK_ENV_NUMA_ID_ANY, SPDK_MALLOC_DMA);
+		if (ns_entry->slots[i].buf == NULL) {
+			ns_entry->failure = "out of DMA memory";
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
 static void
-write_complete(void *arg, const struct spdk_nvme_cpl *completion)
+health_ns_fini(struct ns_entry *ns_entry)
 {
-	struct nvme_demo_sequence	*sequence = arg;
-	struct ns_entry				*ns_entry = sequence->ns_entry;
-	int							rc;
+	// It is the responsibility of the caller to ensure all pending I/O are completed before trying to free the qpair.
+	// A namespace which timed out keeps them, the detach of the controller cleans up.
+	if (ns_entry->outstanding != 0) {
+		return;
+	}
+	for (uint32_t i = 0; ns_entry->slots != NULL && i < ns_entry->num_slots; i++) {
+		spdk_free(ns_entry->slots[i].buf);
+	}
+	free(ns_entry->slots);
+	ns_entry->slots = NULL;
+	free(ns_entry->lbas);
+	ns_entry->lbas = NULL;
+	if (ns_entry->qpair != NULL) {
+		spdk_nvme_ctrlr_free_io_qpair(ns_entry->qpair);
+		ns_entry->qpair = NULL;
+	}
+}
 
-	if (spdk_nvme_cpl_is_error(completion)) {
-		// spdk_nvme_qpair_print_completion() is a debug tool function
-		spdk_nvme_qpair_print_completion(sequence->ns_entry->qpair, (struct spdk_nvme_cpl *)completion);
-		fprintf(stderr, "I/O error status: %s\n", spdk_nvme_cpl_get_status_string(&completion->status));
-		fprintf(stderr, "Write I/O failed, aborting run\n");
-		sequence->is_completed = 2;
-		exit(1);
+// Polls the queue pairs of the namespaces of its core until all of them are
+// done. With many namespaces per core the polling loop adds to the QD1 latency,
+// more cores in -c keep it small.
+static int
+health_worker_fn(void *arg)
+{
+	uint32_t lcore = spdk_env_get_current_core();
+	uint64_t timeout_tsc = (uint64_t)g_health.timeout_sec * spdk_get_ticks_hz();
+	struct ns_entry *ns_entry;
+	bool busy = true;
+	int32_t rc;
+
+	TAILQ_FOREACH(ns_entry, &g_namespaces, link) {
+		if (ns_entry->lcore != lcore) {
+			continue;
+		}
+		if (health_ns_init(ns_entry) != 0) {
+			ns_entry->phase = HEALTH_PHASE_DONE;
+			continue;
+		}
+		health_start_pipeline(ns_entry);
+	}
+
+	while (busy) {
+		busy = false;
+		TAILQ_FOREACH(ns_entry, &g_namespaces, link) {
+			if (ns_entry->lcore != lcore || ns_entry->phase == HEALTH_PHASE_DONE) {
+				continue;
+			}
+			busy = true;
+			// The SPDK NVMe driver will only check for completions when the application calls spdk_nvme_qpair_process_completions().
+			rc = spdk_nvme_qpair_process_completions(ns_entry->qpair, 0 /* Process all available completions */);
+			if (rc < 0) {
+				ns_entry->failure = "queue pair failed";
+				ns_entry->phase = HEALTH_PHASE_DONE;
+			} else if (spdk_get_ticks() - ns_entry->start_tsc > timeout_tsc) {
+				ns_entry->failure = "timed out";
+				ns_entry->phase = HEALTH_PHASE_DONE;
+			}
+		}
+	}
+
+	TAILQ_FOREACH(ns_entry, &g_namespaces, link) {
+		if (ns_entry->lcore == lcore) {
+			health_ns_fini(ns_entry);
+		}
+	}
+
+	return 0;
+}
+
+static void
+health_start_pipeline(struct ns_entry *ns_entry)
+{
+	ns_entry->phase = HEALTH_PHASE_PIPELINE;
+	ns_entry->next_sample = 0;
+	ns_entry->completed = 0;
+	for (uint32_t i = 0; i < ns_entry->num_slots; i++) {
+		health_slot_start(&ns_entry->slots[i]);
+	}
+}
+
+static void
+health_start_qd1(struct ns_entry *ns_entry)
+{
+	ns_entry->phase = HEALTH_PHASE_QD1;
+	ns_entry->next_sample = 0;
+	ns_entry->completed = 0;
+	health_slot_start(&ns_entry->slots[0]);
+}
+
+// Begin the write/read-verify sequence of the next sample, if any is left
+static void
+health_slot_start(struct health_slot *slot)
+{
+	struct ns_entry *ns_entry = slot->ns_entry;
+
+	if (ns_entry->next_sample == g_health.num_samples) {
+		return;
+	}
+	slot->sample = ns_entry->next_sample++;
+
+	if (g_health.read_only) {
+		health_slot_submit(slot, false);
+		return;
+	}
+	health_fill(ns_entry, ns_entry->lbas[slot->sample], slot->buf);
+	health_slot_submit(slot, true);
+}
+
+static void
+health_slot_submit(struct health_slot *slot, bool is_write)
+{
+	struct ns_entry *ns_entry = slot->ns_entry;
+	uint64_t lba = ns_entry->lbas[slot->sample];
+	int rc;
+
+	slot->is_write = is_write;
+	slot->submit_tsc = spdk_get_ticks();
+	/* slot is the argument of callback (cb_arg) function health_complete() */
+	if (is_write) {
+		rc = spdk_nvme_ns_cmd_write(ns_entry->ns, ns_entry->qpair, slot->buf, lba,
+					    ns_entry->io_blocks, health_complete, slot, 0);
+	} else {
+		rc = spdk_nvme_ns_cmd_read(ns_entry->ns, ns_entry->qpair, slot->buf, lba,
+					   ns_entry->io_blocks, health_complete, slot, 0);
 	}
-	
-	// Free the buffer associated withthe write I/O 
-	spdk_free(sequence->buf);
-	
-	// And allocate a new zeroed buffer for reading the data back from the NVMe namespace.
-	sequence->buf = spdk_zmalloc(0x1000, 0x1000, NULL, SPDK_ENV_NUMA_ID_ANY, SPDK_MALLOC_DMA);
-
-	// Read the data in LBA 0 of this namespace
-	rc = spdk_nvme_ns_cmd_read(ns_entry->ns, ns_entry->qpair, sequence->buf,
-				   0, /* LBA start */
-				   1, /* number of LBAs */
-				   read_complete, (void *)sequence, 0);
 	if (rc != 0) {
-		fprintf(stderr, "starting read I/O failed\n");
-		exit(1);
+		fprintf(stderr, "starting %s I/O on %s namespace %u failed: %s\n",
+			is_write ? "write" : "read", ns_entry->ctrlr_entry->name, ns_entry->nsid,
+			spdk_strerror(-rc));
+		ns_entry->failure = "submission failed";
+		ns_entry->phase = HEALTH_PHASE_DONE;
+		return;
 	}
+	ns_entry->outstanding++;
 }
 
 static void
-read_complete(void *arg, const struct spdk_nvme_cpl *completion)
+health_complete(void *arg, const struct spdk_nvme_cpl *completion)
 {
-	struct nvme_demo_sequence *sequence = arg;
+	struct health_slot *slot = arg;
+	struct ns_entry *ns_entry = slot->ns_entry;
+	uint64_t tsc = spdk_get_ticks() - slot->submit_tsc;
 
-	// All I/O operations are completed. So the polling in the main thread can stop.
-	sequence->is_completed = 1;
+	ns_entry->outstanding--;
+	if (ns_entry->phase == HEALTH_PHASE_DONE) {
+		return;
+	}
 
 	if (spdk_nvme_cpl_is_error(completion)) {
-		spdk_nvme_qpair_print_completion(sequence->ns_entry->qpair, (struct spdk_nvme_cpl *)completion);
-		fprintf(stderr, "I/O error status: %s\n", spdk_nvme_cpl_get_status_string(&completion->status));
-		fprintf(stderr, "Read I/O failed, aborting run\n");
-		sequence->is_completed = 2;
-		exit(1);
+		if (ns_entry->io_errors++ == 0) {
+			// spdk_nvme_qpair_print_completion() is a debug tool function
+			spdk_nvme_qpair_print_completion(ns_entry->qpair, (struct spdk_nvme_cpl *)completion);
+			fprintf(stderr, "%s I/O error on %s namespace %u LBA %" PRIu64 ": %s\n",
+				slot->is_write ? "Write" : "Read", ns_entry->ctrlr_entry->name, ns_entry->nsid,
+				ns_entry->lbas[slot->sample], spdk_nvme_cpl_get_status_string(&completion->status));
+		}
+	} else if (slot->is_write) {
+		if (ns_entry->phase == HEALTH_PHASE_QD1) {
+			health_latency_record(&ns_entry->write_qd1, tsc);
+		}
+		// Read the data back into the same buffer, cleared so stale data cannot pass
+		memset(slot->buf, 0, (size_t)ns_entry->io_blocks * ns_entry->block_size);
+		health_slot_submit(slot, false);
+		return;
+	} else {
+		if (ns_entry->phase == HEALTH_PHASE_QD1) {
+			health_latency_record(&ns_entry->read_qd1, tsc);
+		}
+		// Compare and check if the I/O is correct
+		if (!g_health.read_only && !health_check(ns_entry, ns_entry->lbas[slot->sample], slot->buf)) {
+			if (ns_entry->mismatches++ == 0) {
+				fprintf(stderr, "Read data doesn't match write data on %s namespace %u LBA %" PRIu64 "\n",
+					ns_entry->ctrlr_entry->name, ns_entry->nsid, ns_entry->lbas[slot->sample]);
+			}
+		}
 	}
 
-	// Compare and check if the I/O is correct
-	if (strcmp(sequence->buf, DATA_BUFFER_STRING)) {
-		fprintf(stderr, "Read data doesn't match write data\n");
-		exit(1);
+	// The sequence of this sample is over
+	if (++ns_entry->completed < g_health.num_samples) {
+		health_slot_start(slot);
+	} else if (ns_entry->phase == HEALTH_PHASE_PIPELINE) {
+		health_start_qd1(ns_entry);
+	} else {
+		ns_entry->phase = HEALTH_PHASE_DONE;
+	}
+}
+
+// Unique to the LBA and the run, so neither another LBA nor an earlier run matches
+static void
+health_fill(struct ns_entry *ns_entry, uint64_t lba, uint64_t *buf)
+{
+	size_t words = (size_t)ns_entry->io_blocks * ns_entry->block_size / sizeof(uint64_t);
+
+	for (size_t i = 0; i < words; i++) {
+		buf[i] = (lba * 0x9e3779b97f4a7c15ULL) ^ g_health.seed ^ i;
+	}
+}
+
+static bool
+health_check(struct ns_entry *ns_entry, uint64_t lba, const uint64_t *buf)
+{
+	size_t words = (size_t)ns_entry->io_blocks * ns_entry->block_size / sizeof(uint64_t);
+
+	for (size_t i = 0; i < words; i++) {
+		if (buf[i] != ((lba * 0x9e3779b97f4a7c15ULL) ^ g_health.seed ^ i)) {
+			return false;
+		}
 	}
 
-	printf("%s\n", sequence->buf);
-	spdk_free(sequence->buf);
+	return true;
+}
+
+static void
+health_latency_record(struct health_latency *latency, uint64_t tsc)
+{
+	latency->count++;
+	latency->total_tsc += tsc;
+	latency->min_tsc = spdk_min(latency->min_tsc, tsc);
+	latency->max_tsc = spdk_max(latency->max_tsc, tsc);
+}
+
+static double
+health_tsc_to_us(uint64_t tsc)
+{
+	return (double)tsc * SECOND_TO_MICROSECOND / spdk_get_ticks_hz();
+}
+
+static void
+health_latency_print(const char *op, const struct health_latency *latency)
+{
+	if (latency->count == 0) {
+		printf("%-43.43s QD1 %-5s latency: none completed\n", "", op);
+		return;
+	}
+	printf("%-43.43s QD1 %-5s latency average: %8.2f min: %8.2f max: %8.2f us\n", "", op,
+	       health_tsc_to_us(latency->total_tsc / latency->count),
+	       health_tsc_to_us(latency->min_tsc), health_tsc_to_us(latency->max_tsc));
+}
+
+static int
+health_report(void)
+{
+	struct ns_entry *ns_entry;
+	const struct health_latency *read, *write;
+	uint32_t passed = 0, total = 0;
+
+	printf("========================================================\n");
+	TAILQ_FOREACH(ns_entry, &g_namespaces, link) {
+		read = &ns_entry->read_qd1;
+		write = &ns_entry->write_qd1;
+		if (ns_entry->failure == NULL) {
+			if (ns_entry->io_errors != 0) {
+				ns_entry->failure = "I/O errors";
+			} else if (ns_entry->mismatches != 0) {
+				ns_entry->failure = "data mismatch";
+			} else if (g_health.max_read_us != 0 && read->count != 0 &&
+				   health_tsc_to_us(read->total_tsc / read->count) > g_health.max_read_us) {
+				ns_entry->failure = "QD1 read latency above -l";
+			}
+		}
+		ns_entry->pass = ns_entry->failure == NULL;
+		passed += ns_entry->pass;
+		total++;
+
+		printf("%-43.43s Namespace %u with core %u: %s%s%s\n", ns_entry->ctrlr_entry->name,
+		       ns_entry->nsid, ns_entry->lcore, ns_entry->pass ? "PASS" : "FAIL",
+		       ns_entry->pass ? "" : ", ", ns_entry->pass ? "" : ns_entry->failure);
+		printf("%-43.43s %" PRIu64 " LBAs, %" PRIu64 " I/O errors, %" PRIu64 " mismatched\n", "",
+		       read->count, ns_entry->io_errors, ns_entry->mismatches);
+		health_latency_print("read", read);
+		if (!g_health.read_only) {
+			health_latency_print("write", write);
+		}
+	}
+	printf("========================================================\n");
+	printf("%u of %u namespaces passed\n", passed, total);
+
+	return passed == total ? 0 : 2;
+}
+
+// Model and serial number come from the device, anything but printable
+// ASCII is escaped
+static void
+health_json_string(FILE *file, const char *str)
+{
+	fputc('"', file);
+	for (const unsigned char *c = (const unsigned char *)str; *c != '\0'; c++) {
+		if (*c == '"' || *c == '\\') {
+			fprintf(file, "\\%c", *c);
+		} else if (*c < 0x20 || *c >= 0x7f) {
+			fprintf(file, "\\u%04x", *c);
+		} else {
+			fputc(*c, file);
+		}
+	}
+	fputc('"', file);
+}
+
+// Written by hand, the tool does not link the JSON library of SPDK
+static int
+health_write_json(void)
+{
+	struct ns_entry *ns_entry;
+	const struct health_latency *read, *write;
+	FILE *file;
+
+	file = fopen(g_health.json_out, "w");
+	if (file == NULL) {
+		perror("json-out");
+		return -1;
+	}
+	fprintf(file, "{\"namespaces\":[");
+	TAILQ_FOREACH(ns_entry, &g_namespaces, link) {
+		read = &ns_entry->read_qd1;
+		write = &ns_entry->write_qd1;
+		fprintf(file, "%s{\"model\":", ns_entry == TAILQ_FIRST(&g_namespaces) ? "" : ",");
+		health_json_string(file, ns_entry->ctrlr_entry->mn);
+		fprintf(file, ",\"serial\":");
+		health_json_string(file, ns_entry->ctrlr_entry->sn);
+		fprintf(file, ",\"nsid\":%u,\"pass\":%s,"
+			"\"samples\":%" PRIu64 ",\"read_qd1_ns\":%" PRIu64 ",\"write_qd1_ns\":%" PRIu64 "}",
+			ns_entry->nsid, ns_entry->pass ? "true" : "false", read->count,
+			read->count ? (uint64_t)(health_tsc_to_us(read->total_tsc / read->count) * 1000) : 0,
+			write->count ? (uint64_t)(health_tsc_to_us(write->total_tsc / write->count) * 1000) : 0);
+	}
+	fprintf(file, "]}\n");
+	if (fclose(file) != 0) {
+		fprintf(stderr, "could not write %s\n", g_health.json_out);
+		return -1;
+	}
+	printf("Results written to %s\n", g_health.json_out);
+
+	return 0;
 }
 
 static void
@@ -263,22 +663,32 @@ cleanup(void)
 	struct ctrlr_entry *ctrlr_entry, *tmp_ctrlr_entry;
 	struct spdk_nvme_detach_ctx *detach_ctx = NULL;
 
-	TAILQ_FOREACH_SAFE(ns_entry, &g_namespaces, link, tmp_ns_entry) {
-		TAILQ_REMOVE(&g_namespaces, ns_entry, link);
-		free(ns_entry);
-	}
-
-	TAILQ_FOREACH_SAFE(ctrlr_entry, &g_controllers, link, tmp_ctrlr_entry) {
-		TAILQ_REMOVE(&g_controllers, ctrlr_entry, link);
+	TAILQ_FOREACH(ctrlr_entry, &g_controllers, link) {
 		// detach_ctx tracks detachment of multiple controllers
 		// An new context is allocated if this call is the first successful start of detachment in a sequence.
 		spdk_nvme_detach_async(ctrlr_entry->ctrlr, &detach_ctx);
-		free(ctrlr_entry);
 	}
 
-	// detach_ctx 
+	// detach_ctx
 	if (detach_ctx) {
 		// polling the detachment
 		spdk_nvme_detach_poll(detach_ctx);
 	}
+
+	// Only after the detach, it completes the I/O a namespace which timed out
+	// left outstanding and health_complete() still uses the entry
+	TAILQ_FOREACH_SAFE(ns_entry, &g_namespaces, link, tmp_ns_entry) {
+		TAILQ_REMOVE(&g_namespaces, ns_entry, link);
+		for (uint32_t i = 0; ns_entry->slots != NULL && i < ns_entry->num_slots; i++) {
+			spdk_free(ns_entry->slots[i].buf);
+		}
+		free(ns_entry->slots);
+		free(ns_entry->lbas);
+		free(ns_entry);
+	}
+
+	TAILQ_FOREACH_SAFE(ctrlr_entry, &g_controllers, link, tmp_ctrlr_entry) {
+		TAILQ_REMOVE(&g_controllers, ctrlr_entry, link);
+		free(ctrlr_entry);
+	}
 }
@@ -2,25 +2,111 @@
 #include "spdk/env.h"
 
 #include "spdk/nvme.h"
+#include "spdk/string.h"
+#include "spdk/util.h"
+
+#define SECOND_TO_MICROSECOND 1000000
 
 static struct spdk_nvme_transport_id g_trid = {};
 
+// Command line of the health check
+static struct {
+	const char	*core_mask;
+	// LBAs checked in each namespace, spread over all of it
+	uint32_t	num_samples;
+	// Write/read-verify sequences in flight per namespace in the pipelined pass
+	uint32_t	queue_depth;
+	uint32_t	io_size_bytes;
+	// Only reads, nothing on the namespaces is overwritten
+	bool		read_only;
+	// Mean QD1 read latency above it fails a namespace, 0 means no limit
+	uint32_t	max_read_us;
+	// A namespace which has not finished by then fails
+	uint32_t	timeout_sec;
+	// Per namespace results for --unloaded of nvme_wrr_demo
+	const char	*json_out;
+	uint64_t	seed;
+} g_health = {
+	.core_mask		= "0x1",
+	.num_samples	= 64,
+	.queue_depth	= 8,
+	.io_size_bytes	= 4096,
+	.timeout_sec	= 10,
+};
+
 struct ctrlr_entry {
 	// spdk_nvme_ctrlr is the logical abstraction in SPDK for an NVMe controller
 	struct spdk_nvme_ctrlr		*ctrlr;
 	TAILQ_ENTRY(ctrlr_entry)	link;
 	char						name[1024];
+	// Model and serial number without the padding
+	char						mn[41];
+	char						sn[21];
 };
 static TAILQ_HEAD(, ctrlr_entry) g_controllers = TAILQ_HEAD_INITIALIZER(g_controllers);
 
+enum health_phase {
+	// Write/read-verify of every sample, queue_depth of them at once
+	HEALTH_PHASE_PIPELINE,
+	// The samples again one at a time, for the unloaded latency
+	HEALTH_PHASE_QD1,
+	HEALTH_PHASE_DONE,
+};
+
+struct health_latency {
+	uint64_t	count;
+	uint64_t	total_tsc;
+	uint64_t	min_tsc;
+	uint64_t	max_tsc;
+};
+
+// A write/read-verify sequence in flight, with its own buffer for the whole run
+struct health_slot {
+	struct ns_entry			*ns_entry;
+	void					*buf;
+	uint32_t				sample;
+	bool					is_write;
+	uint64_t				submit_tsc;
+};
+
 struct ns_entry {
 	struct spdk_nvme_ctrlr	*ctrlr;
+	struct ctrlr_entry		*ctrlr_entry;
 	struct spdk_nvme_ns		*ns;
 	TAILQ_ENTRY(ns_entry)	link;
+	// Allocated by the worker of lcore, which is the only one to touch it
 	struct spdk_nvme_qpair	*qpair;
+	uint32_t				lcore;
+	uint32_t				nsid;
+	uint64_t				num_blocks;
+	// Extended sector size, the interleaved metadata is checked as data
+	uint32_t				block_size;
+	uint32_t				io_blocks;
+	uint64_t				*lbas;
+	struct health_slot		*slots;
+	uint32_t				num_slots;
+
+	enum health_phase		phase;
+	uint32_t				next_sample;
+	uint32_t				completed;
+	uint32_t				outstanding;
+	uint64_t				start_tsc;
+	// Why the namespace failed, NULL while it passes
+	const char				*failure;
+	uint64_t				io_errors;
+	uint64_t				mismatches;
+	struct health_latency	write_qd1;
+	struct health_latency	read_qd1;
+	bool					pass;
 };
 static TAILQ_HEAD(, ns_entry) g_namespaces = TAILQ_HEAD_INITIALIZER(g_namespaces);
 
+static void
+usage(const char *program_name);
+
+static int
+parse_args(int argc, char **argv);
+
 static bool
 probe_cb(void *cb_ctx, const struct spdk_nvme_transport_id *trid,
 	  struct spdk_nvme_ctrlr_opts *opts);
@@ -30,13 +116,55 @@ attach_cb(void *cb_ctx, const struct spdk_nvme_transport_id *trid,
 	  struct spdk_nvme_ctrlr *ctrlr, const struct spdk_nvme_ctrlr_opts *opts);
 
 static void
-register_ns(struct spdk_nvme_ctrlr *ctrlr, struct spdk_nvme_ns *ns);
+register_ns(struct ctrlr_entry *ctrlr_entry, struct spdk_nvme_ns *ns);
+
+static int
+health_ns_init(struct ns_entry *ns_entry);
+
+static void
+health_ns_fini(struct ns_entry *ns_entry);
+
+static int
+health_worker_fn(void *arg);
+
+static void
+health_start_pipeline(struct ns_entry *ns_entry);
+
+static void
+health_start_qd1(struct ns_entry *ns_entry);
+
+static void
+health_slot_start(struct health_slot *slot);
+
+static void
+health_slot_submit(struct health_slot *slot, bool is_write);
+
+static void
+health_complete(void *arg, const struct spdk_nvme_cpl *completion);
 
 static void
-write_complete(void *arg, const struct spdk_nvme_cpl *completion);
+health_fill(struct ns_entry *ns_entry, uint64_t lba, uint64_t *buf);
+
+static bool
+health_check(struct ns_entry *ns_entry, uint64_t lba, const uint64_t *buf);
+
+static void
+health_latency_record(struct health_latency *latency, uint64_t tsc);
+
+static double
+health_tsc_to_us(uint64_t tsc);
 
 static void
-read_complete(void *arg, const struct spdk_nvme_cpl *completion);
+health_latency_print(const char *op, const struct health_latency *latency);
+
+static int
+health_report(void);
+
+static void
+health_json_string(FILE *file, const char *str);
+
+static int
+health_write_json(void);
 
 static void
 cleanup(void);
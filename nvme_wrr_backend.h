@@ -0,0 +1,144 @@
+#ifndef NVME_WRR_BACKEND_H
+#define NVME_WRR_BACKEND_H
+
+#include "spdk/stdinc.h"
+#include "spdk/config.h"
+#include "spdk/nvme.h"
+
+// Upper bound of the segments of one vectored I/O
+#define SGL_MAX_SEGMENTS 32
+
+// Upper bound of --filename
+#define BACKEND_MAX_FILENAMES 32
+
+// Commands issued by the workload
+enum arb_op {
+	ARB_OP_READ,
+	ARB_OP_WRITE,
+	ARB_OP_FLUSH,
+	// Dataset Management with the deallocate attribute
+	ARB_OP_DSM,
+	ARB_OP_WRITE_ZEROES,
+	ARB_OP_COUNT,
+};
+
+// One command handed to a backend queue pair.
+// The backend calls cb_fn with the command itself once it is completed,
+// the status is reported the NVMe way whatever the backend is.
+struct arb_cmd {
+	enum arb_op			op;
+	// Namespace handle given by the backend at attach time
+	void				*ns;
+	uint64_t			lba;
+	uint32_t			lba_count;
+	// Data layout, a single entry for contiguous buffers
+	struct iovec		iovs[SGL_MAX_SEGMENTS];
+	int					iovcnt;
+	// Submit through the scatter-gather interface even for one entry
+	bool				vectored;
+	// Separate metadata of the blocks, NULL when the namespace has none or
+	// the metadata is interleaved with the data
+	void				*md_buf;
+	// SPDK_NVME_IO_FLAGS_PRACT and PRCHK_* of reads and writes
+	uint32_t			io_flags;
+	uint16_t			apptag_mask;
+	uint16_t			apptag;
+	// Cursor of the reset_sgl/next_sge callbacks
+	int					iov_pos;
+	uint32_t			iov_offset;
+	spdk_nvme_cmd_cb	cb_fn;
+};
+
+// Service time distributions of the sim backend
+enum arb_sim_dist {
+	ARB_SIM_DIST_FIXED,
+	ARB_SIM_DIST_UNIFORM,
+	ARB_SIM_DIST_EXP,
+};
+
+struct arb_sim_service {
+	enum arb_sim_dist	dist;
+	// Fixed and exp use min_us as the value and the mean respectively
+	uint32_t			min_us;
+	uint32_t			max_us;
+};
+
+// What the workload needs to know about a namespace of any backend
+struct arb_backend_ns_info {
+	char				name[44];
+	uint32_t			nsid;
+	uint64_t			size;
+	uint32_t			block_size;
+	// block_size plus md_size when the metadata is interleaved
+	uint32_t			extended_block_size;
+	uint32_t			md_size;
+	// Extended LBA, otherwise the metadata goes in a buffer of its own
+	bool				md_interleave;
+	enum spdk_nvme_pi_type	pi_type;
+	// Protection information in the first bytes of the metadata
+	bool				pi_loc;
+	// SPDK_NVME_NS_*_SUPPORTED
+	uint32_t			flags;
+	bool				sgl_supported;
+	// The backend arbitrates between the queue priorities
+	bool				wrr_supported;
+};
+
+struct arb_backend_opts {
+	// uring
+	const char			*filenames[BACKEND_MAX_FILENAMES];
+	int					num_filenames;
+	bool				uring_sqpoll;
+	// sim
+	uint32_t			sim_namespaces;
+	uint64_t			sim_ns_size;
+	struct arb_sim_service	sim_service[ARB_OP_COUNT];
+	// Commands the controller works on at the same time
+	uint32_t			sim_parallelism;
+	uint64_t			sim_seed;
+	// Metadata of every block, interleaved or separate, with protection information
+	uint32_t			sim_md_size;
+	bool				sim_md_interleave;
+	enum spdk_nvme_pi_type	sim_pi_type;
+	// Arbitration feature as set on hardware, weights are 1's based
+	uint32_t			arbitration_burst;
+	uint32_t			weights[SPDK_NVME_QPRIO_MAX];
+};
+
+typedef void (*arb_backend_ns_cb)(void *backend_ns, const struct arb_backend_ns_info *info);
+
+// Everything the workload does with a device goes through these.
+// Queue pairs are only used by the thread which allocated them.
+struct arb_backend_ops {
+	const char	*name;
+	// Find the devices and report every namespace through ns_cb
+	int			(*attach)(const struct arb_backend_opts *opts, arb_backend_ns_cb ns_cb);
+	void		(*detach)(void);
+	void		*(*qpair_alloc)(void *backend_ns, enum spdk_nvme_qprio qprio, uint32_t depth);
+	void		(*qpair_free)(void *qpair);
+	// Tell the queue pair about memory which is used for many I/O, optional
+	int			(*register_buf)(void *qpair, void *buf, size_t len);
+	int			(*submit)(void *qpair, struct arb_cmd *cmd);
+	// Returns the number of completions, 0 for max_completions means all
+	int32_t		(*poll)(void *qpair, uint32_t max_completions);
+	// Zeroed memory usable for I/O of this backend
+	void		*(*buf_alloc)(size_t size, size_t align, int numa_id);
+	void		(*buf_free)(void *buf);
+	// Clock of the backend, NULL for the TSC. A backend with its own clock
+	// moves it forward in poll(), so one thread must poll all queue pairs.
+	uint64_t	(*get_ticks)(void);
+	uint64_t	(*get_ticks_hz)(void);
+	// Change the arbitration while running, optional. The nvme backend has
+	// none, the workload programs each controller through its admin queue.
+	int			(*set_arbitration)(uint32_t burst, const uint32_t weights[SPDK_NVME_QPRIO_MAX]);
+};
+
+// Simulated controller on a virtual clock, see nvme_wrr_sim.c
+extern const struct arb_backend_ops g_arb_sim_backend;
+
+#ifdef SPDK_CONFIG_URING
+// Linux io_uring against block devices or files, see nvme_wrr_uring.c
+extern const struct arb_backend_ops g_arb_uring_backend;
+#endif
+
+#endif
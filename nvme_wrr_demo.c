@@ -18,8 +18,161 @@ usage(char *program_name)
 	printf("\t[-m medium priority weight, default: 8]\n");
 	printf("\t[-l low priority weight, default: 4]\n");
 	printf("\t[-u enable urgent priority queue]\n");
+	printf("\t[-r transport ID for local PCIe NVMe or NVMeoF, can be repeated\n");
+	printf("\t\tFormat: 'key:value [key:value] ...'\n");
+	printf("\t\tKeys:\n");
+	printf("\t\t trtype      Transport type (e.g. PCIe, RDMA, TCP)\n");
+	printf("\t\t adrfam      Address family (e.g. IPv4, IPv6)\n");
+	printf("\t\t traddr      Transport address (e.g. 0000:04:00.0 for PCIe or 192.168.100.8 for NVMeoF)\n");
+	printf("\t\t trsvcid     Transport service identifier (e.g. 4420)\n");
+	printf("\t\t subnqn      Subsystem NQN (default: %s)\n", SPDK_NVMF_DISCOVERY_NQN);
+	printf("\t\t num_io_queues  I/O queue pairs to request from the controller\n");
+	printf("\t\t io_queue_size  Most entries of each I/O queue pair, default: enough for -d\n");
+	printf("\t\tExample: -r 'trtype:TCP adrfam:IPv4 traddr:127.0.0.1 trsvcid:4420 num_io_queues:8'\n");
+	printf("\t\tDefault: all local PCIe NVMe devices]\n");
+	printf("\t[--verify stamp written blocks and check them when read back]\n");
+	printf("\t[--verify-seed seed stamped into blocks, default: random]\n");
+	printf("\t[--payload write content, must be one of\n");
+	printf("\t\t(zero, random, compress:<percent>, dedup:<percent>), default: zero,\n");
+	printf("\t\tcompress zeroes that percent of every 4 KiB chunk and fills the rest at\n");
+	printf("\t\trandom, dedup makes that percent of the chunks copies of earlier ones]\n");
+	printf("\t[--payload-pool payload pool size per worker in MiB, default: 8]\n");
+	printf("\t[--region LBA range of the I/O, 'split' gives every worker sharing a namespace\n");
+	printf("\t\tand a range its own part of it, <class>:start=N[%%],size=N[%%] limits a class\n");
+	printf("\t\tto N MiB or percent of the namespace, size defaults to the rest,\n");
+	printf("\t\te.g. --region split --region low:start=50%%, can be repeated]\n");
+	printf("\t[--streams sequential streams of read, write and rw per worker and namespace,\n");
+	printf("\t\teach walks its own slice of the region, default: 1]\n");
+	printf("\t[--qpairs queue pairs per namespace of each worker, the commands go round robin\n");
+	printf("\t\tover them and share the depth of -d, N for every class or <class>:N,\n");
+	printf("\t\te.g. low:4,high:2, default: 1]\n");
+	printf("\t[--sgl-segments split each I/O into non-contiguous segments and submit it\n");
+	printf("\t\twith spdk_nvme_ns_cmd_readv/writev, default: 0 (contiguous)]\n");
+	printf("\t[--read-sink reads of a worker land in this many shared buffers and their data\n");
+	printf("\t\tis dropped instead of each read having its own, not with --verify or --pi host,\n");
+	printf("\t\tdefault: 0 (own buffers)]\n");
+	printf("\t[--pi protection information of namespaces formatted with it, must be one of\n");
+	printf("\t\t(off, pract, host) followed by the checks ,guard,apptag,reftag, pract lets the\n");
+	printf("\t\tcontroller insert and strip it, host generates and checks it with DIF or DIX,\n");
+	printf("\t\te.g. host,guard,reftag, default: off, all checks when none are given]\n");
+	printf("\t[--cmd-mix mix flush, deallocate and write zeroes commands into one class,\n");
+	printf("\t\te.g. low:flush=1,dsm=10,wz=5 (percent of the commands), can be repeated]\n");
+	printf("\t[--qos cap a class with token buckets, <class>:iops=N,bw=<MiB/s>,burst=<ios>[,shared],\n");
+	printf("\t\te.g. low:bw=200,burst=16, every namespace of every worker of the class\n");
+	printf("\t\tgets its own buckets unless shared, burst defaults to -d, can be repeated]\n");
+	printf("\t[--slo completion deadline of a class in microseconds after the I/O is issued,\n");
+	printf("\t\t<class>:<cmd>=<us>,..., cmd one of (read, write, flush, dsm, wz, all),\n");
+	printf("\t\te.g. high:all=1000,read=200, misses are reported per class, can be repeated]\n");
+	printf("\t[--edf host scheduler with at most N commands of all classes in flight, the\n");
+	printf("\t\tother I/O wait in one heap and go out earliest --slo deadline first to\n");
+	printf("\t\tthe queue pairs of their class]\n");
+	printf("\t[--stages split the latency into submit, device, reap and callback stages and\n");
+	printf("\t\treport their percentiles per class with the gaps between polls]\n");
+	printf("\t[--host-wrr scale each class's queue depth by its weight on controllers\n");
+	printf("\t\twhich do not arbitrate by priority, e.g. fabrics]\n");
+	printf("\t[--arb-rule arbitration for the controllers whose model or serial number\n");
+	printf("\t\tmatches a pattern, (mn|sn)=<pattern>:b=N,h=N,m=N,l=N, values left out\n");
+	printf("\t\tare taken from -b/-h/-m/-l, e.g. 'mn=INTEL SSDPE2KX*:h=32,m=16,l=8',\n");
+	printf("\t\tcan be repeated, the first match wins]\n");
+	printf("\t[--backend I/O backend, must be one of\n");
+	printf("\t\t(nvme, %suring, sim), default: nvme]\n",
+#ifdef SPDK_CONFIG_URING
+		   ""
+#else
+		   "not built: "
+#endif
+		  );
+	printf("\t[--filename block device or file for the uring backend, can be repeated]\n");
+	printf("\t[--uring-sqpoll poll the submission queues from a kernel thread]\n");
+	printf("\t\tThe uring backend runs urgent in the real-time I/O priority class, which needs\n");
+	printf("\t\tCAP_SYS_ADMIN or CAP_SYS_NICE, without either in best-effort level 0\n");
+	printf("\t[--sim-namespaces namespaces of the sim backend, default: 1]\n");
+	printf("\t[--sim-ns-size size of each sim namespace in MiB, default: 1024]\n");
+	printf("\t[--sim-latency service time of every sim command in microseconds, default: 50]\n");
+	printf("\t[--sim-service service time distribution of sim commands in microseconds,\n");
+	printf("\t\t<cmd>=fixed:N|uniform:MIN-MAX|exp:MEAN, cmd one of (read, write, flush, dsm, wz, all),\n");
+	printf("\t\te.g. read=exp:80,write=uniform:20-200, can be repeated]\n");
+	printf("\t[--sim-parallelism commands the sim controller services at once, default: 8]\n");
+	printf("\t[--sim-seed seed of the sim service times, default: 1]\n");
+	printf("\t[--sim-md metadata bytes of every sim block, <bytes>[,extended][,pi=<1|2|3>],\n");
+	printf("\t\tseparate unless extended, protection information of the given type]\n");
+	printf("\t[--no-huge run the SPDK environment without hugepages]\n");
+	printf("\t[--control serve JSON-RPC requests, one per line, on a unix socket at this path\n");
+	printf("\t\tfrom the main core, methods: get_stats, set_arbitration {burst, high, medium, low},\n");
+	printf("\t\tset_class {class, queue_depth, iops, bw, qos_burst}, pause_class {class},\n");
+	printf("\t\tresume_class {class}]\n");
+	printf("\t[--steady-state warm up until steady state before the -t measurement, sampled every\n");
+	printf("\t\tinterval seconds, interval[,window[,max rounds]], default window 5, max rounds 25,\n");
+	printf("\t\tsteady when the IO/s and latency of every class range within 20%% of their\n");
+	printf("\t\taverage over the window and their linear fit moves within 10%%]\n");
+	printf("\t[--precondition write every block before the measured runs, at -d on every\n");
+	printf("\t\tqueue pair without --qos or --edf, fill[,random=<seconds>|random=steady],\n");
+	printf("\t\tfill writes each namespace once sequentially, random overwrites at random\n");
+	printf("\t\toffsets for a time or until the write IO/s are steady by --steady-state rounds]\n");
+	printf("\t[--timeline every this many seconds of the measured run, print the IO/s and latency\n");
+	printf("\t\tof each class over the interval with the temperature, throttling and wear of\n");
+	printf("\t\teach controller from its SMART / Health log, read through the admin queue]\n");
+	printf("\t[--repeat run the workload this many times with the controllers kept attached and\n");
+	printf("\t\treport the mean, standard deviation and 95%% confidence interval per class]\n");
+	printf("\t[--json-out write the results of every run and their statistics to this file]\n");
+	printf("\t[--baseline compare with a --json-out file by Welch's t-test, exit code 2 when\n");
+	printf("\t\ta class is slower with 95%% confidence]\n");
+	printf("\t[--unloaded report the latencies under load against the unloaded QD1 ones of\n");
+	printf("\t\tthe same namespaces, from the -o file of the beginner pre-flight check]\n");
+	printf("\t[--telemetry publish live counters and latency histograms of every namespace\n");
+	printf("\t\tof every worker to a memory-mapped file at this path, see nvme_wrr_stats]\n");
+	printf("\t[--shm-id share the controllers with other processes of the same id, nvme only]\n");
+	printf("\t[--tenants primary of --shm-id, attach and program arbitration, then wait\n");
+	printf("\t\tfor N tenant processes and print their combined results, tenants\n");
+	printf("\t\thave %d seconds to attach]\n", TENANT_ATTACH_TIMEOUT_S);
+	printf("\t[--tenant secondary of --shm-id, run one priority class on every core of -c,\n");
+	printf("\t\tmust be one of (urgent, high, medium, low)]\n");
 }
 
+static const struct option g_arb_cmdline_opts[] = {
+	{"verify",			no_argument,		NULL, ARB_OPT_VERIFY},
+	{"verify-seed",		required_argument,	NULL, ARB_OPT_VERIFY_SEED},
+	{"payload",			required_argument,	NULL, ARB_OPT_PAYLOAD},
+	{"payload-pool",	required_argument,	NULL, ARB_OPT_PAYLOAD_POOL},
+	{"region",			required_argument,	NULL, ARB_OPT_REGION},
+	{"streams",			required_argument,	NULL, ARB_OPT_STREAMS},
+	{"sgl-segments",	required_argument,	NULL, ARB_OPT_SGL_SEGMENTS},
+	{"read-sink",		required_argument,	NULL, ARB_OPT_READ_SINK},
+	{"cmd-mix",			required_argument,	NULL, ARB_OPT_CMD_MIX},
+	{"qos",				required_argument,	NULL, ARB_OPT_QOS},
+	{"slo",				required_argument,	NULL, ARB_OPT_SLO},
+	{"edf",				required_argument,	NULL, ARB_OPT_EDF},
+	{"host-wrr",		no_argument,		NULL, ARB_OPT_HOST_WRR},
+	{"stages",			no_argument,		NULL, ARB_OPT_STAGES},
+	{"arb-rule",		required_argument,	NULL, ARB_OPT_ARB_RULE},
+	{"backend",			required_argument,	NULL, ARB_OPT_BACKEND},
+	{"filename",		required_argument,	NULL, ARB_OPT_FILENAME},
+	{"uring-sqpoll",	no_argument,		NULL, ARB_OPT_URING_SQPOLL},
+	{"sim-namespaces",	required_argument,	NULL, ARB_OPT_SIM_NAMESPACES},
+	{"sim-ns-size",		required_argument,	NULL, ARB_OPT_SIM_NS_SIZE},
+	{"sim-latency",		required_argument,	NULL, ARB_OPT_SIM_LATENCY},
+	{"sim-service",		required_argument,	NULL, ARB_OPT_SIM_SERVICE},
+	{"sim-parallelism",	required_argument,	NULL, ARB_OPT_SIM_PARALLELISM},
+	{"sim-seed",		required_argument,	NULL, ARB_OPT_SIM_SEED},
+	{"sim-md",			required_argument,	NULL, ARB_OPT_SIM_MD},
+	{"pi",				required_argument,	NULL, ARB_OPT_PI},
+	{"qpairs",			required_argument,	NULL, ARB_OPT_QPAIRS},
+	{"no-huge",			no_argument,		NULL, ARB_OPT_NO_HUGE},
+	{"control",			required_argument,	NULL, ARB_OPT_CONTROL},
+	{"telemetry",		required_argument,	NULL, ARB_OPT_TELEMETRY},
+	{"steady-state",	required_argument,	NULL, ARB_OPT_STEADY_STATE},
+	{"precondition",	required_argument,	NULL, ARB_OPT_PRECONDITION},
+	{"repeat",			required_argument,	NULL, ARB_OPT_REPEAT},
+	{"timeline",		required_argument,	NULL, ARB_OPT_TIMELINE},
+	{"json-out",		required_argument,	NULL, ARB_OPT_JSON_OUT},
+	{"baseline",		required_argument,	NULL, ARB_OPT_BASELINE},
+	{"unloaded",		required_argument,	NULL, ARB_OPT_UNLOADED},
+	{"shm-id",			required_argument,	NULL, ARB_OPT_SHM_ID},
+	{"tenants",			required_argument,	NULL, ARB_OPT_TENANTS},
+	{"tenant",			required_argument,	NULL, ARB_OPT_TENANT},
+	{0, 0, 0, 0}
+};
+
 int
 main(int argc, char **argv) {
 	int rc;
@@ -29,7 +182,8 @@ main(int argc, char **argv) {
 	uint32_t task_count = 0;
 
 	uint32_t main_core;
-	struct worker_thread *worker, *main_worker;
+
+	g_arbitration.startup.start_tsc = spdk_get_ticks();
 
 	rc = parse_args(argc, argv);
 	if (rc != 0) {
@@ -40,15 +194,29 @@ main(int argc, char **argv) {
 	spdk_env_opts_init(&opts);
 	opts.name = "nvme_wrr_demo";
 	opts.core_mask = g_arbitration.core_mask;
+	opts.shm_id = g_arbitration.shm_id;
+	// Only the nvme backend needs the devices unbound from the kernel
+	opts.no_pci = g_backend != &g_nvme_backend;
+	if (g_arbitration.no_huge) {
+		opts.no_huge = true;
+		opts.mem_size = 2048;
+	}
 
 	// Initialize the SPDK environment
 	if (spdk_env_init(&opts) < 0) {
 		fprintf(stderr, "Unable to initialize SPDK env\n");
 		return 1;
 	}
+	g_arbitration.startup.env_init_tsc = spdk_get_ticks();
 
 	// Get tick rate to convert second into ticks in order to limit the work
-	g_arbitration.tsc_rate = spdk_get_ticks_hz();
+	g_arbitration.tsc_rate = g_backend->get_ticks_hz != NULL ? g_backend->get_ticks_hz() :
+							 spdk_get_ticks_hz();
+	init_class_qos();
+
+	if (g_arbitration.verify && !g_arbitration.verify_seed_set) {
+		g_arbitration.verify_seed = (uint32_t)spdk_get_ticks();
+	}
 
 	if (register_workers() != 0) {
 		rc = 1;
@@ -58,10 +226,28 @@ main(int argc, char **argv) {
 		rc = 1;
 		goto exit;
 	}
+	if (g_arbitration.unloaded_path != NULL && load_unloaded() != 0) {
+		rc = 1;
+		goto exit;
+	}
+	// The primary of --tenants only owns the controllers and the report
+	if (g_arbitration.num_tenants != 0) {
+		rc = run_tenant_primary();
+		goto exit;
+	}
+	if (g_arbitration.tenant && claim_tenant_slot() != 0) {
+		rc = 1;
+		goto exit;
+	}
 	if (associate_workers_with_ns() != 0) {
 		rc = 1;
 		goto exit;
 	}
+	if (edf_init() != 0) {
+		fprintf(stderr, "could not allocate the --edf heap\n");
+		rc = 1;
+		goto exit;
+	}
 
 	// Create a thread-safe task pool
 	snprintf(task_pool_name, sizeof(task_pool_name), "task_pool_%d", getpid());
@@ -76,10 +262,95 @@ main(int argc, char **argv) {
 		goto exit;
 	}
 
-	printf("Initialization complete. Launching workers.\n");
-
 	// The worker of the main core should be called by main() function
 	main_core = spdk_env_get_current_core();
+	g_control.main_core = main_core;
+	if (g_control.path != NULL && control_init() != 0) {
+		rc = 1;
+		goto exit;
+	}
+	if (g_telemetry.path != NULL && telemetry_init() != 0) {
+		rc = 1;
+		goto exit;
+	}
+
+	if (g_repeat.count > 1 || g_repeat.json_out != NULL || g_repeat.baseline != NULL) {
+		g_repeat.results = calloc(g_repeat.count, sizeof(*g_repeat.results));
+		if (g_repeat.results == NULL) {
+			fprintf(stderr, "could not allocate the results of --repeat\n");
+			rc = 1;
+			goto exit;
+		}
+	}
+
+	g_arbitration.startup.ready_tsc = spdk_get_ticks();
+	print_startup();
+	printf("Initialization complete. Launching workers.\n");
+
+	if ((g_precondition.fill || g_precondition.random_s != 0 || g_precondition.random_steady) &&
+		precondition_run(main_core) != 0) {
+		rc = 1;
+		goto exit;
+	}
+
+	// The controllers stay attached and programmed from one run to the next
+	for (uint32_t rep = 0; rep < g_repeat.count; rep++) {
+		if (g_repeat.count > 1) {
+			printf("Repetition %u of %u\n", rep + 1, g_repeat.count);
+		}
+		if (rep != 0) {
+			reset_run_stats();
+		}
+		steady_state_start();
+		timeline_start();
+		run_workers(main_core);
+		timeline_finish();
+		print_configuration_and_performance(argv[0]);
+		if (g_repeat.results != NULL) {
+			record_repetition(rep);
+		}
+	}
+	rc = 0;
+	if (g_repeat.results != NULL) {
+		print_repetition_summary();
+		if (g_repeat.json_out != NULL && write_results_json() != 0) {
+			rc = 1;
+		}
+		// Told apart from a failed run by scripts
+		if (g_repeat.baseline != NULL && compare_baseline() != 0) {
+			rc = 2;
+		}
+	}
+	if (g_arbitration.tenant) {
+		publish_tenant_stats();
+	}
+
+	// A successful run releases everything too, detaching the sim backend
+	// prints what its arbiter fetched per class
+exit:
+	control_fini();
+	telemetry_fini();
+	cleanup(task_count);
+	spdk_env_fini();
+	// 2 is a regression against --baseline, not an error
+	if (rc == 1) {
+		fprintf(stderr, "%s: errors occurred\n", argv[0]);
+	}
+	return rc;
+}
+
+// One run of every worker, on their cores or in turns on the main core
+static int
+run_workers(uint32_t main_core)
+{
+	struct worker_thread *worker, *main_worker;
+	int rc;
+
+	// A backend clock only advances when every queue pair has been polled
+	if (g_backend->get_ticks != NULL) {
+		return run_workers_cooperatively();
+	}
+
 	main_worker = NULL;
 	TAILQ_FOREACH(worker, &g_workers, link) {
 		if (worker->lcore != main_core) {
@@ -99,15 +370,6 @@ main(int argc, char **argv) {
 
 	spdk_env_thread_wait_all();
 
-	print_configuration_and_performance(argv[0]);
-
-	return 0;
-exit:
-	cleanup(task_count);
-	spdk_env_fini();
-	if (rc != 0) {
-		fprintf(stderr, "%s: errors occurred\n", argv[0]);
-	}
 	return rc;
 }
 
@@ -115,51 +377,372 @@ static int
 worker_fn(void *arg)
 {	
 	struct worker_thread *worker = (struct worker_thread *)arg;
-	struct worker_ns_ctx *ns_ctx;
 
 	uint64_t tsc_end;
 
+	if (worker_init(worker) != 0) {
+		return 1;
+	}
+
+	// Calculate the end time of the thread, --steady-state sets it once warm
+	// and the main core ends a --precondition phase
+	tsc_end = g_steady.interval_s != 0 || g_precondition.phase != PRECONDITION_NONE ? UINT64_MAX :
+			  arb_get_ticks() + g_arbitration.time_in_sec * g_arbitration.tsc_rate;
+
+	// Polling
+	worker->cpu.last_tsc = spdk_get_ticks();
+	while (1) {
+		worker_poll(worker);
+		if (worker->lcore == g_control.main_core) {
+			control_poll();
+			if (g_precondition.phase != PRECONDITION_NONE) {
+				precondition_poll();
+			} else {
+				steady_state_poll();
+				timeline_poll();
+			}
+		}
+
+		// On the TSC the read which closed the last poll is recent enough
+		if ((g_backend->get_ticks != NULL ? g_backend->get_ticks() : worker->cpu.last_tsc) > tsc_end) {
+			break;
+		}
+		if (spdk_unlikely(g_precondition.phase != PRECONDITION_NONE)) {
+			tsc_end = __atomic_load_n(&g_precondition.end_tsc, __ATOMIC_RELAXED);
+		} else if (spdk_unlikely(g_steady.interval_s != 0)) {
+			tsc_end = __atomic_load_n(&g_steady.end_tsc, __ATOMIC_RELAXED);
+		}
+	}
+
+	worker_fini(worker);
+
+	return 0;
+}
+
+static int
+worker_init(struct worker_thread *worker)
+{
+	struct worker_ns_ctx *ns_ctx;
+
 	printf("Starting thread on core %u with %s\n", worker->lcore, print_qprio(worker->qprio));
 
+	memset(worker->dma_bytes, 0, sizeof(worker->dma_bytes));
+	// Generate the write content before the clock starts
+	if (payload_pool_init(worker) != 0) {
+		printf("ERROR: payload_pool_init() failed\n");
+		return 1;
+	}
+	if (segment_pool_init(worker) != 0) {
+		printf("ERROR: segment_pool_init() failed\n");
+		return 1;
+	}
+	if (read_sink_init(worker) != 0) {
+		printf("ERROR: read_sink_init() failed\n");
+		return 1;
+	}
+	memset(&worker->bufs, 0, sizeof(worker->bufs));
+
 	TAILQ_FOREACH(ns_ctx, &worker->ns_ctx, link) {
 		// Allocate a queue pair for each namespace of this worker with priority
 		if (init_worker_ns_ctx(ns_ctx, worker->qprio) != 0) {
 			printf("ERROR: init_worker_ns_ctx() failed\n");
 			return 1;
 		}
+		ns_ctx->qprio = worker->qprio;
+		ns_ctx->class_cfg = &g_arbitration.classes[worker->qprio];
+		if (g_precondition.phase == PRECONDITION_NONE &&
+			(ns_ctx->class_cfg->iops_limit != 0 || ns_ctx->class_cfg->bw_limit_bytes != 0)) {
+			if (ns_ctx->class_cfg->qos_shared) {
+				ns_ctx->qos = &g_class_qos[worker->qprio];
+			} else {
+				qos_buckets_init(&ns_ctx->qos_private, ns_ctx->class_cfg);
+				ns_ctx->qos = &ns_ctx->qos_private;
+			}
+		}
+		ns_ctx->payload = &worker->payload;
+		ns_ctx->segments = &worker->segments;
+		ns_ctx->bufs = &worker->bufs;
+		ns_ctx->sink = worker->sink.num_bufs != 0 ? &worker->sink : NULL;
+		ns_ctx_specialize(ns_ctx);
+		// Every read and write takes one, none is allocated on the submit path
+		if (ns_ctx->ns_entry->io_md_bytes != 0 &&
+			buf_pool_reserve(worker, ns_ctx->ns_entry->io_md_bytes, g_arbitration.io_queue_depth) != 0) {
+			printf("ERROR: could not allocate the metadata buffers\n");
+			return 1;
+		}
+		if (ns_ctx_private_data(ns_ctx) &&
+			buf_pool_reserve(worker, ns_ctx->ns_entry->io_buf_bytes, g_arbitration.io_queue_depth) != 0) {
+			printf("ERROR: could not allocate the data buffers\n");
+			return 1;
+		}
+		// Kept from one --repeat run to the next
+		if (g_arbitration.stages && ns_ctx->stages == NULL) {
+			ns_ctx->stages = calloc(1, sizeof(*ns_ctx->stages));
+			if (ns_ctx->stages == NULL) {
+				printf("ERROR: could not allocate the stage histograms\n");
+				return 1;
+			}
+		}
+		// A failed registration only loses the fixed buffer fast path
+		for (uint32_t i = 0; g_backend->register_buf != NULL && i < ns_ctx->num_qpairs; i++) {
+			g_backend->register_buf(ns_ctx->qpairs[i], worker->payload.base, worker->payload.size);
+			if (worker->segments.base != NULL) {
+				g_backend->register_buf(ns_ctx->qpairs[i], worker->segments.base, worker->segments.size);
+			}
+		}
 	}
 
-	// Calculate the end time of the thread
-	tsc_end = spdk_get_ticks() + g_arbitration.time_in_sec * g_arbitration.tsc_rate;
+	if (g_precondition.phase == PRECONDITION_NONE && g_edf.heap != NULL) {
+		edf_attach(worker);
+	}
 
 	// Submit initial I/O for each namespace.
 	TAILQ_FOREACH(ns_ctx, &worker->ns_ctx, link) {
-		submit_init_ios(ns_ctx, g_arbitration.io_queue_depth);
+		ns_ctx->queue_depth = class_queue_depth(ns_ctx);
+		ns_ctx->queue_depth_set = false;
+		submit_init_ios(ns_ctx, ns_ctx->queue_depth);
 	}
 
-	// Polling
-	while (1) {
-		// Check for completed I/O for each controller.
-		// A new I/O will be submitted in the task_complete() callback to replace each I/O that is completed.
+	return 0;
+}
 
-		TAILQ_FOREACH(ns_ctx, &worker->ns_ctx, link) {
-			spdk_nvme_qpair_process_completions(ns_ctx->qpair, 0);
+static void
+worker_poll(struct worker_thread *worker)
+{
+	struct worker_cpu_stats *cpu = &worker->cpu;
+	struct worker_ns_ctx *ns_ctx;
+	uint64_t now;
+	int32_t rc;
+	bool between = false;
+
+	now = spdk_get_ticks();
+	// Workers taking turns on the main core would be charged for each other
+	if (g_backend->get_ticks == NULL) {
+		cpu->loop_tsc += now - cpu->last_tsc;
+	}
+	cpu->last_tsc = now;
+
+	// Check for completed I/O for each controller.
+	// A new I/O will be submitted in the task_complete() callback to replace each I/O that is completed.
+	if (__atomic_load_n(&worker->mailbox.head, __ATOMIC_ACQUIRE) != worker->mailbox.tail) {
+		worker_process_mailbox(worker);
+		between = true;
+	}
+	// Let through by a completion of another worker
+	if (__atomic_load_n(&worker->edf_ready.count, __ATOMIC_ACQUIRE) != 0) {
+		edf_submit_ready(&g_edf, &worker->edf_ready);
+		between = true;
+	}
+
+	TAILQ_FOREACH(ns_ctx, &worker->ns_ctx, link) {
+		if (ns_ctx->qos_deferred != 0 && !ns_ctx->is_draining && !ns_ctx->paused) {
+			qos_release(ns_ctx);
+			between = true;
+		}
+		// Charged to the loop rather than to the poll after it
+		if (spdk_unlikely(between)) {
+			now = spdk_get_ticks();
+			cpu->loop_tsc += now - cpu->last_tsc;
+			cpu->last_tsc = now;
+			between = false;
+		}
+		if (ns_ctx->stages != NULL) {
+			rc = poll_with_stages(ns_ctx);
+		} else {
+			rc = ns_ctx_poll(ns_ctx);
 		}
 
-		if (spdk_get_ticks() > tsc_end) {
-			break;
+		now = spdk_get_ticks();
+		cpu->polls++;
+		if (rc > 0) {
+			cpu->completions += rc;
+			cpu->busy_poll_tsc += now - cpu->last_tsc;
+		} else {
+			cpu->empty_polls++;
+			cpu->empty_poll_tsc += now - cpu->last_tsc;
 		}
+		cpu->last_tsc = now;
 	}
+}
+
+// Completions can only be seen from the start of a poll on, the time since
+// the previous poll bounds how long they waited for the worker
+static int32_t
+poll_with_stages(struct worker_ns_ctx *ns_ctx)
+{
+	struct stage_stats *stages = ns_ctx->stages;
+	uint64_t prev_poll_tsc = stages->poll_tsc;
+	int32_t rc;
+
+	stages->poll_tsc = arb_get_ticks();
+	rc = ns_ctx_poll(ns_ctx);
+	if (rc > 0 && prev_poll_tsc != 0) {
+		stage_record(&stages->hist[ARB_STAGE_POLL_GAP], stages->poll_tsc - prev_poll_tsc);
+	}
+
+	return rc;
+}
+
+static void
+worker_process_mailbox(struct worker_thread *worker)
+{
+	struct worker_mailbox *mailbox = &worker->mailbox;
+	uint32_t head = __atomic_load_n(&mailbox->head, __ATOMIC_ACQUIRE);
+	const struct worker_msg *msg;
+	struct worker_ns_ctx *ns_ctx;
+
+	while (mailbox->tail != head) {
+		msg = &mailbox->msgs[mailbox->tail % WORKER_MAILBOX_SIZE];
+		TAILQ_FOREACH(ns_ctx, &worker->ns_ctx, link) {
+			switch (msg->type) {
+			case WORKER_MSG_QUEUE_DEPTH:
+				// Lowering the depth takes effect as the extra I/O complete
+				if (msg->queue_depth != 0) {
+					ns_ctx->queue_depth = msg->queue_depth;
+					ns_ctx->queue_depth_set = true;
+				} else if (!ns_ctx->queue_depth_set) {
+					ns_ctx->queue_depth = class_queue_depth(ns_ctx);
+				}
+				top_up_ns_ctx(ns_ctx);
+				break;
+			case WORKER_MSG_PAUSE:
+				ns_ctx->paused = true;
+				break;
+			case WORKER_MSG_RESUME:
+				ns_ctx->paused = false;
+				top_up_ns_ctx(ns_ctx);
+				break;
+			case WORKER_MSG_QOS:
+				qos_apply(ns_ctx);
+				break;
+			case WORKER_MSG_RESET_STATS:
+				reset_ns_ctx_stats(ns_ctx);
+				break;
+			}
+		}
+		if (msg->type == WORKER_MSG_RESET_STATS) {
+			memset(&worker->cpu, 0, sizeof(worker->cpu));
+			worker->cpu.last_tsc = spdk_get_ticks();
+		}
+		__atomic_store_n(&mailbox->tail, mailbox->tail + 1, __ATOMIC_RELEASE);
+	}
+}
+
+static int
+worker_post(struct worker_thread *worker, const struct worker_msg *msg)
+{
+	struct worker_mailbox *mailbox = &worker->mailbox;
+
+	if (mailbox->head - __atomic_load_n(&mailbox->tail, __ATOMIC_ACQUIRE) == WORKER_MAILBOX_SIZE) {
+		return -EBUSY;
+	}
+	mailbox->msgs[mailbox->head % WORKER_MAILBOX_SIZE] = *msg;
+	__atomic_store_n(&mailbox->head, mailbox->head + 1, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+// Bring a context back to its depth after it was raised or resumed
+static void
+top_up_ns_ctx(struct worker_ns_ctx *ns_ctx)
+{
+	int64_t missing;
+
+	if (ns_ctx->is_draining || ns_ctx->paused) {
+		return;
+	}
+	missing = (int64_t)ns_ctx->queue_depth - (int64_t)(ns_ctx->current_queue_depth + ns_ctx->qos_deferred);
+	if (missing > 0) {
+		submit_init_ios(ns_ctx, missing);
+	}
+}
+
+static void
+worker_fini(struct worker_thread *worker)
+{
+	struct worker_ns_ctx *ns_ctx;
 
+	if (g_edf.heap != NULL) {
+		edf_drain(worker);
+	}
 	TAILQ_FOREACH(ns_ctx, &worker->ns_ctx, link) {
 		drain_io(ns_ctx);
 		// Free the queue pair for each namespace of this worker
 		cleanup_ns_worker_ctx(ns_ctx);
 	}
+	sample_hugepages();
+	payload_pool_free(&worker->payload);
+	segment_pool_free(&worker->segments);
+	read_sink_free(&worker->sink);
+	buf_pool_free(&worker->bufs);
+}
+
+// All workers take turns on the main core, in the same order every run,
+// so a backend with its own clock gives the same results every time
+static int
+run_workers_cooperatively(void)
+{
+	struct worker_thread *worker;
+	struct worker_ns_ctx *ns_ctx;
+	uint64_t tsc_end;
+	bool busy;
+
+	TAILQ_FOREACH(worker, &g_workers, link) {
+		if (worker_init(worker) != 0) {
+			return 1;
+		}
+	}
+
+	tsc_end = g_steady.interval_s != 0 || g_precondition.phase != PRECONDITION_NONE ? UINT64_MAX :
+			  arb_get_ticks() + g_arbitration.time_in_sec * g_arbitration.tsc_rate;
+	while (arb_get_ticks() <= tsc_end) {
+		TAILQ_FOREACH(worker, &g_workers, link) {
+			worker_poll(worker);
+		}
+		control_poll();
+		if (g_precondition.phase != PRECONDITION_NONE) {
+			precondition_poll();
+			tsc_end = g_precondition.end_tsc;
+		} else {
+			if (g_steady.interval_s != 0) {
+				steady_state_poll();
+				tsc_end = g_steady.end_tsc;
+			}
+			timeline_poll();
+		}
+	}
+
+	// Stop all classes at once, draining one by one would leave the others
+	// running alone on the controller
+	TAILQ_FOREACH(worker, &g_workers, link) {
+		TAILQ_FOREACH(ns_ctx, &worker->ns_ctx, link) {
+			ns_ctx->is_draining = true;
+			qos_stop(ns_ctx);
+		}
+	}
+	do {
+		busy = false;
+		TAILQ_FOREACH(worker, &g_workers, link) {
+			worker_poll(worker);
+			TAILQ_FOREACH(ns_ctx, &worker->ns_ctx, link) {
+				busy |= ns_ctx->current_queue_depth > 0;
+			}
+		}
+	} while (busy);
+
+	TAILQ_FOREACH(worker, &g_workers, link) {
+		worker_fini(worker);
+	}
 
 	return 0;
 }
 
+static inline uint64_t
+arb_get_ticks(void)
+{
+	return g_backend->get_ticks != NULL ? g_backend->get_ticks() : spdk_get_ticks();
+}
+
 static int
 parse_args(int argc, char **argv)
 {
@@ -168,7 +751,8 @@ parse_args(int argc, char **argv)
 	const char *io_pattern_type = NULL;
 	bool mix_specified = false;
 
-	while ((op = getopt(argc, argv, "b:c:d:h:l:m:p:s:t:uM:")) != -1) {
+	while ((op = getopt_long(argc, argv, "b:c:d:h:l:m:p:r:s:t:uM:",
+							 g_arb_cmdline_opts, NULL)) != -1) {
 		switch (op) {
 		case 'c':
 			g_arbitration.core_mask = optarg;
@@ -179,56 +763,234 @@ parse_args(int argc, char **argv)
 		case 'u':
 			g_arbitration.enable_urgent = true;
 			break;
-		case '?':
-			usage(argv[0]);
-			return 1;
-		default:
-			val = spdk_strtol(optarg, 10);
-			if (val < 0) {
-				fprintf(stderr, "Converting a string to integer failed\n");
-				return val;
+		case 'r':
+			if (add_trid(optarg) != 0) {
+				usage(argv[0]);
+				return 1;
 			}
-			switch (op) {
-			case 'd':
-				g_arbitration.io_queue_depth = val;
-				break;
-			case 's':
-				g_arbitration.io_size_bytes = val;
-				break;
-			case 'M':
-				g_arbitration.rw_percentage = val;
-				mix_specified = true;
-				break;
-			case 't':
-				g_arbitration.time_in_sec = val;
-				break;
-			case 'b':
-				if (val >= 7) {
-					printf("The arbitration burst is set to bigger than 7 which means unlimited\n");
-				}
-				g_arbitration.arbitration_burst = val;
-				break;
-			case 'h':
-				g_arbitration.high_priority_weight = val;
-				break;
-			case 'm':
-				g_arbitration.medium_priority_weight = val;
-				break;
-			case 'l':
-				g_arbitration.low_priority_weight = val;
-				break;
-			default:
+			break;
+		case ARB_OPT_HOST_WRR:
+			g_arbitration.host_wrr = true;
+			break;
+		case ARB_OPT_STAGES:
+			g_arbitration.stages = true;
+			break;
+		case ARB_OPT_BACKEND:
+			if (select_backend(optarg) != 0) {
 				usage(argv[0]);
-				return -EINVAL;
+				return 1;
 			}
-		}
-	}
-
-	io_pattern_type = g_arbitration.io_pattern_type;
-
-	if (strcmp(io_pattern_type, "read") &&
-		strcmp(io_pattern_type, "write") &&
-		strcmp(io_pattern_type, "randread") &&
+			break;
+		case ARB_OPT_FILENAME:
+			if (g_arbitration.backend_opts.num_filenames == BACKEND_MAX_FILENAMES) {
+				fprintf(stderr, "At most %d --filename can be given\n", BACKEND_MAX_FILENAMES);
+				return 1;
+			}
+			g_arbitration.backend_opts.filenames[g_arbitration.backend_opts.num_filenames++] = optarg;
+			break;
+		case ARB_OPT_URING_SQPOLL:
+			g_arbitration.backend_opts.uring_sqpoll = true;
+			break;
+		case ARB_OPT_NO_HUGE:
+			g_arbitration.no_huge = true;
+			break;
+		case ARB_OPT_VERIFY:
+			g_arbitration.verify = true;
+			break;
+		case ARB_OPT_PAYLOAD:
+			if (parse_payload(optarg) != 0) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case ARB_OPT_ARB_RULE:
+			if (parse_arb_rule(optarg) != 0) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case ARB_OPT_SIM_SERVICE:
+			if (parse_sim_service(optarg) != 0) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case ARB_OPT_CMD_MIX:
+			if (parse_cmd_mix(optarg) != 0) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case ARB_OPT_QOS:
+			if (parse_qos(optarg) != 0) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case ARB_OPT_CONTROL:
+			g_control.path = optarg;
+			break;
+		case ARB_OPT_TELEMETRY:
+			g_telemetry.path = optarg;
+			break;
+		case ARB_OPT_STEADY_STATE:
+			if (parse_steady_state(optarg) != 0) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case ARB_OPT_JSON_OUT:
+			g_repeat.json_out = optarg;
+			break;
+		case ARB_OPT_BASELINE:
+			g_repeat.baseline = optarg;
+			break;
+		case ARB_OPT_UNLOADED:
+			g_arbitration.unloaded_path = optarg;
+			break;
+		case ARB_OPT_TENANT:
+			if (parse_qprio(optarg, &g_arbitration.tenant_qprio) != 0) {
+				usage(argv[0]);
+				return 1;
+			}
+			g_arbitration.tenant = true;
+			break;
+		case ARB_OPT_SLO:
+			if (parse_slo(optarg) != 0) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case ARB_OPT_REGION:
+			if (parse_region(optarg) != 0) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case ARB_OPT_PRECONDITION:
+			if (parse_precondition(optarg) != 0) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case ARB_OPT_PI:
+			if (parse_pi(optarg) != 0) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case ARB_OPT_SIM_MD:
+			if (parse_sim_md(optarg) != 0) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case ARB_OPT_QPAIRS:
+			if (parse_qpairs(optarg) != 0) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case '?':
+			usage(argv[0]);
+			return 1;
+		default:
+			val = spdk_strtol(optarg, 10);
+			if (val < 0) {
+				fprintf(stderr, "Converting a string to integer failed\n");
+				return val;
+			}
+			switch (op) {
+			case 'd':
+				g_arbitration.io_queue_depth = val;
+				break;
+			case 's':
+				g_arbitration.io_size_bytes = val;
+				break;
+			case 'M':
+				g_arbitration.rw_percentage = val;
+				mix_specified = true;
+				break;
+			case 't':
+				g_arbitration.time_in_sec = val;
+				break;
+			case 'b':
+				if (val >= 7) {
+					printf("The arbitration burst is set to bigger than 7 which means unlimited\n");
+				}
+				g_arbitration.arbitration_burst = val;
+				break;
+			case 'h':
+				g_arbitration.high_priority_weight = val;
+				break;
+			case 'm':
+				g_arbitration.medium_priority_weight = val;
+				break;
+			case 'l':
+				g_arbitration.low_priority_weight = val;
+				break;
+			case ARB_OPT_VERIFY_SEED:
+				g_arbitration.verify_seed = val;
+				g_arbitration.verify_seed_set = true;
+				break;
+			case ARB_OPT_PAYLOAD_POOL:
+				g_arbitration.payload_pool_mib = val;
+				break;
+			case ARB_OPT_EDF:
+				g_arbitration.edf_inflight = val;
+				break;
+			case ARB_OPT_REPEAT:
+				g_repeat.count = val;
+				break;
+			case ARB_OPT_TIMELINE:
+				g_timeline.interval_s = val;
+				break;
+			case ARB_OPT_STREAMS:
+				g_arbitration.num_streams = val;
+				break;
+			case ARB_OPT_SHM_ID:
+				g_arbitration.shm_id = val;
+				break;
+			case ARB_OPT_TENANTS:
+				g_arbitration.num_tenants = val;
+				break;
+			case ARB_OPT_SGL_SEGMENTS:
+				g_arbitration.sgl_segments = val;
+				break;
+			case ARB_OPT_READ_SINK:
+				g_arbitration.read_sink_bufs = val;
+				break;
+			case ARB_OPT_SIM_NAMESPACES:
+				g_arbitration.backend_opts.sim_namespaces = val;
+				break;
+			case ARB_OPT_SIM_NS_SIZE:
+				g_arbitration.backend_opts.sim_ns_size = (uint64_t)val * 1024 * 1024;
+				break;
+			case ARB_OPT_SIM_LATENCY:
+				for (int i = 0; i < ARB_OP_COUNT; i++) {
+					g_arbitration.backend_opts.sim_service[i].dist = ARB_SIM_DIST_FIXED;
+					g_arbitration.backend_opts.sim_service[i].min_us = val;
+					g_arbitration.backend_opts.sim_service[i].max_us = val;
+				}
+				break;
+			case ARB_OPT_SIM_PARALLELISM:
+				g_arbitration.backend_opts.sim_parallelism = val;
+				break;
+			case ARB_OPT_SIM_SEED:
+				g_arbitration.backend_opts.sim_seed = val;
+				break;
+			default:
+				usage(argv[0]);
+				return -EINVAL;
+			}
+		}
+	}
+
+	io_pattern_type = g_arbitration.io_pattern_type;
+
+	if (strcmp(io_pattern_type, "read") &&
+		strcmp(io_pattern_type, "write") &&
+		strcmp(io_pattern_type, "randread") &&
 		strcmp(io_pattern_type, "randwrite") &&
 		strcmp(io_pattern_type, "rw") &&
 		strcmp(io_pattern_type, "randrw")) {
@@ -271,6 +1033,67 @@ parse_args(int argc, char **argv)
 		}
 	}
 
+	if (g_backend == &g_nvme_backend && g_arbitration.backend_opts.num_filenames != 0) {
+		fprintf(stderr, "--filename is only used by the uring backend\n");
+		return 1;
+	}
+	if (g_backend != &g_nvme_backend && !TAILQ_EMPTY(&g_trid_list)) {
+		fprintf(stderr, "-r is only used by the nvme backend\n");
+		return 1;
+	}
+
+	if ((g_arbitration.tenant || g_arbitration.num_tenants != 0) && g_arbitration.shm_id < 0) {
+		fprintf(stderr, "--tenant and --tenants need --shm-id\n");
+		return 1;
+	}
+	if (g_arbitration.tenant && g_arbitration.num_tenants != 0) {
+		fprintf(stderr, "A process is either the primary of --tenants or a --tenant\n");
+		return 1;
+	}
+	if (g_arbitration.num_streams == 0 || g_arbitration.num_streams > ARB_MAX_STREAMS) {
+		fprintf(stderr, "--streams must be from 1 to %d\n", ARB_MAX_STREAMS);
+		return 1;
+	}
+	if (g_repeat.count == 0 || g_repeat.count > REPEAT_MAX) {
+		fprintf(stderr, "--repeat must be from 1 to %d\n", REPEAT_MAX);
+		return 1;
+	}
+	if (g_arbitration.tenant && g_repeat.count > 1) {
+		fprintf(stderr, "A --tenant publishes a single run, --repeat is not supported\n");
+		return 1;
+	}
+	if ((g_arbitration.tenant || g_arbitration.num_tenants != 0) &&
+		(g_precondition.fill || g_precondition.random_s != 0 || g_precondition.random_steady)) {
+		fprintf(stderr, "--precondition needs every worker in one process, not --tenant(s)\n");
+		return 1;
+	}
+	if (g_arbitration.num_tenants > TENANT_MAX) {
+		fprintf(stderr, "--tenants must be at most %d\n", TENANT_MAX);
+		return 1;
+	}
+	if (g_arbitration.shm_id >= 0 && (g_backend != &g_nvme_backend || g_arbitration.no_huge)) {
+		fprintf(stderr, "--shm-id needs the nvme backend and hugepages\n");
+		return 1;
+	}
+
+	if (g_arbitration.sgl_segments > SGL_MAX_SEGMENTS ||
+		(g_arbitration.sgl_segments != 0 &&
+		 g_arbitration.io_size_bytes % g_arbitration.sgl_segments != 0)) {
+		fprintf(stderr,
+			"--sgl-segments must be at most %d and divide the I/O size.\n", SGL_MAX_SEGMENTS);
+		return 1;
+	}
+	if (g_arbitration.read_sink_bufs != 0 && (g_arbitration.verify || g_arbitration.pi_mode == ARB_PI_HOST)) {
+		fprintf(stderr, "--read-sink drops what is read, --verify and --pi host need to check it\n");
+		return 1;
+	}
+	// Raised by the namespaces with interleaved metadata
+	g_arbitration.io_buf_bytes = g_arbitration.io_size_bytes;
+	if (g_arbitration.pi_mode == ARB_PI_PRACT && g_backend != &g_nvme_backend) {
+		fprintf(stderr, "--pi pract needs a controller, only the nvme backend has one\n");
+		return 1;
+	}
+
 	if (g_arbitration.high_priority_weight >= 255 ||
 		g_arbitration.medium_priority_weight >= 255 ||
 		g_arbitration.low_priority_weight >= 255) {
@@ -283,530 +1106,5831 @@ parse_args(int argc, char **argv)
 }
 
 static int
-register_workers(void)
+parse_payload(const char *spec)
 {
-	uint32_t i;
-	struct worker_thread *worker;
-	enum spdk_nvme_qprio qprio = SPDK_NVME_QPRIO_HIGH;
-
-	// The environment is initialized with core_mask at main function
-	SPDK_ENV_FOREACH_CORE(i) {
-		worker = calloc(1, sizeof(*worker));
-		if (worker == NULL) {
-			fprintf(stderr, "Unable to allocate worker\n");
-			return -1;
-		}
-		printf("Allocated worker for %d\n", i);
+	const char *ratio = strchr(spec, ':');
+	size_t type_len = ratio ? (size_t)(ratio - spec) : strlen(spec);
+	long int val = 0;
 
-		TAILQ_INIT(&worker->ns_ctx);
-		worker->lcore = i;
-		// Mask for more than four cores
-		worker->qprio = qprio;
-		qprio = (qprio + 1) & SPDK_NVME_CREATE_IO_SQ_QPRIO_MASK;
-		if (!g_arbitration.enable_urgent && qprio == SPDK_NVME_QPRIO_URGENT) {
-			qprio++;
+	if (ratio != NULL) {
+		val = spdk_strtol(ratio + 1, 10);
+		if (val < 0 || val > 100) {
+			fprintf(stderr, "Payload ratio must be a percentage from 0 to 100\n");
+			return 1;
 		}
-		
-		TAILQ_INSERT_TAIL(&g_workers, worker, link);
-		g_arbitration.num_workers++;
 	}
 
-	return 0;
-}
-
-static int
-register_controllers(void)
-{
-	printf("Initializing NVMe Controllers\n");
-
-	if (spdk_nvme_probe(NULL, NULL, probe_cb, attach_cb, NULL) != 0) {
-		fprintf(stderr, "spdk_nvme_probe() failed\n");
+	if (type_len == strlen("zero") && !strncmp(spec, "zero", type_len)) {
+		g_arbitration.payload_type = PAYLOAD_ZERO;
+	} else if (type_len == strlen("random") && !strncmp(spec, "random", type_len)) {
+		g_arbitration.payload_type = PAYLOAD_RANDOM;
+	} else if (type_len == strlen("compress") && !strncmp(spec, "compress", type_len)) {
+		g_arbitration.payload_type = PAYLOAD_COMPRESS;
+	} else if (type_len == strlen("dedup") && !strncmp(spec, "dedup", type_len)) {
+		g_arbitration.payload_type = PAYLOAD_DEDUP;
+	} else {
+		fprintf(stderr, "Unknown payload type %s\n", spec);
 		return 1;
 	}
 
-	if (g_arbitration.num_namespaces == 0) {
-		fprintf(stderr, "No valid namespaces to continue IO testing\n");
+	if ((g_arbitration.payload_type == PAYLOAD_COMPRESS ||
+		 g_arbitration.payload_type == PAYLOAD_DEDUP) && ratio == NULL) {
+		fprintf(stderr, "Payload %s needs a ratio, e.g. %s:50\n", spec, spec);
 		return 1;
 	}
 
+	g_arbitration.payload_spec = spec;
+	g_arbitration.payload_ratio = val;
 	return 0;
 }
 
-static bool
-probe_cb(void *cb_ctx, const struct spdk_nvme_transport_id *trid,
-	 struct spdk_nvme_ctrlr_opts *opts)
+static int
+parse_qprio(const char *name, enum spdk_nvme_qprio *qprio)
 {
-	// Update arbitration configuration, forced to use WRR
-	opts->arb_mechanism = SPDK_NVME_CC_AMS_WRR;
-	printf("Attaching to %s\n", trid->traddr);
-	return true;
-}
+	for (int i = 0; i < SPDK_NVME_QPRIO_MAX; i++) {
+		if (!strcmp(name, g_qprio_names[i])) {
+			*qprio = i;
+			return 0;
+		}
+	}
 
-static void
-attach_cb(void *cb_ctx, const struct spdk_nvme_transport_id *trid,
-	  struct spdk_nvme_ctrlr *ctrlr, const struct spdk_nvme_ctrlr_opts *opts)
-{
-	printf("Attached to %s\n", trid->traddr);
-	// Update with actual arbitration configuration
-	printf("  Weighted Round Robin: %s\n", opts->arb_mechanism == SPDK_NVME_CC_AMS_WRR ?
-		   "Supported" : "Not Supported");
-	register_ctrlr(ctrlr, opts);
+	fprintf(stderr, "Unknown priority class %s, must be one of (urgent, high, medium, low)\n", name);
+	return 1;
 }
 
-static void
-register_ctrlr(struct spdk_nvme_ctrlr *ctrlr, const struct spdk_nvme_ctrlr_opts *opts)
+// Format: <class>:flush=<percent>,dsm=<percent>,wz=<percent>
+static int
+parse_cmd_mix(const char *spec)
 {
-	struct ctrlr_entry *entry;
-	const struct spdk_nvme_ctrlr_data *cdata;
-
-	uint32_t nsid;
-	struct spdk_nvme_ns *ns;
-
-	union spdk_nvme_cap_register cap;
+	char buf[128];
+	char *mix, *item, *value, *saveptr = NULL;
+	enum spdk_nvme_qprio qprio;
+	struct class_config *cfg;
+	long int val;
 
-	entry = calloc(1, sizeof(struct ctrlr_entry));
-	if (entry == NULL) {
-		perror("ctrlr_entry malloc");
-		exit(1);
+	snprintf(buf, sizeof(buf), "%s", spec);
+	mix = strchr(buf, ':');
+	if (mix == NULL) {
+		fprintf(stderr, "--cmd-mix needs the form <class>:flush=N,dsm=N,wz=N\n");
+		return 1;
 	}
+	*mix++ = '\0';
+	if (parse_qprio(buf, &qprio) != 0) {
+		return 1;
+	}
+	cfg = &g_arbitration.classes[qprio];
 
-	cdata = spdk_nvme_ctrlr_get_data(ctrlr);
-	snprintf(entry->name, sizeof(entry->name), "%-20.20s (%-20.20s)", cdata->mn, cdata->sn);
-	printf("  Name: %s\n", entry->name);
-
-	entry->ctrlr = ctrlr;
-	TAILQ_INSERT_TAIL(&g_controllers, entry, link);
-
-	for (nsid = spdk_nvme_ctrlr_get_first_active_ns(ctrlr); nsid != 0;
-			nsid = spdk_nvme_ctrlr_get_next_active_ns(ctrlr, nsid)) {
-		ns = spdk_nvme_ctrlr_get_ns(ctrlr, nsid);
-		if (ns == NULL) {
-			continue;
+	for (item = strtok_r(mix, ",", &saveptr); item != NULL; item = strtok_r(NULL, ",", &saveptr)) {
+		value = strchr(item, '=');
+		if (value == NULL) {
+			fprintf(stderr, "Missing value in --cmd-mix item %s\n", item);
+			return 1;
+		}
+		*value++ = '\0';
+		val = spdk_strtol(value, 10);
+		if (val < 0 || val > 100) {
+			fprintf(stderr, "--cmd-mix %s must be a percentage from 0 to 100\n", item);
+			return 1;
+		}
+		if (!strcmp(item, "flush")) {
+			cfg->flush_percentage = val;
+		} else if (!strcmp(item, "dsm")) {
+			cfg->dsm_percentage = val;
+		} else if (!strcmp(item, "wz")) {
+			cfg->write_zeroes_percentage = val;
+		} else {
+			fprintf(stderr, "Unknown --cmd-mix command %s, must be one of (flush, dsm, wz)\n", item);
+			return 1;
 		}
-		register_ns(ctrlr, ns);
 	}
 
-	// Setup weighted round robin
-	cap = spdk_nvme_ctrlr_get_regs_cap(ctrlr);
-	if (opts->arb_mechanism == SPDK_NVME_CC_AMS_WRR && (cap.bits.ams & SPDK_NVME_CAP_AMS_WRR)) {
-		print_arb_feature(ctrlr);
-		set_arb_feature(ctrlr);
-		print_arb_feature(ctrlr);	
+	if (cfg->flush_percentage + cfg->dsm_percentage + cfg->write_zeroes_percentage > 100) {
+		fprintf(stderr, "--cmd-mix of %s priority class adds up to more than 100 percent\n",
+				g_qprio_names[qprio]);
+		return 1;
 	}
+
+	return 0;
 }
 
-static void
-register_ns(struct spdk_nvme_ctrlr *ctrlr, struct spdk_nvme_ns *ns)
+// Format: <class>:iops=<N>,bw=<MiB/s>,burst=<ios>[,shared]
+static int
+parse_qos(const char *spec)
 {
-	struct ns_entry *entry;
-	const struct spdk_nvme_ctrlr_data *cdata;
+	char buf[128];
+	char *caps, *item, *value, *saveptr = NULL;
+	enum spdk_nvme_qprio qprio;
+	struct class_config *cfg;
+	long int val;
 
-	if (!spdk_nvme_ns_is_active(ns)) {
-		return;
+	snprintf(buf, sizeof(buf), "%s", spec);
+	caps = strchr(buf, ':');
+	if (caps == NULL) {
+		fprintf(stderr, "--qos needs the form <class>:iops=N,bw=N,burst=N[,shared]\n");
+		return 1;
+	}
+	*caps++ = '\0';
+	if (parse_qprio(buf, &qprio) != 0) {
+		return 1;
 	}
+	cfg = &g_arbitration.classes[qprio];
 
-	// Judge if IO size is valid
-	cdata = spdk_nvme_ctrlr_get_data(ctrlr);
-	// IO size is invalid can because of
-	// 1. The size of namespace size is smaller than IO size
-	// 2. IO size is smaller than sectoer size
+	for (item = strtok_r(caps, ",", &saveptr); item != NULL; item = strtok_r(NULL, ",", &saveptr)) {
+		if (!strcmp(item, "shared")) {
+			cfg->qos_shared = true;
+			continue;
+		}
+		value = strchr(item, '=');
+		if (value == NULL) {
+			fprintf(stderr, "Missing value in --qos item %s\n", item);
+			return 1;
+		}
+		*value++ = '\0';
+		val = spdk_strtol(value, 10);
+		if (val <= 0) {
+			fprintf(stderr, "--qos %s must be a positive number\n", item);
+			return 1;
+		}
+		if (!strcmp(item, "iops")) {
+			cfg->iops_limit = val;
+		} else if (!strcmp(item, "bw")) {
+			cfg->bw_limit_bytes = (uint64_t)val * 1024 * 1024;
+		} else if (!strcmp(item, "burst")) {
+			cfg->qos_burst = val;
+		} else {
+			fprintf(stderr, "Unknown --qos cap %s, must be one of (iops, bw, burst, shared)\n", item);
+			return 1;
+		}
+	}
+
+	if (cfg->iops_limit == 0 && cfg->bw_limit_bytes == 0) {
+		fprintf(stderr, "--qos of %s priority class needs iops or bw\n", g_qprio_names[qprio]);
+		return 1;
+	}
+
+	return 0;
+}
+
+// Format: <interval s>[,<window>[,<max rounds>]]
+static int
+parse_steady_state(const char *spec)
+{
+	long int values[3] = {0, STEADY_DEFAULT_WINDOW, STEADY_DEFAULT_MAX_ROUNDS};
+	char buf[64];
+	char *item, *saveptr = NULL;
+	int i = 0;
+
+	snprintf(buf, sizeof(buf), "%s", spec);
+	for (item = strtok_r(buf, ",", &saveptr); item != NULL; item = strtok_r(NULL, ",", &saveptr)) {
+		if ((size_t)i == SPDK_COUNTOF(values)) {
+			fprintf(stderr, "--steady-state takes at most interval,window,max rounds\n");
+			return 1;
+		}
+		values[i] = spdk_strtol(item, 10);
+		if (values[i++] <= 0) {
+			fprintf(stderr, "--steady-state values must be positive numbers\n");
+			return 1;
+		}
+	}
+	if (i == 0 || values[1] < 2 || values[1] > STEADY_MAX_WINDOW || values[2] < values[1]) {
+		fprintf(stderr, "--steady-state window must be from 2 to %d and at most the max rounds\n",
+				STEADY_MAX_WINDOW);
+		return 1;
+	}
+	g_steady.interval_s = values[0];
+	g_steady.window = values[1];
+	g_steady.max_rounds = values[2];
+
+	return 0;
+}
+
+// Format: split or <class>:start=N[%],size=N[%], MiB or percent of the namespace
+static int
+parse_region(const char *spec)
+{
+	char buf[128];
+	char *range, *item, *value, *saveptr = NULL;
+	enum spdk_nvme_qprio qprio;
+	struct class_config *cfg;
+
+	if (!strcmp(spec, "split")) {
+		g_arbitration.region_split = true;
+		return 0;
+	}
+
+	snprintf(buf, sizeof(buf), "%s", spec);
+	range = strchr(buf, ':');
+	if (range == NULL) {
+		fprintf(stderr, "--region needs to be split or of the form <class>:start=N[%%],size=N[%%]\n");
+		return 1;
+	}
+	*range++ = '\0';
+	if (parse_qprio(buf, &qprio) != 0) {
+		return 1;
+	}
+	cfg = &g_arbitration.classes[qprio];
+	cfg->region_set = true;
+
+	for (item = strtok_r(range, ",", &saveptr); item != NULL; item = strtok_r(NULL, ",", &saveptr)) {
+		value = strchr(item, '=');
+		if (value == NULL) {
+			fprintf(stderr, "Missing value in --region item %s\n", item);
+			return 1;
+		}
+		*value++ = '\0';
+		if (!strcmp(item, "start")) {
+			if (parse_region_bound(value, &cfg->region_start, &cfg->region_start_pct) != 0) {
+				return 1;
+			}
+		} else if (!strcmp(item, "size")) {
+			if (parse_region_bound(value, &cfg->region_size, &cfg->region_size_pct) != 0) {
+				return 1;
+			}
+		} else {
+			fprintf(stderr, "Unknown --region item %s, must be one of (start, size)\n", item);
+			return 1;
+		}
+	}
+
+	if ((cfg->region_start_pct && cfg->region_start >= 100) ||
+		(cfg->region_size_pct && cfg->region_start_pct &&
+		 cfg->region_start + cfg->region_size > 100)) {
+		fprintf(stderr, "--region of %s priority class goes beyond 100 percent\n", g_qprio_names[qprio]);
+		return 1;
+	}
+
+	return 0;
+}
+
+static int
+parse_region_bound(const char *value, uint64_t *bound, bool *pct)
+{
+	char buf[32];
+	size_t len;
+	long int val;
+
+	snprintf(buf, sizeof(buf), "%s", value);
+	len = strlen(buf);
+	*pct = len != 0 && buf[len - 1] == '%';
+	if (*pct) {
+		buf[len - 1] = '\0';
+	}
+	val = spdk_strtol(buf, 10);
+	if (val < 0 || (*pct && val > 100)) {
+		fprintf(stderr, "--region %s must be a number of MiB or a percentage\n", value);
+		return 1;
+	}
+	*bound = val;
+
+	return 0;
+}
+
+// Format: <class>:<cmd>=<us>,...
+static int
+parse_slo(const char *spec)
+{
+	char buf[128];
+	char *slos, *item, *value, *saveptr = NULL;
+	enum spdk_nvme_qprio qprio;
+	long int val;
+	bool matched;
+
+	snprintf(buf, sizeof(buf), "%s", spec);
+	slos = strchr(buf, ':');
+	if (slos == NULL) {
+		fprintf(stderr, "--slo needs the form <class>:<cmd>=<us>,...\n");
+		return 1;
+	}
+	*slos++ = '\0';
+	if (parse_qprio(buf, &qprio) != 0) {
+		return 1;
+	}
+
+	for (item = strtok_r(slos, ",", &saveptr); item != NULL; item = strtok_r(NULL, ",", &saveptr)) {
+		value = strchr(item, '=');
+		if (value == NULL) {
+			fprintf(stderr, "Missing value in --slo item %s\n", item);
+			return 1;
+		}
+		*value++ = '\0';
+		val = spdk_strtol(value, 10);
+		if (val <= 0) {
+			fprintf(stderr, "--slo %s must be a positive number of microseconds\n", item);
+			return 1;
+		}
+		matched = false;
+		for (int op = 0; op < ARB_OP_COUNT; op++) {
+			if (!strcmp(item, "all") || !strcmp(item, g_op_keys[op])) {
+				g_arbitration.classes[qprio].slo_us[op] = val;
+				matched = true;
+			}
+		}
+		if (!matched) {
+			fprintf(stderr, "Unknown --slo command %s, must be one of\n"
+					"(read, write, flush, dsm, wz, all)\n", item);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+static int
+parse_sim_service(const char *spec)
+{
+	char buf[256];
+	char *item, *value, *params, *max, *saveptr = NULL;
+	struct arb_sim_service service;
+	long int min_us, max_us;
+	bool matched;
+	int op;
+
+	snprintf(buf, sizeof(buf), "%s", spec);
+	for (item = strtok_r(buf, ",", &saveptr); item != NULL; item = strtok_r(NULL, ",", &saveptr)) {
+		value = strchr(item, '=');
+		params = value != NULL ? strchr(value, ':') : NULL;
+		if (params == NULL) {
+			fprintf(stderr, "--sim-service item %s needs the form <cmd>=<dist>:<us>\n", item);
+			return 1;
+		}
+		*value++ = '\0';
+		*params++ = '\0';
+
+		max = strchr(params, '-');
+		if (max != NULL) {
+			*max++ = '\0';
+		}
+		min_us = spdk_strtol(params, 10);
+		max_us = max != NULL ? spdk_strtol(max, 10) : min_us;
+		if (min_us < 0 || max_us < min_us) {
+			fprintf(stderr, "Invalid service time in --sim-service item %s\n", item);
+			return 1;
+		}
+		service.min_us = min_us;
+		service.max_us = max_us;
+
+		if (!strcmp(value, "fixed") && max == NULL) {
+			service.dist = ARB_SIM_DIST_FIXED;
+		} else if (!strcmp(value, "uniform") && max != NULL) {
+			service.dist = ARB_SIM_DIST_UNIFORM;
+		} else if (!strcmp(value, "exp") && max == NULL) {
+			service.dist = ARB_SIM_DIST_EXP;
+		} else {
+			fprintf(stderr, "Unknown --sim-service distribution %s, must be one of\n"
+					"(fixed:N, uniform:MIN-MAX, exp:MEAN)\n", value);
+			return 1;
+		}
+
+		matched = false;
+		for (op = 0; op < ARB_OP_COUNT; op++) {
+			if (!strcmp(item, "all") || !strcmp(item, g_op_keys[op])) {
+				g_arbitration.backend_opts.sim_service[op] = service;
+				matched = true;
+			}
+		}
+		if (!matched) {
+			fprintf(stderr, "Unknown --sim-service command %s, must be one of\n"
+					"(read, write, flush, dsm, wz, all)\n", item);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+static void
+print_sim_service(void)
+{
+	const struct arb_sim_service *service;
+
+	printf(" --sim-service ");
+	for (int op = 0; op < ARB_OP_COUNT; op++) {
+		service = &g_arbitration.backend_opts.sim_service[op];
+		printf("%s%s=", op ? "," : "", g_op_keys[op]);
+		switch (service->dist) {
+		case ARB_SIM_DIST_FIXED:
+			printf("fixed:%u", service->min_us);
+			break;
+		case ARB_SIM_DIST_UNIFORM:
+			printf("uniform:%u-%u", service->min_us, service->max_us);
+			break;
+		case ARB_SIM_DIST_EXP:
+			printf("exp:%u", service->min_us);
+			break;
+		}
+	}
+}
+
+static int
+parse_pi(const char *spec)
+{
+	char buf[64];
+	char *item, *saveptr = NULL;
+
+	snprintf(buf, sizeof(buf), "%s", spec);
+	item = strtok_r(buf, ",", &saveptr);
+	if (item == NULL) {
+		fprintf(stderr, "--pi needs a mode\n");
+		return 1;
+	}
+	if (!strcmp(item, "off")) {
+		g_arbitration.pi_mode = ARB_PI_OFF;
+	} else if (!strcmp(item, "pract")) {
+		g_arbitration.pi_mode = ARB_PI_PRACT;
+	} else if (!strcmp(item, "host")) {
+		g_arbitration.pi_mode = ARB_PI_HOST;
+	} else {
+		fprintf(stderr, "Unknown --pi mode %s, must be one of (off, pract, host)\n", item);
+		return 1;
+	}
+
+	g_arbitration.pi_checks = 0;
+	while ((item = strtok_r(NULL, ",", &saveptr)) != NULL) {
+		if (!strcmp(item, "guard")) {
+			g_arbitration.pi_checks |= SPDK_DIF_FLAGS_GUARD_CHECK;
+		} else if (!strcmp(item, "apptag")) {
+			g_arbitration.pi_checks |= SPDK_DIF_FLAGS_APPTAG_CHECK;
+		} else if (!strcmp(item, "reftag")) {
+			g_arbitration.pi_checks |= SPDK_DIF_FLAGS_REFTAG_CHECK;
+		} else {
+			fprintf(stderr, "Unknown --pi check %s, must be one of (guard, apptag, reftag)\n", item);
+			return 1;
+		}
+	}
+	if (g_arbitration.pi_checks == 0) {
+		g_arbitration.pi_checks = SPDK_DIF_FLAGS_GUARD_CHECK | SPDK_DIF_FLAGS_APPTAG_CHECK |
+					  SPDK_DIF_FLAGS_REFTAG_CHECK;
+	}
+	g_arbitration.pi_spec = spec;
+
+	return 0;
+}
+
+static int
+parse_sim_md(const char *spec)
+{
+	struct arb_backend_opts *opts = &g_arbitration.backend_opts;
+	char buf[64];
+	char *item, *saveptr = NULL;
+	long int val;
+
+	snprintf(buf, sizeof(buf), "%s", spec);
+	item = strtok_r(buf, ",", &saveptr);
+	val = item != NULL ? spdk_strtol(item, 10) : -1;
+	if (val < 0 || val > 128) {
+		fprintf(stderr, "--sim-md needs the metadata bytes, at most 128\n");
+		return 1;
+	}
+	opts->sim_md_size = val;
+	opts->sim_md_interleave = false;
+	opts->sim_pi_type = SPDK_NVME_FMT_NVM_PROTECTION_DISABLE;
+
+	while ((item = strtok_r(NULL, ",", &saveptr)) != NULL) {
+		if (!strcmp(item, "extended")) {
+			opts->sim_md_interleave = true;
+		} else if (!strncmp(item, "pi=", 3)) {
+			val = spdk_strtol(item + 3, 10);
+			if (val < SPDK_NVME_FMT_NVM_PROTECTION_TYPE1 || val > SPDK_NVME_FMT_NVM_PROTECTION_TYPE3) {
+				fprintf(stderr, "--sim-md protection information type must be 1, 2 or 3\n");
+				return 1;
+			}
+			opts->sim_pi_type = val;
+		} else {
+			fprintf(stderr, "Unknown --sim-md item %s, must be one of (extended, pi=N)\n", item);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+// Format: N or <class>:N[,<class>:N]
+static int
+parse_qpairs(const char *spec)
+{
+	char buf[128];
+	char *item, *count, *saveptr = NULL;
+	enum spdk_nvme_qprio qprio;
+	long int val;
+
+	snprintf(buf, sizeof(buf), "%s", spec);
+	for (item = strtok_r(buf, ",", &saveptr); item != NULL; item = strtok_r(NULL, ",", &saveptr)) {
+		count = strchr(item, ':');
+		if (count != NULL) {
+			*count++ = '\0';
+			if (parse_qprio(item, &qprio) != 0) {
+				return 1;
+			}
+		} else {
+			count = item;
+		}
+		val = spdk_strtol(count, 10);
+		if (val < 1 || val > ARB_MAX_QPAIRS) {
+			fprintf(stderr, "--qpairs must be from 1 to %d\n", ARB_MAX_QPAIRS);
+			return 1;
+		}
+		if (count != item) {
+			g_arbitration.classes[qprio].num_qpairs = val;
+			continue;
+		}
+		for (int i = 0; i < SPDK_NVME_QPRIO_MAX; i++) {
+			g_arbitration.classes[i].num_qpairs = val;
+		}
+	}
+
+	return 0;
+}
+
+static int
+parse_arb_rule(const char *spec)
+{
+	char buf[128];
+	char *settings, *item, *value, *saveptr = NULL;
+	struct arb_rule *rule;
+	long int val;
+	int *field;
+
+	if (g_arbitration.num_rules == ARB_MAX_RULES) {
+		fprintf(stderr, "At most %d --arb-rule can be given\n", ARB_MAX_RULES);
+		return 1;
+	}
+	rule = &g_arbitration.rules[g_arbitration.num_rules];
+	rule->burst = -1;
+	rule->high_priority_weight = -1;
+	rule->medium_priority_weight = -1;
+	rule->low_priority_weight = -1;
+	if (strlen(spec) >= sizeof(rule->str)) {
+		fprintf(stderr, "--arb-rule %s is longer than %zu characters\n", spec, sizeof(rule->str) - 1);
+		return 1;
+	}
+	snprintf(rule->str, sizeof(rule->str), "%s", spec);
+
+	snprintf(buf, sizeof(buf), "%s", spec);
+	settings = strchr(buf, ':');
+	if ((strncmp(buf, "mn=", 3) && strncmp(buf, "sn=", 3)) || settings == NULL) {
+		fprintf(stderr, "--arb-rule needs the form (mn|sn)=<pattern>:b=N,h=N,m=N,l=N\n");
+		return 1;
+	}
+	*settings++ = '\0';
+	rule->match_serial = buf[0] == 's';
+	if (strlen(buf + 3) >= sizeof(rule->pattern)) {
+		fprintf(stderr, "--arb-rule pattern %s is longer than %zu characters\n", buf + 3,
+			sizeof(rule->pattern) - 1);
+		return 1;
+	}
+	snprintf(rule->pattern, sizeof(rule->pattern), "%s", buf + 3);
+
+	for (item = strtok_r(settings, ",", &saveptr); item != NULL; item = strtok_r(NULL, ",", &saveptr)) {
+		value = strchr(item, '=');
+		if (value == NULL) {
+			fprintf(stderr, "Missing value in --arb-rule item %s\n", item);
+			return 1;
+		}
+		*value++ = '\0';
+		val = spdk_strtol(value, 10);
+		if (!strcmp(item, "b")) {
+			field = &rule->burst;
+			if (val < 0 || val > SPDK_NVME_ARBITRATION_BURST_UNLIMITED) {
+				fprintf(stderr, "--arb-rule burst must be from 0 to 7\n");
+				return 1;
+			}
+		} else if (!strcmp(item, "h") || !strcmp(item, "m") || !strcmp(item, "l")) {
+			field = item[0] == 'h' ? &rule->high_priority_weight :
+					item[0] == 'm' ? &rule->medium_priority_weight : &rule->low_priority_weight;
+			if (val < 1 || val > 255) {
+				fprintf(stderr, "--arb-rule weights must be from 1 to 255\n");
+				return 1;
+			}
+		} else {
+			fprintf(stderr, "Unknown --arb-rule setting %s, must be one of (b, h, m, l)\n", item);
+			return 1;
+		}
+		*field = val;
+	}
+
+	g_arbitration.num_rules++;
+	return 0;
+}
+
+static void
+resolve_arb_settings(struct ctrlr_entry *entry)
+{
+	const struct arb_rule *rule;
+
+	entry->arb.burst = g_arbitration.arbitration_burst;
+	entry->arb.high_priority_weight = g_arbitration.high_priority_weight;
+	entry->arb.medium_priority_weight = g_arbitration.medium_priority_weight;
+	entry->arb.low_priority_weight = g_arbitration.low_priority_weight;
+	entry->arb_rule = -1;
+
+	// The other backends arbitrate all their namespaces with the same values
+	if (entry->ctrlr == NULL) {
+		return;
+	}
+
+	for (int i = 0; i < g_arbitration.num_rules; i++) {
+		rule = &g_arbitration.rules[i];
+		if (fnmatch(rule->pattern, rule->match_serial ? entry->sn : entry->mn, 0) != 0) {
+			continue;
+		}
+		if (rule->burst >= 0) {
+			entry->arb.burst = rule->burst;
+		}
+		if (rule->high_priority_weight > 0) {
+			entry->arb.high_priority_weight = rule->high_priority_weight;
+		}
+		if (rule->medium_priority_weight > 0) {
+			entry->arb.medium_priority_weight = rule->medium_priority_weight;
+		}
+		if (rule->low_priority_weight > 0) {
+			entry->arb.low_priority_weight = rule->low_priority_weight;
+		}
+		entry->arb_rule = i;
+		return;
+	}
+}
+
+static bool
+arb_feature_matches(const struct arb_settings *arb, uint32_t raw)
+{
+	union spdk_nvme_cmd_cdw11 feat;
+
+	feat.feat_arbitration.raw = raw;
+	return feat.feat_arbitration.bits.ab == spdk_min(arb->burst, SPDK_NVME_ARBITRATION_BURST_UNLIMITED) &&
+		   feat.feat_arbitration.bits.hpw == arb->high_priority_weight - 1 &&
+		   feat.feat_arbitration.bits.mpw == arb->medium_priority_weight - 1 &&
+		   feat.feat_arbitration.bits.lpw == arb->low_priority_weight - 1;
+}
+
+// Our own keys are taken out before the string is handed to SPDK
+static int
+add_trid(const char *trid_str)
+{
+	struct trid_entry *trid_entry;
+	char buf[512], spdk_str[512], *key, *saveptr = NULL;
+	size_t len = 0;
+	long int val;
+
+	trid_entry = calloc(1, sizeof(*trid_entry));
+	if (trid_entry == NULL) {
+		return -1;
+	}
+	snprintf(trid_entry->str, sizeof(trid_entry->str), "%s", trid_str);
+	snprintf(buf, sizeof(buf), "%s", trid_str);
+
+	trid_entry->trid.trtype = SPDK_NVME_TRANSPORT_PCIE;
+	snprintf(trid_entry->trid.subnqn, sizeof(trid_entry->trid.subnqn), "%s", SPDK_NVMF_DISCOVERY_NQN);
+
+	// Rebuild the string without num_io_queues and io_queue_size
+	for (key = strtok_r(buf, " \t", &saveptr); key != NULL; key = strtok_r(NULL, " \t", &saveptr)) {
+		if (!strncasecmp(key, "num_io_queues:", strlen("num_io_queues:")) ||
+			!strncasecmp(key, "io_queue_size:", strlen("io_queue_size:"))) {
+			val = spdk_strtol(strchr(key, ':') + 1, 10);
+			if (val <= 0) {
+				fprintf(stderr, "Invalid value in %s\n", key);
+				free(trid_entry);
+				return 1;
+			}
+			if (key[0] == 'n' || key[0] == 'N') {
+				trid_entry->num_io_queues = val;
+			} else {
+				trid_entry->io_queue_size = val;
+			}
+			continue;
+		}
+		len += snprintf(spdk_str + len, sizeof(spdk_str) - len, "%s%s", len ? " " : "", key);
+	}
+	spdk_str[len] = '\0';
+
+	if (spdk_nvme_transport_id_parse(&trid_entry->trid, spdk_str) != 0) {
+		fprintf(stderr, "Invalid transport ID format '%s'\n", trid_str);
+		free(trid_entry);
+		return 1;
+	}
+
+	TAILQ_INSERT_TAIL(&g_trid_list, trid_entry, link);
+	return 0;
+}
+
+static int
+select_backend(const char *name)
+{
+	for (size_t i = 0; i < SPDK_COUNTOF(g_backends); i++) {
+		if (!strcmp(name, g_backends[i]->name)) {
+			g_backend = g_backends[i];
+			g_arbitration.backend_name = g_backend->name;
+			return 0;
+		}
+	}
+
+	fprintf(stderr, "Unknown or not built backend %s\n", name);
+	return 1;
+}
+
+static int
+register_workers(void)
+{
+	uint32_t i;
+	struct worker_thread *worker;
+	enum spdk_nvme_qprio qprio = SPDK_NVME_QPRIO_HIGH;
+
+	// The environment is initialized with core_mask at main function
+	SPDK_ENV_FOREACH_CORE(i) {
+		worker = calloc(1, sizeof(*worker));
+		if (worker == NULL) {
+			fprintf(stderr, "Unable to allocate worker\n");
+			return -1;
+		}
+		printf("Allocated worker for %d\n", i);
+
+		TAILQ_INIT(&worker->ns_ctx);
+		worker->lcore = i;
+		// Mask for more than four cores
+		worker->qprio = g_arbitration.tenant ? g_arbitration.tenant_qprio : qprio;
+		qprio = (qprio + 1) & SPDK_NVME_CREATE_IO_SQ_QPRIO_MASK;
+		if (!g_arbitration.enable_urgent && qprio == SPDK_NVME_QPRIO_URGENT) {
+			qprio++;
+		}
+		
+		TAILQ_INSERT_TAIL(&g_workers, worker, link);
+		g_arbitration.num_workers++;
+	}
+
+	return 0;
+}
+
+static int
+register_controllers(void)
+{
+	g_arbitration.backend_opts.arbitration_burst = g_arbitration.arbitration_burst;
+	g_arbitration.backend_opts.weights[SPDK_NVME_QPRIO_URGENT] = 0;
+	g_arbitration.backend_opts.weights[SPDK_NVME_QPRIO_HIGH] = g_arbitration.high_priority_weight;
+	g_arbitration.backend_opts.weights[SPDK_NVME_QPRIO_MEDIUM] = g_arbitration.medium_priority_weight;
+	g_arbitration.backend_opts.weights[SPDK_NVME_QPRIO_LOW] = g_arbitration.low_priority_weight;
+
+	if (g_backend->attach(&g_arbitration.backend_opts, register_backend_ns) != 0) {
+		fprintf(stderr, "Attaching %s backend failed\n", g_backend->name);
+		return 1;
+	}
+	g_arbitration.startup.ctrlr_setup_tsc = spdk_get_ticks();
+
+	if (g_arbitration.num_namespaces == 0) {
+		fprintf(stderr, "No valid namespaces to continue IO testing\n");
+		return 1;
+	}
+
+	return 0;
+}
+
+// Probes already started when a later one fails still own their
+// controllers, they finish attaching and are detached with the others
+static void
+nvme_probe_drain(struct spdk_nvme_probe_ctx **probe_ctxs, int num_probes)
+{
+	int pending;
+
+	do {
+		pending = 0;
+		for (int i = 0; i < num_probes; i++) {
+			if (probe_ctxs[i] == NULL) {
+				continue;
+			}
+			if (spdk_nvme_probe_poll_async(probe_ctxs[i]) == -EAGAIN) {
+				pending++;
+			} else {
+				probe_ctxs[i] = NULL;
+			}
+		}
+	} while (pending != 0);
+}
+
+static int
+nvme_attach(const struct arb_backend_opts *opts, arb_backend_ns_cb ns_cb)
+{
+	struct trid_entry *trid_entry;
+	struct spdk_nvme_transport_id trid = {};
+	struct spdk_nvme_probe_ctx **probe_ctxs;
+	struct ctrlr_entry *ctrlr_entry;
+	int num_probes = 0, max_probes = 1, pending;
+	bool setup_pending;
+
+	// Controllers are set up in attach_cb() and their namespaces go through
+	// register_ns(), ns_cb is for the backends without controllers of their own
+	(void)ns_cb;
+	(void)opts;
+
+	printf("Initializing NVMe Controllers\n");
+
+	TAILQ_FOREACH(trid_entry, &g_trid_list, link) {
+		max_probes++;
+	}
+	probe_ctxs = calloc(max_probes, sizeof(*probe_ctxs));
+	if (probe_ctxs == NULL) {
+		return 1;
+	}
+
+	// All targets are probed at once, the driver brings their controllers
+	// up in parallel while probe_poll_async() is called
+	if (TAILQ_EMPTY(&g_trid_list)) {
+		spdk_nvme_trid_populate_transport(&trid, SPDK_NVME_TRANSPORT_PCIE);
+		snprintf(trid.subnqn, sizeof(trid.subnqn), "%s", SPDK_NVMF_DISCOVERY_NQN);
+		probe_ctxs[num_probes] = spdk_nvme_probe_async(&trid, NULL, probe_cb, attach_cb, NULL);
+		if (probe_ctxs[num_probes++] == NULL) {
+			fprintf(stderr, "spdk_nvme_probe_async() failed\n");
+			goto err;
+		}
+	}
+
+	TAILQ_FOREACH(trid_entry, &g_trid_list, link) {
+		probe_ctxs[num_probes] = spdk_nvme_probe_async(&trid_entry->trid, trid_entry,
+													   probe_cb, attach_cb, NULL);
+		if (probe_ctxs[num_probes++] == NULL) {
+			fprintf(stderr, "spdk_nvme_probe_async() failed for transport address '%s'\n",
+					trid_entry->trid.traddr);
+			goto err;
+		}
+	}
+
+	// Controllers attached first run their admin setup while the others
+	// are still initializing
+	do {
+		pending = 0;
+		for (int i = 0; i < num_probes; i++) {
+			if (probe_ctxs[i] == NULL) {
+				continue;
+			}
+			if (spdk_nvme_probe_poll_async(probe_ctxs[i]) == -EAGAIN) {
+				pending++;
+			} else {
+				probe_ctxs[i] = NULL;
+			}
+		}
+		if (pending == 0 && g_arbitration.startup.attach_tsc == 0) {
+			g_arbitration.startup.attach_tsc = spdk_get_ticks();
+		}
+
+		setup_pending = false;
+		TAILQ_FOREACH(ctrlr_entry, &g_controllers, link) {
+			if (ctrlr_entry->setup.state != CTRLR_SETUP_DONE) {
+				spdk_nvme_ctrlr_process_admin_completions(ctrlr_entry->ctrlr);
+				setup_pending = true;
+			}
+		}
+	} while (pending != 0 || setup_pending);
+	free(probe_ctxs);
+
+	TAILQ_FOREACH(ctrlr_entry, &g_controllers, link) {
+		print_ctrlr_setup(ctrlr_entry);
+	}
+
+	return 0;
+err:
+	nvme_probe_drain(probe_ctxs, num_probes);
+	free(probe_ctxs);
+	return 1;
+}
+
+static void
+nvme_detach(void)
+{
+	struct ctrlr_entry *ctrlr_entry;
+	struct spdk_nvme_detach_ctx *detach_ctx = NULL;
+
+	TAILQ_FOREACH(ctrlr_entry, &g_controllers, link) {
+		if (ctrlr_entry->ctrlr != NULL) {
+			spdk_nvme_detach_async(ctrlr_entry->ctrlr, &detach_ctx);
+		}
+	}
+
+	if (detach_ctx) {
+		spdk_nvme_detach_poll(detach_ctx);
+	}
+}
+
+static void *
+nvme_qpair_alloc(void *backend_ns, enum spdk_nvme_qprio qprio, uint32_t depth)
+{
+	struct spdk_nvme_ctrlr *ctrlr = spdk_nvme_ns_get_ctrlr(backend_ns);
+	struct spdk_nvme_io_qpair_opts opts;
+	uint32_t requests;
+
+	// The default size is the most the controller takes, see probe_cb(). A
+	// full queue keeps one entry empty, the commands beyond it wait in the
+	// driver as long as it has requests for them.
+	spdk_nvme_ctrlr_get_default_io_qpair_opts(ctrlr, &opts, sizeof(opts));
+	opts.qprio = qprio;
+	if (depth + 1 <= opts.io_queue_size) {
+		opts.io_queue_size = depth + 1;
+	} else {
+		printf("WARNING: queue pairs hold %u commands, the rest of a depth of %u waits in the driver\n",
+			   opts.io_queue_size - 1, depth);
+	}
+	// A command beyond the transfer size of the namespace is split into
+	// child requests under a parent one
+	requests = spdk_divide_round_up(g_arbitration.io_buf_bytes, spdk_nvme_ns_get_max_io_xfer_size(backend_ns));
+	if (requests > 1) {
+		requests++;
+	}
+	opts.io_queue_requests = spdk_max(opts.io_queue_requests, depth * requests);
+
+	return spdk_nvme_ctrlr_alloc_io_qpair(ctrlr, &opts, sizeof(opts));
+}
+
+static void
+nvme_qpair_free(void *qpair)
+{
+	spdk_nvme_ctrlr_free_io_qpair(qpair);
+}
+
+static int
+nvme_submit(void *qpair, struct arb_cmd *cmd)
+{
+	struct spdk_nvme_ns *ns = cmd->ns;
+	// The driver copies the ranges into its own payload before returning
+	struct spdk_nvme_dsm_range dsm_range;
+
+	switch (cmd->op) {
+	// Without metadata and flags the _with_md calls are the plain ones
+	case ARB_OP_READ:
+		if (cmd->vectored) {
+			return spdk_nvme_ns_cmd_readv_with_md(ns, qpair, cmd->lba, cmd->lba_count,
+							cmd->cb_fn, cmd, cmd->io_flags, cmd_reset_sgl, cmd_next_sge,
+							cmd->md_buf, cmd->apptag_mask, cmd->apptag);
+		}
+		return spdk_nvme_ns_cmd_read_with_md(ns, qpair, cmd->iovs[0].iov_base, cmd->md_buf,
+							cmd->lba, cmd->lba_count, cmd->cb_fn, cmd, cmd->io_flags,
+							cmd->apptag_mask, cmd->apptag);
+	case ARB_OP_WRITE:
+		if (cmd->vectored) {
+			return spdk_nvme_ns_cmd_writev_with_md(ns, qpair, cmd->lba, cmd->lba_count,
+							cmd->cb_fn, cmd, cmd->io_flags, cmd_reset_sgl, cmd_next_sge,
+							cmd->md_buf, cmd->apptag_mask, cmd->apptag);
+		}
+		return spdk_nvme_ns_cmd_write_with_md(ns, qpair, cmd->iovs[0].iov_base, cmd->md_buf,
+							cmd->lba, cmd->lba_count, cmd->cb_fn, cmd, cmd->io_flags,
+							cmd->apptag_mask, cmd->apptag);
+	case ARB_OP_FLUSH:
+		return spdk_nvme_ns_cmd_flush(ns, qpair, cmd->cb_fn, cmd);
+	case ARB_OP_DSM:
+		dsm_range.attributes.raw = 0;
+		dsm_range.starting_lba = cmd->lba;
+		dsm_range.length = cmd->lba_count;
+		return spdk_nvme_ns_cmd_dataset_management(ns, qpair, SPDK_NVME_DSM_ATTR_DEALLOCATE,
+							&dsm_range, 1, cmd->cb_fn, cmd);
+	case ARB_OP_WRITE_ZEROES:
+		return spdk_nvme_ns_cmd_write_zeroes(ns, qpair, cmd->lba, cmd->lba_count,
+							cmd->cb_fn, cmd, cmd->io_flags);
+	default:
+		return -EINVAL;
+	}
+}
+
+static void
+cmd_reset_sgl(void *ref, uint32_t sgl_offset)
+{
+	struct arb_cmd *cmd = ref;
+
+	cmd->iov_pos = 0;
+	while (cmd->iov_pos < cmd->iovcnt && sgl_offset >= cmd->iovs[cmd->iov_pos].iov_len) {
+		sgl_offset -= cmd->iovs[cmd->iov_pos].iov_len;
+		cmd->iov_pos++;
+	}
+	cmd->iov_offset = sgl_offset;
+}
+
+static int
+cmd_next_sge(void *ref, void **address, uint32_t *length)
+{
+	struct arb_cmd *cmd = ref;
+	struct iovec *iov;
+
+	if (cmd->iov_pos >= cmd->iovcnt) {
+		*length = 0;
+		return -1;
+	}
+
+	iov = &cmd->iovs[cmd->iov_pos];
+	*address = (uint8_t *)iov->iov_base + cmd->iov_offset;
+	*length = iov->iov_len - cmd->iov_offset;
+	cmd->iov_pos++;
+	cmd->iov_offset = 0;
+
+	return 0;
+}
+
+static int32_t
+nvme_poll(void *qpair, uint32_t max_completions)
+{
+	return spdk_nvme_qpair_process_completions(qpair, max_completions);
+}
+
+static void *
+nvme_buf_alloc(size_t size, size_t align, int numa_id)
+{
+	return spdk_zmalloc(size, align, NULL, numa_id, SPDK_MALLOC_DMA);
+}
+
+static void
+nvme_buf_free(void *buf)
+{
+	spdk_free(buf);
+}
+
+static bool
+probe_cb(void *cb_ctx, const struct spdk_nvme_transport_id *trid,
+	 struct spdk_nvme_ctrlr_opts *opts)
+{
+	struct trid_entry *trid_entry = cb_ctx;
+
+	// Update arbitration configuration, forced to use WRR
+	opts->arb_mechanism = SPDK_NVME_CC_AMS_WRR;
+	if (trid_entry != NULL) {
+		if (trid_entry->num_io_queues != 0) {
+			opts->num_io_queues = trid_entry->num_io_queues;
+		}
+		if (trid_entry->io_queue_size != 0) {
+			opts->io_queue_size = trid_entry->io_queue_size;
+		}
+	}
+	// Room for -d in a single queue pair, the driver caps it at what the controller supports
+	if (trid_entry == NULL || trid_entry->io_queue_size == 0) {
+		opts->io_queue_size = spdk_max(opts->io_queue_size, (uint32_t)g_arbitration.io_queue_depth + 1);
+	}
+	printf("Attaching to %s\n", trid->traddr);
+	return true;
+}
+
+static void
+attach_cb(void *cb_ctx, const struct spdk_nvme_transport_id *trid,
+	  struct spdk_nvme_ctrlr *ctrlr, const struct spdk_nvme_ctrlr_opts *opts)
+{
+	printf("Attached to %s\n", trid->traddr);
+	// Update with actual arbitration configuration
+	printf("  Weighted Round Robin: %s\n", opts->arb_mechanism == SPDK_NVME_CC_AMS_WRR ?
+		   "Supported" : "Not Supported");
+	printf("  SGL: %s\n", spdk_nvme_ctrlr_get_flags(ctrlr) & SPDK_NVME_CTRLR_SGL_SUPPORTED ?
+		   "Supported" : "Not Supported");
+	printf("  Transport: %s, %u I/O queues of %u entries\n",
+		   spdk_nvme_transport_id_trtype_str(trid->trtype), opts->num_io_queues, opts->io_queue_size);
+	if (trid->trtype != SPDK_NVME_TRANSPORT_PCIE) {
+		// The target chooses the in-capsule data size, the host can only report it
+		printf("  In-capsule data size: %u bytes\n",
+			   spdk_nvme_ctrlr_get_data(ctrlr)->nvmf_specific.ioccsz * 16 -
+			   (uint32_t)sizeof(struct spdk_nvme_cmd));
+	}
+	register_ctrlr(ctrlr, opts);
+}
+
+static void
+register_ctrlr(struct spdk_nvme_ctrlr *ctrlr, const struct spdk_nvme_ctrlr_opts *opts)
+{
+	struct ctrlr_entry *entry;
+	const struct spdk_nvme_ctrlr_data *cdata;
+
+	uint32_t nsid;
+	struct spdk_nvme_ns *ns;
+
+	union spdk_nvme_cap_register cap;
+
+	entry = calloc(1, sizeof(struct ctrlr_entry));
+	if (entry == NULL) {
+		perror("ctrlr_entry malloc");
+		exit(1);
+	}
+
+	cdata = spdk_nvme_ctrlr_get_data(ctrlr);
+	snprintf(entry->name, sizeof(entry->name), "%-20.20s (%-20.20s)", cdata->mn, cdata->sn);
+	printf("  Name: %s\n", entry->name);
+	// Identify pads both with spaces
+	snprintf(entry->mn, sizeof(entry->mn), "%.*s", (int)sizeof(cdata->mn), (const char *)cdata->mn);
+	snprintf(entry->sn, sizeof(entry->sn), "%.*s", (int)sizeof(cdata->sn), (const char *)cdata->sn);
+	for (int i = strlen(entry->mn) - 1; i >= 0 && entry->mn[i] == ' '; i--) {
+		entry->mn[i] = '\0';
+	}
+	for (int i = strlen(entry->sn) - 1; i >= 0 && entry->sn[i] == ' '; i--) {
+		entry->sn[i] = '\0';
+	}
+
+	entry->ctrlr = ctrlr;
+	entry->trtype = spdk_nvme_ctrlr_get_transport_id(ctrlr)->trtype;
+	resolve_arb_settings(entry);
+	TAILQ_INSERT_TAIL(&g_controllers, entry, link);
+
+	cap = spdk_nvme_ctrlr_get_regs_cap(ctrlr);
+
+	// Fabrics have no queue priority in Connect, so qprio never reaches the device
+	entry->wrr_enabled = entry->trtype == SPDK_NVME_TRANSPORT_PCIE &&
+						 opts->arb_mechanism == SPDK_NVME_CC_AMS_WRR &&
+						 (cap.bits.ams & SPDK_NVME_CAP_AMS_WRR);
+	if (!entry->wrr_enabled) {
+		printf("  Arbitration: round robin, qprio is not applied by this controller%s\n",
+			   g_arbitration.host_wrr ? ", queue depth is scaled by weight on the host" : "");
+	}
+
+	for (nsid = spdk_nvme_ctrlr_get_first_active_ns(ctrlr); nsid != 0;
+			nsid = spdk_nvme_ctrlr_get_next_active_ns(ctrlr, nsid)) {
+		ns = spdk_nvme_ctrlr_get_ns(ctrlr, nsid);
+		if (ns == NULL) {
+			continue;
+		}
+		register_ns(entry, ns);
+	}
+
+	// Setup weighted round robin, then time the admin queue. Both finish
+	// in nvme_attach() together with the other controllers.
+	entry->setup.attach_tsc = spdk_get_ticks();
+	entry->admin_rtt_tsc = UINT64_MAX;
+	if (opts->arb_mechanism == SPDK_NVME_CC_AMS_WRR && (cap.bits.ams & SPDK_NVME_CAP_AMS_WRR)) {
+		// Tenants only check what the primary programmed
+		entry->setup.state = spdk_process_is_primary() ? CTRLR_SETUP_GET_ARB : CTRLR_SETUP_CHECK_ARB;
+	} else {
+		entry->setup.state = CTRLR_SETUP_RTT;
+	}
+	ctrlr_setup_submit(entry);
+}
+
+static void
+register_ns(struct ctrlr_entry *ctrlr_entry, struct spdk_nvme_ns *ns)
+{
+	struct spdk_nvme_ctrlr *ctrlr = ctrlr_entry->ctrlr;
+	struct arb_backend_ns_info info = {};
+	struct ns_entry *entry;
+	const struct spdk_nvme_ctrlr_data *cdata;
+
+	if (!spdk_nvme_ns_is_active(ns)) {
+		return;
+	}
+
+	cdata = spdk_nvme_ctrlr_get_data(ctrlr);
+	snprintf(info.name, sizeof(info.name), "%-20.20s (%-20.20s)", cdata->mn, cdata->sn);
+	info.nsid = spdk_nvme_ns_get_id(ns);
+	info.size = spdk_nvme_ns_get_size(ns);
+	info.block_size = spdk_nvme_ns_get_sector_size(ns);
+	info.extended_block_size = spdk_nvme_ns_get_extended_sector_size(ns);
+	info.md_size = spdk_nvme_ns_get_md_size(ns);
+	info.md_interleave = spdk_nvme_ns_supports_extended_lba(ns);
+	info.pi_type = spdk_nvme_ns_get_pi_type(ns);
+	info.pi_loc = spdk_nvme_ns_get_data(ns)->dps.md_start;
+	info.flags = spdk_nvme_ns_get_flags(ns);
+	info.sgl_supported = spdk_nvme_ctrlr_get_flags(ctrlr) & SPDK_NVME_CTRLR_SGL_SUPPORTED;
+	info.wrr_supported = ctrlr_entry->wrr_enabled;
+
+	entry = add_namespace(ctrlr_entry, ns, &info);
+	if (entry != NULL) {
+		entry->nvme.ctrlr = ctrlr;
+		entry->nvme.ns = ns;
+	}
+}
+
+// Namespaces of the other backends get a controller entry of their own
+static void
+register_backend_ns(void *backend_ns, const struct arb_backend_ns_info *info)
+{
+	struct ctrlr_entry *entry;
+
+	entry = calloc(1, sizeof(struct ctrlr_entry));
+	if (entry == NULL) {
+		perror("ctrlr_entry malloc");
+		exit(1);
+	}
+
+	snprintf(entry->name, sizeof(entry->name), "%s", info->name);
+	entry->ctrlr = NULL;
+	entry->trtype = SPDK_NVME_TRANSPORT_CUSTOM;
+	entry->wrr_enabled = info->wrr_supported;
+	entry->admin_rtt_tsc = 0;
+	snprintf(entry->mn, sizeof(entry->mn), "%s", info->name);
+	resolve_arb_settings(entry);
+	TAILQ_INSERT_TAIL(&g_controllers, entry, link);
+
+	printf("Attached to %s backend namespace %u: %s\n", g_backend->name, info->nsid, info->name);
+	add_namespace(entry, backend_ns, info);
+}
+
+static struct ns_entry *
+add_namespace(struct ctrlr_entry *ctrlr_entry, void *backend_ns,
+			  const struct arb_backend_ns_info *info)
+{
+	struct ns_entry *entry;
+	uint32_t segment_size, io_size_blocks, md_size, buf_block_size;
+
+	// Judge if IO size is valid
+	// IO size is invalid can because of
+	// 1. The size of namespace size is smaller than IO size
+	// 2. IO size is smaller than sectoer size
 	// 3. IO size is not a multiple of sector size 
-	if (spdk_nvme_ns_get_size(ns) < g_arbitration.io_size_bytes ||
-		spdk_nvme_ns_get_extended_sector_size(ns) > g_arbitration.io_size_bytes ||
-		g_arbitration.io_size_bytes % spdk_nvme_ns_get_extended_sector_size(ns)) {
-		printf("WARNING: controller %-20.20s (%-20.20s) ns %u has invalid "
+	// -s counts the data only, the metadata comes on top of it
+	if (info->size < g_arbitration.io_size_bytes ||
+		info->block_size > g_arbitration.io_size_bytes ||
+		g_arbitration.io_size_bytes % info->block_size) {
+		printf("WARNING: controller %s ns %u has invalid "
 			   "ns size %" PRIu64 " / block size %u for I/O size %u\n",
-			   cdata->mn, cdata->sn, spdk_nvme_ns_get_id(ns),
-			   spdk_nvme_ns_get_size(ns), spdk_nvme_ns_get_extended_sector_size(ns),
+			   info->name, info->nsid, info->size, info->block_size,
 			   g_arbitration.io_size_bytes);
+		return NULL;
+	}
+
+	// With PRACT, 8 bytes of metadata are only the protection information
+	// which the controller inserts and strips, the host transfers none
+	md_size = info->md_size;
+	if (g_arbitration.pi_mode == ARB_PI_PRACT && info->pi_type != SPDK_NVME_FMT_NVM_PROTECTION_DISABLE &&
+		md_size == 8) {
+		md_size = 0;
+	}
+	io_size_blocks = g_arbitration.io_size_bytes / info->block_size;
+	buf_block_size = info->block_size + (info->md_interleave ? md_size : 0);
+
+	// Every segment must hold whole blocks, and without SGL support the driver
+	// builds PRP lists which need page aligned segment boundaries
+	if (g_arbitration.sgl_segments != 0) {
+		segment_size = io_size_blocks * buf_block_size / g_arbitration.sgl_segments;
+		if (segment_size % buf_block_size ||
+			(!info->sgl_supported && segment_size % 0x1000)) {
+			printf("WARNING: controller %s ns %u cannot take "
+				   "%u segments of %u bytes (SGL %s)\n",
+				   info->name, info->nsid, g_arbitration.sgl_segments, segment_size,
+				   info->sgl_supported ? "supported" : "not supported, PRP lists");
+			return NULL;
+		}
+	}
+
+	entry = calloc(1, sizeof(struct ns_entry));
+	if (entry == NULL) {
+		perror("ns_entry malloc");
+		exit(1);
+	}
+
+	entry->backend_ns = backend_ns;
+	entry->nsid = info->nsid;
+	entry->ctrlr_entry = ctrlr_entry;
+	entry->size_in_ios = info->size / g_arbitration.io_size_bytes;
+	entry->io_size_blocks = io_size_blocks;
+	entry->block_size = info->block_size;
+	entry->flags = info->flags;
+	entry->md_size = md_size;
+	entry->md_interleave = info->md_interleave && md_size != 0;
+	entry->buf_block_size = buf_block_size;
+	entry->io_buf_bytes = io_size_blocks * buf_block_size;
+	entry->io_md_bytes = entry->md_interleave ? 0 : io_size_blocks * md_size;
+	entry->pi_type = info->pi_type;
+	entry->pi_loc = info->pi_loc;
+	g_arbitration.io_buf_bytes = spdk_max(g_arbitration.io_buf_bytes, entry->io_buf_bytes);
+	if (info->md_size != 0) {
+		printf("  Format of ns %u: %u+%u bytes, %s metadata, protection information %s%s\n",
+			   info->nsid, info->block_size, info->md_size,
+			   info->md_interleave ? "interleaved" : "separate",
+			   info->pi_type == SPDK_NVME_FMT_NVM_PROTECTION_DISABLE ? "off" :
+			   info->pi_type == SPDK_NVME_FMT_NVM_PROTECTION_TYPE1 ? "type 1" :
+			   info->pi_type == SPDK_NVME_FMT_NVM_PROTECTION_TYPE2 ? "type 2" : "type 3",
+			   md_size != info->md_size ? ", inserted and stripped by the controller" : "");
+	}
+	if (g_arbitration.pi_mode != ARB_PI_OFF) {
+		if (info->pi_type == SPDK_NVME_FMT_NVM_PROTECTION_DISABLE) {
+			printf("WARNING: controller %s ns %u has no protection information, --pi does not apply\n",
+				   info->name, info->nsid);
+		} else {
+			if (g_arbitration.pi_checks & SPDK_DIF_FLAGS_GUARD_CHECK) {
+				entry->io_flags |= SPDK_NVME_IO_FLAGS_PRCHK_GUARD;
+			}
+			if (g_arbitration.pi_checks & SPDK_DIF_FLAGS_APPTAG_CHECK) {
+				entry->io_flags |= SPDK_NVME_IO_FLAGS_PRCHK_APPTAG;
+			}
+			// Type 3 has no reference tag to check
+			if ((g_arbitration.pi_checks & SPDK_DIF_FLAGS_REFTAG_CHECK) &&
+				info->pi_type != SPDK_NVME_FMT_NVM_PROTECTION_TYPE3) {
+				entry->io_flags |= SPDK_NVME_IO_FLAGS_PRCHK_REFTAG;
+			}
+			if (g_arbitration.pi_mode == ARB_PI_PRACT) {
+				entry->io_flags |= SPDK_NVME_IO_FLAGS_PRACT;
+			}
+			entry->host_pi = g_arbitration.pi_mode == ARB_PI_HOST;
+		}
+	}
+	for (int i = 0; i < SPDK_NVME_QPRIO_MAX; i++) {
+		if ((g_arbitration.classes[i].dsm_percentage &&
+			 !(entry->flags & SPDK_NVME_NS_DEALLOCATE_SUPPORTED)) ||
+			(g_arbitration.classes[i].write_zeroes_percentage &&
+			 !(entry->flags & SPDK_NVME_NS_WRITE_ZEROES_SUPPORTED))) {
+			printf("WARNING: controller %s ns %u does not support "
+				   "deallocate or write zeroes, reads and writes are issued instead\n",
+				   info->name, info->nsid);
+			break;
+		}
+	}
+	entry->gen_map = NULL;
+	if (g_arbitration.verify) {
+		entry->gen_map = calloc(entry->size_in_ios, sizeof(*entry->gen_map));
+		if (entry->gen_map == NULL) {
+			fprintf(stderr, "Unable to allocate generation map of %" PRIu64 " entries\n",
+					entry->size_in_ios);
+			free(entry);
+			return NULL;
+		}
+	}
+	snprintf(entry->name, 44, "%s", info->name);
+	TAILQ_INSERT_TAIL(&g_namespaces, entry, link);
+	g_arbitration.num_namespaces++;
+
+	return entry;
+}
+
+static void
+ctrlr_setup_submit(struct ctrlr_entry *entry)
+{
+	struct ctrlr_setup *setup = &entry->setup;
+	struct spdk_nvme_cmd cmd = {};
+	int rc;
+
+	while (setup->state != CTRLR_SETUP_DONE) {
+		memset(&cmd, 0, sizeof(cmd));
+		switch (setup->state) {
+		case CTRLR_SETUP_SET_ARB:
+			cmd.opc = SPDK_NVME_OPC_SET_FEATURES;
+			cmd.cdw10_bits.set_features.fid = SPDK_NVME_FEAT_ARBITRATION;
+			cmd.cdw11_bits.feat_arbitration.bits.ab = entry->arb.burst;
+			cmd.cdw11_bits.feat_arbitration.bits.hpw = entry->arb.high_priority_weight - 1;
+			cmd.cdw11_bits.feat_arbitration.bits.mpw = entry->arb.medium_priority_weight - 1;
+			cmd.cdw11_bits.feat_arbitration.bits.lpw = entry->arb.low_priority_weight - 1;
+			break;
+		default:
+			// Reading the arbitration feature back is also the round trip probe,
+			// the device does almost no work for it
+			cmd.opc = SPDK_NVME_OPC_GET_FEATURES;
+			cmd.cdw10_bits.get_features.fid = SPDK_NVME_FEAT_ARBITRATION;
+			break;
+		}
+
+		setup->cmd_start_tsc = spdk_get_ticks();
+		rc = spdk_nvme_ctrlr_cmd_admin_raw(entry->ctrlr, &cmd, NULL, 0,
+										   ctrlr_setup_completion, entry);
+		if (rc == 0) {
+			return;
+		}
+
+		printf("%s: %s Arbitration Feature: Failed 0x%x\n", entry->name,
+			   setup->state == CTRLR_SETUP_SET_ARB ? "Set" : "Get", rc);
+		setup->state = setup->state == CTRLR_SETUP_RTT ? CTRLR_SETUP_DONE : setup->state + 1;
+	}
+
+	setup->done_tsc = spdk_get_ticks();
+}
+
+static void
+ctrlr_setup_completion(void *cb_arg, const struct spdk_nvme_cpl *cpl)
+{
+	struct ctrlr_entry *entry = cb_arg;
+	struct ctrlr_setup *setup = &entry->setup;
+	uint64_t rtt_tsc = spdk_get_ticks() - setup->cmd_start_tsc;
+	bool ok = !spdk_nvme_cpl_is_error(cpl);
+
+	switch (setup->state) {
+	case CTRLR_SETUP_GET_ARB:
+		setup->before_valid = ok;
+		setup->arb_before = cpl->cdw0;
+		setup->state = CTRLR_SETUP_SET_ARB;
+		break;
+	case CTRLR_SETUP_SET_ARB:
+		setup->set_valid = ok;
+		setup->state = CTRLR_SETUP_CHECK_ARB;
+		break;
+	case CTRLR_SETUP_CHECK_ARB:
+		setup->after_valid = ok;
+		setup->arb_after = cpl->cdw0;
+		setup->state = CTRLR_SETUP_RTT;
+		break;
+	case CTRLR_SETUP_RTT:
+		entry->admin_rtt_tsc = spdk_min(entry->admin_rtt_tsc, rtt_tsc);
+		if (++setup->rtt_probes == RTT_PROBE_COMMANDS) {
+			setup->state = CTRLR_SETUP_DONE;
+		}
+		break;
+	default:
+		break;
+	}
+
+	ctrlr_setup_submit(entry);
+}
+
+static void
+print_arb_feature(uint32_t raw)
+{
+	// SPDK designed serveral unions to decode the result automatically
+	union spdk_nvme_cmd_cdw11 arb;
+	arb.feat_arbitration.raw = raw;
+
+	printf("Arbitration Burst:          ");
+	if (arb.feat_arbitration.bits.ab == SPDK_NVME_ARBITRATION_BURST_UNLIMITED) {
+		printf("no limit\n");
+	} else {
+		printf("%u\n", 1u << arb.feat_arbitration.bits.ab);
+	}
+	printf("Low Priority Weight:        %u\n", arb.feat_arbitration.bits.lpw + 1);
+	printf("Medium Priority Weight:     %u\n", arb.feat_arbitration.bits.mpw + 1);
+	printf("High Priority Weight:       %u\n", arb.feat_arbitration.bits.hpw + 1);
+	printf("\n");
+}
+
+// Controllers finish their setup in any order, report them in attach order
+static void
+print_ctrlr_setup(struct ctrlr_entry *entry)
+{
+	struct ctrlr_setup *setup = &entry->setup;
+	uint64_t hz = spdk_get_ticks_hz();
+
+	printf("Controller %s\n", entry->name);
+	if (setup->before_valid) {
+		printf("Current Arbitration Configuration\n");
+		printf("===========\n");
+		print_arb_feature(setup->arb_before);
+	}
+	if (setup->set_valid) {
+		printf("Set Arbitration Feature Successfully\n\n");
+	} else if (setup->before_valid) {
+		printf("Set Arbitration Feature failed and use default configuration\n");
+	}
+	if (setup->after_valid) {
+		printf("Current Arbitration Configuration\n");
+		printf("===========\n");
+		print_arb_feature(setup->arb_after);
+		printf("  Arbitration from %s%s: %s\n",
+			   entry->arb_rule >= 0 ? "--arb-rule " : "-b/-h/-m/-l",
+			   entry->arb_rule >= 0 ? g_arbitration.rules[entry->arb_rule].str : "",
+			   arb_feature_matches(&entry->arb, setup->arb_after) ? "verified" :
+			   "differs from the requested values");
+	}
+
+	if (entry->admin_rtt_tsc == UINT64_MAX) {
+		entry->admin_rtt_tsc = 0;
+	}
+	printf("  Admin round trip: %.2f us\n",
+		   (double)entry->admin_rtt_tsc * SECOND_TO_MICROSECOND / g_arbitration.tsc_rate);
+	printf("  Attached after %.2f ms, setup took %.2f ms\n\n",
+		   (double)(setup->attach_tsc - g_arbitration.startup.env_init_tsc) * 1000 / hz,
+		   (double)(setup->done_tsc - setup->attach_tsc) * 1000 / hz);
+}
+
+static void
+print_startup(void)
+{
+	uint64_t hz = spdk_get_ticks_hz();
+	uint64_t attach_tsc = g_arbitration.startup.attach_tsc;
+
+	// Only the nvme backend separates probing from the admin setup
+	if (attach_tsc == 0) {
+		attach_tsc = g_arbitration.startup.ctrlr_setup_tsc;
+	}
+	printf("Startup: %.2f ms, env init %.2f ms, attach %.2f ms, controller setup %.2f ms "
+		   "after the last attach, workers and task pool %.2f ms\n",
+		   (double)(g_arbitration.startup.ready_tsc - g_arbitration.startup.start_tsc) * 1000 / hz,
+		   (double)(g_arbitration.startup.env_init_tsc - g_arbitration.startup.start_tsc) * 1000 / hz,
+		   (double)(attach_tsc - g_arbitration.startup.env_init_tsc) * 1000 / hz,
+		   (double)(g_arbitration.startup.ctrlr_setup_tsc - attach_tsc) * 1000 / hz,
+		   (double)(g_arbitration.startup.ready_tsc - g_arbitration.startup.ctrlr_setup_tsc) * 1000 / hz);
+}
+
+static int
+associate_workers_with_ns(void)
+{
+	struct ns_entry			*ns_entry = TAILQ_FIRST(&g_namespaces);
+	struct worker_thread	*worker = TAILQ_FIRST(&g_workers);
+	struct worker_ns_ctx	*ns_ctx;
+	
+	// The functoin is designed to make every worker or every namespace are being used
+	// In this experiment, the device has only one namespaces, so all the workers are associated to the same namespace
+	int count = g_arbitration.num_namespaces > g_arbitration.num_workers ?
+				g_arbitration.num_namespaces : g_arbitration.num_workers;
+	
+	for (int i = 0; i < count; i++) {
+		if (ns_entry == NULL) {
+			break;
+		}
+
+		// Allocate a context for worker
+		ns_ctx = malloc(sizeof(struct worker_ns_ctx));
+		if (!ns_ctx) {
+			return 1;
+		}
+		memset(ns_ctx, 0, sizeof(*ns_ctx));
+
+		printf("Associating %s Namespace %u with lcore %d\n", ns_entry->name, 
+				ns_entry->nsid, worker->lcore);
+		ns_ctx->ns_entry = ns_entry;
+		reset_ns_ctx_stats(ns_ctx);
+		TAILQ_INSERT_TAIL(&worker->ns_ctx, ns_ctx, link);
+
+		worker = TAILQ_NEXT(worker, link);
+		if (worker == NULL) {
+			worker = TAILQ_FIRST(&g_workers);
+		}
+
+		ns_entry = TAILQ_NEXT(ns_entry, link);
+		if (ns_entry == NULL) {
+			ns_entry = TAILQ_FIRST(&g_namespaces);
+		}
+	}
+
+	return assign_ns_regions();
+}
+
+// Range of a class in I/O of -s, the whole namespace without --region
+static int
+class_region(const struct ns_entry *ns_entry, const struct class_config *cfg,
+			 uint64_t *start, uint64_t *size)
+{
+	// In bytes first, an I/O of -s may be larger than a MiB
+	uint64_t mib = 1024 * 1024;
+
+	*start = 0;
+	*size = ns_entry->size_in_ios;
+	if (!cfg->region_set) {
+		return 0;
+	}
+
+	*start = cfg->region_start_pct ? ns_entry->size_in_ios * cfg->region_start / 100 :
+			 cfg->region_start * mib / g_arbitration.io_size_bytes;
+	if (cfg->region_size == 0) {
+		*size = *start < ns_entry->size_in_ios ? ns_entry->size_in_ios - *start : 0;
+	} else {
+		*size = cfg->region_size_pct ? ns_entry->size_in_ios * cfg->region_size / 100 :
+				cfg->region_size * mib / g_arbitration.io_size_bytes;
+	}
+	if (*size == 0 && *start < ns_entry->size_in_ios) {
+		fprintf(stderr, "--region is smaller than one I/O of %u bytes\n", g_arbitration.io_size_bytes);
+		return 1;
+	}
+	if (*size == 0 || *start + *size > ns_entry->size_in_ios) {
+		fprintf(stderr, "--region does not fit into %s Namespace %u of %" PRIu64 " MiB\n",
+				ns_entry->name, ns_entry->nsid,
+				ns_entry->size_in_ios * g_arbitration.io_size_bytes / (1024 * 1024));
+		return 1;
+	}
+
+	return 0;
+}
+
+// With --region split, the contexts of one namespace whose classes have the
+// same range divide it in the order they were associated
+static int
+assign_ns_regions(void)
+{
+	struct worker_thread *worker, *peer_worker;
+	struct worker_ns_ctx *ns_ctx, *peer;
+	const struct class_config *cfg;
+	uint64_t start, size, peer_start, peer_size;
+	uint32_t parts, index;
+
+	TAILQ_FOREACH(worker, &g_workers, link) {
+		TAILQ_FOREACH(ns_ctx, &worker->ns_ctx, link) {
+			cfg = &g_arbitration.classes[worker->qprio];
+			if (class_region(ns_ctx->ns_entry, cfg, &start, &size) != 0) {
+				return 1;
+			}
+
+			parts = 0;
+			index = 0;
+			TAILQ_FOREACH(peer_worker, &g_workers, link) {
+				TAILQ_FOREACH(peer, &peer_worker->ns_ctx, link) {
+					if (!g_arbitration.region_split || peer->ns_entry != ns_ctx->ns_entry) {
+						continue;
+					}
+					class_region(peer->ns_entry, &g_arbitration.classes[peer_worker->qprio],
+								 &peer_start, &peer_size);
+					if (peer_start != start || peer_size != size) {
+						continue;
+					}
+					if (peer == ns_ctx) {
+						index = parts;
+					}
+					parts++;
+				}
+			}
+			if (parts > 1) {
+				size /= parts;
+				start += index * size;
+			}
+
+			ns_ctx->region_start = start;
+			ns_ctx->region_size = size;
+			ns_ctx->stream_size = size / g_arbitration.num_streams;
+			if (ns_ctx->stream_size == 0) {
+				fprintf(stderr, "Region of %s Namespace %u with lcore %u is smaller than "
+						"--streams %u I/O\n", ns_ctx->ns_entry->name, ns_ctx->ns_entry->nsid,
+						worker->lcore, g_arbitration.num_streams);
+				return 1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+static int
+init_worker_ns_ctx(struct worker_ns_ctx *ns_ctx, enum spdk_nvme_qprio qprio)
+{
+	uint32_t num_qpairs = spdk_max(g_arbitration.classes[qprio].num_qpairs, 1);
+	// Round robin keeps the queue pairs about evenly filled, the retry queue
+	// takes what does not fit
+	uint32_t depth = spdk_divide_round_up(g_arbitration.io_queue_depth, num_qpairs);
+
+	TAILQ_INIT(&ns_ctx->retry_queue);
+	for (ns_ctx->num_qpairs = 0; ns_ctx->num_qpairs < num_qpairs; ns_ctx->num_qpairs++) {
+		ns_ctx->qpairs[ns_ctx->num_qpairs] = g_backend->qpair_alloc(ns_ctx->ns_entry->backend_ns,
+											 qprio, depth);
+		if (!ns_ctx->qpairs[ns_ctx->num_qpairs]) {
+			printf("ERROR: %s backend failed to allocate queue pair %u of %u\n", g_backend->name,
+				   ns_ctx->num_qpairs + 1, num_qpairs);
+			return 1;
+		}
+	}
+	ns_ctx->next_qpair = 0;
+
+	return 0;
+}
+
+static inline uint64_t
+payload_rand(uint64_t *state)
+{
+	// xorshift64, fast enough to fill a pool of several MiB at startup
+	*state ^= *state << 13;
+	*state ^= *state >> 7;
+	*state ^= *state << 17;
+	return *state;
+}
+
+static void
+payload_fill_random(uint8_t *buf, size_t len, uint64_t *state)
+{
+	uint64_t word;
+
+	for (size_t i = 0; i < len; i += sizeof(word)) {
+		word = payload_rand(state);
+		memcpy(buf + i, &word, spdk_min(sizeof(word), len - i));
+	}
+}
+
+// Every pool of a worker takes its memory here, on the NUMA node of the worker
+static void *
+worker_dma_alloc(struct worker_thread *worker, enum worker_dma_pool pool, uint64_t size, size_t align)
+{
+	void *buf = g_backend->buf_alloc(size, align, spdk_env_get_numa_id(worker->lcore));
+
+	if (buf != NULL) {
+		worker->dma_bytes[pool] += size;
+	}
+	return buf;
+}
+
+static int
+payload_pool_init(struct worker_thread *worker)
+{
+	struct payload_pool *pool = &worker->payload;
+	uint64_t pool_bytes = (uint64_t)g_arbitration.payload_pool_mib * 1024 * 1024;
+	uint64_t num_chunks, random_bytes;
+	uint64_t state = 0x9e3779b97f4a7c15ULL ^ ((uint64_t)worker->lcore << 32) ^ g_arbitration.verify_seed;
+	uint8_t *chunk;
+
+	// A zero payload never changes, one slot is enough unless segments are
+	// taken from different slots to keep them apart
+	pool->num_slots = g_arbitration.payload_type == PAYLOAD_ZERO ?
+					  spdk_max(g_arbitration.sgl_segments, 1) :
+					  spdk_max(pool_bytes / g_arbitration.io_buf_bytes,
+							   spdk_max(g_arbitration.sgl_segments, 1));
+	pool->next_slot = 0;
+	pool_bytes = pool->num_slots * g_arbitration.io_buf_bytes;
+
+	pool->base = worker_dma_alloc(worker, WORKER_DMA_PAYLOAD, pool_bytes, 0x1000);
+	pool->size = pool_bytes;
+	if (pool->base == NULL) {
+		fprintf(stderr, "Unable to allocate %" PRIu64 " bytes of payload pool\n", pool_bytes);
+		return 1;
+	}
+
+	num_chunks = pool_bytes / PAYLOAD_CHUNK_SIZE;
+	switch (g_arbitration.payload_type) {
+	case PAYLOAD_ZERO:
+		break;
+	case PAYLOAD_RANDOM:
+		payload_fill_random(pool->base, pool_bytes, &state);
+		break;
+	case PAYLOAD_COMPRESS:
+		// The zeros at the end of the chunk are what compresses
+		random_bytes = PAYLOAD_CHUNK_SIZE * (100 - g_arbitration.payload_ratio) / 100;
+		for (uint64_t i = 0; i < num_chunks; i++) {
+			payload_fill_random(pool->base + i * PAYLOAD_CHUNK_SIZE, random_bytes, &state);
+		}
+		break;
+	case PAYLOAD_DEDUP:
+		payload_fill_random(pool->base, pool_bytes, &state);
+		// Replace the chosen chunks with a copy of an earlier unique one
+		for (uint64_t i = 1; i < num_chunks; i++) {
+			if (payload_rand(&state) % 100 >= g_arbitration.payload_ratio) {
+				continue;
+			}
+			chunk = pool->base + (payload_rand(&state) % i) * PAYLOAD_CHUNK_SIZE;
+			memcpy(pool->base + i * PAYLOAD_CHUNK_SIZE, chunk, PAYLOAD_CHUNK_SIZE);
+		}
+		break;
+	}
+
+	return 0;
+}
+
+static void
+payload_pool_free(struct payload_pool *pool)
+{
+	g_backend->buf_free(pool->base);
+	pool->base = NULL;
+}
+
+static inline void *
+payload_next(struct payload_pool *pool)
+{
+	void *buf = pool->base + pool->next_slot * g_arbitration.io_buf_bytes;
+
+	if (++pool->next_slot == pool->num_slots) {
+		pool->next_slot = 0;
+	}
+	return buf;
+}
+
+static int
+segment_pool_init(struct worker_thread *worker)
+{
+	struct segment_pool *pool = &worker->segments;
+	struct worker_ns_ctx *ns_ctx;
+	uint32_t segment_size, stride, num_segments = 0;
+	void *tmp;
+
+	pool->base = NULL;
+	pool->size = 0;
+	pool->free_segs = NULL;
+	pool->num_free = 0;
+	if (g_arbitration.sgl_segments == 0) {
+		return 0;
+	}
+
+	TAILQ_FOREACH(ns_ctx, &worker->ns_ctx, link) {
+		num_segments += g_arbitration.io_queue_depth * g_arbitration.sgl_segments;
+	}
+	if (num_segments == 0) {
+		return 0;
+	}
+
+	// Leave a hole of the same size after every segment
+	segment_size = g_arbitration.io_buf_bytes / g_arbitration.sgl_segments;
+	stride = SPDK_ALIGN_CEIL(segment_size, 0x1000) * 2;
+
+	pool->size = (uint64_t)num_segments * stride;
+	pool->base = worker_dma_alloc(worker, WORKER_DMA_SEGMENTS, pool->size, 0x1000);
+	pool->free_segs = calloc(num_segments, sizeof(*pool->free_segs));
+	if (pool->base == NULL || pool->free_segs == NULL) {
+		fprintf(stderr, "Unable to allocate %u segments of %u bytes\n", num_segments, segment_size);
+		segment_pool_free(pool);
+		return 1;
+	}
+
+	for (uint32_t i = 0; i < num_segments; i++) {
+		pool->free_segs[i] = pool->base + (uint64_t)i * stride;
+	}
+	// Shuffle so that consecutive segments of an I/O are scattered over the pool
+	for (uint32_t i = num_segments - 1; i > 0; i--) {
+		uint32_t j = rand_r(&random_seed) % (i + 1);
+
+		tmp = pool->free_segs[i];
+		pool->free_segs[i] = pool->free_segs[j];
+		pool->free_segs[j] = tmp;
+	}
+	pool->num_free = num_segments;
+
+	return 0;
+}
+
+static void
+segment_pool_free(struct segment_pool *pool)
+{
+	g_backend->buf_free(pool->base);
+	free(pool->free_segs);
+	pool->base = NULL;
+	pool->free_segs = NULL;
+}
+
+static int
+read_sink_init(struct worker_thread *worker)
+{
+	struct read_sink *sink = &worker->sink;
+
+	sink->base = NULL;
+	sink->num_bufs = 0;
+	sink->next = 0;
+	// Preconditioning only writes
+	if (g_arbitration.read_sink_bufs == 0 || g_precondition.phase != PRECONDITION_NONE) {
+		return 0;
+	}
+
+	sink->base = worker_dma_alloc(worker, WORKER_DMA_SINK,
+								  (uint64_t)g_arbitration.read_sink_bufs * g_arbitration.io_buf_bytes, 0x1000);
+	if (sink->base == NULL) {
+		fprintf(stderr, "Unable to allocate %u read sink buffers\n", g_arbitration.read_sink_bufs);
+		return 1;
+	}
+	sink->num_bufs = g_arbitration.read_sink_bufs;
+
+	return 0;
+}
+
+static void
+read_sink_free(struct read_sink *sink)
+{
+	g_backend->buf_free(sink->base);
+	sink->base = NULL;
+}
+
+static inline void *
+read_sink_next(struct read_sink *sink)
+{
+	void *buf = sink->base + (uint64_t)sink->next * g_arbitration.io_buf_bytes;
+
+	if (++sink->next == sink->num_bufs) {
+		sink->next = 0;
+	}
+	return buf;
+}
+
+static inline uint32_t
+buf_pool_class(uint32_t size)
+{
+	return size <= (1u << BUF_POOL_MIN_SHIFT) ? 0 : spdk_u32log2(size - 1) + 1 - BUF_POOL_MIN_SHIFT;
+}
+
+// Only takes from the free list, worker_init() reserved a buffer for each
+// of the -d I/O of every context which needs one
+static void *
+buf_pool_get(struct buf_pool *pool, uint32_t size)
+{
+	uint32_t class = buf_pool_class(size);
+	void *buf = pool->free[class];
+
+	assert(class < BUF_POOL_CLASSES);
+	if (spdk_unlikely(buf == NULL)) {
+		fprintf(stderr, "No free private buffer of %u bytes\n", size);
+		exit(1);
+	}
+	pool->free[class] = *(void **)buf;
+	return buf;
+}
+
+static void
+buf_pool_put(struct buf_pool *pool, void *buf, uint32_t size)
+{
+	uint32_t class = buf_pool_class(size);
+
+	*(void **)buf = pool->free[class];
+	pool->free[class] = buf;
+}
+
+// Fills the free list ahead of the run
+static int
+buf_pool_reserve(struct worker_thread *worker, uint32_t size, uint32_t count)
+{
+	uint32_t class = buf_pool_class(size);
+	void *buf;
+
+	for (uint32_t i = 0; i < count; i++) {
+		buf = worker_dma_alloc(worker, WORKER_DMA_BUFS, (uint64_t)1 << (class + BUF_POOL_MIN_SHIFT), 0x200);
+		if (buf == NULL) {
+			return -ENOMEM;
+		}
+		worker->bufs.allocated[class]++;
+		buf_pool_put(&worker->bufs, buf, size);
+	}
+
+	return 0;
+}
+
+// Only once every I/O of the worker has completed, all buffers are free
+static void
+buf_pool_free(struct buf_pool *pool)
+{
+	void *buf;
+
+	for (int i = 0; i < BUF_POOL_CLASSES; i++) {
+		while ((buf = pool->free[i]) != NULL) {
+			pool->free[i] = *(void **)buf;
+			g_backend->buf_free(buf);
+		}
+	}
+}
+
+// Whether the reads or writes of the context take private data buffers,
+// the same choice as task_setup_buffers() makes for each I/O
+static bool
+ns_ctx_private_data(const struct worker_ns_ctx *ns_ctx)
+{
+	const struct ns_entry *ns_entry = ns_ctx->ns_entry;
+	bool reads = ns_ctx->next_op != next_op_write && ns_ctx->read_percentage != 0;
+
+	if (ns_ctx->vectored) {
+		return false;
+	}
+	return (reads && ns_ctx->sink == NULL) || ns_entry->gen_map != NULL ||
+		   (ns_entry->host_pi && ns_entry->md_interleave);
+}
+
+// Point the task at its data, either private memory or the shared payload pool
+static void
+task_setup_buffers(struct arb_task *task)
+{
+	struct worker_ns_ctx *ns_ctx = task->ns_ctx;
+	struct ns_entry *ns_entry = ns_ctx->ns_entry;
+	bool is_read = task->cmd.op == ARB_OP_READ;
+	// Writes share the payload pool unless each one is stamped for verification
+	// or gets protection information generated into its blocks
+	bool private_buf = (is_read && ns_ctx->sink == NULL) || ns_entry->gen_map != NULL ||
+					   (ns_entry->host_pi && ns_entry->md_interleave);
+	uint32_t segment_size;
+	uint8_t *payload;
+
+	task->dma_buf = NULL;
+	task->md_buf = NULL;
+	task->iovs_from_segment_pool = false;
+	task->cmd.iovcnt = 0;
+	task->cmd.md_buf = NULL;
+	if (task->cmd.op != ARB_OP_READ && task->cmd.op != ARB_OP_WRITE) {
+		return;
+	}
+
+	if (ns_entry->io_md_bytes != 0) {
+		task->md_buf = buf_pool_get(ns_ctx->bufs, ns_entry->io_md_bytes);
+		task->cmd.md_buf = task->md_buf;
+	}
+
+	if (!ns_ctx->vectored) {
+		if (private_buf) {
+			task->dma_buf = buf_pool_get(ns_ctx->bufs, ns_entry->io_buf_bytes);
+			task->buf = task->dma_buf;
+			if (!is_read && g_arbitration.payload_type != PAYLOAD_ZERO) {
+				memcpy(task->buf, payload_next(ns_ctx->payload), ns_entry->io_buf_bytes);
+			}
+		} else if (is_read) {
+			task->buf = read_sink_next(ns_ctx->sink);
+		} else {
+			task->buf = payload_next(ns_ctx->payload);
+		}
+		task->cmd.iovs[0].iov_base = task->buf;
+		task->cmd.iovs[0].iov_len = ns_entry->io_buf_bytes;
+		task->cmd.iovcnt = 1;
+		return;
+	}
+
+	// Segment i of an I/O always comes from a different payload slot or pool
+	// segment than segment i - 1, so no two of them are adjacent in memory
+	segment_size = ns_entry->io_buf_bytes / g_arbitration.sgl_segments;
+	task->buf = NULL;
+	task->cmd.iovcnt = g_arbitration.sgl_segments;
+	task->iovs_from_segment_pool = private_buf;
+	for (int i = 0; i < task->cmd.iovcnt; i++) {
+		payload = is_read ? NULL : payload_next(ns_ctx->payload) + i * segment_size;
+		if (is_read && !private_buf) {
+			// Each segment from the next buffer, at its place in the I/O
+			task->cmd.iovs[i].iov_base = (uint8_t *)read_sink_next(ns_ctx->sink) + i * segment_size;
+		} else if (private_buf) {
+			assert(ns_ctx->segments->num_free > 0);
+			task->cmd.iovs[i].iov_base = ns_ctx->segments->free_segs[--ns_ctx->segments->num_free];
+			if (payload != NULL) {
+				memcpy(task->cmd.iovs[i].iov_base, payload, segment_size);
+			}
+		} else {
+			task->cmd.iovs[i].iov_base = payload;
+		}
+		task->cmd.iovs[i].iov_len = segment_size;
+	}
+}
+
+static void
+task_release_buffers(struct arb_task *task)
+{
+	struct segment_pool *pool = task->ns_ctx->segments;
+
+	if (task->iovs_from_segment_pool) {
+		for (int i = 0; i < task->cmd.iovcnt; i++) {
+			pool->free_segs[pool->num_free++] = task->cmd.iovs[i].iov_base;
+		}
+	}
+	if (task->dma_buf != NULL) {
+		buf_pool_put(task->ns_ctx->bufs, task->dma_buf, task->ns_ctx->ns_entry->io_buf_bytes);
+	}
+	if (task->md_buf != NULL) {
+		buf_pool_put(task->ns_ctx->bufs, task->md_buf, task->ns_ctx->ns_entry->io_md_bytes);
+	}
+}
+
+// Without device arbitration the share of a class follows its number of
+// outstanding commands, so --host-wrr hands out depth in proportion to weight
+static int
+class_queue_depth(struct worker_ns_ctx *ns_ctx)
+{
+	const struct arb_settings *arb = &ns_ctx->ns_entry->ctrlr_entry->arb;
+	uint32_t weight, max_weight;
+
+	if (!g_arbitration.host_wrr || ns_ctx->ns_entry->ctrlr_entry->wrr_enabled ||
+		g_precondition.phase != PRECONDITION_NONE) {
+		return g_arbitration.io_queue_depth;
+	}
+
+	max_weight = spdk_max(arb->high_priority_weight,
+						  spdk_max(arb->medium_priority_weight, arb->low_priority_weight));
+	switch (ns_ctx->qprio) {
+	case SPDK_NVME_QPRIO_HIGH:
+		weight = arb->high_priority_weight;
+		break;
+	case SPDK_NVME_QPRIO_MEDIUM:
+		weight = arb->medium_priority_weight;
+		break;
+	case SPDK_NVME_QPRIO_LOW:
+		weight = arb->low_priority_weight;
+		break;
+	default:
+		// Urgent is strict priority, keep the full depth
+		return g_arbitration.io_queue_depth;
+	}
+
+	return spdk_max(1, (int)((uint64_t)g_arbitration.io_queue_depth * weight / max_weight));
+}
+
+static void
+submit_init_ios(struct worker_ns_ctx *ns_ctx, int queue_depth)
+{
+	while (queue_depth-- > 0) {
+		submit_single_io(ns_ctx);
+	}
+}
+
+static enum arb_op
+choose_op(struct worker_ns_ctx *ns_ctx)
+{
+	const struct class_config *cfg = ns_ctx->class_cfg;
+	uint32_t flags = ns_ctx->ns_entry->flags;
+	uint32_t dice;
+
+	if (cfg->flush_percentage + cfg->dsm_percentage + cfg->write_zeroes_percentage != 0) {
+		dice = rand_r(&random_seed) % 100;
+		if (dice < cfg->flush_percentage) {
+			return ARB_OP_FLUSH;
+		}
+		dice -= cfg->flush_percentage;
+		// Unsupported commands fall back to reads and writes
+		if (dice < cfg->dsm_percentage) {
+			if (flags & SPDK_NVME_NS_DEALLOCATE_SUPPORTED) {
+				return ARB_OP_DSM;
+			}
+		} else if (dice - cfg->dsm_percentage < cfg->write_zeroes_percentage) {
+			if (flags & SPDK_NVME_NS_WRITE_ZEROES_SUPPORTED) {
+				return ARB_OP_WRITE_ZEROES;
+			}
+		}
+	}
+
+	if ((ns_ctx->read_percentage == 100) ||
+		(ns_ctx->read_percentage != 0 &&
+		 (((uint32_t)rand_r(&random_seed) % 100) < ns_ctx->read_percentage))) {
+		return ARB_OP_READ;
+	}
+	return ARB_OP_WRITE;
+}
+
+// The phase of --precondition and the workload are fixed for a run, only
+// --control changes things in between and none of these
+static void
+ns_ctx_specialize(struct worker_ns_ctx *ns_ctx)
+{
+	struct ns_entry *ns_entry = ns_ctx->ns_entry;
+	const struct class_config *cfg = ns_ctx->class_cfg;
+
+	ns_ctx->backend_ns = ns_entry->backend_ns;
+	ns_ctx->size_in_ios = ns_entry->size_in_ios;
+	ns_ctx->io_size_blocks = ns_entry->io_size_blocks;
+	ns_ctx->io_flags = ns_entry->io_flags;
+	ns_ctx->host_pi = ns_entry->host_pi;
+	ns_ctx->read_percentage = g_arbitration.rw_percentage;
+	ns_ctx->num_streams = g_arbitration.num_streams;
+	ns_ctx->vectored = g_arbitration.sgl_segments != 0;
+	ns_ctx->filling = g_precondition.phase == PRECONDITION_FILL;
+
+	switch (g_precondition.phase) {
+	case PRECONDITION_FILL:
+		ns_ctx->next_offset = next_offset_fill;
+		break;
+	case PRECONDITION_NONE:
+		ns_ctx->next_offset = g_arbitration.is_random ? next_offset_random :
+							  ns_ctx->num_streams > 1 ? next_offset_streams : next_offset_sequential;
+		break;
+	default:
+		ns_ctx->next_offset = next_offset_anywhere;
+		break;
+	}
+
+	if (g_precondition.phase != PRECONDITION_NONE) {
+		ns_ctx->next_op = next_op_write;
+	} else if (cfg->flush_percentage + cfg->dsm_percentage + cfg->write_zeroes_percentage != 0) {
+		ns_ctx->next_op = choose_op;
+	} else {
+		ns_ctx->next_op = ns_ctx->read_percentage == 100 ? next_op_read :
+						  ns_ctx->read_percentage == 0 ? next_op_write : next_op_mixed;
+	}
+}
+
+static uint64_t
+next_offset_fill(struct worker_ns_ctx *ns_ctx)
+{
+	return ns_ctx->fill_next++;
+}
+
+// The whole namespace whatever --region says
+static uint64_t
+next_offset_anywhere(struct worker_ns_ctx *ns_ctx)
+{
+	return rand_r(&random_seed) % ns_ctx->size_in_ios;
+}
+
+static uint64_t
+next_offset_random(struct worker_ns_ctx *ns_ctx)
+{
+	// rand_r() is a thread-safe version random number generator
+	// number range is [0, RAND_MAX] (RAND_MAX == 2147483647 on this machine)
+	return ns_ctx->region_start + rand_r(&random_seed) % ns_ctx->region_size;
+}
+
+static uint64_t
+next_offset_sequential(struct worker_ns_ctx *ns_ctx)
+{
+	uint64_t offset_in_ios = ns_ctx->region_start + ns_ctx->stream_offset[0]++;
+
+	if (ns_ctx->stream_offset[0] == ns_ctx->stream_size) {
+		ns_ctx->stream_offset[0] = 0;
+	}
+	return offset_in_ios;
+}
+
+static uint64_t
+next_offset_streams(struct worker_ns_ctx *ns_ctx)
+{
+	uint32_t stream = ns_ctx->next_stream;
+	uint64_t offset_in_ios;
+
+	if (++ns_ctx->next_stream == ns_ctx->num_streams) {
+		ns_ctx->next_stream = 0;
+	}
+	offset_in_ios = ns_ctx->region_start + stream * ns_ctx->stream_size + ns_ctx->stream_offset[stream]++;
+	if (ns_ctx->stream_offset[stream] == ns_ctx->stream_size) {
+		ns_ctx->stream_offset[stream] = 0;
+	}
+	return offset_in_ios;
+}
+
+static enum arb_op
+next_op_read(struct worker_ns_ctx *ns_ctx)
+{
+	return ARB_OP_READ;
+}
+
+static enum arb_op
+next_op_write(struct worker_ns_ctx *ns_ctx)
+{
+	return ARB_OP_WRITE;
+}
+
+static enum arb_op
+next_op_mixed(struct worker_ns_ctx *ns_ctx)
+{
+	return ((uint32_t)rand_r(&random_seed) % 100) < ns_ctx->read_percentage ? ARB_OP_READ : ARB_OP_WRITE;
+}
+
+// Issue one I/O now or, when the class is over its --qos caps, from
+// worker_poll() once the buckets have refilled
+static void
+submit_single_io(struct worker_ns_ctx *ns_ctx)
+{
+	uint64_t now, issue_tsc;
+	int rc;
+
+	// A context is done once its part of the fill has been issued
+	if (spdk_unlikely(ns_ctx->filling) && ns_ctx->fill_next == ns_ctx->fill_end) {
+		return;
+	}
+
+	if (ns_ctx->qos != NULL) {
+		now = arb_get_ticks();
+		// Nothing overtakes an earlier deferred submission
+		if (ns_ctx->qos_deferred != 0 || !qos_admits(ns_ctx, now)) {
+			if (ns_ctx->qos_deferred++ == 0) {
+				ns_ctx->qos_stats.throttle_start_tsc = now;
+			}
+			ns_ctx->qos_stats.deferred_ios++;
+			return;
+		}
+	}
+
+	issue_tsc = spdk_get_ticks();
+	rc = issue_single_io(ns_ctx);
+	// Only completions issue the rest of a part of the fill, so a failed
+	// write goes on with the next slot rather than leave the part unwritten
+	while (spdk_unlikely(rc != 0 && ns_ctx->filling) && ns_ctx->fill_next != ns_ctx->fill_end) {
+		rc = issue_single_io(ns_ctx);
+	}
+	ns_ctx->stats.issue_tsc += spdk_get_ticks() - issue_tsc;
+}
+
+// 0 once the I/O is submitted or waits in the --edf heap
+static int
+issue_single_io(struct worker_ns_ctx *ns_ctx)
+{
+	struct arb_task	*task = NULL;
+	struct ns_entry	*ns_entry = ns_ctx->ns_entry;
+	struct token_bucket *bucket;
+	uint64_t offset_in_ios;
+	uint32_t slo_us;
+	int rc;
+
+	// Get a task from task pool
+	task = spdk_mempool_get(g_task_pool);
+	if (!task) {
+		fprintf(stderr, "Failed to get task from task_pool\n");
+		exit(1);
+	}
+
+	task->ns_ctx = ns_ctx;
+
+	task->submit_tsc = arb_get_ticks();
+
+	offset_in_ios = ns_ctx->next_offset(ns_ctx);
+	task->offset_in_ios = offset_in_ios;
+	task->cmd.op = ns_ctx->next_op(ns_ctx);
+	slo_us = ns_ctx->class_cfg->slo_us[task->cmd.op];
+	task->deadline_tsc = slo_us != 0 ?
+						 task->submit_tsc + (uint64_t)slo_us * g_arbitration.tsc_rate / SECOND_TO_MICROSECOND :
+						 UINT64_MAX;
+
+	if (ns_ctx->qos != NULL) {
+		bucket = __atomic_load_n(&ns_ctx->qos->iops, __ATOMIC_ACQUIRE);
+		if (bucket != NULL) {
+			token_bucket_charge(bucket, task->submit_tsc, 1);
+		}
+		// Only reads and writes move data
+		bucket = __atomic_load_n(&ns_ctx->qos->bytes, __ATOMIC_ACQUIRE);
+		if (bucket != NULL && (task->cmd.op == ARB_OP_READ || task->cmd.op == ARB_OP_WRITE)) {
+			token_bucket_charge(bucket, task->submit_tsc, g_arbitration.io_size_bytes);
+		}
+	}
+
+	task_setup_buffers(task);
+
+	if (ns_entry->gen_map != NULL) {
+		if (task->cmd.op == ARB_OP_READ) {
+			task->gen_snapshot = __atomic_load_n(&ns_entry->gen_map[offset_in_ios], __ATOMIC_ACQUIRE);
+		} else if (task->cmd.op == ARB_OP_WRITE) {
+			verify_stamp(task, verify_write_begin(ns_entry, offset_in_ios));
+		} else if (task->cmd.op != ARB_OP_FLUSH) {
+			verify_write_begin(ns_entry, offset_in_ios);
+		}
+	}
+
+	task->cmd.ns = ns_ctx->backend_ns;
+	task->cmd.lba = offset_in_ios * ns_ctx->io_size_blocks;
+	task->cmd.lba_count = ns_ctx->io_size_blocks;
+	task->cmd.vectored = ns_ctx->vectored;
+	task->cmd.io_flags = ns_ctx->io_flags;
+	task->cmd.apptag_mask = 0xffff;
+	task->cmd.apptag = ARB_PI_APPTAG;
+	task->cmd.cb_fn = task_complete;
+	// After the verify stamp, the guard covers it
+	if (ns_ctx->host_pi && task->cmd.op == ARB_OP_WRITE) {
+		pi_generate(task);
+	}
+
+	if (ns_ctx->edf != NULL) {
+		// Counted from now on, the drain waits for the I/O still in the heap too
+		ns_ctx->current_queue_depth++;
+		edf_enqueue(task, task->deadline_tsc != UINT64_MAX ? task->deadline_tsc :
+					task->submit_tsc + (uint64_t)EDF_NO_SLO_US * g_arbitration.tsc_rate / SECOND_TO_MICROSECOND);
+		return 0;
+	}
+
+	rc = submit_task(task);
+	if (rc == 0) {
+		ns_ctx->current_queue_depth++;
+	}
+
+	return rc;
+}
+
+// Hand a built task to the queue pairs of its namespace. When the backend
+// is out of room the task waits on the retry queue and still counts as
+// outstanding, on any other failure it is freed.
+static int
+submit_task(struct arb_task *task)
+{
+	struct worker_ns_ctx *ns_ctx = task->ns_ctx;
+	int rc;
+
+	// Behind the waiting ones, in the order of submission
+	if (spdk_unlikely(!TAILQ_EMPTY(&ns_ctx->retry_queue))) {
+		TAILQ_INSERT_TAIL(&ns_ctx->retry_queue, task, link);
+		ns_ctx->stats.submit_retries++;
+		return 0;
+	}
+
+	rc = backend_submit(task);
+	if (spdk_unlikely(rc == -ENOMEM)) {
+		TAILQ_INSERT_TAIL(&ns_ctx->retry_queue, task, link);
+		ns_ctx->stats.submit_retries++;
+		return 0;
+	}
+	if (rc != 0) {
+		submit_task_failed(task);
+	}
+
+	return rc;
+}
+
+static int
+backend_submit(struct arb_task *task)
+{
+	struct worker_ns_ctx *ns_ctx = task->ns_ctx;
+	uint64_t submit_call_tsc;
+	int rc = -ENOMEM;
+
+	// Round robin, passing over the queue pairs which are full
+	submit_call_tsc = spdk_get_ticks();
+	for (uint32_t i = 0; i < ns_ctx->num_qpairs && rc == -ENOMEM; i++) {
+		rc = g_backend->submit(ns_ctx->qpairs[ns_ctx->next_qpair], &task->cmd);
+		if (++ns_ctx->next_qpair == ns_ctx->num_qpairs) {
+			ns_ctx->next_qpair = 0;
+		}
+	}
+	ns_ctx->stats.submit_call_tsc += spdk_get_ticks() - submit_call_tsc;
+	if (ns_ctx->stages != NULL) {
+		task->sent_tsc = arb_get_ticks();
+	}
+
+	return rc;
+}
+
+static void
+submit_task_failed(struct arb_task *task)
+{
+	struct worker_ns_ctx *ns_ctx = task->ns_ctx;
+	struct ns_entry	*ns_entry = ns_ctx->ns_entry;
+
+	if (ns_ctx->stats.submit_errors++ == 0) {
+		fprintf(stderr, "starting I/O failed\n");
+	}
+	if (ns_entry->gen_map != NULL && task->cmd.op != ARB_OP_READ && task->cmd.op != ARB_OP_FLUSH) {
+		verify_write_end(ns_entry, task->offset_in_ios, true);
+	}
+	task_release_buffers(task);
+	spdk_mempool_put(g_task_pool, task);
+}
+
+// Commands complete in the poll before, so the backend has room again
+static void
+submit_retry_queue(struct worker_ns_ctx *ns_ctx)
+{
+	struct arb_task *task;
+	int rc;
+
+	while ((task = TAILQ_FIRST(&ns_ctx->retry_queue)) != NULL) {
+		rc = backend_submit(task);
+		if (rc == -ENOMEM) {
+			break;
+		}
+		TAILQ_REMOVE(&ns_ctx->retry_queue, task, link);
+		if (rc != 0) {
+			// It was counted as outstanding when it went on the queue
+			ns_ctx->current_queue_depth--;
+			submit_task_failed(task);
+			if (ns_ctx->edf != NULL) {
+				edf_release(ns_ctx->edf, 1);
+			}
+		}
+	}
+}
+
+static int32_t
+ns_ctx_poll(struct worker_ns_ctx *ns_ctx)
+{
+	int32_t rc, completions = 0;
+
+	for (uint32_t i = 0; i < ns_ctx->num_qpairs; i++) {
+		rc = g_backend->poll(ns_ctx->qpairs[i], 0);
+		if (rc > 0) {
+			completions += rc;
+		}
+	}
+	if (spdk_unlikely(!TAILQ_EMPTY(&ns_ctx->retry_queue))) {
+		submit_retry_queue(ns_ctx);
+	}
+
+	return completions;
+}
+
+static void
+task_complete(void *ctx, const struct spdk_nvme_cpl *completion)
+{
+	struct arb_task *task = SPDK_CONTAINEROF(ctx, struct arb_task, cmd);
+	struct worker_ns_ctx *ns_ctx = task->ns_ctx;
+	struct op_stats *op_stats = &ns_ctx->op_stats[task->cmd.op];
+	uint64_t now, tsc_diff, reap_tsc;
+
+	ns_ctx->current_queue_depth--;
+	ns_ctx->io_completed++;
+
+	now = arb_get_ticks();
+	tsc_diff = now - task->submit_tsc;
+	if (task->deadline_tsc != UINT64_MAX) {
+		if (now <= task->deadline_tsc) {
+			ns_ctx->slo_stats.met++;
+		} else {
+			ns_ctx->slo_stats.missed++;
+			ns_ctx->slo_stats.late_tsc += now - task->deadline_tsc;
+		}
+	}
+
+	if (spdk_unlikely(spdk_nvme_cpl_is_error(completion)) &&
+		completion->status.sct == SPDK_NVME_SCT_MEDIA_ERROR &&
+		(completion->status.sc == SPDK_NVME_SC_GUARD_CHECK_ERROR ||
+		 completion->status.sc == SPDK_NVME_SC_APPLICATION_TAG_CHECK_ERROR ||
+		 completion->status.sc == SPDK_NVME_SC_REFERENCE_TAG_CHECK_ERROR)) {
+		ns_ctx->pi.device_errors++;
+	}
+	if (ns_ctx->ns_entry->host_pi && task->cmd.op == ARB_OP_READ && !spdk_nvme_cpl_is_error(completion)) {
+		pi_check(task);
+	}
+
+	if (ns_ctx->ns_entry->gen_map != NULL) {
+		if (task->cmd.op == ARB_OP_WRITE) {
+			verify_write_end(ns_ctx->ns_entry, task->offset_in_ios,
+							 spdk_nvme_cpl_is_error(completion));
+		} else if (task->cmd.op == ARB_OP_DSM || task->cmd.op == ARB_OP_WRITE_ZEROES) {
+			// The slot holds no stamped blocks anymore
+			verify_write_end(ns_ctx->ns_entry, task->offset_in_ios, true);
+		} else if (task->cmd.op == ARB_OP_READ && !spdk_nvme_cpl_is_error(completion)) {
+			verify_check(task);
+		}
+	}
+
+	op_stats->io_completed++;
+	op_stats->total_tsc += tsc_diff;
+	op_stats->min_tsc = spdk_min(op_stats->min_tsc, tsc_diff);
+	op_stats->max_tsc = spdk_max(op_stats->max_tsc, tsc_diff);
+	ns_ctx->stats.total_tsc += tsc_diff;
+	if (spdk_unlikely(ns_ctx->stats.min_tsc > tsc_diff)) {
+		ns_ctx->stats.min_tsc = tsc_diff;
+	}
+	if (spdk_unlikely(ns_ctx->stats.max_tsc < tsc_diff)) {
+		ns_ctx->stats.max_tsc = tsc_diff;
+	}
+	if (ns_ctx->telemetry != NULL) {
+		telemetry_record(ns_ctx, task, now, tsc_diff);
+	}
+	if (ns_ctx->stages != NULL) {
+		// A command submitted from a callback can be reaped by the same poll
+		reap_tsc = spdk_max(ns_ctx->stages->poll_tsc, task->sent_tsc);
+		stage_record(&ns_ctx->stages->hist[ARB_STAGE_SUBMIT], task->sent_tsc - task->submit_tsc);
+		stage_record(&ns_ctx->stages->hist[ARB_STAGE_DEVICE], reap_tsc - task->sent_tsc);
+		stage_record(&ns_ctx->stages->hist[ARB_STAGE_REAP], now - reap_tsc);
+	}
+
+	task_release_buffers(task);
+	spdk_mempool_put(g_task_pool, task);
+
+	// is_draining indicates when time has expired for the test run
+	// If is_draining is true, only waits for the previously submitted I/O to complete.
+	// A paused or lowered depth from --control lets the I/O run out as well.
+	if (!ns_ctx->is_draining && !ns_ctx->paused &&
+		ns_ctx->current_queue_depth + ns_ctx->qos_deferred < (uint64_t)ns_ctx->queue_depth) {
+		submit_single_io(ns_ctx);
+	}
+	// After the replacement is in the heap, so it competes for the room
+	if (ns_ctx->edf != NULL) {
+		edf_release(ns_ctx->edf, 1);
+		edf_submit_ready(ns_ctx->edf, ns_ctx->edf_ready);
+	}
+	if (ns_ctx->stages != NULL) {
+		stage_record(&ns_ctx->stages->hist[ARB_STAGE_CALLBACK], arb_get_ticks() - now);
+	}
+}
+
+// A bucket of burst_units admits commands of nominal_units back to back
+// until it is empty, then one every nominal_units at rate units per second
+static void
+token_bucket_init(struct token_bucket *tb, uint64_t rate, uint64_t burst_units, uint64_t nominal_units)
+{
+	token_bucket_set_rate(tb, rate, burst_units, nominal_units);
+	tb->full_tick = arb_get_ticks();
+}
+
+// The tokens in the bucket are kept, only the refill and the depth change
+static void
+token_bucket_set_rate(struct token_bucket *tb, uint64_t rate, uint64_t burst_units, uint64_t nominal_units)
+{
+	uint64_t unit_ticks = (g_arbitration.tsc_rate << TOKEN_BUCKET_SHIFT) / rate;
+
+	__atomic_store_n(&tb->unit_ticks, unit_ticks, __ATOMIC_RELAXED);
+	__atomic_store_n(&tb->admit_ticks, ((burst_units - nominal_units) * unit_ticks) >> TOKEN_BUCKET_SHIFT,
+					 __ATOMIC_RELAXED);
+}
+
+static bool
+token_bucket_admits(struct token_bucket *tb, uint64_t now)
+{
+	return __atomic_load_n(&tb->full_tick, __ATOMIC_RELAXED) <=
+		   now + __atomic_load_n(&tb->admit_ticks, __ATOMIC_RELAXED);
+}
+
+static void
+token_bucket_charge(struct token_bucket *tb, uint64_t now, uint64_t units)
+{
+	uint64_t cost = (units * __atomic_load_n(&tb->unit_ticks, __ATOMIC_RELAXED)) >> TOKEN_BUCKET_SHIFT;
+	uint64_t old_tick, new_tick;
+
+	old_tick = __atomic_load_n(&tb->full_tick, __ATOMIC_RELAXED);
+	do {
+		// A bucket full since before now has no more tokens than full
+		new_tick = spdk_max(old_tick, now) + cost;
+	} while (!__atomic_compare_exchange_n(&tb->full_tick, &old_tick, new_tick, false,
+										  __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+// Also applies caps changed by --control, a bucket in use keeps its tokens
+static void
+qos_buckets_init(struct qos_buckets *qos, const struct class_config *cfg)
+{
+	uint64_t burst = cfg->qos_burst != 0 ? cfg->qos_burst : (uint64_t)g_arbitration.io_queue_depth;
+
+	if (cfg->iops_limit == 0) {
+		__atomic_store_n(&qos->iops, NULL, __ATOMIC_RELEASE);
+	} else if (qos->iops == NULL) {
+		token_bucket_init(&qos->iops_bucket, cfg->iops_limit, burst, 1);
+		__atomic_store_n(&qos->iops, &qos->iops_bucket, __ATOMIC_RELEASE);
+	} else {
+		token_bucket_set_rate(qos->iops, cfg->iops_limit, burst, 1);
+	}
+	if (cfg->bw_limit_bytes == 0) {
+		__atomic_store_n(&qos->bytes, NULL, __ATOMIC_RELEASE);
+	} else if (qos->bytes == NULL) {
+		token_bucket_init(&qos->bytes_bucket, cfg->bw_limit_bytes, burst * g_arbitration.io_size_bytes,
+						  g_arbitration.io_size_bytes);
+		__atomic_store_n(&qos->bytes, &qos->bytes_bucket, __ATOMIC_RELEASE);
+	} else {
+		token_bucket_set_rate(qos->bytes, cfg->bw_limit_bytes, burst * g_arbitration.io_size_bytes,
+							  g_arbitration.io_size_bytes);
+	}
+}
+
+// Shared buckets are set up once, before any worker can draw from them
+static void
+init_class_qos(void)
+{
+	for (int i = 0; i < SPDK_NVME_QPRIO_MAX; i++) {
+		if (g_arbitration.classes[i].qos_shared) {
+			qos_buckets_init(&g_class_qos[i], &g_arbitration.classes[i]);
+		}
+	}
+}
+
+// Workers sharing a bucket may all pass before any of them charges it,
+// which lets the class run over by at most one I/O per worker
+static bool
+qos_admits(struct worker_ns_ctx *ns_ctx, uint64_t now)
+{
+	struct token_bucket *iops = __atomic_load_n(&ns_ctx->qos->iops, __ATOMIC_ACQUIRE);
+	struct token_bucket *bytes = __atomic_load_n(&ns_ctx->qos->bytes, __ATOMIC_ACQUIRE);
+
+	return (iops == NULL || token_bucket_admits(iops, now)) &&
+		   (bytes == NULL || token_bucket_admits(bytes, now));
+}
+
+static void
+qos_release(struct worker_ns_ctx *ns_ctx)
+{
+	uint64_t now = arb_get_ticks();
+	uint64_t issue_tsc;
+
+	while (ns_ctx->qos_deferred != 0 && qos_admits(ns_ctx, now)) {
+		if (--ns_ctx->qos_deferred == 0) {
+			ns_ctx->qos_stats.throttled_tsc += now - ns_ctx->qos_stats.throttle_start_tsc;
+		}
+		issue_tsc = spdk_get_ticks();
+		issue_single_io(ns_ctx);
+		ns_ctx->stats.issue_tsc += spdk_get_ticks() - issue_tsc;
+	}
+}
+
+// Submissions still waiting when the run ends are dropped
+static void
+qos_stop(struct worker_ns_ctx *ns_ctx)
+{
+	if (ns_ctx->qos_deferred != 0) {
+		ns_ctx->qos_stats.throttled_tsc += arb_get_ticks() - ns_ctx->qos_stats.throttle_start_tsc;
+		ns_ctx->qos_deferred = 0;
+	}
+}
+
+// Caps of the class changed by --control
+static void
+qos_apply(struct worker_ns_ctx *ns_ctx)
+{
+	const struct class_config *cfg = ns_ctx->class_cfg;
+
+	if (cfg->iops_limit == 0 && cfg->bw_limit_bytes == 0) {
+		// Nothing holds the deferred submissions back anymore
+		qos_stop(ns_ctx);
+		ns_ctx->qos = NULL;
+		top_up_ns_ctx(ns_ctx);
+		return;
+	}
+	if (cfg->qos_shared) {
+		ns_ctx->qos = &g_class_qos[ns_ctx->qprio];
+	} else {
+		qos_buckets_init(&ns_ctx->qos_private, cfg);
+		ns_ctx->qos = &ns_ctx->qos_private;
+	}
+}
+
+// One heap for all workers, room for every namespace context at full depth
+static int
+edf_init(void)
+{
+	struct worker_thread *worker;
+	struct worker_ns_ctx *ns_ctx;
+	uint32_t num_ns_ctx = 0;
+
+	if (g_arbitration.edf_inflight == 0) {
+		return 0;
+	}
+
+	TAILQ_FOREACH(worker, &g_workers, link) {
+		TAILQ_FOREACH(ns_ctx, &worker->ns_ctx, link) {
+			num_ns_ctx++;
+		}
+	}
+	// Each namespace context keeps at most -d I/O, waiting or in flight
+	g_edf.capacity = num_ns_ctx * g_arbitration.io_queue_depth;
+	g_edf.heap = calloc(g_edf.capacity, sizeof(*g_edf.heap));
+	if (g_edf.heap == NULL) {
+		return -ENOMEM;
+	}
+	g_edf.count = 0;
+	g_edf.inflight = 0;
+	g_edf.max_inflight = g_arbitration.edf_inflight;
+	pthread_spin_init(&g_edf.lock, PTHREAD_PROCESS_PRIVATE);
+
+	return 0;
+}
+
+static void
+edf_attach(struct worker_thread *worker)
+{
+	struct worker_ns_ctx *ns_ctx;
+
+	TAILQ_INIT(&worker->edf_ready.tasks);
+	worker->edf_ready.count = 0;
+	TAILQ_FOREACH(ns_ctx, &worker->ns_ctx, link) {
+		ns_ctx->edf = &g_edf;
+		ns_ctx->edf_ready = &worker->edf_ready;
+	}
+}
+
+static void
+edf_push(struct edf_sched *edf, uint64_t deadline_tsc, struct arb_task *task)
+{
+	uint32_t i, parent;
+
+	assert(edf->count < edf->capacity);
+	i = edf->count++;
+	while (i > 0) {
+		parent = (i - 1) / EDF_HEAP_ARITY;
+		if (edf->heap[parent].deadline_tsc <= deadline_tsc) {
+			break;
+		}
+		edf->heap[i] = edf->heap[parent];
+		i = parent;
+	}
+	edf->heap[i].deadline_tsc = deadline_tsc;
+	edf->heap[i].task = task;
+}
+
+static struct arb_task *
+edf_pop(struct edf_sched *edf)
+{
+	struct arb_task *task = edf->heap[0].task;
+	struct edf_entry last = edf->heap[--edf->count];
+	uint32_t i = 0, child, end, min;
+
+	while ((child = i * EDF_HEAP_ARITY + 1) < edf->count) {
+		end = spdk_min(child + EDF_HEAP_ARITY, edf->count);
+		for (min = child++; child < end; child++) {
+			if (edf->heap[child].deadline_tsc < edf->heap[min].deadline_tsc) {
+				min = child;
+			}
+		}
+		if (last.deadline_tsc <= edf->heap[min].deadline_tsc) {
+			break;
+		}
+		edf->heap[i] = edf->heap[min];
+		i = min;
+	}
+	edf->heap[i] = last;
+
+	return task;
+}
+
+static void
+edf_enqueue(struct arb_task *task, uint64_t deadline_tsc)
+{
+	struct worker_ns_ctx *ns_ctx = task->ns_ctx;
+
+	pthread_spin_lock(&ns_ctx->edf->lock);
+	edf_push(ns_ctx->edf, deadline_tsc, task);
+	edf_dispatch(ns_ctx->edf);
+	pthread_spin_unlock(&ns_ctx->edf->lock);
+
+	edf_submit_ready(ns_ctx->edf, ns_ctx->edf_ready);
+}
+
+// Under the lock, the earliest deadlines of any class go to the worker of
+// their queue pairs while there is room in flight
+static void
+edf_dispatch(struct edf_sched *edf)
+{
+	struct edf_ready *ready;
+	struct arb_task *task;
+
+	while (edf->inflight < edf->max_inflight && edf->count != 0) {
+		task = edf_pop(edf);
+		ready = task->ns_ctx->edf_ready;
+		TAILQ_INSERT_TAIL(&ready->tasks, task, link);
+		__atomic_store_n(&ready->count, ready->count + 1, __ATOMIC_RELEASE);
+		edf->inflight++;
+	}
+}
+
+// Completed or failed, their room goes to the next deadlines
+static void
+edf_release(struct edf_sched *edf, uint32_t count)
+{
+	pthread_spin_lock(&edf->lock);
+	edf->inflight -= count;
+	edf_dispatch(edf);
+	pthread_spin_unlock(&edf->lock);
+}
+
+static void
+edf_submit_ready(struct edf_sched *edf, struct edf_ready *ready)
+{
+	TAILQ_HEAD(, arb_task) tasks;
+	struct worker_ns_ctx *ns_ctx;
+	struct arb_task *task;
+	uint32_t failed;
+
+	// The room of a failed submission can be given to this worker again
+	while (__atomic_load_n(&ready->count, __ATOMIC_ACQUIRE) != 0) {
+		TAILQ_INIT(&tasks);
+		pthread_spin_lock(&edf->lock);
+		TAILQ_CONCAT(&tasks, &ready->tasks, link);
+		__atomic_store_n(&ready->count, 0, __ATOMIC_RELAXED);
+		pthread_spin_unlock(&edf->lock);
+
+		failed = 0;
+		while ((task = TAILQ_FIRST(&tasks)) != NULL) {
+			TAILQ_REMOVE(&tasks, task, link);
+			ns_ctx = task->ns_ctx;
+			if (submit_task(task) != 0) {
+				ns_ctx->current_queue_depth--;
+				failed++;
+			}
+		}
+		if (failed != 0) {
+			edf_release(edf, failed);
+		}
+	}
+}
+
+// The contexts of a worker wait for the room in flight of each other, so
+// they stop together and are all polled until their I/O is back
+static void
+edf_drain(struct worker_thread *worker)
+{
+	struct worker_ns_ctx *ns_ctx;
+	bool busy;
+
+	TAILQ_FOREACH(ns_ctx, &worker->ns_ctx, link) {
+		ns_ctx->is_draining = true;
+		qos_stop(ns_ctx);
+	}
+	do {
+		busy = false;
+		edf_submit_ready(&g_edf, &worker->edf_ready);
+		TAILQ_FOREACH(ns_ctx, &worker->ns_ctx, link) {
+			if (ns_ctx->stages != NULL) {
+				poll_with_stages(ns_ctx);
+			} else {
+				ns_ctx_poll(ns_ctx);
+			}
+			busy |= ns_ctx->current_queue_depth > 0;
+		}
+	} while (busy);
+}
+
+static void
+drain_io(struct worker_ns_ctx *ns_ctx)
+{
+	ns_ctx->is_draining = true;
+	qos_stop(ns_ctx);
+	while (ns_ctx->current_queue_depth > 0) {
+		if (ns_ctx->stages != NULL) {
+			poll_with_stages(ns_ctx);
+		} else {
+			ns_ctx_poll(ns_ctx);
+		}
+	}
+}
+
+// Begin a write of one io sized slot and return the generation to stamp
+static uint32_t
+verify_write_begin(struct ns_entry *ns_entry, uint64_t offset_in_ios)
+{
+	uint32_t *word = &ns_entry->gen_map[offset_in_ios];
+	uint32_t old_word, new_word;
+
+	old_word = __atomic_load_n(word, __ATOMIC_RELAXED);
+	do {
+		new_word = old_word + (1u << GEN_MAP_SHIFT) + 1;
+		// Generation 0 is reserved for never written
+		if ((new_word >> GEN_MAP_SHIFT) == 0) {
+			new_word += 1u << GEN_MAP_SHIFT;
+		}
+		// Overlapped writes may reach the media in any order
+		if (old_word & GEN_MAP_INFLIGHT_MASK) {
+			new_word |= GEN_MAP_AMBIGUOUS;
+		} else {
+			new_word &= ~GEN_MAP_AMBIGUOUS;
+		}
+	} while (!__atomic_compare_exchange_n(word, &old_word, new_word, false,
+										  __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+	return new_word >> GEN_MAP_SHIFT;
+}
+
+static void
+verify_write_end(struct ns_entry *ns_entry, uint64_t offset_in_ios, bool failed)
+{
+	uint32_t *word = &ns_entry->gen_map[offset_in_ios];
+
+	if (failed) {
+		__atomic_fetch_or(word, GEN_MAP_AMBIGUOUS, __ATOMIC_RELEASE);
+	}
+	__atomic_fetch_sub(word, 1, __ATOMIC_RELEASE);
+}
+
+static inline uint32_t
+verify_block_crc(const uint8_t *block, uint32_t block_size)
+{
+	uint32_t crc;
+
+	crc = spdk_crc32c_update(block, offsetof(struct verify_header, crc), ~0u);
+	crc = spdk_crc32c_update(block + sizeof(struct verify_header),
+							 block_size - sizeof(struct verify_header), crc);
+	return ~crc;
+}
+
+static void
+verify_stamp(struct arb_task *task, uint32_t generation)
+{
+	struct ns_entry *ns_entry = task->ns_ctx->ns_entry;
+	uint64_t start_tsc = spdk_get_ticks();
+	uint64_t lba = task->offset_in_ios * ns_entry->io_size_blocks;
+	struct verify_header *hdr;
+	uint8_t *block;
+
+	// Segments always hold whole blocks, the interleaved metadata is skipped
+	for (int v = 0; v < task->cmd.iovcnt; v++) {
+		block = task->cmd.iovs[v].iov_base;
+		for (size_t off = 0; off < task->cmd.iovs[v].iov_len; off += ns_entry->buf_block_size) {
+			hdr = (struct verify_header *)(block + off);
+			hdr->lba = lba++;
+			hdr->generation = generation;
+			hdr->seed = g_arbitration.verify_seed;
+			hdr->crc = verify_block_crc(block + off, ns_entry->block_size);
+		}
+	}
+
+	task->ns_ctx->verify.total_tsc += spdk_get_ticks() - start_tsc;
+}
+
+static void
+verify_check(struct arb_task *task)
+{
+	struct worker_ns_ctx *ns_ctx = task->ns_ctx;
+	struct ns_entry *ns_entry = ns_ctx->ns_entry;
+	uint64_t start_tsc = spdk_get_ticks();
+	uint64_t lba = task->offset_in_ios * ns_entry->io_size_blocks;
+	uint32_t generation = task->gen_snapshot >> GEN_MAP_SHIFT;
+	const struct verify_header *hdr;
+	const uint8_t *block;
+	uint32_t current;
+	bool mismatch = false;
+
+	// Only a slot which is quiet for the whole read has a known content
+	current = __atomic_load_n(&ns_entry->gen_map[task->offset_in_ios], __ATOMIC_ACQUIRE);
+	if (generation == 0 || current != task->gen_snapshot ||
+		(task->gen_snapshot & (GEN_MAP_AMBIGUOUS | GEN_MAP_INFLIGHT_MASK))) {
+		ns_ctx->verify.skipped++;
+		ns_ctx->verify.total_tsc += spdk_get_ticks() - start_tsc;
+		return;
+	}
+
+	for (int v = 0; v < task->cmd.iovcnt; v++) {
+		for (size_t off = 0; off < task->cmd.iovs[v].iov_len; off += ns_entry->buf_block_size, lba++) {
+			block = (const uint8_t *)task->cmd.iovs[v].iov_base + off;
+			hdr = (const struct verify_header *)block;
+			if (spdk_likely(hdr->lba == lba && hdr->generation == generation &&
+							hdr->seed == g_arbitration.verify_seed &&
+							hdr->crc == verify_block_crc(block, ns_entry->block_size))) {
+				continue;
+			}
+
+			if (!mismatch && ns_ctx->verify.errors < VERIFY_MAX_REPORTED_ERRORS) {
+				fprintf(stderr, "Verify mismatch on %s Namespace %u LBA %" PRIu64 ": "
+						"expected generation %u seed 0x%x, "
+						"got LBA %" PRIu64 " generation %u seed 0x%x crc %s\n",
+						ns_entry->name, ns_entry->nsid, lba,
+						generation, g_arbitration.verify_seed,
+						hdr->lba, hdr->generation, hdr->seed,
+						hdr->crc == verify_block_crc(block, ns_entry->block_size) ? "ok" : "bad");
+			}
+			mismatch = true;
+		}
+	}
+
+	ns_ctx->verify.checked++;
+	if (mismatch) {
+		ns_ctx->verify.errors++;
+	}
+	ns_ctx->verify.total_tsc += spdk_get_ticks() - start_tsc;
+}
+
+static int
+pi_ctx_init(struct arb_task *task, struct spdk_dif_ctx *ctx)
+{
+	struct ns_entry *ns_entry = task->ns_ctx->ns_entry;
+	struct spdk_dif_ctx_init_ext_opts dif_opts;
+	uint32_t checks = g_arbitration.pi_checks;
+
+	if (ns_entry->pi_type == SPDK_NVME_FMT_NVM_PROTECTION_TYPE3) {
+		checks &= ~SPDK_DIF_FLAGS_REFTAG_CHECK;
+	}
+	dif_opts.size = SPDK_SIZEOF(&dif_opts, dif_pi_format);
+	dif_opts.dif_pi_format = SPDK_DIF_PI_FORMAT_16;
+
+	// The reference tag of type 1 is the low 32 bits of the LBA, type 2
+	// takes it from the command and uses the same here
+	return spdk_dif_ctx_init(ctx, ns_entry->buf_block_size, ns_entry->md_size,
+				 ns_entry->md_interleave, ns_entry->pi_loc,
+				 (enum spdk_dif_type)ns_entry->pi_type, checks,
+				 (uint32_t)task->cmd.lba, 0xffff, ARB_PI_APPTAG, 0, 0, &dif_opts);
+}
+
+static void
+pi_generate(struct arb_task *task)
+{
+	struct worker_ns_ctx *ns_ctx = task->ns_ctx;
+	struct ns_entry *ns_entry = ns_ctx->ns_entry;
+	uint64_t start_tsc = spdk_get_ticks();
+	struct spdk_dif_ctx ctx;
+	struct iovec md_iov = { task->md_buf, ns_entry->io_md_bytes };
+	int rc;
+
+	rc = pi_ctx_init(task, &ctx);
+	if (rc == 0) {
+		if (ns_entry->md_interleave) {
+			rc = spdk_dif_generate(task->cmd.iovs, task->cmd.iovcnt, task->cmd.lba_count, &ctx);
+		} else {
+			rc = spdk_dix_generate(task->cmd.iovs, task->cmd.iovcnt, &md_iov, task->cmd.lba_count, &ctx);
+		}
+	}
+	if (rc != 0) {
+		fprintf(stderr, "Generating the protection information of %s Namespace %u LBA %" PRIu64
+				" failed: %d\n", ns_entry->name, ns_entry->nsid, task->cmd.lba, rc);
+		exit(1);
+	}
+
+	ns_ctx->pi.generated++;
+	ns_ctx->pi.total_tsc += spdk_get_ticks() - start_tsc;
+}
+
+static void
+pi_check(struct arb_task *task)
+{
+	struct worker_ns_ctx *ns_ctx = task->ns_ctx;
+	struct ns_entry *ns_entry = ns_ctx->ns_entry;
+	uint64_t start_tsc = spdk_get_ticks();
+	struct spdk_dif_ctx ctx;
+	struct spdk_dif_error err = {};
+	struct iovec md_iov = { task->md_buf, ns_entry->io_md_bytes };
+	int rc;
+
+	rc = pi_ctx_init(task, &ctx);
+	if (rc != 0) {
+		fprintf(stderr, "Checking the protection information of %s Namespace %u LBA %" PRIu64
+				" failed: %d\n", ns_entry->name, ns_entry->nsid, task->cmd.lba, rc);
+		exit(1);
+	}
+	if (ns_entry->md_interleave) {
+		rc = spdk_dif_verify(task->cmd.iovs, task->cmd.iovcnt, task->cmd.lba_count, &ctx, &err);
+	} else {
+		rc = spdk_dix_verify(task->cmd.iovs, task->cmd.iovcnt, &md_iov, task->cmd.lba_count, &ctx, &err);
+	}
+
+	ns_ctx->pi.checked++;
+	if (rc != 0) {
+		if (ns_ctx->pi.host_errors < VERIFY_MAX_REPORTED_ERRORS) {
+			fprintf(stderr, "Protection information %s error on %s Namespace %u LBA %" PRIu64 ": "
+					"expected 0x%x, got 0x%x\n",
+					err.err_type == SPDK_DIF_GUARD_ERROR ? "guard" :
+					err.err_type == SPDK_DIF_APPTAG_ERROR ? "application tag" : "reference tag",
+					ns_entry->name, ns_entry->nsid, task->cmd.lba + err.err_offset,
+					(uint32_t)err.expected, (uint32_t)err.actual);
+		}
+		ns_ctx->pi.host_errors++;
+	}
+	ns_ctx->pi.total_tsc += spdk_get_ticks() - start_tsc;
+}
+
+static void
+print_configuration_and_performance(char *program_name)
+{
+	struct worker_thread	*worker;
+	struct worker_ns_ctx	*ns_ctx;
+	const struct class_config *cfg;
+	struct op_stats *op_stats;
+	struct trid_entry *trid_entry;
+	struct ctrlr_entry *ctrlr_entry;
+	double rtt;
+	double io_per_second, sent_comparison_io_in_secs, mb_per_second;
+	double average_latency, min_latency, max_latency;
+
+	printf("========================================================\n");
+	printf("Rerun with configuration:\n");
+	printf("sudo %s -d %d -s %d -p %s -M %d -c %s -t %d -b %d -h %d -m %d -l %d",
+	       program_name,
+	       g_arbitration.io_queue_depth,
+	       g_arbitration.io_size_bytes,
+	       g_arbitration.io_pattern_type,
+	       g_arbitration.rw_percentage,
+	       g_arbitration.core_mask,
+	       g_arbitration.time_in_sec,
+	       g_arbitration.arbitration_burst,
+	       g_arbitration.high_priority_weight,
+	       g_arbitration.medium_priority_weight,
+	       g_arbitration.low_priority_weight);
+	printf(g_arbitration.enable_urgent ? " -u" : "");
+	if (g_arbitration.verify) {
+		printf(" --verify --verify-seed %u", g_arbitration.verify_seed);
+	}
+	printf(" --payload %s --payload-pool %u", g_arbitration.payload_spec,
+		   g_arbitration.payload_pool_mib);
+	if (g_arbitration.sgl_segments != 0) {
+		printf(" --sgl-segments %u", g_arbitration.sgl_segments);
+	}
+	if (g_arbitration.read_sink_bufs != 0) {
+		printf(" --read-sink %u", g_arbitration.read_sink_bufs);
+	}
+	if (g_arbitration.pi_spec != NULL) {
+		printf(" --pi %s", g_arbitration.pi_spec);
+	}
+	if (g_arbitration.region_split) {
+		printf(" --region split");
+	}
+	if (g_arbitration.num_streams > 1) {
+		printf(" --streams %u", g_arbitration.num_streams);
+	}
+	TAILQ_FOREACH(trid_entry, &g_trid_list, link) {
+		printf(" -r '%s'", trid_entry->str);
+	}
+	if (g_arbitration.host_wrr) {
+		printf(" --host-wrr");
+	}
+	if (g_arbitration.stages) {
+		printf(" --stages");
+	}
+	if (g_arbitration.edf_inflight != 0) {
+		printf(" --edf %u", g_arbitration.edf_inflight);
+	}
+	for (int i = 0; i < g_arbitration.num_rules; i++) {
+		printf(" --arb-rule '%s'", g_arbitration.rules[i].str);
+	}
+	if (strcmp(g_backend->name, "nvme")) {
+		printf(" --backend %s", g_backend->name);
+	}
+	for (int i = 0; i < g_arbitration.backend_opts.num_filenames; i++) {
+		printf(" --filename %s", g_arbitration.backend_opts.filenames[i]);
+	}
+	if (g_arbitration.backend_opts.uring_sqpoll) {
+		printf(" --uring-sqpoll");
+	}
+	if (!strcmp(g_backend->name, "sim")) {
+		printf(" --sim-namespaces %u --sim-ns-size %" PRIu64 " --sim-parallelism %u"
+			   " --sim-seed %" PRIu64, g_arbitration.backend_opts.sim_namespaces,
+			   g_arbitration.backend_opts.sim_ns_size / (1024 * 1024),
+			   g_arbitration.backend_opts.sim_parallelism, g_arbitration.backend_opts.sim_seed);
+		print_sim_service();
+		if (g_arbitration.backend_opts.sim_md_size != 0) {
+			printf(" --sim-md %u%s", g_arbitration.backend_opts.sim_md_size,
+				   g_arbitration.backend_opts.sim_md_interleave ? ",extended" : "");
+			if (g_arbitration.backend_opts.sim_pi_type != SPDK_NVME_FMT_NVM_PROTECTION_DISABLE) {
+				printf(",pi=%d", g_arbitration.backend_opts.sim_pi_type);
+			}
+		}
+	}
+	if (g_arbitration.no_huge) {
+		printf(" --no-huge");
+	}
+	if (g_control.path != NULL) {
+		printf(" --control %s", g_control.path);
+	}
+	if (g_telemetry.path != NULL) {
+		printf(" --telemetry %s", g_telemetry.path);
+	}
+	if (g_steady.interval_s != 0) {
+		printf(" --steady-state %u,%u,%u", g_steady.interval_s, g_steady.window, g_steady.max_rounds);
+	}
+	if (g_precondition.fill || g_precondition.random_s != 0 || g_precondition.random_steady) {
+		printf(" --precondition %s", g_precondition.fill ? "fill" : "");
+		if (g_precondition.random_steady) {
+			printf("%srandom=steady", g_precondition.fill ? "," : "");
+		} else if (g_precondition.random_s != 0) {
+			printf("%srandom=%u", g_precondition.fill ? "," : "", g_precondition.random_s);
+		}
+	}
+	if (g_repeat.count > 1) {
+		printf(" --repeat %u", g_repeat.count);
+	}
+	if (g_timeline.interval_s != 0) {
+		printf(" --timeline %u", g_timeline.interval_s);
+	}
+	if (g_repeat.json_out != NULL) {
+		printf(" --json-out %s", g_repeat.json_out);
+	}
+	if (g_repeat.baseline != NULL) {
+		printf(" --baseline %s", g_repeat.baseline);
+	}
+	if (g_arbitration.unloaded_path != NULL) {
+		printf(" --unloaded %s", g_arbitration.unloaded_path);
+	}
+	for (int i = 0; i < SPDK_NVME_QPRIO_MAX; i++) {
+		cfg = &g_arbitration.classes[i];
+		if (cfg->flush_percentage + cfg->dsm_percentage + cfg->write_zeroes_percentage != 0) {
+			printf(" --cmd-mix %s:flush=%u,dsm=%u,wz=%u", g_qprio_names[i], cfg->flush_percentage,
+				   cfg->dsm_percentage, cfg->write_zeroes_percentage);
+		}
+		if (cfg->iops_limit != 0 || cfg->bw_limit_bytes != 0) {
+			printf(" --qos %s:", g_qprio_names[i]);
+			if (cfg->iops_limit != 0) {
+				printf("iops=%" PRIu64 ",", cfg->iops_limit);
+			}
+			if (cfg->bw_limit_bytes != 0) {
+				printf("bw=%" PRIu64 ",", cfg->bw_limit_bytes / (1024 * 1024));
+			}
+			printf("burst=%u%s", cfg->qos_burst != 0 ? cfg->qos_burst : (uint32_t)g_arbitration.io_queue_depth,
+				   cfg->qos_shared ? ",shared" : "");
+		}
+		for (int op = 0; op < ARB_OP_COUNT; op++) {
+			if (cfg->slo_us[op] != 0) {
+				printf(" --slo %s:%s=%u", g_qprio_names[i], g_op_keys[op], cfg->slo_us[op]);
+			}
+		}
+		if (cfg->region_set) {
+			printf(" --region %s:start=%" PRIu64 "%s,size=%" PRIu64 "%s", g_qprio_names[i],
+				   cfg->region_start, cfg->region_start_pct ? "%" : "",
+				   cfg->region_size, cfg->region_size_pct ? "%" : "");
+		}
+		if (cfg->num_qpairs > 1) {
+			printf(" --qpairs %s:%u", g_qprio_names[i], cfg->num_qpairs);
+		}
+	}
+	printf("\n");
+
+	printf("========================================================\n");
+
+	TAILQ_FOREACH(worker, &g_workers, link) {
+		TAILQ_FOREACH(ns_ctx, &worker->ns_ctx, link) {
+			io_per_second = (double)ns_ctx->io_completed / g_arbitration.time_in_sec;
+			sent_comparison_io_in_secs = COMPARISON_IO_COUNT / io_per_second;
+			// Only reads and writes move data
+			mb_per_second = (double)(ns_ctx->op_stats[ARB_OP_READ].io_completed +
+									 ns_ctx->op_stats[ARB_OP_WRITE].io_completed) /
+							g_arbitration.time_in_sec * g_arbitration.io_size_bytes / (1024 * 1024);
+			average_latency = ((double)ns_ctx->stats.total_tsc / ns_ctx->io_completed) * SECOND_TO_MICROSECOND / g_arbitration.tsc_rate;
+  			min_latency = (double)ns_ctx->stats.min_tsc * SECOND_TO_MICROSECOND / g_arbitration.tsc_rate;
+  			max_latency = (double)ns_ctx->stats.max_tsc * SECOND_TO_MICROSECOND / g_arbitration.tsc_rate;
+
+			printf("%-43.43s Namespace %u with core %u: %8.2lf IO/s %8.2lf secs/%d ios %8.2lf MiB/s  ",
+				   ns_ctx->ns_entry->name, ns_ctx->ns_entry->nsid, worker->lcore, io_per_second, sent_comparison_io_in_secs, COMPARISON_IO_COUNT, mb_per_second);
+			printf("Latency average: %8.2f min: %8.2f: max: %8.2f\n",
+				   average_latency, min_latency, max_latency);
+			ctrlr_entry = ns_ctx->ns_entry->ctrlr_entry;
+			if (ctrlr_entry->ctrlr != NULL && ctrlr_entry->trtype != SPDK_NVME_TRANSPORT_PCIE) {
+				rtt = (double)ctrlr_entry->admin_rtt_tsc * SECOND_TO_MICROSECOND / g_arbitration.tsc_rate;
+				printf("%-43.43s Fabric round trip: %8.2f us, latency beyond it: %8.2f us, "
+					   "arbitration: %s, queue depth %d\n", "", rtt, average_latency - rtt,
+					   ctrlr_entry->wrr_enabled ? "device WRR" :
+					   g_arbitration.host_wrr ? "host depth by weight" : "none",
+					   ns_ctx->queue_depth);
+			}
+			if (ns_ctx->region_size != ns_ctx->ns_entry->size_in_ios || g_arbitration.num_streams > 1) {
+				printf("%-43.43s Region: LBA %" PRIu64 "-%" PRIu64 ", %u stream%s\n", "",
+					   ns_ctx->region_start * ns_ctx->ns_entry->io_size_blocks,
+					   (ns_ctx->region_start + ns_ctx->region_size) * ns_ctx->ns_entry->io_size_blocks - 1,
+					   g_arbitration.is_random ? 1 : g_arbitration.num_streams,
+					   g_arbitration.is_random || g_arbitration.num_streams == 1 ? "" : "s");
+			}
+			printf("%-43.43s Submit path: %8.2f cycles/IO, of which the submit call (%s) %8.2f\n", "",
+				   ns_ctx->io_completed ? (double)ns_ctx->stats.issue_tsc / ns_ctx->io_completed : 0,
+				   g_arbitration.sgl_segments ? "vectored" : "contiguous",
+				   ns_ctx->io_completed ? (double)ns_ctx->stats.submit_call_tsc / ns_ctx->io_completed : 0);
+			if (ns_ctx->num_qpairs > 1 || ns_ctx->stats.submit_retries + ns_ctx->stats.submit_errors != 0) {
+				printf("%-43.43s Queue pairs: %u, %" PRIu64 " submissions retried, %" PRIu64 " failed\n", "",
+					   ns_ctx->num_qpairs, ns_ctx->stats.submit_retries, ns_ctx->stats.submit_errors);
+			}
+			if (ns_ctx->ns_entry->unloaded_read_ns + ns_ctx->ns_entry->unloaded_write_ns != 0) {
+				print_unloaded_latency(ns_ctx);
+			}
+			cfg = ns_ctx->class_cfg;
+			if (cfg->flush_percentage + cfg->dsm_percentage + cfg->write_zeroes_percentage != 0) {
+				for (int op = 0; op < ARB_OP_COUNT; op++) {
+					op_stats = &ns_ctx->op_stats[op];
+					if (op_stats->io_completed == 0) {
+						continue;
+					}
+					printf("%-43.43s %-12s: %8.2lf IO/s Latency average: %8.2f min: %8.2f: max: %8.2f\n",
+						   "", g_op_names[op], (double)op_stats->io_completed / g_arbitration.time_in_sec,
+						   (double)op_stats->total_tsc / op_stats->io_completed * SECOND_TO_MICROSECOND / g_arbitration.tsc_rate,
+						   (double)op_stats->min_tsc * SECOND_TO_MICROSECOND / g_arbitration.tsc_rate,
+						   (double)op_stats->max_tsc * SECOND_TO_MICROSECOND / g_arbitration.tsc_rate);
+				}
+			}
+			if (g_arbitration.verify) {
+				printf("%-43.43s Verify: %" PRIu64 " checked %" PRIu64 " skipped %" PRIu64
+					   " mismatched, %8.2f cycles/IO\n", "",
+					   ns_ctx->verify.checked, ns_ctx->verify.skipped, ns_ctx->verify.errors,
+					   ns_ctx->io_completed ? (double)ns_ctx->verify.total_tsc / ns_ctx->io_completed : 0);
+			}
+		}
+	}
+	printf("========================================================\n");
+	print_cpu_performance();
+	print_memory_usage();
+	print_ctrlr_performance();
+	print_qos_performance();
+	print_slo_performance();
+	print_pi_performance();
+	print_stage_performance();
+}
+
+// Sum of all namespaces and workers of each controller, with the share of
+// every priority class next to the weights the controller was given
+static void
+print_ctrlr_performance(void)
+{
+	struct ctrlr_entry *ctrlr_entry;
+	struct worker_thread *worker;
+	struct worker_ns_ctx *ns_ctx;
+	uint64_t class_ios[SPDK_NVME_QPRIO_MAX];
+	uint64_t io_completed, data_ios, total_tsc;
+	const struct ctrlr_setup *setup;
+
+	TAILQ_FOREACH(ctrlr_entry, &g_controllers, link) {
+		memset(class_ios, 0, sizeof(class_ios));
+		io_completed = 0;
+		data_ios = 0;
+		total_tsc = 0;
+		TAILQ_FOREACH(worker, &g_workers, link) {
+			TAILQ_FOREACH(ns_ctx, &worker->ns_ctx, link) {
+				if (ns_ctx->ns_entry->ctrlr_entry != ctrlr_entry) {
+					continue;
+				}
+				class_ios[ns_ctx->qprio] += ns_ctx->io_completed;
+				io_completed += ns_ctx->io_completed;
+				data_ios += ns_ctx->op_stats[ARB_OP_READ].io_completed +
+							ns_ctx->op_stats[ARB_OP_WRITE].io_completed;
+				total_tsc += ns_ctx->stats.total_tsc;
+			}
+		}
+		if (io_completed == 0) {
+			continue;
+		}
+
+		setup = &ctrlr_entry->setup;
+		printf("%-43.43s Controller: %8.2lf IO/s %8.2lf MiB/s  Latency average: %8.2f\n",
+			   ctrlr_entry->name, (double)io_completed / g_arbitration.time_in_sec,
+			   (double)data_ios / g_arbitration.time_in_sec * g_arbitration.io_size_bytes / (1024 * 1024),
+			   (double)total_tsc / io_completed * SECOND_TO_MICROSECOND / g_arbitration.tsc_rate);
+		printf("%-43.43s Arbitration burst %u weights %u/%u/%u from %s, %s\n", "",
+			   ctrlr_entry->arb.burst, ctrlr_entry->arb.high_priority_weight,
+			   ctrlr_entry->arb.medium_priority_weight, ctrlr_entry->arb.low_priority_weight,
+			   ctrlr_entry->arb_rule >= 0 ? g_arbitration.rules[ctrlr_entry->arb_rule].str : "-b/-h/-m/-l",
+			   !ctrlr_entry->wrr_enabled ? "not applied, no device WRR" :
+			   ctrlr_entry->ctrlr == NULL ? "applied by the backend" :
+			   setup->after_valid && arb_feature_matches(&ctrlr_entry->arb, setup->arb_after) ?
+			   "verified" : "not verified");
+		printf("%-43.43s Share:", "");
+		for (int i = 0; i < SPDK_NVME_QPRIO_MAX; i++) {
+			if (class_ios[i] != 0) {
+				printf(" %s %.1f%%", g_qprio_names[i], (double)class_ios[i] * 100 / io_completed);
+			}
+		}
+		printf("\n");
+		if (ctrlr_entry->health.samples != 0) {
+			print_ctrlr_health(ctrlr_entry);
+		}
+	}
+	printf("========================================================\n");
+}
+
+// The controllers stay attached and their admin queues polled, which also
+// releases what tenants leave behind when they exit, until all have reported
+static int
+run_tenant_primary(void)
+{
+	struct tenant_region *region;
+	struct tenant_slot *slot;
+	struct ctrlr_entry *ctrlr_entry;
+	uint32_t num_claimed, done, failed, unclaimed = 0;
+	uint64_t attach_end_tsc;
+
+	region = spdk_memzone_reserve(TENANT_MEMZONE_NAME, sizeof(*region), SPDK_ENV_NUMA_ID_ANY, 0);
+	if (region == NULL) {
+		fprintf(stderr, "Unable to reserve the tenant memzone\n");
+		return 1;
+	}
+	memset(region, 0, sizeof(*region));
+
+	printf("Waiting for %u tenants, start each with --shm-id %d --tenant <class>\n",
+		   g_arbitration.num_tenants, g_arbitration.shm_id);
+	attach_end_tsc = spdk_get_ticks() + TENANT_ATTACH_TIMEOUT_S * spdk_get_ticks_hz();
+	do {
+		usleep(TENANT_POLL_US);
+		TAILQ_FOREACH(ctrlr_entry, &g_controllers, link) {
+			spdk_nvme_ctrlr_process_admin_completions(ctrlr_entry->ctrlr);
+		}
+
+		num_claimed = spdk_min(__atomic_load_n(&region->num_claimed, __ATOMIC_ACQUIRE), TENANT_MAX);
+		done = 0;
+		failed = 0;
+		for (uint32_t i = 0; i < num_claimed; i++) {
+			slot = &region->slots[i];
+			switch (__atomic_load_n(&slot->state, __ATOMIC_ACQUIRE)) {
+			case TENANT_DONE:
+				done++;
+				break;
+			case TENANT_RUNNING:
+				if (kill(slot->pid, 0) != 0 && errno == ESRCH) {
+					failed++;
+				}
+				break;
+			default:
+				break;
+			}
+		}
+		unclaimed = 0;
+		if (num_claimed < g_arbitration.num_tenants && spdk_get_ticks() > attach_end_tsc) {
+			unclaimed = g_arbitration.num_tenants - num_claimed;
+		}
+	} while (done + failed + unclaimed < g_arbitration.num_tenants);
+
+	g_arbitration.tenant_slot = region->slots;
+	print_tenant_report();
+	if (failed != 0) {
+		fprintf(stderr, "%u tenants exited without results\n", failed);
+	}
+	if (unclaimed != 0) {
+		fprintf(stderr, "%u tenants did not attach within %d seconds\n", unclaimed,
+				TENANT_ATTACH_TIMEOUT_S);
+	}
+	spdk_memzone_free(TENANT_MEMZONE_NAME);
+
+	return failed + unclaimed != 0;
+}
+
+static void
+print_tenant_report(void)
+{
+	const struct tenant_slot *slot;
+	const struct tenant_ns_stats *ns;
+	double class_iops[SPDK_NVME_QPRIO_MAX] = {};
+	double class_mibps[SPDK_NVME_QPRIO_MAX] = {};
+	double total_iops = 0, hz, secs;
+
+	printf("========================================================\n");
+	printf("Tenants of shm id %d\n", g_arbitration.shm_id);
+	printf("========================================================\n");
+	for (uint32_t i = 0; i < TENANT_MAX; i++) {
+		slot = &g_arbitration.tenant_slot[i];
+		if (__atomic_load_n(&slot->state, __ATOMIC_ACQUIRE) != TENANT_DONE) {
+			continue;
+		}
+		hz = slot->tsc_rate;
+		secs = slot->time_in_sec;
+		printf("Tenant pid %d, %s priority class, env init %.2f ms, attach %.2f ms\n",
+			   (int)slot->pid, g_qprio_names[slot->qprio],
+			   slot->env_init_tsc * 1000 / hz, slot->attach_tsc * 1000 / hz);
+		for (uint32_t j = 0; j < slot->num_ns_ctx; j++) {
+			ns = &slot->ns[j];
+			if (ns->io_completed == 0) {
+				continue;
+			}
+			printf("%-43.43s Namespace %u with core %u: %8.2lf IO/s %8.2lf MiB/s  "
+				   "Latency average: %8.2f min: %8.2f: max: %8.2f\n",
+				   ns->name, ns->nsid, ns->lcore, ns->io_completed / secs,
+				   ns->data_bytes / secs / (1024 * 1024),
+				   (double)ns->total_tsc / ns->io_completed * SECOND_TO_MICROSECOND / hz,
+				   ns->min_tsc * SECOND_TO_MICROSECOND / hz, ns->max_tsc * SECOND_TO_MICROSECOND / hz);
+			if (ns->slo_met + ns->slo_missed != 0) {
+				printf("%-43.43s Deadlines missed: %" PRIu64 " of %" PRIu64 "\n", "",
+					   ns->slo_missed, ns->slo_met + ns->slo_missed);
+			}
+			class_iops[slot->qprio] += ns->io_completed / secs;
+			class_mibps[slot->qprio] += ns->data_bytes / secs / (1024 * 1024);
+			total_iops += ns->io_completed / secs;
+		}
+	}
+	printf("========================================================\n");
+	for (int i = 0; i < SPDK_NVME_QPRIO_MAX; i++) {
+		if (class_iops[i] != 0) {
+			printf("%-6s priority class: %10.2lf IO/s %8.2lf MiB/s  Share: %.1f%%\n", g_qprio_names[i],
+				   class_iops[i], class_mibps[i], class_iops[i] * 100 / total_iops);
+		}
+	}
+	printf("========================================================\n");
+}
+
+// Tenants claim a slot once attached, so the primary can tell a tenant
+// which died from one which is still running
+static int
+claim_tenant_slot(void)
+{
+	struct tenant_region *region;
+	struct tenant_slot *slot;
+	uint32_t idx;
+
+	region = spdk_memzone_lookup(TENANT_MEMZONE_NAME);
+	if (region == NULL) {
+		fprintf(stderr, "No primary with --tenants runs with --shm-id %d\n", g_arbitration.shm_id);
+		return 1;
+	}
+	idx = __atomic_fetch_add(&region->num_claimed, 1, __ATOMIC_ACQ_REL);
+	if (idx >= TENANT_MAX) {
+		fprintf(stderr, "More than %d tenants\n", TENANT_MAX);
+		return 1;
+	}
+
+	slot = &region->slots[idx];
+	slot->pid = getpid();
+	slot->qprio = g_arbitration.tenant_qprio;
+	slot->tsc_rate = g_arbitration.tsc_rate;
+	slot->time_in_sec = g_arbitration.time_in_sec;
+	slot->env_init_tsc = g_arbitration.startup.env_init_tsc - g_arbitration.startup.start_tsc;
+	slot->attach_tsc = g_arbitration.startup.ctrlr_setup_tsc - g_arbitration.startup.env_init_tsc;
+	__atomic_store_n(&slot->state, TENANT_RUNNING, __ATOMIC_RELEASE);
+	g_arbitration.tenant_slot = slot;
+
+	return 0;
+}
+
+static void
+publish_tenant_stats(void)
+{
+	struct tenant_slot *slot = g_arbitration.tenant_slot;
+	struct tenant_ns_stats *ns;
+	struct worker_thread *worker;
+	struct worker_ns_ctx *ns_ctx;
+
+	slot->num_ns_ctx = 0;
+	TAILQ_FOREACH(worker, &g_workers, link) {
+		TAILQ_FOREACH(ns_ctx, &worker->ns_ctx, link) {
+			if (slot->num_ns_ctx == TENANT_MAX_NS_CTX) {
+				break;
+			}
+			ns = &slot->ns[slot->num_ns_ctx++];
+			snprintf(ns->name, sizeof(ns->name), "%s", ns_ctx->ns_entry->name);
+			ns->nsid = ns_ctx->ns_entry->nsid;
+			ns->lcore = worker->lcore;
+			ns->io_completed = ns_ctx->io_completed;
+			ns->data_bytes = (ns_ctx->op_stats[ARB_OP_READ].io_completed +
+							  ns_ctx->op_stats[ARB_OP_WRITE].io_completed) * g_arbitration.io_size_bytes;
+			ns->total_tsc = ns_ctx->stats.total_tsc;
+			ns->min_tsc = ns_ctx->stats.min_tsc;
+			ns->max_tsc = ns_ctx->stats.max_tsc;
+			ns->slo_met = ns_ctx->slo_stats.met;
+			ns->slo_missed = ns_ctx->slo_stats.missed;
+		}
+	}
+	__atomic_store_n(&slot->state, TENANT_DONE, __ATOMIC_RELEASE);
+}
+
+static int
+control_init(void)
+{
+	struct sockaddr_un addr = {};
+
+	if (strlen(g_control.path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "--control path %s is too long\n", g_control.path);
+		return 1;
+	}
+	addr.sun_family = AF_UNIX;
+	snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", g_control.path);
+
+	g_control.listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (g_control.listen_fd < 0) {
+		perror("control socket");
+		return 1;
+	}
+	// A socket left behind by an earlier run
+	unlink(g_control.path);
+	if (bind(g_control.listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+		listen(g_control.listen_fd, 1) != 0) {
+		perror("control socket");
+		close(g_control.listen_fd);
+		g_control.listen_fd = -1;
+		return 1;
+	}
+	g_control.start_ticks = arb_get_ticks();
+	printf("Control socket listening at %s\n", g_control.path);
+
+	return 0;
+}
+
+static void
+control_fini(void)
+{
+	if (g_control.client_fd >= 0) {
+		control_drop_client();
+	}
+	free(g_control.out);
+	g_control.out = NULL;
+	g_control.out_size = 0;
+	if (g_control.listen_fd >= 0) {
+		close(g_control.listen_fd);
+		g_control.listen_fd = -1;
+		unlink(g_control.path);
+	}
+}
+
+// Called from the loop of the main core, cheap until the next interval
+static void
+control_poll(void)
+{
+	struct ctrlr_entry *ctrlr_entry;
+	uint64_t now = spdk_get_ticks();
+	char *newline;
+	size_t line_len;
+	ssize_t n;
+	int fd;
+
+	if (g_control.listen_fd < 0 || now < g_control.next_poll_tsc) {
+		return;
+	}
+	g_control.next_poll_tsc = now + spdk_get_ticks_hz() * CONTROL_POLL_US / SECOND_TO_MICROSECOND;
+
+	// Controllers taking a new arbitration from set_arbitration
+	TAILQ_FOREACH(ctrlr_entry, &g_controllers, link) {
+		if (ctrlr_entry->ctrlr != NULL && ctrlr_entry->setup.state != CTRLR_SETUP_DONE) {
+			spdk_nvme_ctrlr_process_admin_completions(ctrlr_entry->ctrlr);
+		}
+	}
+
+	if (g_control.client_fd < 0) {
+		fd = accept4(g_control.listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0) {
+			return;
+		}
+		g_control.client_fd = fd;
+		g_control.len = 0;
+	}
+
+	// The next requests wait until the client took the earlier replies
+	if (g_control.out_len != 0) {
+		if (control_flush() != 0) {
+			control_drop_client();
+			return;
+		}
+		if (g_control.out_len != 0) {
+			return;
+		}
+	}
+
+	n = recv(g_control.client_fd, g_control.buf + g_control.len,
+			 sizeof(g_control.buf) - 1 - g_control.len, 0);
+	if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+		control_drop_client();
+		return;
+	}
+	if (n > 0) {
+		g_control.len += n;
+	}
+
+	while (g_control.client_fd >= 0 &&
+		   (newline = memchr(g_control.buf, '\n', g_control.len)) != NULL) {
+		line_len = newline - g_control.buf;
+		control_handle(g_control.buf, line_len);
+		g_control.len -= line_len + 1;
+		memmove(g_control.buf, newline + 1, g_control.len);
+	}
+	if (g_control.client_fd >= 0 && g_control.len == sizeof(g_control.buf) - 1) {
+		control_reply_error(NULL, -32600, "Request too long");
+		g_control.len = 0;
+	}
+}
+
+static const struct spdk_json_object_decoder g_control_request_decoders[] = {
+	{"jsonrpc", offsetof(struct control_request, jsonrpc), control_decode_val, true},
+	{"method", offsetof(struct control_request, method), control_decode_val},
+	{"params", offsetof(struct control_request, params), control_decode_val, true},
+	{"id", offsetof(struct control_request, id), control_decode_val, true},
+};
+
+static const struct spdk_json_object_decoder g_control_params_decoders[] = {
+	{"class", offsetof(struct control_params, class_name), control_decode_val, true},
+	{"burst", offsetof(struct control_params, burst), spdk_json_decode_int32, true},
+	{"high", offsetof(struct control_params, high), spdk_json_decode_int32, true},
+	{"medium", offsetof(struct control_params, medium), spdk_json_decode_int32, true},
+	{"low", offsetof(struct control_params, low), spdk_json_decode_int32, true},
+	{"queue_depth", offsetof(struct control_params, queue_depth), spdk_json_decode_int32, true},
+	{"iops", offsetof(struct control_params, iops), spdk_json_decode_int32, true},
+	{"bw", offsetof(struct control_params, bw), spdk_json_decode_int32, true},
+	{"qos_burst", offsetof(struct control_params, qos_burst), spdk_json_decode_int32, true},
+};
+
+// The line is parsed in place and stays valid while the request is handled
+static void
+control_handle(char *line, size_t len)
+{
+	struct spdk_json_val values[CONTROL_MAX_VALUES];
+	struct control_request req = {};
+	ssize_t num_values;
+
+	if (len == 0) {
+		return;
+	}
+	num_values = spdk_json_parse(line, len, values, CONTROL_MAX_VALUES, NULL,
+								 SPDK_JSON_PARSE_FLAG_DECODE_IN_PLACE);
+	if (num_values <= 0 || spdk_json_decode_object(values, g_control_request_decoders,
+			SPDK_COUNTOF(g_control_request_decoders), &req) != 0) {
+		control_reply_error(NULL, -32700, "Parse error");
+		return;
+	}
+
+	if (spdk_json_strequal(req.method, "get_stats")) {
+		control_get_stats(&req);
+	} else if (spdk_json_strequal(req.method, "set_arbitration")) {
+		control_set_arbitration(&req);
+	} else if (spdk_json_strequal(req.method, "set_class")) {
+		control_set_class(&req);
+	} else if (spdk_json_strequal(req.method, "pause_class")) {
+		control_pause_class(&req, true);
+	} else if (spdk_json_strequal(req.method, "resume_class")) {
+		control_pause_class(&req, false);
+	} else {
+		control_reply_error(&req, -32601, "Method not found");
+	}
+}
+
+// Keeps the value itself, decoded once the method is known
+static int
+control_decode_val(const struct spdk_json_val *val, void *out)
+{
+	*(const struct spdk_json_val **)out = val;
+	return 0;
+}
+
+// Replies are small, a client which stops reading stalls the main core
+static int
+control_write_cb(void *cb_ctx, const void *data, size_t size)
+{
+	size_t out_size = spdk_max(g_control.out_size, CONTROL_BUF_SIZE);
+	char *out;
+
+	(void)cb_ctx;
+	if (g_control.out_len + size > CONTROL_OUT_MAX) {
+		return -1;
+	}
+	if (g_control.out_len + size > g_control.out_size) {
+		while (out_size < g_control.out_len + size) {
+			out_size *= 2;
+		}
+		out = realloc(g_control.out, out_size);
+		if (out == NULL) {
+			return -1;
+		}
+		g_control.out = out;
+		g_control.out_size = out_size;
+	}
+	memcpy(g_control.out + g_control.out_len, data, size);
+	g_control.out_len += size;
+
+	return 0;
+}
+
+// Sends what the socket takes without blocking, the rest stays queued
+static int
+control_flush(void)
+{
+	size_t sent = 0;
+	ssize_t n;
+
+	while (sent < g_control.out_len) {
+		n = send(g_control.client_fd, g_control.out + sent, g_control.out_len - sent, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				break;
+			}
+			return -1;
+		}
+		sent += n;
+	}
+	g_control.out_len -= sent;
+	memmove(g_control.out, g_control.out + sent, g_control.out_len);
+
+	return 0;
+}
+
+static void
+control_drop_client(void)
+{
+	close(g_control.client_fd);
+	g_control.client_fd = -1;
+	g_control.len = 0;
+	g_control.out_len = 0;
+}
+
+static struct spdk_json_write_ctx *
+control_reply_begin(const struct control_request *req)
+{
+	struct spdk_json_write_ctx *w;
+
+	w = spdk_json_write_begin(control_write_cb, NULL, 0);
+	if (w == NULL) {
+		return NULL;
+	}
+	spdk_json_write_object_begin(w);
+	spdk_json_write_named_string(w, "jsonrpc", "2.0");
+	spdk_json_write_name(w, "id");
+	if (req != NULL && req->id != NULL) {
+		spdk_json_write_val(w, req->id);
+	} else {
+		spdk_json_write_null(w);
+	}
+
+	return w;
+}
+
+static void
+control_reply_end(struct spdk_json_write_ctx *w)
+{
+	spdk_json_write_object_end(w);
+	if (spdk_json_write_end(w) != 0 || control_write_cb(NULL, "\n", 1) != 0 ||
+		control_flush() != 0) {
+		control_drop_client();
+	}
+}
+
+static void
+control_reply_error(const struct control_request *req, int code, const char *msg)
+{
+	struct spdk_json_write_ctx *w = control_reply_begin(req);
+
+	if (w == NULL) {
+		return;
+	}
+	spdk_json_write_named_object_begin(w, "error");
+	spdk_json_write_named_int32(w, "code", code);
+	spdk_json_write_named_string(w, "message", msg);
+	spdk_json_write_object_end(w);
+	control_reply_end(w);
+}
+
+// Replies with an error itself, qprio is only looked up when given
+static int
+control_decode_params(const struct control_request *req, struct control_params *params,
+					  enum spdk_nvme_qprio *qprio)
+{
+	params->class_name = NULL;
+	params->burst = params->high = params->medium = params->low = -1;
+	params->queue_depth = params->iops = params->bw = params->qos_burst = -1;
+
+	if (req->params != NULL && spdk_json_decode_object(req->params, g_control_params_decoders,
+			SPDK_COUNTOF(g_control_params_decoders), params) != 0) {
+		control_reply_error(req, -32602, "Invalid params");
+		return 1;
+	}
+	// -1 is the same as leaving a parameter out
+	if (params->burst < -1 || params->high < -1 || params->medium < -1 || params->low < -1 ||
+		params->queue_depth < -1 || params->iops < -1 || params->bw < -1 || params->qos_burst < -1) {
+		control_reply_error(req, -32602, "Parameters must not be negative");
+		return 1;
+	}
+	if (qprio == NULL) {
+		return 0;
+	}
+
+	for (int i = 0; i < SPDK_NVME_QPRIO_MAX; i++) {
+		if (params->class_name != NULL && spdk_json_strequal(params->class_name, g_qprio_names[i])) {
+			*qprio = i;
+			return 0;
+		}
+	}
+	control_reply_error(req, -32602, "class must be one of (urgent, high, medium, low)");
+	return 1;
+}
+
+static void
+control_get_stats(const struct control_request *req)
+{
+	const struct class_config *cfg;
+	struct spdk_json_write_ctx *w;
+	struct ctrlr_entry *ctrlr_entry;
+	struct worker_thread *worker;
+	struct worker_ns_ctx *ns_ctx;
+	uint64_t io_completed, data_ios, queue_depth, deferred;
+	uint32_t num_ns_ctx, num_paused;
+	const char *state;
+
+	w = control_reply_begin(req);
+	if (w == NULL) {
+		return;
+	}
+	spdk_json_write_named_object_begin(w, "result");
+	spdk_json_write_named_double(w, "elapsed_s", (double)(arb_get_ticks() - g_control.start_ticks) /
+								 g_arbitration.tsc_rate);
+
+	// Counters belong to the workers, they are read while being updated
+	spdk_json_write_named_array_begin(w, "classes");
+	for (int i = 0; i < SPDK_NVME_QPRIO_MAX; i++) {
+		cfg = &g_arbitration.classes[i];
+		io_completed = data_ios = queue_depth = deferred = 0;
+		num_ns_ctx = num_paused = 0;
+		TAILQ_FOREACH(worker, &g_workers, link) {
+			TAILQ_FOREACH(ns_ctx, &worker->ns_ctx, link) {
+				if (ns_ctx->qprio != (enum spdk_nvme_qprio)i) {
+					continue;
+				}
+				io_completed += __atomic_load_n(&ns_ctx->io_completed, __ATOMIC_RELAXED);
+				data_ios += __atomic_load_n(&ns_ctx->op_stats[ARB_OP_READ].io_completed, __ATOMIC_RELAXED) +
+							__atomic_load_n(&ns_ctx->op_stats[ARB_OP_WRITE].io_completed, __ATOMIC_RELAXED);
+				queue_depth += __atomic_load_n(&ns_ctx->queue_depth, __ATOMIC_RELAXED);
+				deferred += __atomic_load_n(&ns_ctx->qos_stats.deferred_ios, __ATOMIC_RELAXED);
+				num_paused += __atomic_load_n(&ns_ctx->paused, __ATOMIC_RELAXED);
+				num_ns_ctx++;
+			}
+		}
+		if (num_ns_ctx == 0) {
+			continue;
+		}
+		spdk_json_write_object_begin(w);
+		spdk_json_write_named_string(w, "class", g_qprio_names[i]);
+		spdk_json_write_named_uint32(w, "namespaces", num_ns_ctx);
+		spdk_json_write_named_bool(w, "paused", num_paused == num_ns_ctx);
+		spdk_json_write_named_uint64(w, "queue_depth", queue_depth);
+		spdk_json_write_named_uint64(w, "io_completed", io_completed);
+		spdk_json_write_named_uint64(w, "bytes", data_ios * g_arbitration.io_size_bytes);
+		spdk_json_write_named_uint64(w, "iops_cap", cfg->iops_limit);
+		spdk_json_write_named_uint64(w, "bw_cap_mib", cfg->bw_limit_bytes / (1024 * 1024));
+		spdk_json_write_named_uint64(w, "deferred_ios", deferred);
+		spdk_json_write_object_end(w);
+	}
+	spdk_json_write_array_end(w);
+
+	spdk_json_write_named_array_begin(w, "controllers");
+	TAILQ_FOREACH(ctrlr_entry, &g_controllers, link) {
+		if (ctrlr_entry->ctrlr == NULL) {
+			state = "backend";
+		} else if (!ctrlr_entry->wrr_enabled) {
+			state = "no device WRR";
+		} else if (ctrlr_entry->setup.state != CTRLR_SETUP_DONE) {
+			state = "applying";
+		} else if (ctrlr_entry->setup.after_valid &&
+				   arb_feature_matches(&ctrlr_entry->arb, ctrlr_entry->setup.arb_after)) {
+			state = "verified";
+		} else {
+			state = "differs";
+		}
+		spdk_json_write_object_begin(w);
+		spdk_json_write_named_string(w, "name", ctrlr_entry->name);
+		spdk_json_write_named_uint32(w, "burst", ctrlr_entry->arb.burst);
+		spdk_json_write_named_uint32(w, "high", ctrlr_entry->arb.high_priority_weight);
+		spdk_json_write_named_uint32(w, "medium", ctrlr_entry->arb.medium_priority_weight);
+		spdk_json_write_named_uint32(w, "low", ctrlr_entry->arb.low_priority_weight);
+		spdk_json_write_named_string(w, "arbitration", state);
+		spdk_json_write_object_end(w);
+	}
+	spdk_json_write_array_end(w);
+
+	spdk_json_write_object_end(w);
+	control_reply_end(w);
+}
+
+// Applies to every controller, --arb-rule only chooses the values at attach
+static void
+control_set_arbitration(const struct control_request *req)
+{
+	struct control_params params;
+	struct spdk_json_write_ctx *w;
+	struct ctrlr_entry *ctrlr_entry;
+	struct worker_thread *worker;
+	struct worker_msg msg = { .type = WORKER_MSG_QUEUE_DEPTH, .queue_depth = 0 };
+	uint32_t weights[SPDK_NVME_QPRIO_MAX] = {};
+	uint32_t num_applying = 0;
+
+	if (control_decode_params(req, &params, NULL) != 0) {
+		return;
+	}
+	if (params.burst > SPDK_NVME_ARBITRATION_BURST_UNLIMITED || params.high == 0 || params.high > 255 ||
+		params.medium == 0 || params.medium > 255 || params.low == 0 || params.low > 255) {
+		control_reply_error(req, -32602, "burst must be from 0 to 7 and weights from 1 to 255");
+		return;
+	}
+	TAILQ_FOREACH(ctrlr_entry, &g_controllers, link) {
+		if (ctrlr_entry->ctrlr != NULL && ctrlr_entry->setup.state != CTRLR_SETUP_DONE) {
+			control_reply_error(req, -32000, "An earlier arbitration change is still being applied");
+			return;
+		}
+	}
+	if (g_backend != &g_nvme_backend && g_backend->set_arbitration == NULL) {
+		control_reply_error(req, -32000, "The backend cannot change its arbitration");
+		return;
+	}
+
+	TAILQ_FOREACH(ctrlr_entry, &g_controllers, link) {
+		if (params.burst >= 0) {
+			ctrlr_entry->arb.burst = params.burst;
+		}
+		if (params.high > 0) {
+			ctrlr_entry->arb.high_priority_weight = params.high;
+		}
+		if (params.medium > 0) {
+			ctrlr_entry->arb.medium_priority_weight = params.medium;
+		}
+		if (params.low > 0) {
+			ctrlr_entry->arb.low_priority_weight = params.low;
+		}
+		if (ctrlr_entry->ctrlr == NULL) {
+			weights[SPDK_NVME_QPRIO_HIGH] = ctrlr_entry->arb.high_priority_weight;
+			weights[SPDK_NVME_QPRIO_MEDIUM] = ctrlr_entry->arb.medium_priority_weight;
+			weights[SPDK_NVME_QPRIO_LOW] = ctrlr_entry->arb.low_priority_weight;
+			g_backend->set_arbitration(ctrlr_entry->arb.burst, weights);
+		} else if (ctrlr_entry->wrr_enabled) {
+			// Set, read back and time the admin queue again, completed in control_poll()
+			ctrlr_entry->setup.state = CTRLR_SETUP_SET_ARB;
+			ctrlr_entry->setup.after_valid = false;
+			ctrlr_entry->setup.rtt_probes = 0;
+			ctrlr_entry->setup.attach_tsc = spdk_get_ticks();
+			ctrlr_entry->admin_rtt_tsc = UINT64_MAX;
+			ctrlr_setup_submit(ctrlr_entry);
+			num_applying++;
+		}
+	}
+
+	// Depths of --host-wrr follow the weights
+	if (g_arbitration.host_wrr) {
+		TAILQ_FOREACH(worker, &g_workers, link) {
+			if (worker_post(worker, &msg) != 0) {
+				control_reply_error(req, -32000, "Worker mailbox full");
+				return;
+			}
+		}
+	}
+
+	w = control_reply_begin(req);
+	if (w == NULL) {
+		return;
+	}
+	spdk_json_write_named_object_begin(w, "result");
+	spdk_json_write_named_uint32(w, "controllers_applying", num_applying);
+	spdk_json_write_object_end(w);
+	control_reply_end(w);
+}
+
+static void
+control_set_class(const struct control_request *req)
+{
+	struct control_params params;
+	struct class_config *cfg;
+	struct spdk_json_write_ctx *w;
+	struct worker_msg msg = {};
+	enum spdk_nvme_qprio qprio;
+
+	if (control_decode_params(req, &params, &qprio) != 0) {
+		return;
+	}
+	if (params.queue_depth == 0 || params.queue_depth > g_arbitration.io_queue_depth) {
+		control_reply_error(req, -32602, "queue_depth must be from 1 to -d");
+		return;
+	}
+	if (params.qos_burst == 0) {
+		control_reply_error(req, -32602, "qos_burst must be at least 1");
+		return;
+	}
+
+	cfg = &g_arbitration.classes[qprio];
+	if (params.iops >= 0 || params.bw >= 0 || params.qos_burst > 0) {
+		if (params.iops >= 0) {
+			cfg->iops_limit = params.iops;
+		}
+		if (params.bw >= 0) {
+			cfg->bw_limit_bytes = (uint64_t)params.bw * 1024 * 1024;
+		}
+		if (params.qos_burst > 0) {
+			cfg->qos_burst = params.qos_burst;
+		}
+		// Workers of the class only switch over to the shared buckets
+		if (cfg->qos_shared) {
+			qos_buckets_init(&g_class_qos[qprio], cfg);
+		}
+		msg.type = WORKER_MSG_QOS;
+		if (post_class_msg(qprio, &msg) != 0) {
+			control_reply_error(req, -32000, "Worker mailbox full");
+			return;
+		}
+	}
+	if (params.queue_depth > 0) {
+		msg.type = WORKER_MSG_QUEUE_DEPTH;
+		msg.queue_depth = params.queue_depth;
+		if (post_class_msg(qprio, &msg) != 0) {
+			control_reply_error(req, -32000, "Worker mailbox full");
+			return;
+		}
+	}
+
+	w = control_reply_begin(req);
+	if (w == NULL) {
+		return;
+	}
+	spdk_json_write_named_bool(w, "result", true);
+	control_reply_end(w);
+}
+
+static void
+control_pause_class(const struct control_request *req, bool pause)
+{
+	struct control_params params;
+	struct spdk_json_write_ctx *w;
+	struct worker_msg msg = { .type = pause ? WORKER_MSG_PAUSE : WORKER_MSG_RESUME };
+	enum spdk_nvme_qprio qprio;
+
+	if (control_decode_params(req, &params, &qprio) != 0) {
+		return;
+	}
+	if (post_class_msg(qprio, &msg) != 0) {
+		control_reply_error(req, -32000, "Worker mailbox full");
+		return;
+	}
+
+	w = control_reply_begin(req);
+	if (w == NULL) {
+		return;
+	}
+	spdk_json_write_named_bool(w, "result", true);
+	control_reply_end(w);
+}
+
+static int
+post_class_msg(enum spdk_nvme_qprio qprio, const struct worker_msg *msg)
+{
+	struct worker_thread *worker;
+
+	TAILQ_FOREACH(worker, &g_workers, link) {
+		if (worker->qprio == qprio && worker_post(worker, msg) != 0) {
+			return -EBUSY;
+		}
+	}
+	return 0;
+}
+
+// The file is sized for every namespace of every worker before the run,
+// a reader maps it once and never sees it grow
+static int
+telemetry_init(void)
+{
+	struct worker_thread *worker;
+	struct worker_ns_ctx *ns_ctx;
+	struct telemetry_header *header;
+	struct telemetry_slot *slot;
+	uint32_t num_slots = 0;
+	size_t size;
+	int fd;
+
+	TAILQ_FOREACH(worker, &g_workers, link) {
+		TAILQ_FOREACH(ns_ctx, &worker->ns_ctx, link) {
+			num_slots++;
+		}
+	}
+	size = sizeof(struct telemetry_header) + num_slots * sizeof(struct telemetry_slot);
+
+	fd = open(g_telemetry.path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		perror("telemetry open");
+		return 1;
+	}
+	if (ftruncate(fd, size) != 0) {
+		perror("telemetry size");
+		close(fd);
+		return 1;
+	}
+	header = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (header == MAP_FAILED) {
+		perror("telemetry map");
+		return 1;
+	}
+
+	header->magic = TELEMETRY_MAGIC;
+	header->version = TELEMETRY_VERSION;
+	header->header_size = sizeof(struct telemetry_header);
+	header->slot_size = sizeof(struct telemetry_slot);
+	header->num_slots = num_slots;
+	header->hist_sub_bits = TELEMETRY_HIST_SUB_BITS;
+	header->hist_buckets = TELEMETRY_HIST_BUCKETS;
+	header->ticks_hz = g_arbitration.tsc_rate;
+	header->start_time = (uint64_t)time(NULL);
+	header->pid = getpid();
+
+	slot = (struct telemetry_slot *)(header + 1);
+	TAILQ_FOREACH(worker, &g_workers, link) {
+		TAILQ_FOREACH(ns_ctx, &worker->ns_ctx, link) {
+			snprintf(slot->name, sizeof(slot->name), "%s", ns_ctx->ns_entry->name);
+			slot->qprio = worker->qprio;
+			slot->lcore = worker->lcore;
+			slot->nsid = ns_ctx->ns_entry->nsid;
+			ns_ctx->telemetry = slot++;
+		}
+	}
+
+	// Readers check the state last, everything above is visible by then
+	__atomic_store_n(&header->state, TELEMETRY_STATE_RUNNING, __ATOMIC_RELEASE);
+	g_telemetry.header = header;
+	g_telemetry.size = size;
+	printf("Telemetry published to %s\n", g_telemetry.path);
+
+	return 0;
+}
+
+static void
+telemetry_fini(void)
+{
+	if (g_telemetry.header == NULL) {
+		return;
+	}
+	// The file stays behind with the final counters
+	__atomic_store_n(&g_telemetry.header->state, TELEMETRY_STATE_FINISHED, __ATOMIC_RELEASE);
+	munmap(g_telemetry.header, g_telemetry.size);
+	g_telemetry.header = NULL;
+}
+
+// Stores into the slot of this worker only, no syscall, no atomic
+// read-modify-write. The release fences order the stores for a reader on
+// another core, on x86 they only keep the compiler from reordering.
+static void
+telemetry_record(struct worker_ns_ctx *ns_ctx, const struct arb_task *task, uint64_t now,
+				 uint64_t tsc_diff)
+{
+	struct telemetry_slot *slot = ns_ctx->telemetry;
+	uint64_t seq = slot->seq;
+
+	__atomic_store_n(&slot->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	slot->io_completed++;
+	if (task->cmd.op == ARB_OP_READ) {
+		slot->read_ios++;
+		slot->bytes += (uint64_t)task->cmd.lba_count * ns_ctx->ns_entry->block_size;
+	} else if (task->cmd.op == ARB_OP_WRITE) {
+		slot->write_ios++;
+		slot->bytes += (uint64_t)task->cmd.lba_count * ns_ctx->ns_entry->block_size;
+	}
+	slot->latency_ticks += tsc_diff;
+	if (task->deadline_tsc != UINT64_MAX && now > task->deadline_tsc) {
+		slot->slo_missed++;
+	}
+	slot->last_tick = now;
+	slot->hist[telemetry_hist_bucket(tsc_diff)]++;
+
+	__atomic_store_n(&slot->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+static void
+cleanup_ns_worker_ctx(struct worker_ns_ctx *ns_ctx)
+{
+	for (uint32_t i = 0; i < ns_ctx->num_qpairs; i++) {
+		g_backend->qpair_free(ns_ctx->qpairs[i]);
+	}
+}
+
+static void
+cleanup(uint32_t task_count)
+{
+	struct worker_thread *worker, *tmp_worker;
+	struct worker_ns_ctx *ns_ctx, *tmp_ns_ctx;
+	struct ns_entry *ns_entry, *tmp_ns_entry;
+	struct ctrlr_entry *ctrlr_entry, *tmp_ctrlr_entry;
+	struct trid_entry *trid_entry, *tmp_trid_entry;
+
+	// No pool when the run stopped before it or with --tenants
+	if (g_task_pool != NULL && spdk_mempool_count(g_task_pool) != (size_t)task_count) {
+		fprintf(stderr, "task_pool count is %zu but should be %u\n", 
+				spdk_mempool_count(g_task_pool), task_count);
+	}
+	spdk_mempool_free(g_task_pool);
+
+	TAILQ_FOREACH_SAFE(worker, &g_workers, link, tmp_worker) {
+		TAILQ_REMOVE(&g_workers, worker, link);
+
+		/* ns_worker_ctx is a list in the worker */
+		TAILQ_FOREACH_SAFE(ns_ctx, &worker->ns_ctx, link, tmp_ns_ctx) {
+			TAILQ_REMOVE(&worker->ns_ctx, ns_ctx, link);
+			free(ns_ctx->stages);
+			free(ns_ctx);
+		}
+
+		free(worker);
+	};
+	if (g_edf.heap != NULL) {
+		pthread_spin_destroy(&g_edf.lock);
+		free(g_edf.heap);
+		g_edf.heap = NULL;
+	}
+
+	TAILQ_FOREACH_SAFE(ns_entry, &g_namespaces, link, tmp_ns_entry) {
+		TAILQ_REMOVE(&g_namespaces, ns_entry, link);
+		free(ns_entry->gen_map);
+		free(ns_entry);
+	};
+
+	g_backend->detach();
+
+	TAILQ_FOREACH_SAFE(ctrlr_entry, &g_controllers, link, tmp_ctrlr_entry) {
+		TAILQ_REMOVE(&g_controllers, ctrlr_entry, link);
+		free(ctrlr_entry);
+	}
+
+	TAILQ_FOREACH_SAFE(trid_entry, &g_trid_list, link, tmp_trid_entry) {
+		TAILQ_REMOVE(&g_trid_list, trid_entry, link);
+		free(trid_entry);
+	}
+}
+
+// Every class next to its caps, so that the latency the capped classes give
+// back to the others shows up in the same report
+static void
+print_qos_performance(void)
+{
+	const struct class_config *cfg;
+	struct worker_thread *worker;
+	struct worker_ns_ctx *ns_ctx;
+	uint64_t io_completed, data_ios, total_tsc, throttled_tsc, deferred_ios;
+	uint32_t num_ctx;
+	bool capped = false;
+
+	for (int i = 0; i < SPDK_NVME_QPRIO_MAX; i++) {
+		capped |= g_arbitration.classes[i].iops_limit != 0 || g_arbitration.classes[i].bw_limit_bytes != 0;
+	}
+	if (!capped) {
+		return;
+	}
+
+	printf("QoS, latency from issue, not counting the wait for tokens\n");
+	for (int i = 0; i < SPDK_NVME_QPRIO_MAX; i++) {
+		cfg = &g_arbitration.classes[i];
+		io_completed = data_ios = total_tsc = throttled_tsc = deferred_ios = 0;
+		num_ctx = 0;
+		TAILQ_FOREACH(worker, &g_workers, link) {
+			TAILQ_FOREACH(ns_ctx, &worker->ns_ctx, link) {
+				if (ns_ctx->qprio != (enum spdk_nvme_qprio)i) {
+					continue;
+				}
+				io_completed += ns_ctx->io_completed;
+				data_ios += ns_ctx->op_stats[ARB_OP_READ].io_completed +
+							ns_ctx->op_stats[ARB_OP_WRITE].io_completed;
+				total_tsc += ns_ctx->stats.total_tsc;
+				throttled_tsc += ns_ctx->qos_stats.throttled_tsc;
+				deferred_ios += ns_ctx->qos_stats.deferred_ios;
+				num_ctx++;
+			}
+		}
+		if (num_ctx == 0) {
+			continue;
+		}
+
+		printf("%-6s priority class: %10.2lf IO/s %8.2lf MiB/s  Latency average: %8.2f",
+			   g_qprio_names[i], (double)io_completed / g_arbitration.time_in_sec,
+			   (double)data_ios / g_arbitration.time_in_sec * g_arbitration.io_size_bytes / (1024 * 1024),
+			   io_completed ? (double)total_tsc / io_completed * SECOND_TO_MICROSECOND / g_arbitration.tsc_rate : 0);
+		if (cfg->iops_limit == 0 && cfg->bw_limit_bytes == 0) {
+			printf("  uncapped\n");
+			continue;
+		}
+		printf("\n%-22s cap", "");
+		if (cfg->iops_limit != 0) {
+			printf(" %" PRIu64 " IO/s", cfg->iops_limit);
+		}
+		if (cfg->bw_limit_bytes != 0) {
+			printf(" %" PRIu64 " MiB/s", cfg->bw_limit_bytes / (1024 * 1024));
+		}
+		printf(" %s, throttled %.1f%% of the run, %" PRIu64 " deferred submissions\n",
+			   cfg->qos_shared ? "shared by the class" : "per namespace and worker",
+			   (double)throttled_tsc * 100 / num_ctx / ((double)g_arbitration.time_in_sec * g_arbitration.tsc_rate),
+			   deferred_ios);
+	}
+	printf("========================================================\n");
+}
+
+// Rerun with or without --edf to compare the host scheduler against the
+// device arbitration alone at the same offered load
+static void
+print_slo_performance(void)
+{
+	const struct class_config *cfg;
+	struct worker_thread *worker;
+	struct worker_ns_ctx *ns_ctx;
+	uint64_t met, missed, late_tsc;
+	bool has_slo = false;
+
+	for (int i = 0; i < SPDK_NVME_QPRIO_MAX; i++) {
+		for (int op = 0; op < ARB_OP_COUNT; op++) {
+			has_slo |= g_arbitration.classes[i].slo_us[op] != 0;
+		}
+	}
+	if (!has_slo) {
+		return;
+	}
+
+	if (g_arbitration.edf_inflight != 0) {
+		printf("Deadlines, host EDF with %u commands of all classes in flight\n", g_arbitration.edf_inflight);
+	} else {
+		printf("Deadlines, device arbitration only\n");
+	}
+	for (int i = 0; i < SPDK_NVME_QPRIO_MAX; i++) {
+		cfg = &g_arbitration.classes[i];
+		met = missed = late_tsc = 0;
+		TAILQ_FOREACH(worker, &g_workers, link) {
+			TAILQ_FOREACH(ns_ctx, &worker->ns_ctx, link) {
+				if (ns_ctx->qprio == (enum spdk_nvme_qprio)i) {
+					met += ns_ctx->slo_stats.met;
+					missed += ns_ctx->slo_stats.missed;
+					late_tsc += ns_ctx->slo_stats.late_tsc;
+				}
+			}
+		}
+		if (met + missed == 0) {
+			continue;
+		}
+
+		printf("%-6s priority class: SLO", g_qprio_names[i]);
+		for (int op = 0; op < ARB_OP_COUNT; op++) {
+			if (cfg->slo_us[op] != 0) {
+				printf(" %s %u us", g_op_keys[op], cfg->slo_us[op]);
+			}
+		}
+		printf(", missed %" PRIu64 " of %" PRIu64 " (%.2f%%), %.2f us late on average\n",
+			   missed, met + missed, (double)missed * 100 / (met + missed),
+			   missed ? (double)late_tsc / missed * SECOND_TO_MICROSECOND / g_arbitration.tsc_rate : 0);
+	}
+	printf("========================================================\n");
+}
+
+// The throughput and latency cost shows against a run with --pi off, the
+// CPU cost of host generation and checking is counted here
+static void
+print_pi_performance(void)
+{
+	struct worker_thread *worker;
+	struct worker_ns_ctx *ns_ctx;
+	uint64_t generated, checked, host_errors, device_errors, total_tsc;
+
+	if (g_arbitration.pi_mode == ARB_PI_OFF) {
+		return;
+	}
+
+	printf("Protection information, %s\n",
+		   g_arbitration.pi_mode == ARB_PI_PRACT ? "inserted and stripped by the controller" :
+		   "generated and checked by the host");
+	for (int i = 0; i < SPDK_NVME_QPRIO_MAX; i++) {
+		generated = checked = host_errors = device_errors = total_tsc = 0;
+		TAILQ_FOREACH(worker, &g_workers, link) {
+			TAILQ_FOREACH(ns_ctx, &worker->ns_ctx, link) {
+				if (ns_ctx->qprio == (enum spdk_nvme_qprio)i) {
+					generated += ns_ctx->pi.generated;
+					checked += ns_ctx->pi.checked;
+					host_errors += ns_ctx->pi.host_errors;
+					device_errors += ns_ctx->pi.device_errors;
+					total_tsc += ns_ctx->pi.total_tsc;
+				}
+			}
+		}
+		if (generated + checked + device_errors == 0) {
+			continue;
+		}
+
+		printf("%-6s priority class: generated %" PRIu64 ", checked %" PRIu64
+			   ", %.1f cycles/IO (%.2f us), errors %" PRIu64 " host %" PRIu64 " device\n",
+			   g_qprio_names[i], generated, checked,
+			   generated + checked ? (double)total_tsc / (generated + checked) : 0,
+			   generated + checked ? (double)total_tsc / (generated + checked) *
+			   SECOND_TO_MICROSECOND / spdk_get_ticks_hz() : 0,
+			   host_errors, device_errors);
+	}
+	printf("========================================================\n");
+}
+
+static void
+stage_record(struct stage_hist *hist, uint64_t tsc)
+{
+	hist->count++;
+	hist->total_tsc += tsc;
+	hist->max_tsc = spdk_max(hist->max_tsc, tsc);
+	hist->buckets[telemetry_hist_bucket(tsc)]++;
+}
+
+// Upper bound of the bucket holding the quantile, off by 1/16 at most
+static uint64_t
+stage_hist_quantile(const struct stage_hist *hist, double quantile)
+{
+	uint64_t rank = spdk_max((uint64_t)(quantile * hist->count), 1);
+	uint64_t count = 0;
+	uint32_t bucket;
+
+	for (bucket = 0; bucket < TELEMETRY_HIST_BUCKETS - 1; bucket++) {
+		count += hist->buckets[bucket];
+		if (count >= rank) {
+			break;
+		}
+	}
+
+	return spdk_min(telemetry_hist_lower(bucket + 1), hist->max_tsc);
+}
+
+static void
+print_stage_performance(void)
+{
+	static const char *stage_names[ARB_STAGE_COUNT] = {
+		[ARB_STAGE_SUBMIT]		= "submit",
+		[ARB_STAGE_DEVICE]		= "device",
+		[ARB_STAGE_REAP]		= "reap",
+		[ARB_STAGE_CALLBACK]	= "callback",
+		[ARB_STAGE_POLL_GAP]	= "poll gap",
+	};
+	struct worker_thread *worker;
+	struct worker_ns_ctx *ns_ctx;
+	struct stage_hist *class_hist, *hist;
+	double ticks_per_us = (double)g_arbitration.tsc_rate / SECOND_TO_MICROSECOND;
+
+	if (!g_arbitration.stages) {
+		return;
+	}
+	class_hist = calloc(ARB_STAGE_COUNT, sizeof(*class_hist));
+	if (class_hist == NULL) {
+		return;
+	}
+
+	printf("Latency stages in us, device includes up to one poll gap of the worker\n");
+	for (int i = 0; i < SPDK_NVME_QPRIO_MAX; i++) {
+		memset(class_hist, 0, ARB_STAGE_COUNT * sizeof(*class_hist));
+		TAILQ_FOREACH(worker, &g_workers, link) {
+			TAILQ_FOREACH(ns_ctx, &worker->ns_ctx, link) {
+				if (ns_ctx->qprio != (enum spdk_nvme_qprio)i || ns_ctx->stages == NULL) {
+					continue;
+				}
+				for (int stage = 0; stage < ARB_STAGE_COUNT; stage++) {
+					hist = &ns_ctx->stages->hist[stage];
+					class_hist[stage].count += hist->count;
+					class_hist[stage].total_tsc += hist->total_tsc;
+					class_hist[stage].max_tsc = spdk_max(class_hist[stage].max_tsc, hist->max_tsc);
+					for (int b = 0; b < TELEMETRY_HIST_BUCKETS; b++) {
+						class_hist[stage].buckets[b] += hist->buckets[b];
+					}
+				}
+			}
+		}
+		if (class_hist[ARB_STAGE_SUBMIT].count == 0) {
+			continue;
+		}
+
+		printf("%-6s priority class: %-8s %10s %10s %10s %10s %10s\n", g_qprio_names[i], "stage",
+			   "average", "p50", "p99", "p99.9", "max");
+		for (int stage = 0; stage < ARB_STAGE_COUNT; stage++) {
+			hist = &class_hist[stage];
+			if (hist->count == 0) {
+				continue;
+			}
+			printf("%-22s %-8s %10.2f %10.2f %10.2f %10.2f %10.2f\n", "", stage_names[stage],
+				   (double)hist->total_tsc / hist->count / ticks_per_us,
+				   stage_hist_quantile(hist, 0.5) / ticks_per_us,
+				   stage_hist_quantile(hist, 0.99) / ticks_per_us,
+				   stage_hist_quantile(hist, 0.999) / ticks_per_us,
+				   hist->max_tsc / ticks_per_us);
+		}
+	}
+	printf("========================================================\n");
+	free(class_hist);
+}
+
+// Cycles a worker spends per I/O, without the empty polls a busier core
+// would not make, give the cores a class needs for a rate at this I/O size
+static void
+print_cpu_performance(void)
+{
+	struct worker_thread *worker;
+	struct worker_ns_ctx *ns_ctx;
+	const struct worker_cpu_stats *cpu;
+	uint64_t total_tsc, used_tsc, submit_tsc;
+	double cycles_per_io;
+
+	printf("CPU of the workers in TSC cycles, %u byte I/O%s\n", g_arbitration.io_size_bytes,
+		   g_backend->get_ticks != NULL ? ", all of them take turns on the main core" : "");
+	TAILQ_FOREACH(worker, &g_workers, link) {
+		cpu = &worker->cpu;
+		total_tsc = cpu->busy_poll_tsc + cpu->empty_poll_tsc + cpu->loop_tsc;
+		if (cpu->polls == 0 || total_tsc == 0) {
+			continue;
+		}
+		submit_tsc = 0;
+		TAILQ_FOREACH(ns_ctx, &worker->ns_ctx, link) {
+			submit_tsc += ns_ctx->stats.submit_call_tsc;
+		}
+		used_tsc = total_tsc - cpu->empty_poll_tsc;
+		cycles_per_io = cpu->completions ? (double)used_tsc / cpu->completions : 0;
+
+		printf("Core %-3u %-6s: %12" PRIu64 " polls %6.2f%% empty %6.2f completions/busy poll "
+			   "%10.2f IO/Mcycle %10.2f cycles/IO %8.3f cores/MIOPS\n",
+			   worker->lcore, g_qprio_names[worker->qprio], cpu->polls,
+			   (double)cpu->empty_polls * 100 / cpu->polls,
+			   cpu->polls > cpu->empty_polls ? (double)cpu->completions / (cpu->polls - cpu->empty_polls) : 0,
+			   (double)cpu->completions * 1000000 / total_tsc, cycles_per_io,
+			   cycles_per_io * 1000000 / spdk_get_ticks_hz());
+		printf("%-16s cycles: busy polls %6.2f%% (submit calls %6.2f%%), empty polls %6.2f%%, "
+			   "loop %6.2f%%\n", "",
+			   (double)cpu->busy_poll_tsc * 100 / total_tsc, (double)submit_tsc * 100 / total_tsc,
+			   (double)cpu->empty_poll_tsc * 100 / total_tsc, (double)cpu->loop_tsc * 100 / total_tsc);
+	}
+	printf("========================================================\n");
+}
+
+// What each worker took from the backend for data during the last run
+static void
+print_memory_usage(void)
+{
+	const struct worker_thread *worker;
+	uint64_t worker_bytes, total_bytes = 0, num_bufs;
+
+	printf("DMA memory taken by the pools of the workers in MiB, %u byte I/O at depth %u\n",
+		   g_arbitration.io_size_bytes, g_arbitration.io_queue_depth);
+	TAILQ_FOREACH(worker, &g_workers, link) {
+		num_bufs = 0;
+		for (int i = 0; i < BUF_POOL_CLASSES; i++) {
+			num_bufs += worker->bufs.allocated[i];
+		}
+		worker_bytes = 0;
+		for (int i = 0; i < WORKER_DMA_POOLS; i++) {
+			worker_bytes += worker->dma_bytes[i];
+		}
+		total_bytes += worker_bytes;
+		printf("Core %-3u %-6s: %10.2f payload pool %10.2f segments %10.2f private (%" PRIu64 " buffers) "
+			   "%10.2f read sink = %10.2f\n", worker->lcore, g_qprio_names[worker->qprio],
+			   (double)worker->dma_bytes[WORKER_DMA_PAYLOAD] / (1024 * 1024),
+			   (double)worker->dma_bytes[WORKER_DMA_SEGMENTS] / (1024 * 1024),
+			   (double)worker->dma_bytes[WORKER_DMA_BUFS] / (1024 * 1024), num_bufs,
+			   (double)worker->dma_bytes[WORKER_DMA_SINK] / (1024 * 1024),
+			   (double)worker_bytes / (1024 * 1024));
+	}
+	printf("Total of this run: %.2f MiB\n", (double)total_bytes / (1024 * 1024));
+	if (g_hugepages.total != 0) {
+		printf("System wide, all processes: hugepages in use at most %" PRIu64 " of %" PRIu64
+			   " (%.2f of %.2f MiB)\n", g_hugepages.max_used, g_hugepages.total,
+			   (double)g_hugepages.max_used * g_hugepages.page_kb / 1024,
+			   (double)g_hugepages.total * g_hugepages.page_kb / 1024);
+	}
+	printf("========================================================\n");
+}
+
+// Several workers may sample at once, the largest use wins
+static void
+sample_hugepages(void)
+{
+	uint64_t total = 0, free_pages = 0, page_kb = 0, used, max_used;
+	char line[128];
+	FILE *file;
+
+	if (g_arbitration.no_huge) {
+		return;
+	}
+	file = fopen("/proc/meminfo", "r");
+	if (file == NULL) {
+		return;
+	}
+	while (fgets(line, sizeof(line), file) != NULL) {
+		sscanf(line, "HugePages_Total: %" SCNu64, &total);
+		sscanf(line, "HugePages_Free: %" SCNu64, &free_pages);
+		sscanf(line, "Hugepagesize: %" SCNu64, &page_kb);
+	}
+	fclose(file);
+	if (total == 0 || page_kb == 0) {
+		return;
+	}
+
+	g_hugepages.total = total;
+	g_hugepages.page_kb = page_kb;
+	used = total - spdk_min(free_pages, total);
+	max_used = __atomic_load_n(&g_hugepages.max_used, __ATOMIC_RELAXED);
+	while (used > max_used &&
+		   !__atomic_compare_exchange_n(&g_hugepages.max_used, &max_used, used, false,
+										__ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+	}
+}
+
+static void
+reset_ns_ctx_stats(struct worker_ns_ctx *ns_ctx)
+{
+	ns_ctx->io_completed = 0;
+	memset(&ns_ctx->stats, 0, sizeof(ns_ctx->stats));
+	ns_ctx->stats.min_tsc = UINT64_MAX;
+	memset(ns_ctx->op_stats, 0, sizeof(ns_ctx->op_stats));
+	for (int i = 0; i < ARB_OP_COUNT; i++) {
+		ns_ctx->op_stats[i].min_tsc = UINT64_MAX;
+	}
+	memset(&ns_ctx->qos_stats, 0, sizeof(ns_ctx->qos_stats));
+	if (ns_ctx->qos_deferred != 0) {
+		ns_ctx->qos_stats.throttle_start_tsc = arb_get_ticks();
+	}
+	memset(&ns_ctx->slo_stats, 0, sizeof(ns_ctx->slo_stats));
+	memset(&ns_ctx->verify, 0, sizeof(ns_ctx->verify));
+	memset(&ns_ctx->pi, 0, sizeof(ns_ctx->pi));
+	if (ns_ctx->stages != NULL) {
+		memset(ns_ctx->stages->hist, 0, sizeof(ns_ctx->stages->hist));
+	}
+}
+
+// Between two --repeat runs, the workers are stopped
+static void
+reset_run_stats(void)
+{
+	struct worker_thread *worker;
+	struct worker_ns_ctx *ns_ctx;
+
+	TAILQ_FOREACH(worker, &g_workers, link) {
+		memset(&worker->cpu, 0, sizeof(worker->cpu));
+		TAILQ_FOREACH(ns_ctx, &worker->ns_ctx, link) {
+			reset_ns_ctx_stats(ns_ctx);
+			ns_ctx->is_draining = false;
+			ns_ctx->paused = false;
+		}
+	}
+}
+
+static void
+steady_state_start(void)
+{
+	uint32_t interval_s = g_steady.interval_s;
+	uint32_t window = g_steady.window;
+	uint32_t max_rounds = g_steady.max_rounds;
+
+	memset(&g_steady, 0, sizeof(g_steady));
+	g_steady.interval_s = interval_s;
+	g_steady.window = window;
+	g_steady.max_rounds = max_rounds;
+	g_steady.end_tsc = UINT64_MAX;
+}
+
+// Every interval, the IO/s and latency of each class over the interval
+// make a round. Once the last window of rounds is steady, or there were
+// too many, the workers start counting again and the -t measurement runs.
+static void
+steady_state_poll(void)
+{
+	struct worker_msg msg = {.type = WORKER_MSG_RESET_STATS};
+	struct worker_thread *worker;
+	struct worker_ns_ctx *ns_ctx;
+	uint64_t ios[SPDK_NVME_QPRIO_MAX] = {}, total_tsc[SPDK_NVME_QPRIO_MAX] = {};
+	bool active[SPDK_NVME_QPRIO_MAX] = {};
+	uint64_t now, delta_ios;
+	uint32_t slot, index;
+	bool steady = true;
+
+	if (g_steady.interval_s == 0 || g_steady.end_tsc != UINT64_MAX) {
+		return;
+	}
+	now = arb_get_ticks();
+	if (g_steady.reset_pending) {
+		goto post;
+	}
+	if (now < g_steady.next_sample_tsc) {
 		return;
 	}
 
-	entry = malloc(sizeof(struct ns_entry));
-	if (entry == NULL) {
-		perror("ns_entry malloc");
-		exit(1);
+	// Counters belong to the workers, they are read while being updated
+	TAILQ_FOREACH(worker, &g_workers, link) {
+		TAILQ_FOREACH(ns_ctx, &worker->ns_ctx, link) {
+			ios[ns_ctx->qprio] += __atomic_load_n(&ns_ctx->io_completed, __ATOMIC_RELAXED);
+			total_tsc[ns_ctx->qprio] += __atomic_load_n(&ns_ctx->stats.total_tsc, __ATOMIC_RELAXED);
+			active[ns_ctx->qprio] = true;
+		}
+	}
+	if (g_steady.next_sample_tsc != 0) {
+		slot = g_steady.rounds % STEADY_MAX_WINDOW;
+		printf("Steady state round %u:", g_steady.rounds + 1);
+		for (int i = 0; i < SPDK_NVME_QPRIO_MAX; i++) {
+			delta_ios = ios[i] - g_steady.last_ios[i];
+			g_steady.iops[i][slot] = (double)delta_ios / g_steady.interval_s;
+			g_steady.latency_us[i][slot] = delta_ios ? (double)(total_tsc[i] - g_steady.last_total_tsc[i]) /
+										   delta_ios * SECOND_TO_MICROSECOND / g_arbitration.tsc_rate : 0;
+			if (active[i]) {
+				printf(" %s %.2f IO/s %.2f us", g_qprio_names[i], g_steady.iops[i][slot],
+					   g_steady.latency_us[i][slot]);
+			}
+		}
+		printf("\n");
+		g_steady.rounds++;
 	}
+	memcpy(g_steady.last_ios, ios, sizeof(ios));
+	memcpy(g_steady.last_total_tsc, total_tsc, sizeof(total_tsc));
+	g_steady.next_sample_tsc = now + (uint64_t)g_steady.interval_s * g_arbitration.tsc_rate;
 
-	entry->nvme.ctrlr = ctrlr;
-	entry->nvme.ns = ns;
-	entry->size_in_ios = spdk_nvme_ns_get_size(ns) / g_arbitration.io_size_bytes;
-	entry->io_size_blocks = g_arbitration.io_size_bytes / spdk_nvme_ns_get_sector_size(ns);
-	snprintf(entry->name, 44, "%-20.20s (%-20.20s)", cdata->mn, cdata->sn);
-	TAILQ_INSERT_TAIL(&g_namespaces, entry, link);
-	g_arbitration.num_namespaces++;
+	if (g_steady.rounds < g_steady.window) {
+		return;
+	}
+	for (int i = 0; i < SPDK_NVME_QPRIO_MAX; i++) {
+		if (active[i]) {
+			steady &= steady_state_reached(g_steady.iops[i], g_steady.rounds, g_steady.window) &&
+					  steady_state_reached(g_steady.latency_us[i], g_steady.rounds, g_steady.window);
+		}
+	}
+	if (!steady && g_steady.rounds < g_steady.max_rounds) {
+		return;
+	}
+	g_steady.steady = steady;
+	if (steady) {
+		printf("Steady state reached after %u rounds, measuring for %u seconds\n", g_steady.rounds,
+			   g_arbitration.time_in_sec);
+	} else {
+		printf("WARNING: no steady state after %u rounds, measuring for %u seconds anyway\n",
+			   g_steady.rounds, g_arbitration.time_in_sec);
+	}
+	g_steady.reset_pending = true;
+
+post:
+	// A full mailbox is tried again at the next poll
+	index = 0;
+	TAILQ_FOREACH(worker, &g_workers, link) {
+		if (index++ < g_steady.reset_posted) {
+			continue;
+		}
+		if (worker_post(worker, &msg) != 0) {
+			return;
+		}
+		g_steady.reset_posted++;
+	}
+	g_steady.reset_pending = false;
+	__atomic_store_n(&g_steady.end_tsc, now + g_arbitration.time_in_sec * g_arbitration.tsc_rate,
+					 __ATOMIC_RELAXED);
+}
+
+// SNIA PTS criteria on the last window of rounds
+static bool
+steady_state_reached(const double *values, uint32_t rounds, uint32_t window)
+{
+	uint32_t first = rounds - window;
+	double sum = 0, min, max, avg, x_avg, slope_num = 0, slope_den = 0, y;
+
+	min = max = values[first % STEADY_MAX_WINDOW];
+	for (uint32_t x = 0; x < window; x++) {
+		y = values[(first + x) % STEADY_MAX_WINDOW];
+		sum += y;
+		min = spdk_min(min, y);
+		max = spdk_max(max, y);
+	}
+	avg = sum / window;
+	if (avg == 0) {
+		return true;
+	}
+
+	// Least squares slope over the rounds, its excursion across the window
+	x_avg = (double)(window - 1) / 2;
+	for (uint32_t x = 0; x < window; x++) {
+		y = values[(first + x) % STEADY_MAX_WINDOW];
+		slope_num += (x - x_avg) * (y - avg);
+		slope_den += (x - x_avg) * (x - x_avg);
+	}
+
+	return max - min <= avg * STEADY_RANGE_PCT / 100 &&
+		   fabs(slope_num / slope_den) * (window - 1) <= avg * STEADY_SLOPE_PCT / 100;
+}
+
+static void
+timeline_start(void)
+{
+	struct ctrlr_entry *ctrlr_entry;
+	struct ctrlr_health *health;
+	uint32_t interval_s = g_timeline.interval_s;
+
+	memset(&g_timeline, 0, sizeof(g_timeline));
+	g_timeline.interval_s = interval_s;
+	// A log page still in flight from the last run lands as the first sample
+	TAILQ_FOREACH(ctrlr_entry, &g_controllers, link) {
+		health = &ctrlr_entry->health;
+		health->fresh = false;
+		health->samples = 0;
+		health->critical_warnings = 0;
+	}
+}
+
+// Called from the loop of the main core. The log pages go through the admin
+// queue of each controller and are completed by later polls, the workers
+// never wait for them.
+static void
+timeline_poll(void)
+{
+	struct ctrlr_entry *ctrlr_entry;
+	uint64_t now;
+	bool pending = false;
+
+	// The warm-up of --steady-state is not part of the timeline
+	if (g_timeline.interval_s == 0 || (g_steady.interval_s != 0 && g_steady.end_tsc == UINT64_MAX)) {
+		return;
+	}
+	TAILQ_FOREACH(ctrlr_entry, &g_controllers, link) {
+		if (ctrlr_entry->health.pending) {
+			spdk_nvme_ctrlr_process_admin_completions(ctrlr_entry->ctrlr);
+			pending |= ctrlr_entry->health.pending;
+		}
+	}
+	now = arb_get_ticks();
+	if (g_timeline.row_pending && (!pending || now >= g_timeline.next_sample_tsc)) {
+		timeline_print_row();
+	}
+	if (now < g_timeline.next_sample_tsc) {
+		return;
+	}
+	timeline_sample(now);
+}
+
+// Ends the interval since the last sample and asks for the health logs of
+// its row
+static void
+timeline_sample(uint64_t now)
+{
+	struct worker_thread *worker;
+	struct worker_ns_ctx *ns_ctx;
+	struct ctrlr_entry *ctrlr_entry;
+	uint64_t ios[SPDK_NVME_QPRIO_MAX] = {}, total_tsc[SPDK_NVME_QPRIO_MAX] = {};
+	uint64_t delta_ios, delta_tsc;
+	double elapsed_s;
+
+	// Counters belong to the workers, they are read while being updated
+	TAILQ_FOREACH(worker, &g_workers, link) {
+		TAILQ_FOREACH(ns_ctx, &worker->ns_ctx, link) {
+			ios[ns_ctx->qprio] += __atomic_load_n(&ns_ctx->io_completed, __ATOMIC_RELAXED);
+			total_tsc[ns_ctx->qprio] += __atomic_load_n(&ns_ctx->stats.total_tsc, __ATOMIC_RELAXED);
+			g_timeline.active[ns_ctx->qprio] = true;
+		}
+	}
+	if (!g_timeline.started) {
+		g_timeline.started = true;
+		g_timeline.start_tsc = now;
+	} else {
+		elapsed_s = (double)(now - g_timeline.last_sample_tsc) / g_arbitration.tsc_rate;
+		for (int i = 0; i < SPDK_NVME_QPRIO_MAX; i++) {
+			// Counters start again from 0 when --steady-state ends the warm-up
+			delta_ios = ios[i] >= g_timeline.last_ios[i] ? ios[i] - g_timeline.last_ios[i] : ios[i];
+			delta_tsc = total_tsc[i] >= g_timeline.last_total_tsc[i] ?
+						total_tsc[i] - g_timeline.last_total_tsc[i] : total_tsc[i];
+			g_timeline.iops[i] = delta_ios / elapsed_s;
+			g_timeline.latency_us[i] = delta_ios ? (double)delta_tsc / delta_ios * SECOND_TO_MICROSECOND /
+									   g_arbitration.tsc_rate : 0;
+		}
+		g_timeline.row_time_s = (double)(now - g_timeline.start_tsc) / g_arbitration.tsc_rate;
+		g_timeline.row_pending = true;
+	}
+	memcpy(g_timeline.last_ios, ios, sizeof(ios));
+	memcpy(g_timeline.last_total_tsc, total_tsc, sizeof(total_tsc));
+	g_timeline.last_sample_tsc = now;
+	g_timeline.next_sample_tsc = now + (uint64_t)g_timeline.interval_s * g_arbitration.tsc_rate;
+
+	TAILQ_FOREACH(ctrlr_entry, &g_controllers, link) {
+		if (ctrlr_entry->ctrlr != NULL) {
+			health_log_request(ctrlr_entry);
+		}
+	}
+}
+
+// After the run, the row still waiting for its log pages and the partial
+// last interval are printed once the admin queues have answered
+static void
+timeline_finish(void)
+{
+	if (g_timeline.interval_s == 0 || !g_timeline.started) {
+		return;
+	}
+
+	health_log_wait();
+	if (g_timeline.row_pending) {
+		timeline_print_row();
+	}
+	timeline_sample(arb_get_ticks());
+	health_log_wait();
+	if (g_timeline.row_pending) {
+		timeline_print_row();
+	}
+}
+
+static void
+timeline_print_row(void)
+{
+	const struct ctrlr_entry *ctrlr_entry;
+	const struct ctrlr_health *health;
+
+	printf("Timeline %8.1f s:", g_timeline.row_time_s);
+	for (int i = 0; i < SPDK_NVME_QPRIO_MAX; i++) {
+		if (g_timeline.active[i]) {
+			printf(" %s %.2f IO/s %.2f us", g_qprio_names[i], g_timeline.iops[i], g_timeline.latency_us[i]);
+		}
+	}
+	TAILQ_FOREACH(ctrlr_entry, &g_controllers, link) {
+		health = &ctrlr_entry->health;
+		if (ctrlr_entry->ctrlr == NULL) {
+			continue;
+		}
+		if (!health->fresh) {
+			printf(" | %s no health log", ctrlr_entry->sn);
+			continue;
+		}
+		printf(" | %s %d C %u%% used, throttled %u times %u s", ctrlr_entry->sn,
+			   (int)health->last.temperature - 273, health->last.percentage_used,
+			   health->last.tmt_transitions[0] + health->last.tmt_transitions[1] -
+			   health->first.tmt_transitions[0] - health->first.tmt_transitions[1],
+			   health->last.tmt_time_s[0] + health->last.tmt_time_s[1] -
+			   health->first.tmt_time_s[0] - health->first.tmt_time_s[1]);
+		if (health->last.critical_warning != 0) {
+			printf(", critical warning 0x%x", health->last.critical_warning);
+		}
+	}
+	printf("\n");
+	g_timeline.row_pending = false;
+}
+
+static void
+health_log_request(struct ctrlr_entry *ctrlr_entry)
+{
+	struct ctrlr_health *health = &ctrlr_entry->health;
+
+	health->fresh = false;
+	// Still waiting for the last one, the row goes without
+	if (health->pending) {
+		return;
+	}
+	if (spdk_nvme_ctrlr_cmd_get_log_page(ctrlr_entry->ctrlr, SPDK_NVME_LOG_HEALTH_INFORMATION,
+										 SPDK_NVME_GLOBAL_NS_TAG, &health->page, sizeof(health->page), 0,
+										 health_log_done, ctrlr_entry) != 0) {
+		if (!health->failed) {
+			printf("WARNING: could not read the health log of %s\n", ctrlr_entry->name);
+		}
+		health->failed = true;
+		return;
+	}
+	health->pending = true;
+}
+
+// Polls the admin queues until no log page is pending anymore
+static void
+health_log_wait(void)
+{
+	struct ctrlr_entry *ctrlr_entry;
+	bool pending;
+
+	do {
+		pending = false;
+		TAILQ_FOREACH(ctrlr_entry, &g_controllers, link) {
+			if (!ctrlr_entry->health.pending) {
+				continue;
+			}
+			// A failed controller does not answer anymore
+			if (spdk_nvme_ctrlr_process_admin_completions(ctrlr_entry->ctrlr) < 0) {
+				ctrlr_entry->health.pending = false;
+				ctrlr_entry->health.failed = true;
+				continue;
+			}
+			pending |= ctrlr_entry->health.pending;
+		}
+	} while (pending);
+}
+
+static void
+health_log_done(void *arg, const struct spdk_nvme_cpl *cpl)
+{
+	struct ctrlr_entry *ctrlr_entry = arg;
+	struct ctrlr_health *health = &ctrlr_entry->health;
+	const struct spdk_nvme_health_information_page *page = &health->page;
+	struct health_sample *sample = &health->last;
+
+	health->pending = false;
+	if (spdk_nvme_cpl_is_error(cpl)) {
+		if (!health->failed) {
+			printf("WARNING: reading the health log of %s failed: %s\n", ctrlr_entry->name,
+				   spdk_nvme_cpl_get_status_string(&cpl->status));
+		}
+		health->failed = true;
+		return;
+	}
+
+	sample->temperature = page->temperature;
+	sample->percentage_used = page->percentage_used;
+	sample->critical_warning = page->critical_warning.raw;
+	sample->warning_temp_time = page->warning_temp_time;
+	sample->critical_temp_time = page->critical_temp_time;
+	sample->tmt_transitions[0] = page->thermal_management_temp1_transition_count;
+	sample->tmt_transitions[1] = page->thermal_management_temp2_transition_count;
+	sample->tmt_time_s[0] = page->total_time_for_thermal_management_temp1;
+	sample->tmt_time_s[1] = page->total_time_for_thermal_management_temp2;
+	if (health->samples == 0) {
+		health->first = *sample;
+		health->min_temperature = sample->temperature;
+		health->max_temperature = sample->temperature;
+	}
+	health->min_temperature = spdk_min(health->min_temperature, sample->temperature);
+	health->max_temperature = spdk_max(health->max_temperature, sample->temperature);
+	health->critical_warnings |= sample->critical_warning;
+	health->samples++;
+	health->fresh = true;
+}
+
+// From the first to the last --timeline sample of the measured run
+static void
+print_ctrlr_health(const struct ctrlr_entry *ctrlr_entry)
+{
+	const struct ctrlr_health *health = &ctrlr_entry->health;
+
+	printf("%-43.43s Health: %d-%d C, throttled %u/%u times %u/%u s (light/heavy), "
+		   "%u/%u min above warning/critical, %u%% used, critical warnings 0x%x\n", "",
+		   (int)health->min_temperature - 273, (int)health->max_temperature - 273,
+		   health->last.tmt_transitions[0] - health->first.tmt_transitions[0],
+		   health->last.tmt_transitions[1] - health->first.tmt_transitions[1],
+		   health->last.tmt_time_s[0] - health->first.tmt_time_s[0],
+		   health->last.tmt_time_s[1] - health->first.tmt_time_s[1],
+		   health->last.warning_temp_time - health->first.warning_temp_time,
+		   health->last.critical_temp_time - health->first.critical_temp_time,
+		   health->last.percentage_used, health->critical_warnings);
+}
+
+static void
+record_repetition(uint32_t rep)
+{
+	struct repeat_result *result = &g_repeat.results[rep];
+	struct worker_thread *worker;
+	struct worker_ns_ctx *ns_ctx;
+	uint64_t total_tsc[SPDK_NVME_QPRIO_MAX] = {};
+
+	TAILQ_FOREACH(worker, &g_workers, link) {
+		TAILQ_FOREACH(ns_ctx, &worker->ns_ctx, link) {
+			result->io_completed[ns_ctx->qprio] += ns_ctx->io_completed;
+			total_tsc[ns_ctx->qprio] += ns_ctx->stats.total_tsc;
+		}
+	}
+	for (int i = 0; i < SPDK_NVME_QPRIO_MAX; i++) {
+		result->iops[i] = (double)result->io_completed[i] / g_arbitration.time_in_sec;
+		result->latency_us[i] = result->io_completed[i] ? (double)total_tsc[i] / result->io_completed[i] *
+								SECOND_TO_MICROSECOND / g_arbitration.tsc_rate : 0;
+	}
+	result->warmup_rounds = g_steady.rounds;
+	result->steady = g_steady.steady;
+}
+
+// Sample standard deviation, 0 for a single value
+static void
+mean_stddev(const double *values, uint32_t count, double *mean, double *stddev)
+{
+	double sum = 0, sq = 0;
+
+	for (uint32_t i = 0; i < count; i++) {
+		sum += values[i];
+	}
+	*mean = count ? sum / count : 0;
+	for (uint32_t i = 0; i < count; i++) {
+		sq += (values[i] - *mean) * (values[i] - *mean);
+	}
+	*stddev = count > 1 ? sqrt(sq / (count - 1)) : 0;
+}
+
+// Two-sided 95% quantile of Student's t. Degrees of freedom between the
+// rows of the table take the row below, the interval is never narrower.
+static double
+t_critical_95(double df)
+{
+	static const double table[] = {
+		12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+		2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+		2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042,
+	};
+	uint32_t row = df < 1 ? 1 : (uint32_t)df;
+
+	if (row <= SPDK_COUNTOF(table)) {
+		return table[row - 1];
+	}
+	return row < 40 ? 2.042 : row < 60 ? 2.021 : row < 120 ? 2.000 : 1.980;
 }
 
 static void
-print_arb_feature(struct spdk_nvme_ctrlr *ctrlr)
+print_repetition_summary(void)
+{
+	double values[REPEAT_MAX];
+	double mean, stddev, ci;
+	uint32_t count = g_repeat.count;
+	bool unsteady = false;
+
+	printf("Repetitions: %u", count);
+	if (g_steady.interval_s != 0) {
+		printf(", warm-up rounds");
+		for (uint32_t rep = 0; rep < count; rep++) {
+			printf(" %u%s", g_repeat.results[rep].warmup_rounds, g_repeat.results[rep].steady ? "" : "*");
+			unsteady |= !g_repeat.results[rep].steady;
+		}
+		printf("%s", unsteady ? " (* no steady state)" : "");
+	}
+	printf("\n");
+	for (int i = 0; i < SPDK_NVME_QPRIO_MAX; i++) {
+		if (g_repeat.results[0].io_completed[i] == 0) {
+			continue;
+		}
+		printf("%-6s priority class:", g_qprio_names[i]);
+		for (uint32_t rep = 0; rep < count; rep++) {
+			values[rep] = g_repeat.results[rep].iops[i];
+		}
+		mean_stddev(values, count, &mean, &stddev);
+		ci = count > 1 ? t_critical_95(count - 1) * stddev / sqrt(count) : 0;
+		printf(" %10.2f IO/s stddev %8.2f CI95 +/- %8.2f (%5.2f%%)", mean, stddev, ci,
+			   mean ? ci * 100 / mean : 0);
+		for (uint32_t rep = 0; rep < count; rep++) {
+			values[rep] = g_repeat.results[rep].latency_us[i];
+		}
+		mean_stddev(values, count, &mean, &stddev);
+		ci = count > 1 ? t_critical_95(count - 1) * stddev / sqrt(count) : 0;
+		printf(", latency %8.2f us stddev %8.2f CI95 +/- %8.2f (%5.2f%%)\n", mean, stddev, ci,
+			   mean ? ci * 100 / mean : 0);
+	}
+	printf("========================================================\n");
+}
+
+static int
+results_write_cb(void *cb_ctx, const void *data, size_t size)
+{
+	return fwrite(data, 1, size, cb_ctx) == size ? 0 : -1;
+}
+
+// Runs are kept as integers, IO/s and latency in ns, so that --baseline
+// reads them back with the decoders of SPDK
+static int
+write_results_json(void)
 {
+	struct spdk_json_write_ctx *w;
+	double values[REPEAT_MAX];
+	double mean, stddev;
+	uint32_t count = g_repeat.count;
+	FILE *file;
 	int rc;
-	struct spdk_nvme_cmd cmd = {};
 
-	g_features[SPDK_NVME_FEAT_ARBITRATION].valid = false;
+	file = fopen(g_repeat.json_out, "w");
+	if (file == NULL) {
+		perror("json-out");
+		return -1;
+	}
+	w = spdk_json_write_begin(results_write_cb, file, SPDK_JSON_WRITE_FLAG_FORMATTED);
+	if (w == NULL) {
+		fclose(file);
+		return -1;
+	}
+
+	spdk_json_write_object_begin(w);
+	spdk_json_write_named_uint32(w, "version", RESULTS_JSON_VERSION);
+	spdk_json_write_named_string(w, "backend", g_backend->name);
+	spdk_json_write_named_string(w, "pattern", g_arbitration.io_pattern_type);
+	spdk_json_write_named_int32(w, "rwmixread", g_arbitration.rw_percentage);
+	spdk_json_write_named_uint32(w, "io_size", g_arbitration.io_size_bytes);
+	spdk_json_write_named_uint32(w, "queue_depth", g_arbitration.io_queue_depth);
+	spdk_json_write_named_uint32(w, "time_s", g_arbitration.time_in_sec);
+	spdk_json_write_named_array_begin(w, "classes");
+	for (int i = 0; i < SPDK_NVME_QPRIO_MAX; i++) {
+		if (g_repeat.results[0].io_completed[i] == 0) {
+			continue;
+		}
+		spdk_json_write_object_begin(w);
+		spdk_json_write_named_string(w, "class", g_qprio_names[i]);
+		spdk_json_write_named_array_begin(w, "iops");
+		for (uint32_t rep = 0; rep < count; rep++) {
+			values[rep] = g_repeat.results[rep].iops[i];
+			spdk_json_write_uint64(w, (uint64_t)llround(values[rep]));
+		}
+		spdk_json_write_array_end(w);
+		mean_stddev(values, count, &mean, &stddev);
+		spdk_json_write_named_double(w, "iops_mean", mean);
+		spdk_json_write_named_double(w, "iops_stddev", stddev);
+		spdk_json_write_named_double(w, "iops_ci95", count > 1 ? t_critical_95(count - 1) * stddev / sqrt(count) : 0);
+		spdk_json_write_named_array_begin(w, "latency_ns");
+		for (uint32_t rep = 0; rep < count; rep++) {
+			values[rep] = g_repeat.results[rep].latency_us[i];
+			spdk_json_write_uint64(w, (uint64_t)llround(values[rep] * 1000));
+		}
+		spdk_json_write_array_end(w);
+		mean_stddev(values, count, &mean, &stddev);
+		spdk_json_write_named_double(w, "latency_us_mean", mean);
+		spdk_json_write_named_double(w, "latency_us_stddev", stddev);
+		spdk_json_write_named_double(w, "latency_us_ci95",
+									 count > 1 ? t_critical_95(count - 1) * stddev / sqrt(count) : 0);
+		spdk_json_write_object_end(w);
+	}
+	spdk_json_write_array_end(w);
+	spdk_json_write_object_end(w);
+
+	rc = spdk_json_write_end(w);
+	fputc('\n', file);
+	if (fclose(file) != 0 || rc != 0) {
+		fprintf(stderr, "could not write %s\n", g_repeat.json_out);
+		return -1;
+	}
+	printf("Results written to %s\n", g_repeat.json_out);
+
+	return 0;
+}
+
+static const struct spdk_json_object_decoder g_baseline_class_decoders[] = {
+	{"class", offsetof(struct baseline_class, name), spdk_json_decode_string},
+	{"iops", offsetof(struct baseline_class, iops), baseline_decode_series},
+	{"latency_ns", offsetof(struct baseline_class, latency_ns), baseline_decode_series},
+};
+
+static const struct spdk_json_object_decoder g_baseline_decoders[] = {
+	{"classes", 0, baseline_decode_class},
+};
+
+static int
+baseline_decode_series(const struct spdk_json_val *val, void *out)
+{
+	struct baseline_series *series = out;
+
+	return spdk_json_decode_array(val, spdk_json_decode_uint64, series->values, REPEAT_MAX,
+								  &series->count, sizeof(uint64_t));
+}
+
+static int
+baseline_decode_class(const struct spdk_json_val *val, void *out)
+{
+	struct baseline *baseline = out;
+	const struct spdk_json_val *item;
+
+	if (val->type != SPDK_JSON_VAL_ARRAY_BEGIN) {
+		return -1;
+	}
+	// Every member of the array is an object, skip it with its values
+	for (item = val + 1; item->type != SPDK_JSON_VAL_ARRAY_END; item += item->len + 2) {
+		if (baseline->num_classes == SPDK_NVME_QPRIO_MAX ||
+			spdk_json_decode_object_relaxed(item, g_baseline_class_decoders,
+											SPDK_COUNTOF(g_baseline_class_decoders),
+											&baseline->classes[baseline->num_classes]) != 0) {
+			return -1;
+		}
+		baseline->num_classes++;
+	}
+
+	return 0;
+}
+
+// Reads and parses a whole JSON file, the values point into *json and both are freed by the caller
+static int
+read_json_file(const char *path, char **json_out, struct spdk_json_val **values_out)
+{
+	struct spdk_json_val *values = NULL;
+	ssize_t num_values;
+	void *end;
+	char *json = NULL;
+	long size;
+	FILE *file;
+
+	file = fopen(path, "r");
+	if (file == NULL) {
+		perror(path);
+		return -1;
+	}
+	if (fseek(file, 0, SEEK_END) != 0 || (size = ftell(file)) <= 0 || fseek(file, 0, SEEK_SET) != 0) {
+		fprintf(stderr, "could not read %s\n", path);
+		goto err;
+	}
+	json = malloc(size);
+	if (json == NULL || fread(json, 1, size, file) != (size_t)size) {
+		fprintf(stderr, "could not read %s\n", path);
+		goto err;
+	}
+
+	// Once to count the values, once to keep them
+	num_values = spdk_json_parse(json, size, NULL, 0, &end, 0);
+	if (num_values <= 0) {
+		fprintf(stderr, "%s is not JSON\n", path);
+		goto err;
+	}
+	values = calloc(num_values, sizeof(*values));
+	if (values == NULL ||
+		spdk_json_parse(json, size, values, num_values, &end, SPDK_JSON_PARSE_FLAG_DECODE_IN_PLACE) != num_values) {
+		fprintf(stderr, "%s is not JSON\n", path);
+		goto err;
+	}
+	fclose(file);
+	*json_out = json;
+	*values_out = values;
+	return 0;
+err:
+	free(values);
+	free(json);
+	fclose(file);
+	return -1;
+}
+
+static int
+load_baseline(const char *path, struct baseline *baseline)
+{
+	struct spdk_json_val *values;
+	char *json;
+	int rc = 0;
+
+	if (read_json_file(path, &json, &values) != 0) {
+		return -1;
+	}
+	if (spdk_json_decode_object_relaxed(values, g_baseline_decoders, SPDK_COUNTOF(g_baseline_decoders),
+										baseline) != 0) {
+		fprintf(stderr, "%s is not a --json-out document\n", path);
+		rc = -1;
+	}
+	free(values);
+	free(json);
+	return rc;
+}
+
+static const struct spdk_json_object_decoder g_unloaded_ns_decoders[] = {
+	{"serial", offsetof(struct unloaded_ns, serial), spdk_json_decode_string},
+	{"nsid", offsetof(struct unloaded_ns, nsid), spdk_json_decode_uint32},
+	{"pass", offsetof(struct unloaded_ns, pass), spdk_json_decode_bool},
+	{"read_qd1_ns", offsetof(struct unloaded_ns, read_qd1_ns), spdk_json_decode_uint64},
+	{"write_qd1_ns", offsetof(struct unloaded_ns, write_qd1_ns), spdk_json_decode_uint64},
+};
+
+static const struct spdk_json_object_decoder g_unloaded_decoders[] = {
+	{"namespaces", 0, unloaded_decode_namespaces},
+};
+
+// Matched by serial number and namespace ID, the transport address of a
+// controller may change between the pre-flight check and the run
+static int
+unloaded_decode_namespaces(const struct spdk_json_val *val, void *out)
+{
+	uint32_t *matched = out;
+	const struct spdk_json_val *item;
+	struct unloaded_ns entry;
+	struct ns_entry *ns_entry;
+	int rc = 0;
+
+	if (val->type != SPDK_JSON_VAL_ARRAY_BEGIN) {
+		return -1;
+	}
+	for (item = val + 1; item->type != SPDK_JSON_VAL_ARRAY_END && rc == 0; item += item->len + 2) {
+		memset(&entry, 0, sizeof(entry));
+		if (spdk_json_decode_object_relaxed(item, g_unloaded_ns_decoders,
+											SPDK_COUNTOF(g_unloaded_ns_decoders), &entry) != 0) {
+			rc = -1;
+		}
+		TAILQ_FOREACH(ns_entry, &g_namespaces, link) {
+			if (rc != 0 || ns_entry->nsid != entry.nsid ||
+				strcmp(ns_entry->ctrlr_entry->sn, entry.serial) != 0) {
+				continue;
+			}
+			if (!entry.pass) {
+				printf("WARNING: %s namespace %u failed its pre-flight check\n",
+					   ns_entry->name, ns_entry->nsid);
+			}
+			ns_entry->unloaded_read_ns = entry.read_qd1_ns;
+			ns_entry->unloaded_write_ns = entry.write_qd1_ns;
+			(*matched)++;
+		}
+		free(entry.serial);
+	}
+
+	return rc;
+}
 
-	cmd.opc = SPDK_NVME_OPC_GET_FEATURES;
-	cmd.cdw10_bits.get_features.fid = SPDK_NVME_FEAT_ARBITRATION;
+static int
+load_unloaded(void)
+{
+	struct spdk_json_val *values;
+	struct ns_entry *ns_entry;
+	uint32_t matched = 0;
+	char *json;
+	int rc = 0;
 
-	rc = spdk_nvme_ctrlr_cmd_admin_raw(ctrlr, &cmd, NULL, 0, get_feature_completion, &g_features[SPDK_NVME_FEAT_ARBITRATION]);
-	if (rc) {
-		printf("Get Arbitration Feature: Failed 0x%x\n", rc);
-		return;
+	if (read_json_file(g_arbitration.unloaded_path, &json, &values) != 0) {
+		return -1;
 	}
-
-	// get_feature() is asynchronized. Polling is needed
-	g_outstanding_commands++;
-	while (g_outstanding_commands) {
-		spdk_nvme_ctrlr_process_admin_completions(ctrlr);
-		/* This function is thread safe */
-		/* This function can be called at any point while the controller is attached to the SPDK NVMe driver. */
+	if (spdk_json_decode_object_relaxed(values, g_unloaded_decoders, SPDK_COUNTOF(g_unloaded_decoders),
+										&matched) != 0) {
+		fprintf(stderr, "%s is not a beginner -o document\n", g_arbitration.unloaded_path);
+		rc = -1;
+	}
+	free(values);
+	free(json);
+	if (rc != 0) {
+		return rc;
 	}
 
-	if (g_features[SPDK_NVME_FEAT_ARBITRATION].valid) {
-		// SPDK designed serveral unions to decode the result automatically
-		union spdk_nvme_cmd_cdw11 arb;
-		arb.feat_arbitration.raw = g_features[SPDK_NVME_FEAT_ARBITRATION].result;
-
-		printf("Current Arbitration Configuration\n");
-		printf("===========\n");
-		printf("Arbitration Burst:          ");
-		if (arb.feat_arbitration.bits.ab == SPDK_NVME_ARBITRATION_BURST_UNLIMITED) {
-			printf("no limit\n");
-		} else {
-			printf("%u\n", 1u << arb.feat_arbitration.bits.ab);
+	TAILQ_FOREACH(ns_entry, &g_namespaces, link) {
+		if (ns_entry->unloaded_read_ns + ns_entry->unloaded_write_ns == 0) {
+			printf("WARNING: no unloaded latency of %s namespace %u in %s\n",
+				   ns_entry->name, ns_entry->nsid, g_arbitration.unloaded_path);
 		}
-		printf("Low Priority Weight:        %u\n", arb.feat_arbitration.bits.lpw + 1);
-		printf("Medium Priority Weight:     %u\n", arb.feat_arbitration.bits.mpw + 1);
-		printf("High Priority Weight:       %u\n", arb.feat_arbitration.bits.hpw + 1);
-		printf("\n");
-	} else {
-		printf("Set Arbitration Feature failed\n");
 	}
+	printf("Unloaded latencies of %u namespace%s from %s\n", matched, matched == 1 ? "" : "s",
+		   g_arbitration.unloaded_path);
+
+	return 0;
 }
 
+// The mean under load against the QD1 one measured on the idle namespace
 static void
-get_feature_completion(void *cb_arg, const struct spdk_nvme_cpl *cpl)
+print_unloaded_latency(const struct worker_ns_ctx *ns_ctx)
 {
-	struct feature_entry *feature = cb_arg;
-	// Use the offset of feature entry pointer to calculate fid (feature id)
-	int fid = feature - g_features;
+	const struct op_stats *op_stats;
+	uint64_t unloaded_ns;
+	double loaded_us;
 
-	if (spdk_nvme_cpl_is_error(cpl)) {
-		printf("get_feature(0x%02X) failed\n", fid);
-	} else {
-		feature->result = cpl->cdw0;
-		feature->valid = true;
+	printf("%-43.43s Unloaded QD1:", "");
+	for (int op = ARB_OP_READ; op <= ARB_OP_WRITE; op++) {
+		unloaded_ns = op == ARB_OP_READ ? ns_ctx->ns_entry->unloaded_read_ns :
+					  ns_ctx->ns_entry->unloaded_write_ns;
+		if (unloaded_ns == 0) {
+			continue;
+		}
+		op_stats = &ns_ctx->op_stats[op];
+		printf(" %s %8.2f us", g_op_names[op], (double)unloaded_ns / 1000);
+		if (op_stats->io_completed != 0) {
+			loaded_us = (double)op_stats->total_tsc / op_stats->io_completed *
+						SECOND_TO_MICROSECOND / g_arbitration.tsc_rate;
+			printf(" (%.1fx under load)", loaded_us * 1000 / unloaded_ns);
+		}
 	}
-
-	g_outstanding_commands--;
+	printf("\n");
 }
 
-static void
-set_arb_feature(struct spdk_nvme_ctrlr *ctrlr)
+// Welch's t-test, the runs of either side may differ in number and spread.
+// Only a significant change in the worse direction is a regression.
+static bool
+welch_regression(const char *class_name, const char *metric, const struct baseline_series *base,
+				 const double *current, bool higher_is_better)
 {
-	int rc;
-	struct spdk_nvme_cmd cmd = {};
-
-	g_features[SPDK_NVME_FEAT_ARBITRATION].valid = false;
-
-	cmd.opc = SPDK_NVME_OPC_SET_FEATURES;
-	cmd.cdw10_bits.set_features.fid = SPDK_NVME_FEAT_ARBITRATION;
-
-	cmd.cdw11_bits.feat_arbitration.bits.ab = g_arbitration.arbitration_burst;
-	cmd.cdw11_bits.feat_arbitration.bits.hpw = g_arbitration.high_priority_weight - 1;
-	cmd.cdw11_bits.feat_arbitration.bits.mpw = g_arbitration.medium_priority_weight - 1;
-	cmd.cdw11_bits.feat_arbitration.bits.lpw = g_arbitration.low_priority_weight - 1;
+	double base_values[REPEAT_MAX];
+	double base_mean, base_stddev, mean, stddev, var_base, var_cur, t, df, change;
+	uint32_t count = g_repeat.count;
+	bool significant, worse;
 
-	rc = spdk_nvme_ctrlr_cmd_admin_raw(ctrlr, &cmd, NULL, 0,
-						set_feature_completion, &g_features[SPDK_NVME_FEAT_ARBITRATION]);
-	if (rc) {
-		printf("Set Arbitration Feature: Failed 0x%x\n", rc);
-		return;
-	}
-
-	// Polling is also needed
-	g_outstanding_commands++;
-	while (g_outstanding_commands) {
-		spdk_nvme_ctrlr_process_admin_completions(ctrlr);
+	for (size_t i = 0; i < base->count; i++) {
+		base_values[i] = (double)base->values[i];
 	}
+	mean_stddev(base_values, base->count, &base_mean, &base_stddev);
+	mean_stddev(current, count, &mean, &stddev);
+	change = base_mean ? (mean - base_mean) * 100 / base_mean : 0;
+	worse = higher_is_better ? mean < base_mean : mean > base_mean;
 
-	if (!g_features[SPDK_NVME_FEAT_ARBITRATION].valid) {
-		printf("Set Arbitration Feature failed and use default configuration\n");
+	if (base->count < 2 || count < 2) {
+		printf("%-6s %-10s %12.2f -> %12.2f (%+6.2f%%), needs 2 runs on both sides to test\n",
+			   class_name, metric, base_mean, mean, change);
+		return false;
 	}
-}
-
-static void
-set_feature_completion(void *cb_arg, const struct spdk_nvme_cpl *cpl)
-{
-	struct feature_entry *feature = cb_arg;
-	int fid = feature - g_features;
-
-	if (spdk_nvme_cpl_is_error(cpl)) {
-		printf("set_feature(0x%02X) failed\n", fid);
+	var_base = base_stddev * base_stddev / base->count;
+	var_cur = stddev * stddev / count;
+	if (var_base + var_cur == 0) {
+		// Both sides repeat exactly, any difference stands
+		t = 0;
+		significant = mean != base_mean;
 	} else {
-		printf("Set Arbitration Feature Successfully\n\n");
-		feature->valid = true;
+		t = (mean - base_mean) / sqrt(var_base + var_cur);
+		df = (var_base + var_cur) * (var_base + var_cur) /
+			 (var_base * var_base / (base->count - 1) + var_cur * var_cur / (count - 1));
+		significant = fabs(t) > t_critical_95(df);
 	}
+	printf("%-6s %-10s %12.2f -> %12.2f (%+6.2f%%), t %7.2f, %s%s\n", class_name, metric, base_mean, mean,
+		   change, t, significant ? "significant" : "not significant",
+		   significant && worse ? ", REGRESSION" : "");
 
-	g_outstanding_commands--;
+	return significant && worse;
 }
 
 static int
-associate_workers_with_ns(void)
+compare_baseline(void)
 {
-	struct ns_entry			*ns_entry = TAILQ_FIRST(&g_namespaces);
-	struct worker_thread	*worker = TAILQ_FIRST(&g_workers);
-	struct worker_ns_ctx	*ns_ctx;
-	
-	// The functoin is designed to make every worker or every namespace are being used
-	// In this experiment, the device has only one namespaces, so all the workers are associated to the same namespace
-	int count = g_arbitration.num_namespaces > g_arbitration.num_workers ?
-				g_arbitration.num_namespaces : g_arbitration.num_workers;
-	
-	for (int i = 0; i < count; i++) {
-		if (ns_entry == NULL) {
-			break;
-		}
-
-		// Allocate a context for worker
-		ns_ctx = malloc(sizeof(struct worker_ns_ctx));
-		if (!ns_ctx) {
-			return 1;
-		}
-		memset(ns_ctx, 0, sizeof(*ns_ctx));
+	struct baseline *baseline;
+	const struct baseline_class *base;
+	double iops[REPEAT_MAX], latency_ns[REPEAT_MAX];
+	bool regression = false;
+	int qprio;
 
-		printf("Associating %s Namespace %u with lcore %d\n", ns_entry->name, 
-				spdk_nvme_ns_get_id(ns_entry->nvme.ns), worker->lcore);
-		ns_ctx->ns_entry = ns_entry;
-		ns_ctx->stats.total_tsc = 0;
-		ns_ctx->stats.max_tsc = 0;
-		ns_ctx->stats.min_tsc = UINT64_MAX;
-		TAILQ_INSERT_TAIL(&worker->ns_ctx, ns_ctx, link);
+	baseline = calloc(1, sizeof(*baseline));
+	if (baseline == NULL) {
+		return -1;
+	}
+	if (load_baseline(g_repeat.baseline, baseline) != 0) {
+		free(baseline);
+		return -1;
+	}
 
-		worker = TAILQ_NEXT(worker, link);
-		if (worker == NULL) {
-			worker = TAILQ_FIRST(&g_workers);
+	printf("Baseline %s, 95%% confidence\n", g_repeat.baseline);
+	for (size_t i = 0; i < baseline->num_classes; i++) {
+		base = &baseline->classes[i];
+		for (qprio = 0; qprio < SPDK_NVME_QPRIO_MAX; qprio++) {
+			if (!strcmp(base->name, g_qprio_names[qprio])) {
+				break;
+			}
 		}
-
-		ns_entry = TAILQ_NEXT(ns_entry, link);
-		if (ns_entry == NULL) {
-			ns_entry = TAILQ_FIRST(&g_namespaces);
+		if (qprio == SPDK_NVME_QPRIO_MAX || g_repeat.results[0].io_completed[qprio] == 0) {
+			printf("%-6s not run\n", base->name);
+			continue;
+		}
+		for (uint32_t rep = 0; rep < g_repeat.count; rep++) {
+			iops[rep] = llround(g_repeat.results[rep].iops[qprio]);
+			latency_ns[rep] = llround(g_repeat.results[rep].latency_us[qprio] * 1000);
 		}
+		regression |= welch_regression(base->name, "IO/s", &base->iops, iops, true);
+		regression |= welch_regression(base->name, "latency ns", &base->latency_ns, latency_ns, false);
 	}
+	printf("========================================================\n");
 
-	return 0;
+	for (size_t i = 0; i < baseline->num_classes; i++) {
+		free(baseline->classes[i].name);
+	}
+	free(baseline);
+
+	return regression ? 1 : 0;
 }
 
+// Format: fill[,random=<seconds>|random=steady], either part can be left out
 static int
-init_worker_ns_ctx(struct worker_ns_ctx *ns_ctx, enum spdk_nvme_qprio qprio)
+parse_precondition(const char *spec)
 {
-	struct spdk_nvme_ctrlr *ctrlr = ns_ctx->ns_entry->nvme.ctrlr;
-	struct spdk_nvme_io_qpair_opts opts;
-
-	spdk_nvme_ctrlr_get_default_io_qpair_opts(ctrlr, &opts, sizeof(opts));
-	opts.qprio = qprio;
+	char buf[64];
+	char *item, *value, *saveptr = NULL;
+	long int val;
 
-	ns_ctx->qpair = spdk_nvme_ctrlr_alloc_io_qpair(ctrlr, &opts, sizeof(opts));
-	if (!ns_ctx->qpair) {
-		printf("ERROR: spdk_nvme_ctrlr_alloc_io_qpair failed\n");
+	snprintf(buf, sizeof(buf), "%s", spec);
+	for (item = strtok_r(buf, ",", &saveptr); item != NULL; item = strtok_r(NULL, ",", &saveptr)) {
+		if (!strcmp(item, "fill")) {
+			g_precondition.fill = true;
+			continue;
+		}
+		value = strchr(item, '=');
+		if (value == NULL || strncmp(item, "random=", 7)) {
+			fprintf(stderr, "Unknown --precondition item %s, must be one of (fill, random)\n", item);
+			return 1;
+		}
+		value++;
+		if (!strcmp(value, "steady")) {
+			g_precondition.random_steady = true;
+			continue;
+		}
+		val = spdk_strtol(value, 10);
+		if (val <= 0) {
+			fprintf(stderr, "--precondition random must be a positive number of seconds or steady\n");
+			return 1;
+		}
+		g_precondition.random_s = val;
+	}
+	if (!g_precondition.fill && g_precondition.random_s == 0 && !g_precondition.random_steady) {
+		fprintf(stderr, "--precondition needs fill or random\n");
 		return 1;
 	}
 
 	return 0;
 }
 
-static void
-submit_init_ios(struct worker_ns_ctx *ns_ctx, int queue_depth)
+// Both phases run every worker on every queue pair, then the statistics
+// start over for the measured runs
+static int
+precondition_run(uint32_t main_core)
 {
-	while (queue_depth-- > 0) {
-		submit_single_io(ns_ctx);
+	if (g_precondition.fill) {
+		precondition_assign_fill();
+		if (precondition_phase_run(PRECONDITION_FILL, main_core) != 0) {
+			return 1;
+		}
+	}
+	if (g_precondition.random_s != 0 || g_precondition.random_steady) {
+		if (g_steady.interval_s != 0) {
+			g_precondition.interval_s = g_steady.interval_s;
+			g_precondition.window = g_steady.window;
+			g_precondition.max_rounds = g_steady.max_rounds;
+		} else {
+			g_precondition.interval_s = PRECONDITION_DEFAULT_INTERVAL_S;
+			g_precondition.window = STEADY_DEFAULT_WINDOW;
+			g_precondition.max_rounds = STEADY_DEFAULT_MAX_ROUNDS;
+		}
+		if (precondition_phase_run(PRECONDITION_RANDOM, main_core) != 0) {
+			return 1;
+		}
 	}
+	reset_run_stats();
+
+	return 0;
 }
 
-static void
-submit_single_io(struct worker_ns_ctx *ns_ctx)
+static int
+precondition_phase_run(enum precondition_phase phase, uint32_t main_core)
 {
+	uint64_t now, writes;
+	double secs;
 	int rc;
-	struct arb_task	*task = NULL;
-	struct ns_entry	*ns_entry = ns_ctx->ns_entry;
-	uint64_t offset_in_ios;
-
-	// Get a task from task pool
-	task = spdk_mempool_get(g_task_pool);
-	if (!task) {
-		fprintf(stderr, "Failed to get task from task_pool\n");
-		exit(1);
-	}
-
-	// Allocate a space for DMA
-	task->buf = spdk_dma_zmalloc(g_arbitration.io_size_bytes, 0x200, NULL);
-	if (!task->buf) {
-		spdk_mempool_put(g_task_pool, task);
-		fprintf(stderr, "task->buf spdk_dma_zmalloc failed\n");
-		exit(1);
-	}
-	task->ns_ctx = ns_ctx;
 
-	task->submit_tsc = spdk_get_ticks();
+	reset_run_stats();
+	now = arb_get_ticks();
+	g_precondition.start_tsc = now;
+	g_precondition.report_tsc = now;
+	g_precondition.report_ios = 0;
+	g_precondition.next_check_tsc = now;
+	g_precondition.next_report_tsc = now + PRECONDITION_REPORT_S * g_arbitration.tsc_rate;
+	g_precondition.rounds = 0;
+	g_precondition.round_ios = 0;
+	g_precondition.next_round_tsc = now + (uint64_t)g_precondition.interval_s * g_arbitration.tsc_rate;
+	g_precondition.end_tsc = UINT64_MAX;
+	g_precondition.phase = phase;
+	printf("Preconditioning: %s\n", phase == PRECONDITION_FILL ? "sequential fill" : "random overwrite");
 
-	if (g_arbitration.is_random) {
-		// rand_r() is a thread-safe version random number generator
-		// number range is [0, RAND_MAX] (RAND_MAX == 2147483647 on this machine)
-		offset_in_ios = rand_r(&random_seed) % ns_entry->size_in_ios;
-	} else {
-		offset_in_ios = ns_ctx->offset_in_ios++;
-		if (ns_ctx->offset_in_ios == ns_entry->size_in_ios) {
-			ns_ctx->offset_in_ios = 0;
-		}
+	rc = run_workers(main_core);
+	g_precondition.phase = PRECONDITION_NONE;
+	if (rc != 0) {
+		return rc;
 	}
 
-	if ((g_arbitration.rw_percentage == 100) ||
-		(g_arbitration.rw_percentage != 0 &&
-		 ((rand_r(&random_seed) % 100) < g_arbitration.rw_percentage))) {
-		rc = spdk_nvme_ns_cmd_read(ns_entry->nvme.ns, ns_ctx->qpair, task->buf,
-						offset_in_ios * ns_entry->io_size_blocks,
-						ns_entry->io_size_blocks, task_complete, task, 0);
-	} else {
-		rc = spdk_nvme_ns_cmd_write(ns_entry->nvme.ns, ns_ctx->qpair, task->buf,
-						offset_in_ios * ns_entry->io_size_blocks,
-						ns_entry->io_size_blocks, task_complete, task, 0);
-	}
+	writes = precondition_writes();
+	secs = (double)(arb_get_ticks() - g_precondition.start_tsc) / g_arbitration.tsc_rate;
+	printf("Preconditioning: %s done, %" PRIu64 " MiB in %.1f seconds, %.2f MiB/s\n",
+		   phase == PRECONDITION_FILL ? "sequential fill" : "random overwrite",
+		   writes * g_arbitration.io_size_bytes / (1024 * 1024), secs,
+		   secs > 0 ? (double)writes * g_arbitration.io_size_bytes / (1024 * 1024) / secs : 0);
 
-	if (rc != 0) {
-		fprintf(stderr, "starting I/O failed\n");
-	} else {
-		ns_ctx->current_queue_depth++;
-	}
+	return 0;
 }
 
+// Every namespace is divided among its contexts in the order they were associated
 static void
-task_complete(void *ctx, const struct spdk_nvme_cpl *completion)
+precondition_assign_fill(void)
 {
-	struct arb_task *task = (struct arb_task *)ctx;
-	struct worker_ns_ctx *ns_ctx = task->ns_ctx;
-	uint64_t tsc_diff;
+	struct worker_thread *worker, *peer_worker;
+	struct worker_ns_ctx *ns_ctx, *peer;
+	struct ns_entry *ns_entry;
+	uint32_t parts, index;
+	uint64_t part;
 
-	ns_ctx->current_queue_depth--;
-	ns_ctx->io_completed++;
-
-	tsc_diff = spdk_get_ticks() - task->submit_tsc;
-	ns_ctx->stats.total_tsc += tsc_diff;
-	if (spdk_unlikely(ns_ctx->stats.min_tsc > tsc_diff)) {
-		ns_ctx->stats.min_tsc = tsc_diff;
-	}
-	if (spdk_unlikely(ns_ctx->stats.max_tsc < tsc_diff)) {
-		ns_ctx->stats.max_tsc = tsc_diff;
+	g_precondition.fill_ios = 0;
+	TAILQ_FOREACH(ns_entry, &g_namespaces, link) {
+		g_precondition.fill_ios += ns_entry->size_in_ios;
 	}
 
-	spdk_dma_free(task->buf);
-	spdk_mempool_put(g_task_pool, task);
-
-	// is_draining indicates when time has expired for the test run
-	// If is_draining is true, only waits for the previously submitted I/O to complete.
-	if (!ns_ctx->is_draining) {
-		submit_single_io(ns_ctx);
+	TAILQ_FOREACH(worker, &g_workers, link) {
+		TAILQ_FOREACH(ns_ctx, &worker->ns_ctx, link) {
+			parts = 0;
+			index = 0;
+			TAILQ_FOREACH(peer_worker, &g_workers, link) {
+				TAILQ_FOREACH(peer, &peer_worker->ns_ctx, link) {
+					if (peer->ns_entry != ns_ctx->ns_entry) {
+						continue;
+					}
+					if (peer == ns_ctx) {
+						index = parts;
+					}
+					parts++;
+				}
+			}
+			// The last part takes the remainder
+			part = ns_ctx->ns_entry->size_in_ios / parts;
+			ns_ctx->fill_next = index * part;
+			ns_ctx->fill_end = index == parts - 1 ? ns_ctx->ns_entry->size_in_ios : ns_ctx->fill_next + part;
+		}
 	}
 }
 
-static void
-drain_io(struct worker_ns_ctx *ns_ctx)
+// Writes completed in this phase, read while the workers update them
+static uint64_t
+precondition_writes(void)
 {
-	ns_ctx->is_draining = true;
-	while (ns_ctx->current_queue_depth > 0) {
-		spdk_nvme_qpair_process_completions(ns_ctx->qpair, 0);
+	struct worker_thread *worker;
+	struct worker_ns_ctx *ns_ctx;
+	uint64_t writes = 0;
+
+	TAILQ_FOREACH(worker, &g_workers, link) {
+		TAILQ_FOREACH(ns_ctx, &worker->ns_ctx, link) {
+			writes += __atomic_load_n(&ns_ctx->op_stats[ARB_OP_WRITE].io_completed, __ATOMIC_RELAXED);
+		}
 	}
+
+	return writes;
 }
 
-static void
-print_configuration_and_performance(char *program_name)
+// A failed submission uses up its slot without a write completing, so the
+// fill also ends once every context issued its part and has nothing left
+// outstanding
+static bool
+precondition_filled(void)
 {
-	struct worker_thread	*worker;
-	struct worker_ns_ctx	*ns_ctx;
-	double io_per_second, sent_comparison_io_in_secs, mb_per_second;
-	double average_latency, min_latency, max_latency;
-
-	printf("========================================================\n");
-	printf("Rerun with configuration:\n");
-	printf("sudo %s -d %d -s %d -p %s -M %d -c %s -t %d -b %d -h %d -m %d -l %d",
-	       program_name,
-	       g_arbitration.io_queue_depth,
-	       g_arbitration.io_size_bytes,
-	       g_arbitration.io_pattern_type,
-	       g_arbitration.rw_percentage,
-	       g_arbitration.core_mask,
-	       g_arbitration.time_in_sec,
-	       g_arbitration.arbitration_burst,
-	       g_arbitration.high_priority_weight,
-	       g_arbitration.medium_priority_weight,
-	       g_arbitration.low_priority_weight);
-	printf(g_arbitration.enable_urgent ? " -u" : "");
-	printf("\n");
-
-	printf("========================================================\n");
+	struct worker_thread *worker;
+	struct worker_ns_ctx *ns_ctx;
 
 	TAILQ_FOREACH(worker, &g_workers, link) {
 		TAILQ_FOREACH(ns_ctx, &worker->ns_ctx, link) {
-			io_per_second = (double)ns_ctx->io_completed / g_arbitration.time_in_sec;
-			sent_comparison_io_in_secs = COMPARISON_IO_COUNT / io_per_second;
-			mb_per_second = io_per_second * g_arbitration.io_size_bytes / (1024 * 1024);
-			average_latency = ((double)ns_ctx->stats.total_tsc / ns_ctx->io_completed) * SECOND_TO_MICROSECOND / g_arbitration.tsc_rate;
-  			min_latency = (double)ns_ctx->stats.min_tsc * SECOND_TO_MICROSECOND / g_arbitration.tsc_rate;
-  			max_latency = (double)ns_ctx->stats.max_tsc * SECOND_TO_MICROSECOND / g_arbitration.tsc_rate;
-
-			printf("%-43.43s Namespace %u with core %u: %8.2lf IO/s %8.2lf secs/%d ios %8.2lf MiB/s  ",
-				   ns_ctx->ns_entry->name, spdk_nvme_ns_get_id(ns_ctx->ns_entry->nvme.ns), worker->lcore, io_per_second, sent_comparison_io_in_secs, COMPARISON_IO_COUNT, mb_per_second);
-			printf("Latency average: %8.2f min: %8.2f: max: %8.2f\n",
-				   average_latency, min_latency, max_latency);
+			if (__atomic_load_n(&ns_ctx->fill_next, __ATOMIC_RELAXED) != ns_ctx->fill_end ||
+				__atomic_load_n(&ns_ctx->current_queue_depth, __ATOMIC_RELAXED) != 0) {
+				return false;
+			}
 		}
 	}
-	printf("========================================================\n");
-}
 
-static void
-cleanup_ns_worker_ctx(struct worker_ns_ctx *ns_ctx)
-{
-	spdk_nvme_ctrlr_free_io_qpair(ns_ctx->qpair);
+	return true;
 }
 
+// On the main core, reports the progress and ends the fill once every block
+// was written and the random overwrite after its time or once steady
 static void
-cleanup(uint32_t task_count)
+precondition_poll(void)
 {
-	struct worker_thread *worker, *tmp_worker;
-	struct worker_ns_ctx *ns_ctx, *tmp_ns_ctx;
-	struct ns_entry *ns_entry, *tmp_ns_entry;
-	struct ctrlr_entry *ctrlr_entry, *tmp_ctrlr_entry;
-	struct spdk_nvme_detach_ctx *detach_ctx = NULL;
+	uint64_t now, writes;
+	double mib_per_second, iops;
+	uint32_t slot;
+	bool done = false;
 
-	if (spdk_mempool_count(g_task_pool) != (size_t)task_count) {
-		fprintf(stderr, "task_pool count is %zu but should be %u\n", 
-				spdk_mempool_count(g_task_pool), task_count);
+	if (g_precondition.end_tsc != UINT64_MAX) {
+		return;
 	}
-	spdk_mempool_free(g_task_pool);
-
-	TAILQ_FOREACH_SAFE(worker, &g_workers, link, tmp_worker) {
-		TAILQ_REMOVE(&g_workers, worker, link);
+	now = arb_get_ticks();
+	if (now < g_precondition.next_check_tsc) {
+		return;
+	}
+	g_precondition.next_check_tsc = now + PRECONDITION_CHECK_MS * g_arbitration.tsc_rate / 1000;
+	writes = precondition_writes();
 
-		/* ns_worker_ctx is a list in the worker */
-		TAILQ_FOREACH_SAFE(ns_ctx, &worker->ns_ctx, link, tmp_ns_ctx) {
-			TAILQ_REMOVE(&worker->ns_ctx, ns_ctx, link);
-			free(ns_ctx);
+	if (g_precondition.phase == PRECONDITION_FILL) {
+		done = writes >= g_precondition.fill_ios;
+		if (!done && precondition_filled()) {
+			printf("WARNING: preconditioning wrote %" PRIu64 " of %" PRIu64 " I/O, the others failed\n",
+				   writes, g_precondition.fill_ios);
+			done = true;
 		}
+	} else if (g_precondition.random_steady) {
+		if (now >= g_precondition.next_round_tsc) {
+			slot = g_precondition.rounds % STEADY_MAX_WINDOW;
+			iops = (double)(writes - g_precondition.round_ios) / g_precondition.interval_s;
+			g_precondition.iops[slot] = iops;
+			g_precondition.rounds++;
+			g_precondition.round_ios = writes;
+			g_precondition.next_round_tsc = now + (uint64_t)g_precondition.interval_s * g_arbitration.tsc_rate;
+			printf("Preconditioning round %u: %.2f write IO/s\n", g_precondition.rounds, iops);
+			if (g_precondition.rounds >= g_precondition.window &&
+				steady_state_reached(g_precondition.iops, g_precondition.rounds, g_precondition.window)) {
+				printf("Preconditioning: steady after %u rounds\n", g_precondition.rounds);
+				done = true;
+			} else if (g_precondition.rounds >= g_precondition.max_rounds) {
+				printf("WARNING: preconditioning not steady after %u rounds\n", g_precondition.rounds);
+				done = true;
+			}
+		}
+	} else {
+		done = now - g_precondition.start_tsc >= (uint64_t)g_precondition.random_s * g_arbitration.tsc_rate;
+	}
 
-		free(worker);
-	};
-
-	TAILQ_FOREACH_SAFE(ns_entry, &g_namespaces, link, tmp_ns_entry) {
-		TAILQ_REMOVE(&g_namespaces, ns_entry, link);
-		free(ns_entry);
-	};
-
-	TAILQ_FOREACH_SAFE(ctrlr_entry, &g_controllers, link, tmp_ctrlr_entry) {
-		TAILQ_REMOVE(&g_controllers, ctrlr_entry, link);
-		spdk_nvme_detach_async(ctrlr_entry->ctrlr, &detach_ctx);
-		free(ctrlr_entry);
+	if (!done && now >= g_precondition.next_report_tsc) {
+		mib_per_second = (double)(writes - g_precondition.report_ios) * g_arbitration.io_size_bytes /
+						 (1024 * 1024) * g_arbitration.tsc_rate / (now - g_precondition.report_tsc);
+		if (g_precondition.phase == PRECONDITION_FILL) {
+			printf("Preconditioning: %5.1f%% filled, %.2f MiB/s\n",
+				   (double)writes * 100 / g_precondition.fill_ios, mib_per_second);
+		} else {
+			printf("Preconditioning: %.0f seconds of random overwrite, %.2f MiB/s\n",
+				   (double)(now - g_precondition.start_tsc) / g_arbitration.tsc_rate, mib_per_second);
+		}
+		g_precondition.report_tsc = now;
+		g_precondition.report_ios = writes;
+		g_precondition.next_report_tsc = now + PRECONDITION_REPORT_S * g_arbitration.tsc_rate;
 	}
 
-	if (detach_ctx) {
-		spdk_nvme_detach_poll(detach_ctx);
+	if (done) {
+		__atomic_store_n(&g_precondition.end_tsc, 0, __ATOMIC_RELAXED);
 	}
 }
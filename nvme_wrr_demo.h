@@ -3,13 +3,341 @@
 #include "spdk/env.h"
 #include "spdk/nvme.h"
 #include "spdk/event.h"
+#include "spdk/crc32.h"
+#include "spdk/util.h"
+#include "spdk/json.h"
+#include "spdk/dif.h"
+
+#include "nvme_wrr_backend.h"
+#include "nvme_wrr_telemetry.h"
+
+#include <fnmatch.h>
+#include <math.h>
 
 #define COMPARISON_IO_COUNT 100000
 
 #define SECOND_TO_MICROSECOND 1000000
 
-// outstanding == problems have not yet been resolved
-int	g_outstanding_commands = 0;
+// Only the first few verify mismatches are printed, the rest are only counted
+#define VERIFY_MAX_REPORTED_ERRORS 16
+
+// Application tag of the protection information written with --pi
+#define ARB_PI_APPTAG 0x5752
+
+// Granularity of compression and deduplication in write payloads
+#define PAYLOAD_CHUNK_SIZE 4096
+
+// Admin commands used to estimate the fabric round trip of a controller
+#define RTT_PROBE_COMMANDS 16
+
+// Options without a short form start after the printable characters
+enum arb_long_option {
+	ARB_OPT_VERIFY = 256,
+	ARB_OPT_VERIFY_SEED,
+	ARB_OPT_PAYLOAD,
+	ARB_OPT_PAYLOAD_POOL,
+	ARB_OPT_SGL_SEGMENTS,
+	ARB_OPT_CMD_MIX,
+	ARB_OPT_HOST_WRR,
+	ARB_OPT_BACKEND,
+	ARB_OPT_FILENAME,
+	ARB_OPT_URING_SQPOLL,
+	ARB_OPT_SIM_NAMESPACES,
+	ARB_OPT_SIM_NS_SIZE,
+	ARB_OPT_SIM_LATENCY,
+	ARB_OPT_SIM_SERVICE,
+	ARB_OPT_SIM_PARALLELISM,
+	ARB_OPT_SIM_SEED,
+	ARB_OPT_NO_HUGE,
+	ARB_OPT_ARB_RULE,
+	ARB_OPT_QOS,
+	ARB_OPT_SLO,
+	ARB_OPT_EDF,
+	ARB_OPT_SHM_ID,
+	ARB_OPT_TENANTS,
+	ARB_OPT_TENANT,
+	ARB_OPT_CONTROL,
+	ARB_OPT_TELEMETRY,
+	ARB_OPT_STAGES,
+	ARB_OPT_STEADY_STATE,
+	ARB_OPT_REPEAT,
+	ARB_OPT_JSON_OUT,
+	ARB_OPT_BASELINE,
+	ARB_OPT_REGION,
+	ARB_OPT_STREAMS,
+	ARB_OPT_PRECONDITION,
+	ARB_OPT_PI,
+	ARB_OPT_SIM_MD,
+	ARB_OPT_QPAIRS,
+	ARB_OPT_UNLOADED,
+	ARB_OPT_TIMELINE,
+	ARB_OPT_READ_SINK,
+};
+
+// Memzone the tenant processes of one --shm-id report their results in
+#define TENANT_MEMZONE_NAME "nvme_wrr_tenants"
+
+// Upper bounds of --tenants and of the namespace contexts of one tenant
+#define TENANT_MAX 16
+#define TENANT_MAX_NS_CTX 64
+
+// Interval the primary checks on the tenants and the admin queues in
+#define TENANT_POLL_US 10000
+
+// A tenant only has a pid to check once it claimed a slot, one which has
+// not claimed it by then is taken as dead before it attached
+#define TENANT_ATTACH_TIMEOUT_S 60
+
+enum tenant_state {
+	TENANT_FREE,
+	TENANT_RUNNING,
+	// Stats are complete, published with release ordering
+	TENANT_DONE,
+};
+
+struct tenant_ns_stats {
+	char					name[64];
+	uint32_t				nsid;
+	uint32_t				lcore;
+	uint64_t				io_completed;
+	// Tenants may run with different I/O sizes
+	uint64_t				data_bytes;
+	uint64_t				total_tsc;
+	uint64_t				min_tsc;
+	uint64_t				max_tsc;
+	uint64_t				slo_met;
+	uint64_t				slo_missed;
+};
+
+// Written only by the tenant which claimed it
+struct tenant_slot {
+	uint32_t				state;
+	pid_t					pid;
+	enum spdk_nvme_qprio	qprio;
+	uint64_t				tsc_rate;
+	int						time_in_sec;
+	// Cost of a process of its own, env init and attach to the primary's controllers
+	uint64_t				env_init_tsc;
+	uint64_t				attach_tsc;
+	uint32_t				num_ns_ctx;
+	struct tenant_ns_stats	ns[TENANT_MAX_NS_CTX];
+};
+
+struct tenant_region {
+	uint32_t				num_claimed;
+	struct tenant_slot		slots[TENANT_MAX];
+};
+
+// One request of the --control socket per line, up to this size
+#define CONTROL_BUF_SIZE 4096
+#define CONTROL_MAX_VALUES 64
+
+// Replies wait for a client which reads slowly, one which leaves this much
+// unread is dropped
+#define CONTROL_OUT_MAX (1024 * 1024)
+
+// Interval the main core checks the --control socket in
+#define CONTROL_POLL_US 1000
+
+// Steady state as in the SNIA PTS: over a window of rounds, the range of
+// a value stays within 20% of its average and the excursion of its linear
+// fit within 10%. Rounds stop at the maximum, steady or not.
+#define STEADY_DEFAULT_WINDOW 5
+#define STEADY_DEFAULT_MAX_ROUNDS 25
+#define STEADY_MAX_WINDOW 32
+#define STEADY_RANGE_PCT 20
+#define STEADY_SLOPE_PCT 10
+
+// Rounds of --precondition random=steady without --steady-state
+#define PRECONDITION_DEFAULT_INTERVAL_S 10
+// The main core checks the progress of --precondition this often and
+// prints it every PRECONDITION_REPORT_S
+#define PRECONDITION_CHECK_MS 10
+#define PRECONDITION_REPORT_S 5
+
+// Upper bound of --repeat and of the runs of a --baseline class
+#define REPEAT_MAX 100
+
+// Version of the --json-out document
+#define RESULTS_JSON_VERSION 1
+
+// Messages from the --control socket waiting for one worker
+#define WORKER_MAILBOX_SIZE 16
+
+enum worker_msg_type {
+	// A queue_depth of 0 takes the depth from the weights again, except
+	// where set_class set it
+	WORKER_MSG_QUEUE_DEPTH,
+	WORKER_MSG_PAUSE,
+	WORKER_MSG_RESUME,
+	// The caps of the class changed in g_arbitration.classes
+	WORKER_MSG_QOS,
+	// --steady-state reached, the measurement starts from zero
+	WORKER_MSG_RESET_STATS,
+};
+
+struct worker_msg {
+	enum worker_msg_type	type;
+	uint32_t				queue_depth;
+};
+
+// Single producer, the control socket on the main core, single consumer, the worker
+struct worker_mailbox {
+	struct worker_msg		msgs[WORKER_MAILBOX_SIZE];
+	uint32_t				head;
+	uint32_t				tail;
+};
+
+// Upper bound of --arb-rule
+#define ARB_MAX_RULES 16
+
+// Values of the Arbitration feature, weights are 1's based
+struct arb_settings {
+	uint32_t		burst;
+	uint32_t		high_priority_weight;
+	uint32_t		medium_priority_weight;
+	uint32_t		low_priority_weight;
+};
+
+// Arbitration for the controllers whose model or serial number matches a
+// fnmatch() pattern. Values left out (-1) are taken from -b/-h/-m/-l.
+struct arb_rule {
+	bool			match_serial;
+	char			pattern[64];
+	int				burst;
+	int				high_priority_weight;
+	int				medium_priority_weight;
+	int				low_priority_weight;
+	// As given on the command line
+	char			str[128];
+};
+
+// Settings that differ between the priority classes
+struct class_config {
+	// Percentage of the commands which are not reads or writes
+	uint32_t		flush_percentage;
+	uint32_t		dsm_percentage;
+	uint32_t		write_zeroes_percentage;
+	// --qos caps, 0 means unlimited
+	uint64_t		iops_limit;
+	uint64_t		bw_limit_bytes;
+	// I/O the class may issue back to back after being idle, 0 means -d
+	uint32_t		qos_burst;
+	// One bucket for all workers of the class instead of one per namespace and worker
+	bool			qos_shared;
+	// --slo, completion deadline after the I/O was issued, 0 means none
+	uint32_t		slo_us[ARB_OP_COUNT];
+	// --region, in MiB or in percent of the namespace, a size of 0 runs to its end
+	bool			region_set;
+	bool			region_start_pct;
+	bool			region_size_pct;
+	uint64_t		region_start;
+	uint64_t		region_size;
+	// --qpairs, queue pairs per namespace and worker the depth is spread over, 0 means 1
+	uint32_t		num_qpairs;
+};
+
+// Sequential cursors of a namespace context with --streams
+#define ARB_MAX_STREAMS 16
+
+// Queue pairs of a namespace context with --qpairs
+#define ARB_MAX_QPAIRS 16
+
+// Size classes of the private buffers of a worker, powers of two from
+// 512 bytes to 256 MiB
+#define BUF_POOL_MIN_SHIFT 9
+#define BUF_POOL_CLASSES 20
+
+// What a worker takes DMA memory from the backend for
+enum worker_dma_pool {
+	WORKER_DMA_PAYLOAD,
+	WORKER_DMA_SEGMENTS,
+	WORKER_DMA_BUFS,
+	WORKER_DMA_SINK,
+	WORKER_DMA_POOLS,
+};
+
+// Deadline that orders I/O without an SLO behind the others in --edf,
+// such I/O never count as missed
+#define EDF_NO_SLO_US 1000000
+
+// Heap entries are 16 bytes, so the four children of a node share a cache line
+#define EDF_HEAP_ARITY 4
+
+struct edf_entry {
+	uint64_t			deadline_tsc;
+	struct arb_task		*task;
+};
+
+// Host scheduler of --edf, one for all workers so the I/O of every class
+// wait in the same heap and go to the queue pairs of their class, with its
+// hardware priority, earliest deadline first
+struct edf_sched {
+	pthread_spinlock_t	lock;
+	struct edf_entry	*heap;
+	uint32_t			count;
+	uint32_t			capacity;
+	// Let through and not completed yet, wherever they wait
+	uint32_t			inflight;
+	uint32_t			max_inflight;
+};
+
+static struct edf_sched g_edf;
+
+// I/O of a worker which the scheduler let through, only the worker itself
+// submits to its queue pairs. Under the lock of the scheduler, count is
+// also read without it.
+struct edf_ready {
+	TAILQ_HEAD(, arb_task)	tasks;
+	uint32_t				count;
+};
+
+// Fraction bits of the per unit cost of a token bucket
+#define TOKEN_BUCKET_SHIFT 16
+
+// Token bucket kept as the tick at which it is full again, so one compare
+// and swap both refills it from the clock and charges it. A command goes out
+// while one nominal I/O fits, the bucket may then run short by its real cost.
+struct token_bucket {
+	// Ticks that one unit refills in, << TOKEN_BUCKET_SHIFT.
+	// Both rates are changed by --control while the bucket is in use.
+	uint64_t		unit_ticks;
+	// How far ahead of the clock full_tick may be and still admit a command
+	uint64_t		admit_ticks;
+	uint64_t		full_tick;
+};
+
+struct qos_buckets {
+	// NULL when the class has no such cap
+	struct token_bucket	*iops;
+	struct token_bucket	*bytes;
+	struct token_bucket	iops_bucket;
+	struct token_bucket	bytes_bucket;
+};
+
+// Buckets of the classes with a shared --qos
+static struct qos_buckets g_class_qos[SPDK_NVME_QPRIO_MAX];
+
+// Content of the write payloads
+enum payload_type {
+	PAYLOAD_ZERO,
+	PAYLOAD_RANDOM,
+	// Ratio percent of every chunk is zeros, the rest random, the percent
+	// compressible as fio has it
+	PAYLOAD_COMPRESS,
+	// Ratio percent of the chunks are copies of other chunks
+	PAYLOAD_DEDUP,
+};
+
+// Protection information of namespaces formatted with it
+enum arb_pi_mode {
+	// Written and read as they are, nothing generated or checked
+	ARB_PI_OFF,
+	// The controller inserts it on writes and checks and strips it on reads
+	ARB_PI_PRACT,
+	// The host generates and checks it, the controller checks it too
+	ARB_PI_HOST,
+};
 
 static __thread unsigned int random_seed = 0;
 
@@ -27,8 +355,64 @@ struct arb_context {
 	uint32_t		medium_priority_weight;
 	uint32_t		low_priority_weight;
 	bool			enable_urgent;
+	bool			verify;
+	uint32_t		verify_seed;
+	// --verify-seed was given, 0 is a seed like any other
+	bool			verify_seed_set;
+	const char		*payload_spec;
+	enum payload_type	payload_type;
+	uint32_t		payload_ratio;
+	uint32_t		payload_pool_mib;
+	// --read-sink, reads of a worker land in this many shared buffers instead
+	// of one each, 0 without
+	uint32_t		read_sink_bufs;
+	// Data buffer of one I/O, -s plus the interleaved metadata of the
+	// namespace with the most of it
+	uint32_t		io_buf_bytes;
+	// --pi, checks are SPDK_DIF_FLAGS_*_CHECK
+	const char		*pi_spec;
+	enum arb_pi_mode	pi_mode;
+	uint32_t		pi_checks;
+	// 0 means contiguous buffers through spdk_nvme_ns_cmd_read/write
+	uint32_t		sgl_segments;
+	// Commands in flight of all classes with the --edf host scheduler, 0 means off
+	uint32_t		edf_inflight;
+	// Indexed by enum spdk_nvme_qprio
+	struct class_config	classes[SPDK_NVME_QPRIO_MAX];
+	// Scale queue depth by weight on controllers without WRR
+	bool			host_wrr;
+	// Split the latency into enum arb_stage
+	bool			stages;
+	// -o file of beginner, the QD1 latencies of each namespace on its own
+	const char		*unloaded_path;
+	// --region split, the contexts sharing a namespace and a class range get
+	// disjoint parts of it
+	bool			region_split;
+	uint32_t		num_streams;
+	// The first matching rule wins
+	struct arb_rule	rules[ARB_MAX_RULES];
+	int				num_rules;
+	const char		*backend_name;
+	struct arb_backend_opts	backend_opts;
+	bool			no_huge;
+	// SPDK multi-process, -1 for a process of its own
+	int				shm_id;
+	// Primary of --tenants, only attaches, programs arbitration and reports
+	uint32_t		num_tenants;
+	// Secondary of --tenant, every worker runs this class
+	bool			tenant;
+	enum spdk_nvme_qprio	tenant_qprio;
+	struct tenant_slot		*tenant_slot;
 	// Get by using SPDK
 	uint64_t		tsc_rate;
+	// Startup breakdown, in TSC ticks of the host whatever the backend clock is
+	struct {
+		uint64_t	start_tsc;
+		uint64_t	env_init_tsc;
+		uint64_t	attach_tsc;
+		uint64_t	ctrlr_setup_tsc;
+		uint64_t	ready_tsc;
+	} startup;
 	// Other
 	int				num_workers;
 	int				num_namespaces;
@@ -49,32 +433,137 @@ static struct arb_context g_arbitration = {
 	.medium_priority_weight		= 8,
 	.low_priority_weight		= 4,
 	.enable_urgent				= false,
+	.verify						= false,
+	.verify_seed				= 0,
+	.payload_spec				= "zero",
+	.payload_type				= PAYLOAD_ZERO,
+	.payload_ratio				= 0,
+	.payload_pool_mib			= 8,
+	.sgl_segments				= 0,
+	.host_wrr					= false,
+	.region_split				= false,
+	.num_streams				= 1,
+	.backend_name				= "nvme",
+	.backend_opts				= {
+		.sim_namespaces			= 1,
+		.sim_ns_size			= 1024ULL * 1024 * 1024,
+		.sim_service			= {
+			[ARB_OP_READ]			= {ARB_SIM_DIST_FIXED, 50, 50},
+			[ARB_OP_WRITE]			= {ARB_SIM_DIST_FIXED, 50, 50},
+			[ARB_OP_FLUSH]			= {ARB_SIM_DIST_FIXED, 50, 50},
+			[ARB_OP_DSM]			= {ARB_SIM_DIST_FIXED, 50, 50},
+			[ARB_OP_WRITE_ZEROES]	= {ARB_SIM_DIST_FIXED, 50, 50},
+		},
+		.sim_parallelism		= 8,
+		.sim_seed				= 1,
+	},
+	.no_huge					= false,
+	.shm_id						= -1,
+	.num_tenants				= 0,
+	.tenant						= false,
 	// Initial value
 	.num_workers				= 0,
 	.num_namespaces				= 0,
 };
 
-// Use to store the features fetched from controller
-struct feature_entry {
-	uint32_t				result;
-	bool					valid;
+// Transport IDs given by -r, each probed on its own
+struct trid_entry {
+	struct spdk_nvme_transport_id	trid;
+	// Per transport tuning, 0 means the driver default
+	uint32_t						num_io_queues;
+	uint32_t						io_queue_size;
+	char							str[512];
+	TAILQ_ENTRY(trid_entry)			link;
+};
+
+static TAILQ_HEAD(, trid_entry) g_trid_list = TAILQ_HEAD_INITIALIZER(g_trid_list);
+
+// Admin commands run on every controller after attach. Each one is issued
+// from the completion of the previous one, so all controllers proceed at once.
+enum ctrlr_setup_state {
+	CTRLR_SETUP_GET_ARB,
+	CTRLR_SETUP_SET_ARB,
+	CTRLR_SETUP_CHECK_ARB,
+	CTRLR_SETUP_RTT,
+	CTRLR_SETUP_DONE,
+};
+
+struct ctrlr_setup {
+	enum ctrlr_setup_state	state;
+	// Arbitration feature before and after Set Features
+	uint32_t				arb_before;
+	uint32_t				arb_after;
+	bool					before_valid;
+	bool					set_valid;
+	bool					after_valid;
+	uint32_t				rtt_probes;
+	uint64_t				cmd_start_tsc;
+	uint64_t				attach_tsc;
+	uint64_t				done_tsc;
+};
+
+// What --timeline keeps of one SMART / Health Information log page
+struct health_sample {
+	// Kelvin, 0 before the first sample
+	uint16_t		temperature;
+	uint8_t			percentage_used;
+	uint8_t			critical_warning;
+	// Minutes above the warning and critical composite temperature thresholds
+	uint32_t		warning_temp_time;
+	uint32_t		critical_temp_time;
+	// Thermal management temperature 1 and 2, the light and heavy throttling
+	uint32_t		tmt_transitions[2];
+	uint32_t		tmt_time_s[2];
 };
 
-static struct feature_entry g_features[SPDK_NVME_FEAT_ARBITRATION + 1] = {};
+struct ctrlr_health {
+	// Filled by the admin queue, only read once pending is clear
+	struct spdk_nvme_health_information_page	page;
+	bool				pending;
+	bool				failed;
+	// The last sample is of the current interval of the timeline
+	bool				fresh;
+	uint32_t			samples;
+	struct health_sample	first;
+	struct health_sample	last;
+	uint16_t			min_temperature;
+	uint16_t			max_temperature;
+	// Every critical warning bit seen during the run
+	uint8_t				critical_warnings;
+};
 
 struct ctrlr_entry {
+	// NULL for backends other than nvme
 	struct spdk_nvme_ctrlr		*ctrlr;
 	TAILQ_ENTRY(ctrlr_entry)	link;
 	char					    name[1024];
+	enum spdk_nvme_transport_type	trtype;
+	// The device arbitrates between the prioritized submission queues
+	bool						wrr_enabled;
+	// Minimum admin command round trip, the fixed cost of the transport
+	uint64_t					admin_rtt_tsc;
+	// Model and serial number without the padding
+	char						mn[41];
+	char						sn[21];
+	// Arbitration asked of this controller and the rule it came from, -1 for -b/-h/-m/-l
+	struct arb_settings			arb;
+	int							arb_rule;
+	struct ctrlr_setup			setup;
+	struct ctrlr_health			health;
 };
 
 static TAILQ_HEAD(, ctrlr_entry) g_controllers = TAILQ_HEAD_INITIALIZER(g_controllers);
 
 struct ns_entry {
+	// Only set with the nvme backend
 	struct {
 		struct spdk_nvme_ctrlr	*ctrlr;
 		struct spdk_nvme_ns		*ns;
 	} nvme;
+	// Handle of the namespace inside the backend
+	void						*backend_ns;
+	uint32_t					nsid;
+	struct ctrlr_entry			*ctrlr_entry;
 
 	TAILQ_ENTRY(ns_entry)		link;
 	char					    name[1024];
@@ -83,26 +572,252 @@ struct ns_entry {
 	uint64_t				    size_in_ios;
 	// The amount of blocks of io size
 	uint32_t				    io_size_blocks;
+	uint32_t				    block_size;
+	// SPDK_NVME_NS_*_SUPPORTED
+	uint32_t				    flags;
+	// Format as the host sees it, block_size plus md_size between two
+	// blocks of the data buffer when the metadata is interleaved
+	uint32_t					buf_block_size;
+	uint32_t					io_buf_bytes;
+	uint32_t					md_size;
+	bool						md_interleave;
+	// Separate metadata of one I/O, 0 without
+	uint32_t					io_md_bytes;
+	enum spdk_nvme_pi_type		pi_type;
+	bool						pi_loc;
+	// PRACT and PRCHK flags of reads and writes
+	uint32_t					io_flags;
+	// Generate the protection information of writes and check the one of
+	// reads on the host, with --pi host
+	bool						host_pi;
+	// Verify mode only, one generation word per io sized slot
+	uint32_t				    *gen_map;
+	// Mean QD1 latencies of the --unloaded pre-flight check, 0 when unknown
+	uint64_t					unloaded_read_ns;
+	uint64_t					unloaded_write_ns;
 };
 
+// Generation word layout of gen_map
+// [31:16] generation of the last submitted write, 0 means never written in this run
+// [15]    the content on media is unknown (overlapped or failed writes)
+// [14:0]  writes in flight
+#define GEN_MAP_SHIFT			16
+#define GEN_MAP_AMBIGUOUS		0x8000u
+#define GEN_MAP_INFLIGHT_MASK	0x7fffu
+
+// Stamped at the beginning of every block written in verify mode
+struct verify_header {
+	uint64_t	lba;
+	uint32_t	generation;
+	uint32_t	seed;
+	// CRC32C of the fields above and the rest of the block
+	uint32_t	crc;
+} __attribute__((packed));
+
 static TAILQ_HEAD(, ns_entry) g_namespaces = TAILQ_HEAD_INITIALIZER(g_namespaces);
 
+// Pre-generated write payloads of a worker, handed out in turn without copying
+struct payload_pool {
+	uint8_t						*base;
+	uint64_t					size;
+	uint64_t					num_slots;
+	uint64_t					next_slot;
+};
+
+// Private segments of a worker for vectored reads and stamped writes.
+// Segments are spaced apart so that the ones of a single I/O never touch.
+struct segment_pool {
+	uint8_t						*base;
+	uint64_t					size;
+	void						**free_segs;
+	uint32_t					num_free;
+};
+
+// Private buffers of a worker, data of stamped writes and reads and the
+// separate metadata. Those of -d I/O of each context are taken from the
+// backend before the run and kept on the free list of their size class
+// instead of going back after each I/O.
+struct buf_pool {
+	// Chained through their first bytes while free
+	void						*free[BUF_POOL_CLASSES];
+	uint32_t					allocated[BUF_POOL_CLASSES];
+};
+
+// --read-sink, the data of reads is overwritten by the next ones
+struct read_sink {
+	uint8_t						*base;
+	uint32_t					num_bufs;
+	uint32_t					next;
+};
+
+struct op_stats {
+	uint64_t					io_completed;
+	uint64_t					total_tsc;
+	uint64_t					max_tsc;
+	uint64_t					min_tsc;
+};
+
+// Parts of the latency of a command with --stages, in backend ticks
+enum arb_stage {
+	// Issue to the return of the backend submit, the --edf heap included
+	ARB_STAGE_SUBMIT,
+	// Submitted to the start of the poll which reaped the completion
+	ARB_STAGE_DEVICE,
+	// Start of that poll to the callback, the completions reaped before it
+	ARB_STAGE_REAP,
+	// The callback itself, accounting and the replacement submission
+	ARB_STAGE_CALLBACK,
+	// Between two polls of the queue pair of which the second reaped
+	// completions, the most the device stage owes to the polling loop
+	ARB_STAGE_POLL_GAP,
+	ARB_STAGE_COUNT,
+};
+
+// Log-linear buckets of nvme_wrr_telemetry.h
+struct stage_hist {
+	uint64_t					count;
+	uint64_t					total_tsc;
+	uint64_t					max_tsc;
+	uint64_t					buckets[TELEMETRY_HIST_BUCKETS];
+};
+
+struct stage_stats {
+	// Start of the current poll of the queue pair, of the previous one between polls
+	uint64_t					poll_tsc;
+	struct stage_hist			hist[ARB_STAGE_COUNT];
+};
+
+struct worker_ns_ctx;
+
+// Where and what the next I/O of a context is, picked per context at the
+// start of every run by ns_ctx_specialize() so that the submit path does
+// not test the workload on every I/O
+typedef uint64_t (*arb_offset_fn)(struct worker_ns_ctx *ns_ctx);
+typedef enum arb_op (*arb_op_fn)(struct worker_ns_ctx *ns_ctx);
+
 struct worker_ns_ctx {
 	struct ns_entry				*ns_entry;
 	TAILQ_ENTRY(worker_ns_ctx)	link;
-	struct spdk_nvme_qpair		*qpair;
-	// For sequential access
-	uint64_t					offset_in_ios;
+	// Copies of what every I/O needs, next to each other instead of behind
+	// ns_entry and the globals shared by all cores
+	arb_offset_fn				next_offset;
+	arb_op_fn					next_op;
+	void						*backend_ns;
+	uint64_t					size_in_ios;
+	uint32_t					io_size_blocks;
+	uint32_t					io_flags;
+	uint32_t					read_percentage;
+	uint32_t					num_streams;
+	bool						vectored;
+	bool						host_pi;
+	// --precondition fill, the context stops once its part is issued
+	bool						filling;
+	// Queue pairs of the backend, struct spdk_nvme_qpair for nvme, the
+	// commands go round robin over them
+	void						*qpairs[ARB_MAX_QPAIRS];
+	uint32_t					num_qpairs;
+	uint32_t					next_qpair;
+	// Commands the backend had no room for, submitted again after each poll
+	TAILQ_HEAD(, arb_task)		retry_queue;
+	enum spdk_nvme_qprio		qprio;
+	const struct class_config	*class_cfg;
+	struct payload_pool			*payload;
+	struct segment_pool			*segments;
+	struct buf_pool				*bufs;
+	// NULL when each read gets a buffer of its own
+	struct read_sink			*sink;
+	// --precondition fill, this context writes [fill_next, fill_end)
+	uint64_t					fill_next;
+	uint64_t					fill_end;
+	// LBA region in I/O of -s, [region_start, region_start + region_size)
+	uint64_t					region_start;
+	uint64_t					region_size;
+	// For sequential access, each stream walks its own slice of the region
+	// and the I/O go round robin over the streams
+	uint64_t					stream_size;
+	uint32_t					next_stream;
+	uint64_t					stream_offset[ARB_MAX_STREAMS];
+	// Depth kept by this context, lower than -d with --host-wrr
+	int							queue_depth;
+	// Set by --control set_class, kept when the weights of --host-wrr change
+	bool						queue_depth_set;
 	// For judge if all the io commands are completed
 	uint64_t					current_queue_depth;
 	bool						is_draining;
+	// --qos, NULL without caps, either the private or the class buckets
+	struct qos_buckets			*qos;
+	struct qos_buckets			qos_private;
+	// Submissions waiting for tokens, issued from worker_poll() in order
+	uint32_t					qos_deferred;
+	// Stopped by --control, the outstanding I/O complete and are not replaced
+	bool						paused;
+	// The --edf scheduler, NULL otherwise
+	struct edf_sched			*edf;
+	// Where the scheduler hands back the I/O of this context
+	struct edf_ready			*edf_ready;
+	// Record of the --telemetry file, NULL without it
+	struct telemetry_slot		*telemetry;
+	// --stages, NULL without it
+	struct stage_stats			*stages;
 	// Use for statistics
 	uint64_t					io_completed;
 	struct {
 		uint64_t				total_tsc;
 		uint64_t				max_tsc;
 		uint64_t				min_tsc;
+		// Cycles spent inside spdk_nvme_ns_cmd_*, including PRP/SGL construction
+		uint64_t				submit_call_tsc;
+		// Cycles spent in issue_single_io, the submit call included
+		uint64_t				issue_tsc;
+		// Submissions put on the retry queue, and the ones which failed otherwise
+		uint64_t				submit_retries;
+		uint64_t				submit_errors;
 	} stats;
+	struct op_stats				op_stats[ARB_OP_COUNT];
+	struct {
+		uint64_t				generated;
+		uint64_t				checked;
+		// Found by the host and reported by the controller
+		uint64_t				host_errors;
+		uint64_t				device_errors;
+		// Cycles spent on generating and checking
+		uint64_t				total_tsc;
+	} pi;
+	struct {
+		// Time with at least one submission waiting for tokens
+		uint64_t				throttle_start_tsc;
+		uint64_t				throttled_tsc;
+		uint64_t				deferred_ios;
+	} qos_stats;
+	struct {
+		uint64_t				met;
+		uint64_t				missed;
+		// Sum of the time past the deadline of the missed ones
+		uint64_t				late_tsc;
+	} slo_stats;
+	struct {
+		uint64_t				checked;
+		uint64_t				skipped;
+		uint64_t				errors;
+		// Cycles spent on stamping and checking
+		uint64_t				total_tsc;
+	} verify;
+};
+
+// Host TSC cycles of a worker, read once per poll of a queue pair and once
+// per pass of the loop. Submission is inside the polls which reaped
+// completions, its cost comes from stats.submit_call_tsc of the contexts.
+struct worker_cpu_stats {
+	uint64_t						polls;
+	uint64_t						empty_polls;
+	uint64_t						completions;
+	// Polls which reaped completions, with the callbacks and resubmission
+	uint64_t						busy_poll_tsc;
+	uint64_t						empty_poll_tsc;
+	// Mailbox, --edf hand-over, --qos release, deadline check and --control
+	// between the polls
+	uint64_t						loop_tsc;
+	uint64_t						last_tsc;
 };
 
 struct worker_thread {
@@ -111,18 +826,306 @@ struct worker_thread {
 	// Logical core
 	unsigned						lcore;
 	enum spdk_nvme_qprio			qprio;
+	struct payload_pool				payload;
+	struct segment_pool				segments;
+	struct buf_pool					bufs;
+	struct read_sink				sink;
+	// Bytes each pool took from the backend for the run, until worker_fini()
+	uint64_t						dma_bytes[WORKER_DMA_POOLS];
+	struct edf_ready				edf_ready;
+	struct worker_mailbox			mailbox;
+	struct worker_cpu_stats			cpu;
 };
 
 static TAILQ_HEAD(, worker_thread) g_workers = TAILQ_HEAD_INITIALIZER(g_workers);
 
+// --control, a single client at a time
+struct control_server {
+	const char		*path;
+	int				listen_fd;
+	int				client_fd;
+	char			buf[CONTROL_BUF_SIZE];
+	size_t			len;
+	// Replies not sent yet, sent from control_poll() as the socket takes them
+	char			*out;
+	size_t			out_len;
+	size_t			out_size;
+	uint64_t		next_poll_tsc;
+	// Backend ticks at the start of the run
+	uint64_t		start_ticks;
+	uint32_t		main_core;
+};
+
+static struct control_server g_control = {
+	.listen_fd		= -1,
+	.client_fd		= -1,
+};
+
+// --telemetry, mapped for the whole run
+struct telemetry_file {
+	const char				*path;
+	struct telemetry_header	*header;
+	size_t					size;
+};
+
+static struct telemetry_file g_telemetry;
+
+// Hugepages of the whole system from /proc/meminfo, every process on the
+// host included, sampled by every worker before it gives its buffers back
+static struct {
+	uint64_t		page_kb;
+	uint64_t		total;
+	// Most in use at any sample
+	uint64_t		max_used;
+} g_hugepages;
+
+// --steady-state, sampled by the main core while the workers warm up
+struct steady_state {
+	uint32_t		interval_s;
+	uint32_t		window;
+	uint32_t		max_rounds;
+	// UINT64_MAX during the warm-up, the end of the measurement after it
+	uint64_t		end_tsc;
+	uint64_t		next_sample_tsc;
+	uint32_t		rounds;
+	bool			steady;
+	// Workers told to reset so far, the rest are told at the next poll
+	uint32_t		reset_posted;
+	bool			reset_pending;
+	// Per class, counters at the last sample and the values of the last rounds
+	uint64_t		last_ios[SPDK_NVME_QPRIO_MAX];
+	uint64_t		last_total_tsc[SPDK_NVME_QPRIO_MAX];
+	double			iops[SPDK_NVME_QPRIO_MAX][STEADY_MAX_WINDOW];
+	double			latency_us[SPDK_NVME_QPRIO_MAX][STEADY_MAX_WINDOW];
+};
+
+static struct steady_state g_steady;
+
+// --timeline, per class IO/s and latency of every interval of the measured
+// run next to the health log of every controller read at its end
+struct timeline {
+	uint32_t		interval_s;
+	// The first sample of a run only takes the counters and the health logs
+	bool			started;
+	uint64_t		start_tsc;
+	uint64_t		last_sample_tsc;
+	uint64_t		next_sample_tsc;
+	// The row of the last interval waits for the log pages asked at its end,
+	// at the latest until the next interval
+	bool			row_pending;
+	double			row_time_s;
+	bool			active[SPDK_NVME_QPRIO_MAX];
+	double			iops[SPDK_NVME_QPRIO_MAX];
+	double			latency_us[SPDK_NVME_QPRIO_MAX];
+	uint64_t		last_ios[SPDK_NVME_QPRIO_MAX];
+	uint64_t		last_total_tsc[SPDK_NVME_QPRIO_MAX];
+};
+
+static struct timeline g_timeline;
+
+enum precondition_phase {
+	PRECONDITION_NONE = 0,
+	// Every block of every namespace written once, sequentially
+	PRECONDITION_FILL,
+	// Writes at random offsets for a time or until steady
+	PRECONDITION_RANDOM,
+};
+
+// --precondition, writes at full depth without --qos or --edf before the
+// measured runs, the controllers stay attached
+struct precondition {
+	bool					fill;
+	// Seconds of random overwrite, 0 without unless random_steady
+	uint32_t				random_s;
+	bool					random_steady;
+	enum precondition_phase	phase;
+	// UINT64_MAX while the phase runs, the main core ends it
+	uint64_t				end_tsc;
+	uint64_t				start_tsc;
+	uint64_t				next_check_tsc;
+	uint64_t				next_report_tsc;
+	uint64_t				report_tsc;
+	uint64_t				report_ios;
+	// Writes of the fill, one per I/O of every namespace
+	uint64_t				fill_ios;
+	// Write IO/s of the rounds of random=steady
+	uint32_t				interval_s;
+	uint32_t				window;
+	uint32_t				max_rounds;
+	uint32_t				rounds;
+	uint64_t				next_round_tsc;
+	uint64_t				round_ios;
+	double					iops[STEADY_MAX_WINDOW];
+};
+
+static struct precondition g_precondition;
+
+// Per class results of one run of --repeat
+struct repeat_result {
+	uint64_t		io_completed[SPDK_NVME_QPRIO_MAX];
+	double			iops[SPDK_NVME_QPRIO_MAX];
+	double			latency_us[SPDK_NVME_QPRIO_MAX];
+	uint32_t		warmup_rounds;
+	bool			steady;
+};
+
+struct repetitions {
+	uint32_t				count;
+	struct repeat_result	*results;
+	const char				*json_out;
+	const char				*baseline;
+};
+
+static struct repetitions g_repeat = {
+	.count		= 1,
+};
+
+// Values of one class read back from a --json-out document
+struct baseline_series {
+	uint64_t		values[REPEAT_MAX];
+	size_t			count;
+};
+
+struct baseline_class {
+	char					*name;
+	struct baseline_series	iops;
+	struct baseline_series	latency_ns;
+};
+
+struct baseline {
+	struct baseline_class	classes[SPDK_NVME_QPRIO_MAX];
+	size_t					num_classes;
+};
+
+// One namespace of a beginner -o document
+struct unloaded_ns {
+	char		*serial;
+	uint32_t	nsid;
+	bool		pass;
+	uint64_t	read_qd1_ns;
+	uint64_t	write_qd1_ns;
+};
+
+// Members of a JSON-RPC request, kept as values of the parsed line
+struct control_request {
+	const struct spdk_json_val	*jsonrpc;
+	const struct spdk_json_val	*method;
+	const struct spdk_json_val	*params;
+	const struct spdk_json_val	*id;
+};
+
+// Parameters of set_arbitration and set_class, -1 leaves a value unchanged
+struct control_params {
+	const struct spdk_json_val	*class_name;
+	int32_t						burst;
+	int32_t						high;
+	int32_t						medium;
+	int32_t						low;
+	int32_t						queue_depth;
+	int32_t						iops;
+	int32_t						bw;
+	int32_t						qos_burst;
+};
+
 struct arb_task {
+	// What is handed to the backend
+	struct arb_cmd			cmd;
 	struct worker_ns_ctx	*ns_ctx;
 	void					*buf;
+	// Private DMA buffer of the task, NULL when buf belongs to the payload pool
+	void					*dma_buf;
+	// Separate metadata of reads and writes, NULL without
+	void					*md_buf;
+	bool					iovs_from_segment_pool;
 	uint64_t				submit_tsc;
+	// Return of the backend submit, only kept with --stages
+	uint64_t				sent_tsc;
+	// UINT64_MAX when the class has no SLO for the command
+	uint64_t				deadline_tsc;
+	uint64_t				offset_in_ios;
+	// For verify mode
+	uint32_t				gen_snapshot;
+	// On the retry queue of the namespace context
+	TAILQ_ENTRY(arb_task)	link;
 };
 
 static struct spdk_mempool *g_task_pool = NULL;
 
+static void
+nvme_probe_drain(struct spdk_nvme_probe_ctx **probe_ctxs, int num_probes);
+
+static int
+nvme_attach(const struct arb_backend_opts *opts, arb_backend_ns_cb ns_cb);
+
+static void
+nvme_detach(void);
+
+static void *
+nvme_qpair_alloc(void *backend_ns, enum spdk_nvme_qprio qprio, uint32_t depth);
+
+static void
+nvme_qpair_free(void *qpair);
+
+static int
+nvme_submit(void *qpair, struct arb_cmd *cmd);
+
+static int32_t
+nvme_poll(void *qpair, uint32_t max_completions);
+
+static void *
+nvme_buf_alloc(size_t size, size_t align, int numa_id);
+
+static void
+nvme_buf_free(void *buf);
+
+// The SPDK NVMe driver, the default backend
+static const struct arb_backend_ops g_nvme_backend = {
+	.name			= "nvme",
+	.attach			= nvme_attach,
+	.detach			= nvme_detach,
+	.qpair_alloc	= nvme_qpair_alloc,
+	.qpair_free		= nvme_qpair_free,
+	.register_buf	= NULL,
+	.submit			= nvme_submit,
+	.poll			= nvme_poll,
+	.buf_alloc		= nvme_buf_alloc,
+	.buf_free		= nvme_buf_free,
+};
+
+static const struct arb_backend_ops *g_backends[] = {
+	&g_nvme_backend,
+#ifdef SPDK_CONFIG_URING
+	&g_arb_uring_backend,
+#endif
+	&g_arb_sim_backend,
+};
+
+static const struct arb_backend_ops *g_backend = &g_nvme_backend;
+
+// Names of the commands in --sim-service
+static const char *g_op_keys[ARB_OP_COUNT] = {
+	[ARB_OP_READ]			= "read",
+	[ARB_OP_WRITE]			= "write",
+	[ARB_OP_FLUSH]			= "flush",
+	[ARB_OP_DSM]			= "dsm",
+	[ARB_OP_WRITE_ZEROES]	= "wz",
+};
+
+static const char *g_op_names[ARB_OP_COUNT] = {
+	[ARB_OP_READ]			= "read",
+	[ARB_OP_WRITE]			= "write",
+	[ARB_OP_FLUSH]			= "flush",
+	[ARB_OP_DSM]			= "deallocate",
+	[ARB_OP_WRITE_ZEROES]	= "write zeroes",
+};
+
+static const char *g_qprio_names[SPDK_NVME_QPRIO_MAX] = {
+	[SPDK_NVME_QPRIO_URGENT]	= "urgent",
+	[SPDK_NVME_QPRIO_HIGH]		= "high",
+	[SPDK_NVME_QPRIO_MEDIUM]	= "medium",
+	[SPDK_NVME_QPRIO_LOW]		= "low",
+};
+
 static inline const char *
 print_qprio(enum spdk_nvme_qprio qprio)
 {
@@ -143,9 +1146,60 @@ print_qprio(enum spdk_nvme_qprio qprio)
 static int
 worker_fn(void *arg);
 
+static int
+worker_init(struct worker_thread *worker);
+
+static void
+worker_poll(struct worker_thread *worker);
+
+static void
+worker_fini(struct worker_thread *worker);
+
+static int
+run_workers_cooperatively(void);
+
+static inline uint64_t
+arb_get_ticks(void);
+
 static int
 parse_args(int argc, char **argv);
 
+static int
+parse_payload(const char *spec);
+
+static int
+parse_qprio(const char *name, enum spdk_nvme_qprio *qprio);
+
+static int
+parse_cmd_mix(const char *spec);
+
+static int
+parse_qos(const char *spec);
+
+static int
+parse_slo(const char *spec);
+
+static int
+parse_sim_service(const char *spec);
+
+static int
+parse_arb_rule(const char *spec);
+
+static void
+resolve_arb_settings(struct ctrlr_entry *entry);
+
+static bool
+arb_feature_matches(const struct arb_settings *arb, uint32_t raw);
+
+static void
+print_sim_service(void);
+
+static int
+add_trid(const char *trid_str);
+
+static int
+select_backend(const char *name);
+
 static int
 register_workers(void);
 
@@ -164,19 +1218,32 @@ static void
 register_ctrlr(struct spdk_nvme_ctrlr *ctrlr, const struct spdk_nvme_ctrlr_opts *opts);
 
 static void
-register_ns(struct spdk_nvme_ctrlr *ctrlr, struct spdk_nvme_ns *ns);
+register_ns(struct ctrlr_entry *ctrlr_entry, struct spdk_nvme_ns *ns);
 
 static void
-print_arb_feature(struct spdk_nvme_ctrlr *ctrlr);
+register_backend_ns(void *backend_ns, const struct arb_backend_ns_info *info);
+
+static struct ns_entry *
+add_namespace(struct ctrlr_entry *ctrlr_entry, void *backend_ns,
+			  const struct arb_backend_ns_info *info);
+
+static void
+ctrlr_setup_submit(struct ctrlr_entry *entry);
 
 static void
-get_feature_completion(void *cb_arg, const struct spdk_nvme_cpl *cpl);
+ctrlr_setup_completion(void *cb_arg, const struct spdk_nvme_cpl *cpl);
 
 static void
-set_arb_feature(struct spdk_nvme_ctrlr *ctrlr);
+print_ctrlr_setup(struct ctrlr_entry *entry);
+
+static void
+print_startup(void);
+
+static int
+class_queue_depth(struct worker_ns_ctx *ns_ctx);
 
 static void
-set_feature_completion(void *cb_arg, const struct spdk_nvme_cpl *cpl);
+print_arb_feature(uint32_t raw);
 
 static int
 associate_workers_with_ns(void);
@@ -184,21 +1251,454 @@ associate_workers_with_ns(void);
 static int
 init_worker_ns_ctx(struct worker_ns_ctx *ns_ctx, enum spdk_nvme_qprio qprio);
 
+static void *
+worker_dma_alloc(struct worker_thread *worker, enum worker_dma_pool pool, uint64_t size, size_t align);
+
+static int
+payload_pool_init(struct worker_thread *worker);
+
+static void
+payload_pool_free(struct payload_pool *pool);
+
+static int
+segment_pool_init(struct worker_thread *worker);
+
+static void
+segment_pool_free(struct segment_pool *pool);
+
+static int
+read_sink_init(struct worker_thread *worker);
+
+static void
+read_sink_free(struct read_sink *sink);
+
+static inline void *
+read_sink_next(struct read_sink *sink);
+
+static inline uint32_t
+buf_pool_class(uint32_t size);
+
+static void *
+buf_pool_get(struct buf_pool *pool, uint32_t size);
+
+static void
+buf_pool_put(struct buf_pool *pool, void *buf, uint32_t size);
+
+static int
+buf_pool_reserve(struct worker_thread *worker, uint32_t size, uint32_t count);
+
+static void
+buf_pool_free(struct buf_pool *pool);
+
+static bool
+ns_ctx_private_data(const struct worker_ns_ctx *ns_ctx);
+
+static void
+task_setup_buffers(struct arb_task *task);
+
+static void
+task_release_buffers(struct arb_task *task);
+
+static void
+cmd_reset_sgl(void *ref, uint32_t sgl_offset);
+
+static int
+cmd_next_sge(void *ref, void **address, uint32_t *length);
+
 static void
 submit_init_ios(struct worker_ns_ctx *ns_ctx, int queue_depth);
 
+static enum arb_op
+choose_op(struct worker_ns_ctx *ns_ctx);
+
+static void
+ns_ctx_specialize(struct worker_ns_ctx *ns_ctx);
+
+static uint64_t
+next_offset_fill(struct worker_ns_ctx *ns_ctx);
+
+static uint64_t
+next_offset_anywhere(struct worker_ns_ctx *ns_ctx);
+
+static uint64_t
+next_offset_random(struct worker_ns_ctx *ns_ctx);
+
+static uint64_t
+next_offset_sequential(struct worker_ns_ctx *ns_ctx);
+
+static uint64_t
+next_offset_streams(struct worker_ns_ctx *ns_ctx);
+
+static enum arb_op
+next_op_read(struct worker_ns_ctx *ns_ctx);
+
+static enum arb_op
+next_op_write(struct worker_ns_ctx *ns_ctx);
+
+static enum arb_op
+next_op_mixed(struct worker_ns_ctx *ns_ctx);
+
 static void
 submit_single_io(struct worker_ns_ctx *ns_ctx);
 
+static int
+issue_single_io(struct worker_ns_ctx *ns_ctx);
+
+static void
+token_bucket_init(struct token_bucket *tb, uint64_t rate, uint64_t burst_units, uint64_t nominal_units);
+
+static bool
+token_bucket_admits(struct token_bucket *tb, uint64_t now);
+
+static void
+token_bucket_charge(struct token_bucket *tb, uint64_t now, uint64_t units);
+
+static void
+qos_buckets_init(struct qos_buckets *qos, const struct class_config *cfg);
+
+static void
+init_class_qos(void);
+
+static bool
+qos_admits(struct worker_ns_ctx *ns_ctx, uint64_t now);
+
+static void
+qos_release(struct worker_ns_ctx *ns_ctx);
+
+static void
+qos_stop(struct worker_ns_ctx *ns_ctx);
+
+static int
+edf_init(void);
+
+static void
+edf_attach(struct worker_thread *worker);
+
+static void
+edf_push(struct edf_sched *edf, uint64_t deadline_tsc, struct arb_task *task);
+
+static struct arb_task *
+edf_pop(struct edf_sched *edf);
+
+static void
+edf_enqueue(struct arb_task *task, uint64_t deadline_tsc);
+
+static void
+edf_dispatch(struct edf_sched *edf);
+
+static void
+edf_release(struct edf_sched *edf, uint32_t count);
+
+static void
+edf_submit_ready(struct edf_sched *edf, struct edf_ready *ready);
+
+static void
+edf_drain(struct worker_thread *worker);
+
+static int
+submit_task(struct arb_task *task);
+
+static int
+backend_submit(struct arb_task *task);
+
+static void
+submit_task_failed(struct arb_task *task);
+
+static void
+submit_retry_queue(struct worker_ns_ctx *ns_ctx);
+
+static int32_t
+ns_ctx_poll(struct worker_ns_ctx *ns_ctx);
+
 static void
 task_complete(void *ctx, const struct spdk_nvme_cpl *completion);
 
 static void
 drain_io(struct worker_ns_ctx *ns_ctx);
 
+static uint32_t
+verify_write_begin(struct ns_entry *ns_entry, uint64_t offset_in_ios);
+
+static void
+verify_write_end(struct ns_entry *ns_entry, uint64_t offset_in_ios, bool failed);
+
+static void
+verify_stamp(struct arb_task *task, uint32_t generation);
+
+static void
+verify_check(struct arb_task *task);
+
 static void
 print_configuration_and_performance(char *program_name);
 
+static void
+print_ctrlr_performance(void);
+
+static void
+print_qos_performance(void);
+
+static void
+print_slo_performance(void);
+
+static void
+print_pi_performance(void);
+
+static int
+run_tenant_primary(void);
+
+static void
+print_tenant_report(void);
+
+static int
+claim_tenant_slot(void);
+
+static void
+publish_tenant_stats(void);
+
+static int
+control_init(void);
+
+static void
+control_fini(void);
+
+static void
+control_poll(void);
+
+static void
+control_handle(char *line, size_t len);
+
+static int
+control_decode_val(const struct spdk_json_val *val, void *out);
+
+static int
+control_write_cb(void *cb_ctx, const void *data, size_t size);
+
+static int
+control_flush(void);
+
+static void
+control_drop_client(void);
+
+static struct spdk_json_write_ctx *
+control_reply_begin(const struct control_request *req);
+
+static void
+control_reply_end(struct spdk_json_write_ctx *w);
+
+static void
+control_reply_error(const struct control_request *req, int code, const char *msg);
+
+static int
+control_decode_params(const struct control_request *req, struct control_params *params,
+					  enum spdk_nvme_qprio *qprio);
+
+static void
+control_get_stats(const struct control_request *req);
+
+static void
+control_set_arbitration(const struct control_request *req);
+
+static void
+control_set_class(const struct control_request *req);
+
+static void
+control_pause_class(const struct control_request *req, bool pause);
+
+static int
+post_class_msg(enum spdk_nvme_qprio qprio, const struct worker_msg *msg);
+
+static int
+worker_post(struct worker_thread *worker, const struct worker_msg *msg);
+
+static void
+worker_process_mailbox(struct worker_thread *worker);
+
+static void
+top_up_ns_ctx(struct worker_ns_ctx *ns_ctx);
+
+static void
+token_bucket_set_rate(struct token_bucket *tb, uint64_t rate, uint64_t burst_units, uint64_t nominal_units);
+
+static void
+qos_apply(struct worker_ns_ctx *ns_ctx);
+
+static int32_t
+poll_with_stages(struct worker_ns_ctx *ns_ctx);
+
+static void
+stage_record(struct stage_hist *hist, uint64_t tsc);
+
+static uint64_t
+stage_hist_quantile(const struct stage_hist *hist, double quantile);
+
+static void
+print_stage_performance(void);
+
+static void
+print_cpu_performance(void);
+
+static void
+print_memory_usage(void);
+
+static void
+sample_hugepages(void);
+
+static int
+parse_steady_state(const char *spec);
+
+static void
+reset_ns_ctx_stats(struct worker_ns_ctx *ns_ctx);
+
+static void
+reset_run_stats(void);
+
+static int
+run_workers(uint32_t main_core);
+
+static void
+steady_state_start(void);
+
+static void
+steady_state_poll(void);
+
+static bool
+steady_state_reached(const double *values, uint32_t rounds, uint32_t window);
+
+static void
+timeline_start(void);
+
+static void
+timeline_poll(void);
+
+static void
+timeline_sample(uint64_t now);
+
+static void
+timeline_finish(void);
+
+static void
+health_log_wait(void);
+
+static void
+timeline_print_row(void);
+
+static void
+health_log_request(struct ctrlr_entry *ctrlr_entry);
+
+static void
+health_log_done(void *arg, const struct spdk_nvme_cpl *cpl);
+
+static void
+print_ctrlr_health(const struct ctrlr_entry *ctrlr_entry);
+
+static void
+record_repetition(uint32_t rep);
+
+static void
+mean_stddev(const double *values, uint32_t count, double *mean, double *stddev);
+
+static double
+t_critical_95(double df);
+
+static void
+print_repetition_summary(void);
+
+static int
+write_results_json(void);
+
+static int
+results_write_cb(void *cb_ctx, const void *data, size_t size);
+
+static int
+read_json_file(const char *path, char **json_out, struct spdk_json_val **values_out);
+
+static int
+load_baseline(const char *path, struct baseline *baseline);
+
+static int
+baseline_decode_series(const struct spdk_json_val *val, void *out);
+
+static int
+baseline_decode_class(const struct spdk_json_val *val, void *out);
+
+static int
+compare_baseline(void);
+
+static int
+load_unloaded(void);
+
+static int
+unloaded_decode_namespaces(const struct spdk_json_val *val, void *out);
+
+static void
+print_unloaded_latency(const struct worker_ns_ctx *ns_ctx);
+
+static int
+parse_region(const char *spec);
+
+static int
+parse_region_bound(const char *value, uint64_t *bound, bool *pct);
+
+static int
+class_region(const struct ns_entry *ns_entry, const struct class_config *cfg,
+			 uint64_t *start, uint64_t *size);
+
+static int
+assign_ns_regions(void);
+
+static int
+parse_precondition(const char *spec);
+
+static int
+precondition_run(uint32_t main_core);
+
+static int
+precondition_phase_run(enum precondition_phase phase, uint32_t main_core);
+
+static void
+precondition_assign_fill(void);
+
+static void
+precondition_poll(void);
+
+static uint64_t
+precondition_writes(void);
+
+static bool
+precondition_filled(void);
+
+static int
+parse_pi(const char *spec);
+
+static int
+parse_sim_md(const char *spec);
+
+static int
+parse_qpairs(const char *spec);
+
+static int
+pi_ctx_init(struct arb_task *task, struct spdk_dif_ctx *ctx);
+
+static void
+pi_generate(struct arb_task *task);
+
+static void
+pi_check(struct arb_task *task);
+
+static bool
+welch_regression(const char *class_name, const char *metric, const struct baseline_series *base,
+				 const double *current, bool higher_is_better);
+
+static int
+telemetry_init(void);
+
+static void
+telemetry_fini(void);
+
+static void
+telemetry_record(struct worker_ns_ctx *ns_ctx, const struct arb_task *task, uint64_t now,
+				 uint64_t tsc_diff);
+
 static void
 cleanup_ns_worker_ctx(struct worker_ns_ctx *ns_ctx);
 
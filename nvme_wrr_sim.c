@@ -0,0 +1,600 @@
+#include "spdk/stdinc.h"
+#include "spdk/env.h"
+#include "spdk/util.h"
+
+#include <math.h>
+
+#include "nvme_wrr_backend.h"
+
+#define SIM_BLOCK_SIZE 512
+
+// The virtual clock counts nanoseconds, whatever the TSC of the host is
+#define SIM_TICKS_HZ 1000000000ULL
+#define SIM_TICKS_PER_US 1000ULL
+
+// Arbitration burst of 7 means no limit
+#define SIM_AB_UNLIMITED 7
+
+// Without outstanding commands there is no event to jump to
+#define SIM_IDLE_STEP_TICKS SIM_TICKS_PER_US
+
+struct sim_ns {
+	uint8_t				*data;
+	uint64_t			size;
+	uint32_t			nsid;
+	uint64_t			num_blocks;
+	// Bytes of a block in data, its metadata included when interleaved
+	uint32_t			block_size;
+	uint32_t			md_size;
+	bool				md_interleave;
+	// Separate metadata, NULL when interleaved or without metadata
+	uint8_t				*md;
+};
+
+struct sim_cqe {
+	struct arb_cmd		*cmd;
+	struct spdk_nvme_cpl	cpl;
+};
+
+// One I/O submission queue and its completion queue
+struct sim_qpair {
+	struct sim_ns		*ns;
+	enum spdk_nvme_qprio	qprio;
+	TAILQ_ENTRY(sim_qpair)	link;
+	uint32_t			depth;
+	// Submitted and not reaped yet, never more than depth
+	uint32_t			outstanding;
+	struct arb_cmd		**sq;
+	uint32_t			sq_head;
+	uint32_t			sq_count;
+	struct sim_cqe		*cq;
+	uint32_t			cq_head;
+	uint32_t			cq_count;
+};
+
+// A command being serviced by the controller
+struct sim_slot {
+	struct sim_qpair	*qpair;
+	struct arb_cmd		*cmd;
+	uint64_t			done_tick;
+};
+
+struct sim_ctrlr {
+	uint64_t			now;
+	uint64_t			rng;
+	struct arb_sim_service	service[ARB_OP_COUNT];
+
+	struct sim_slot		*slots;
+	uint32_t			num_slots;
+	uint32_t			num_busy;
+	// Completions posted but not yet reaped by any queue pair
+	uint32_t			cq_pending;
+
+	// Arbiter state, see sim_arbitrate()
+	TAILQ_HEAD(, sim_qpair)	sqs[SPDK_NVME_QPRIO_MAX];
+	uint32_t			weights[SPDK_NVME_QPRIO_MAX];
+	uint32_t			credits[SPDK_NVME_QPRIO_MAX];
+	uint32_t			burst;
+	struct sim_qpair	*grant;
+	uint32_t			grant_left;
+	enum spdk_nvme_qprio	next_class;
+
+	uint64_t			fetched[SPDK_NVME_QPRIO_MAX];
+};
+
+static struct sim_ns *g_sim_ns = NULL;
+static uint32_t g_sim_num_ns = 0;
+static struct sim_ctrlr g_sim;
+
+static const char *g_sim_class_names[SPDK_NVME_QPRIO_MAX] = {
+	[SPDK_NVME_QPRIO_URGENT]	= "urgent",
+	[SPDK_NVME_QPRIO_HIGH]		= "high",
+	[SPDK_NVME_QPRIO_MEDIUM]	= "medium",
+	[SPDK_NVME_QPRIO_LOW]		= "low",
+};
+
+static inline uint64_t
+sim_rand(void)
+{
+	// xorshift64*, the same sequence on every host for the same seed
+	g_sim.rng ^= g_sim.rng >> 12;
+	g_sim.rng ^= g_sim.rng << 25;
+	g_sim.rng ^= g_sim.rng >> 27;
+	return g_sim.rng * 0x2545f4914f6cdd1dULL;
+}
+
+static uint64_t
+sim_service_ticks(enum arb_op op)
+{
+	const struct arb_sim_service *service = &g_sim.service[op];
+	double u;
+
+	switch (service->dist) {
+	case ARB_SIM_DIST_UNIFORM:
+		return (service->min_us +
+				sim_rand() % ((uint64_t)service->max_us - service->min_us + 1)) * SIM_TICKS_PER_US;
+	case ARB_SIM_DIST_EXP:
+		// Uniform on (0, 1] from the top 53 bits
+		u = ((sim_rand() >> 11) + 1) * (1.0 / 9007199254740992.0);
+		return (uint64_t)(-log(u) * service->min_us * SIM_TICKS_PER_US);
+	default:
+		return (uint64_t)service->min_us * SIM_TICKS_PER_US;
+	}
+}
+
+// Metadata of all 1s, a reader does not check the protection information
+// of such blocks
+static void
+sim_deallocate_md(struct sim_ns *ns, uint64_t lba, uint64_t count)
+{
+	if (ns->md != NULL) {
+		memset(ns->md + lba * ns->md_size, 0xff, count * ns->md_size);
+	} else if (ns->md_interleave) {
+		for (uint64_t i = lba; i < lba + count; i++) {
+			memset(ns->data + i * ns->block_size + SIM_BLOCK_SIZE, 0xff, ns->md_size);
+		}
+	}
+}
+
+static int
+sim_attach(const struct arb_backend_opts *opts, arb_backend_ns_cb ns_cb)
+{
+	struct arb_backend_ns_info info = {};
+
+	if (opts->sim_namespaces == 0 || opts->sim_ns_size < SIM_BLOCK_SIZE ||
+		opts->sim_parallelism == 0) {
+		fprintf(stderr, "sim backend needs at least one namespace of one block and one slot\n");
+		return 1;
+	}
+	if (opts->sim_pi_type != SPDK_NVME_FMT_NVM_PROTECTION_DISABLE && opts->sim_md_size < 8) {
+		fprintf(stderr, "sim protection information needs at least 8 bytes of metadata\n");
+		return 1;
+	}
+
+	memset(&g_sim, 0, sizeof(g_sim));
+	g_sim.rng = opts->sim_seed != 0 ? opts->sim_seed : 1;
+	memcpy(g_sim.service, opts->sim_service, sizeof(g_sim.service));
+	g_sim.num_slots = opts->sim_parallelism;
+	g_sim.slots = calloc(g_sim.num_slots, sizeof(*g_sim.slots));
+	if (g_sim.slots == NULL) {
+		return 1;
+	}
+	for (int i = 0; i < SPDK_NVME_QPRIO_MAX; i++) {
+		TAILQ_INIT(&g_sim.sqs[i]);
+		g_sim.weights[i] = spdk_max(opts->weights[i], 1);
+		g_sim.credits[i] = g_sim.weights[i];
+	}
+	g_sim.burst = opts->arbitration_burst >= SIM_AB_UNLIMITED ? UINT32_MAX :
+				  1u << opts->arbitration_burst;
+	g_sim.next_class = SPDK_NVME_QPRIO_HIGH;
+
+	g_sim_ns = calloc(opts->sim_namespaces, sizeof(*g_sim_ns));
+	if (g_sim_ns == NULL) {
+		return 1;
+	}
+
+	printf("Initializing sim controller, %u namespaces of %" PRIu64 " MiB, %u slots\n",
+		   opts->sim_namespaces, opts->sim_ns_size / (1024 * 1024), g_sim.num_slots);
+	printf("  Arbitration: burst %u, weights high %u medium %u low %u, virtual clock\n",
+		   opts->arbitration_burst, g_sim.weights[SPDK_NVME_QPRIO_HIGH],
+		   g_sim.weights[SPDK_NVME_QPRIO_MEDIUM], g_sim.weights[SPDK_NVME_QPRIO_LOW]);
+
+	for (uint32_t i = 0; i < opts->sim_namespaces; i++) {
+		struct sim_ns *ns = &g_sim_ns[i];
+
+		// Pages are only backed once they are written
+		ns->num_blocks = opts->sim_ns_size / SIM_BLOCK_SIZE;
+		ns->md_size = opts->sim_md_size;
+		ns->md_interleave = opts->sim_md_interleave && ns->md_size != 0;
+		ns->block_size = SIM_BLOCK_SIZE + (ns->md_interleave ? ns->md_size : 0);
+		ns->size = ns->num_blocks * ns->block_size;
+		ns->data = calloc(1, ns->size);
+		if (ns->data == NULL) {
+			fprintf(stderr, "Unable to allocate %" PRIu64 " bytes of sim namespace\n", ns->size);
+			return 1;
+		}
+		if (ns->md_size != 0 && !ns->md_interleave) {
+			ns->md = malloc(ns->num_blocks * ns->md_size);
+			if (ns->md == NULL) {
+				fprintf(stderr, "Unable to allocate the metadata of sim namespace\n");
+				return 1;
+			}
+		}
+		// Like deallocated blocks of a device, nothing is checked until written
+		sim_deallocate_md(ns, 0, ns->num_blocks);
+		ns->nsid = i + 1;
+		g_sim_num_ns++;
+
+		snprintf(info.name, sizeof(info.name), "sim%u", i);
+		info.nsid = ns->nsid;
+		info.size = ns->num_blocks * SIM_BLOCK_SIZE;
+		info.block_size = SIM_BLOCK_SIZE;
+		info.extended_block_size = ns->block_size;
+		info.md_size = ns->md_size;
+		info.md_interleave = ns->md_interleave;
+		info.pi_type = ns->md_size != 0 ? opts->sim_pi_type : SPDK_NVME_FMT_NVM_PROTECTION_DISABLE;
+		// PI in the last 8 bytes of the metadata
+		info.pi_loc = false;
+		info.flags = SPDK_NVME_NS_DEALLOCATE_SUPPORTED | SPDK_NVME_NS_WRITE_ZEROES_SUPPORTED;
+		info.sgl_supported = true;
+		info.wrr_supported = true;
+		ns_cb(ns, &info);
+	}
+
+	return 0;
+}
+
+// Takes effect at the next grant, credits left in this round are kept up to the new weight
+static int
+sim_set_arbitration(uint32_t burst, const uint32_t weights[SPDK_NVME_QPRIO_MAX])
+{
+	for (int i = 0; i < SPDK_NVME_QPRIO_MAX; i++) {
+		g_sim.weights[i] = spdk_max(weights[i], 1);
+		g_sim.credits[i] = spdk_min(g_sim.credits[i], g_sim.weights[i]);
+	}
+	g_sim.burst = burst >= SIM_AB_UNLIMITED ? UINT32_MAX : 1u << burst;
+
+	return 0;
+}
+
+static void
+sim_detach(void)
+{
+	uint64_t total = 0;
+
+	for (int i = 0; i < SPDK_NVME_QPRIO_MAX; i++) {
+		total += g_sim.fetched[i];
+	}
+	printf("sim controller: %.6f virtual seconds, commands fetched per class:",
+		   (double)g_sim.now / SIM_TICKS_HZ);
+	for (int i = 0; i < SPDK_NVME_QPRIO_MAX; i++) {
+		printf(" %s %" PRIu64 " (%.1f%%)", g_sim_class_names[i], g_sim.fetched[i],
+			   total ? (double)g_sim.fetched[i] * 100 / total : 0);
+	}
+	printf("\n");
+
+	for (uint32_t i = 0; i < g_sim_num_ns; i++) {
+		free(g_sim_ns[i].data);
+		free(g_sim_ns[i].md);
+	}
+	free(g_sim_ns);
+	free(g_sim.slots);
+	g_sim_ns = NULL;
+	g_sim_num_ns = 0;
+	g_sim.slots = NULL;
+}
+
+static void *
+sim_qpair_alloc(void *backend_ns, enum spdk_nvme_qprio qprio, uint32_t depth)
+{
+	struct sim_qpair *qpair;
+
+	qpair = calloc(1, sizeof(*qpair));
+	if (qpair == NULL) {
+		return NULL;
+	}
+
+	qpair->ns = backend_ns;
+	qpair->qprio = qprio;
+	qpair->depth = spdk_max(depth, 1);
+	qpair->sq = calloc(qpair->depth, sizeof(*qpair->sq));
+	qpair->cq = calloc(qpair->depth, sizeof(*qpair->cq));
+	if (qpair->sq == NULL || qpair->cq == NULL) {
+		free(qpair->sq);
+		free(qpair->cq);
+		free(qpair);
+		return NULL;
+	}
+	TAILQ_INSERT_TAIL(&g_sim.sqs[qprio], qpair, link);
+
+	return qpair;
+}
+
+static void
+sim_qpair_free(void *ctx)
+{
+	struct sim_qpair *qpair = ctx;
+
+	if (qpair == NULL) {
+		return;
+	}
+	if (g_sim.grant == qpair) {
+		g_sim.grant = NULL;
+	}
+	TAILQ_REMOVE(&g_sim.sqs[qpair->qprio], qpair, link);
+	free(qpair->sq);
+	free(qpair->cq);
+	free(qpair);
+}
+
+// Next non-empty submission queue of a class after the one served last,
+// the served queue moves to the tail so queues of a class take turns
+static struct sim_qpair *
+sim_next_sq(enum spdk_nvme_qprio qprio)
+{
+	struct sim_qpair *qpair;
+
+	TAILQ_FOREACH(qpair, &g_sim.sqs[qprio], link) {
+		if (qpair->sq_count > 0) {
+			TAILQ_REMOVE(&g_sim.sqs[qprio], qpair, link);
+			TAILQ_INSERT_TAIL(&g_sim.sqs[qprio], qpair, link);
+			return qpair;
+		}
+	}
+
+	return NULL;
+}
+
+static bool
+sim_class_pending(enum spdk_nvme_qprio qprio)
+{
+	struct sim_qpair *qpair;
+
+	TAILQ_FOREACH(qpair, &g_sim.sqs[qprio], link) {
+		if (qpair->sq_count > 0) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+// NVMe weighted round robin with urgent priority class. Urgent queues are
+// served first, even in the middle of a weighted grant. High, medium and
+// low classes take turns and each may fetch as many commands per round as
+// its weight. A new round starts once no class with credit left has
+// commands. A granted queue keeps the grant for up to arbitration burst
+// commands.
+static struct sim_qpair *
+sim_arbitrate(void)
+{
+	struct sim_qpair *qpair = NULL;
+	enum spdk_nvme_qprio qprio;
+	bool grant_valid = g_sim.grant != NULL && g_sim.grant_left > 0 && g_sim.grant->sq_count > 0;
+
+	if (sim_class_pending(SPDK_NVME_QPRIO_URGENT)) {
+		if (grant_valid && g_sim.grant->qprio == SPDK_NVME_QPRIO_URGENT) {
+			return g_sim.grant;
+		}
+		qpair = sim_next_sq(SPDK_NVME_QPRIO_URGENT);
+	} else if (grant_valid && g_sim.credits[g_sim.grant->qprio] > 0) {
+		return g_sim.grant;
+	} else {
+		for (int round = 0; round < 2 && qpair == NULL; round++) {
+			for (int i = SPDK_NVME_QPRIO_HIGH; i < SPDK_NVME_QPRIO_MAX && qpair == NULL; i++) {
+				qprio = g_sim.next_class;
+				g_sim.next_class = qprio == SPDK_NVME_QPRIO_LOW ? SPDK_NVME_QPRIO_HIGH : qprio + 1;
+				if (g_sim.credits[qprio] > 0) {
+					qpair = sim_next_sq(qprio);
+				}
+			}
+			if (qpair == NULL) {
+				for (int i = SPDK_NVME_QPRIO_HIGH; i < SPDK_NVME_QPRIO_MAX; i++) {
+					g_sim.credits[i] = g_sim.weights[i];
+				}
+			}
+		}
+	}
+
+	g_sim.grant = qpair;
+	g_sim.grant_left = g_sim.burst;
+	return qpair;
+}
+
+// Fill the free slots of the controller in arbitration order
+static void
+sim_dispatch(void)
+{
+	struct sim_qpair *qpair;
+	struct sim_slot *slot = g_sim.slots;
+	struct arb_cmd *cmd;
+
+	while (g_sim.num_busy < g_sim.num_slots) {
+		qpair = sim_arbitrate();
+		if (qpair == NULL) {
+			return;
+		}
+		cmd = qpair->sq[qpair->sq_head];
+		qpair->sq_head = (qpair->sq_head + 1) % qpair->depth;
+		qpair->sq_count--;
+		g_sim.grant_left--;
+		if (qpair->qprio != SPDK_NVME_QPRIO_URGENT) {
+			g_sim.credits[qpair->qprio]--;
+		}
+		g_sim.fetched[qpair->qprio]++;
+
+		while (slot->cmd != NULL) {
+			slot++;
+		}
+		slot->qpair = qpair;
+		slot->cmd = cmd;
+		slot->done_tick = g_sim.now + sim_service_ticks(cmd->op);
+		g_sim.num_busy++;
+	}
+}
+
+// Move the data when the command completes, like a device would by then.
+// Protection information is stored as it comes, the sim checks none.
+static void
+sim_execute(struct sim_ns *ns, struct arb_cmd *cmd, struct spdk_nvme_cpl *cpl)
+{
+	uint64_t offset = cmd->lba * ns->block_size;
+	uint64_t len = (uint64_t)cmd->lba_count * ns->block_size;
+	uint8_t *media;
+
+	memset(cpl, 0, sizeof(*cpl));
+	if (cmd->op == ARB_OP_FLUSH) {
+		return;
+	}
+	if (cmd->lba + cmd->lba_count > ns->num_blocks) {
+		cpl->status.sct = SPDK_NVME_SCT_GENERIC;
+		cpl->status.sc = SPDK_NVME_SC_LBA_OUT_OF_RANGE;
+		return;
+	}
+
+	media = ns->data + offset;
+	switch (cmd->op) {
+	case ARB_OP_READ:
+	case ARB_OP_WRITE:
+		for (int i = 0; i < cmd->iovcnt && len > 0; i++) {
+			size_t n = spdk_min(cmd->iovs[i].iov_len, len);
+
+			if (cmd->op == ARB_OP_READ) {
+				memcpy(cmd->iovs[i].iov_base, media, n);
+			} else {
+				memcpy(media, cmd->iovs[i].iov_base, n);
+			}
+			media += n;
+			len -= n;
+		}
+		if (ns->md != NULL && cmd->md_buf != NULL) {
+			media = ns->md + cmd->lba * ns->md_size;
+			if (cmd->op == ARB_OP_READ) {
+				memcpy(cmd->md_buf, media, (size_t)cmd->lba_count * ns->md_size);
+			} else {
+				memcpy(media, cmd->md_buf, (size_t)cmd->lba_count * ns->md_size);
+			}
+		}
+		break;
+	case ARB_OP_DSM:
+	case ARB_OP_WRITE_ZEROES:
+		memset(media, 0, len);
+		sim_deallocate_md(ns, cmd->lba, cmd->lba_count);
+		break;
+	default:
+		cpl->status.sct = SPDK_NVME_SCT_GENERIC;
+		cpl->status.sc = SPDK_NVME_SC_INVALID_OPCODE;
+		break;
+	}
+}
+
+// Jump the clock to the next completion and post every command done by then
+static void
+sim_advance(void)
+{
+	struct sim_slot *slot;
+	struct sim_qpair *qpair;
+	struct sim_cqe *cqe;
+	uint64_t next = UINT64_MAX;
+
+	for (uint32_t i = 0; i < g_sim.num_slots; i++) {
+		if (g_sim.slots[i].cmd != NULL) {
+			next = spdk_min(next, g_sim.slots[i].done_tick);
+		}
+	}
+	if (next == UINT64_MAX) {
+		g_sim.now += SIM_IDLE_STEP_TICKS;
+		return;
+	}
+	g_sim.now = next;
+
+	for (uint32_t i = 0; i < g_sim.num_slots; i++) {
+		slot = &g_sim.slots[i];
+		if (slot->cmd == NULL || slot->done_tick != next) {
+			continue;
+		}
+		qpair = slot->qpair;
+		cqe = &qpair->cq[(qpair->cq_head + qpair->cq_count) % qpair->depth];
+		cqe->cmd = slot->cmd;
+		sim_execute(qpair->ns, slot->cmd, &cqe->cpl);
+		qpair->cq_count++;
+		g_sim.cq_pending++;
+		slot->cmd = NULL;
+		g_sim.num_busy--;
+	}
+
+	sim_dispatch();
+}
+
+static int
+sim_submit(void *ctx, struct arb_cmd *cmd)
+{
+	struct sim_qpair *qpair = ctx;
+
+	if (qpair->outstanding == qpair->depth) {
+		return -ENOMEM;
+	}
+	qpair->outstanding++;
+
+	qpair->sq[(qpair->sq_head + qpair->sq_count) % qpair->depth] = cmd;
+	qpair->sq_count++;
+	sim_dispatch();
+
+	return 0;
+}
+
+// The clock only moves once every posted completion has been reaped, so
+// the latency seen by a queue pair does not depend on the polling order
+static int32_t
+sim_poll(void *ctx, uint32_t max_completions)
+{
+	struct sim_qpair *qpair = ctx;
+	struct sim_cqe cqe;
+	int32_t completed = 0;
+
+	if (g_sim.cq_pending == 0) {
+		sim_advance();
+	}
+
+	while (qpair->cq_count > 0 && (max_completions == 0 || (uint32_t)completed < max_completions)) {
+		cqe = qpair->cq[qpair->cq_head];
+		qpair->cq_head = (qpair->cq_head + 1) % qpair->depth;
+		qpair->cq_count--;
+		qpair->outstanding--;
+		g_sim.cq_pending--;
+
+		// The callback may submit again
+		cqe.cmd->cb_fn(cqe.cmd, &cqe.cpl);
+		completed++;
+	}
+
+	return completed;
+}
+
+static uint64_t
+sim_get_ticks(void)
+{
+	return g_sim.now;
+}
+
+static uint64_t
+sim_get_ticks_hz(void)
+{
+	return SIM_TICKS_HZ;
+}
+
+static void *
+sim_buf_alloc(size_t size, size_t align, int numa_id)
+{
+	void *buf;
+
+	(void)numa_id;
+	if (posix_memalign(&buf, spdk_max(align, sizeof(void *)), size) != 0) {
+		return NULL;
+	}
+	memset(buf, 0, size);
+
+	return buf;
+}
+
+static void
+sim_buf_free(void *buf)
+{
+	free(buf);
+}
+
+const struct arb_backend_ops g_arb_sim_backend = {
+	.name			= "sim",
+	.attach			= sim_attach,
+	.detach			= sim_detach,
+	.qpair_alloc	= sim_qpair_alloc,
+	.qpair_free		= sim_qpair_free,
+	.register_buf	= NULL,
+	.submit			= sim_submit,
+	.poll			= sim_poll,
+	.buf_alloc		= sim_buf_alloc,
+	.buf_free		= sim_buf_free,
+	.get_ticks		= sim_get_ticks,
+	.get_ticks_hz	= sim_get_ticks_hz,
+	.set_arbitration	= sim_set_arbitration,
+};
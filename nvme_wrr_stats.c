@@ -0,0 +1,350 @@
+// Reader of the --telemetry file of nvme_wrr_demo, prints the counters and
+// latency histograms in the Prometheus text format. Built without SPDK, it
+// only needs nvme_wrr_telemetry.h.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "nvme_wrr_telemetry.h"
+
+// Upper bounds of the exported histogram, 1 us doubled up to about 1 s.
+// Fixed in seconds so that series keep their buckets whatever the ticks are.
+#define STATS_LE_FIRST_US 1
+#define STATS_LE_COUNT 21
+
+// Gives up on a slot the worker keeps rewriting, which is only possible
+// if the reader is descheduled in the middle of every copy
+#define STATS_SEQ_RETRIES 1000
+
+static const char *g_class_names[] = {"urgent", "high", "medium", "low"};
+
+static const double g_quantiles[] = {0.5, 0.9, 0.99, 0.999};
+
+struct stats_snapshot {
+	const struct telemetry_header	*header;
+	uint32_t						num_slots;
+	struct telemetry_slot			*slots;
+};
+
+static void
+usage(const char *program_name)
+{
+	printf("%s [options] <telemetry file>\n", program_name);
+	printf("\t[-i scrape again every this many milliseconds until the run ends]\n");
+	printf("\t[-o write to this file through a rename instead of stdout,\n");
+	printf("\t\tfor the textfile collector of node_exporter]\n");
+}
+
+// A copy of the slot as the worker left it between two completions
+static int
+read_slot(const struct telemetry_slot *slot, struct telemetry_slot *copy)
+{
+	uint64_t seq_begin, seq_end;
+
+	for (int i = 0; i < STATS_SEQ_RETRIES; i++) {
+		seq_begin = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		if (seq_begin & 1) {
+			continue;
+		}
+		memcpy(copy, slot, sizeof(*copy));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		seq_end = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+		if (seq_begin == seq_end) {
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+static const char *
+class_name(uint32_t qprio)
+{
+	return qprio < sizeof(g_class_names) / sizeof(g_class_names[0]) ? g_class_names[qprio] : "unknown";
+}
+
+static void
+print_labels(FILE *out, const struct telemetry_slot *slot)
+{
+	fprintf(out, "class=\"%s\",core=\"%u\",nsid=\"%u\",namespace=\"", class_name(slot->qprio),
+			slot->lcore, slot->nsid);
+	for (const char *c = slot->name; *c != '\0' && c < slot->name + sizeof(slot->name); c++) {
+		if (*c == '\\' || *c == '"') {
+			fputc('\\', out);
+		}
+		fputc(*c, out);
+	}
+	fputc('"', out);
+}
+
+static void
+print_counter(FILE *out, const struct stats_snapshot *snap, const char *name, const char *help,
+			  size_t offset)
+{
+	fprintf(out, "# HELP %s %s\n", name, help);
+	fprintf(out, "# TYPE %s counter\n", name);
+	for (uint32_t i = 0; i < snap->num_slots; i++) {
+		fprintf(out, "%s{", name);
+		print_labels(out, &snap->slots[i]);
+		fprintf(out, "} %" PRIu64 "\n", *(const uint64_t *)((const uint8_t *)&snap->slots[i] + offset));
+	}
+}
+
+// Upper bound in seconds of a bucket, the last one has none
+static double
+bucket_upper(uint32_t bucket, uint64_t ticks_hz)
+{
+	return (double)telemetry_hist_lower(bucket + 1) / ticks_hz;
+}
+
+static void
+print_histogram(FILE *out, const struct stats_snapshot *snap)
+{
+	uint64_t ticks_hz = snap->header->ticks_hz;
+	const struct telemetry_slot *slot;
+	double le;
+	uint64_t count;
+	uint32_t bucket;
+
+	fprintf(out, "# HELP nvme_wrr_latency_seconds Completion latency of the commands.\n");
+	fprintf(out, "# TYPE nvme_wrr_latency_seconds histogram\n");
+	for (uint32_t i = 0; i < snap->num_slots; i++) {
+		slot = &snap->slots[i];
+		count = 0;
+		bucket = 0;
+		le = STATS_LE_FIRST_US / 1e6;
+		// A bucket counts under le once all of it is below, the file is finer than le
+		for (int j = 0; j < STATS_LE_COUNT; j++, le *= 2) {
+			while (bucket < TELEMETRY_HIST_BUCKETS - 1 && bucket_upper(bucket, ticks_hz) <= le) {
+				count += slot->hist[bucket++];
+			}
+			fprintf(out, "nvme_wrr_latency_seconds_bucket{");
+			print_labels(out, slot);
+			fprintf(out, ",le=\"%g\"} %" PRIu64 "\n", le, count);
+		}
+		fprintf(out, "nvme_wrr_latency_seconds_bucket{");
+		print_labels(out, slot);
+		fprintf(out, ",le=\"+Inf\"} %" PRIu64 "\n", slot->io_completed);
+		fprintf(out, "nvme_wrr_latency_seconds_sum{");
+		print_labels(out, slot);
+		fprintf(out, "} %.9f\n", (double)slot->latency_ticks / ticks_hz);
+		fprintf(out, "nvme_wrr_latency_seconds_count{");
+		print_labels(out, slot);
+		fprintf(out, "} %" PRIu64 "\n", slot->io_completed);
+	}
+}
+
+// Quantiles since the start from the full resolution of the file, the
+// upper bound of the bucket holding the rank
+static void
+print_quantiles(FILE *out, const struct stats_snapshot *snap)
+{
+	const struct telemetry_slot *slot;
+	uint64_t rank, count;
+	uint32_t bucket;
+
+	fprintf(out, "# HELP nvme_wrr_latency_quantile_seconds Latency quantiles since the start of the run.\n");
+	fprintf(out, "# TYPE nvme_wrr_latency_quantile_seconds gauge\n");
+	for (uint32_t i = 0; i < snap->num_slots; i++) {
+		slot = &snap->slots[i];
+		if (slot->io_completed == 0) {
+			continue;
+		}
+		for (size_t q = 0; q < sizeof(g_quantiles) / sizeof(g_quantiles[0]); q++) {
+			rank = (uint64_t)(g_quantiles[q] * slot->io_completed);
+			rank = rank == 0 ? 1 : rank;
+			count = 0;
+			for (bucket = 0; bucket < TELEMETRY_HIST_BUCKETS - 1; bucket++) {
+				count += slot->hist[bucket];
+				if (count >= rank) {
+					break;
+				}
+			}
+			fprintf(out, "nvme_wrr_latency_quantile_seconds{");
+			print_labels(out, slot);
+			fprintf(out, ",quantile=\"%g\"} %.9f\n", g_quantiles[q],
+					bucket_upper(bucket, snap->header->ticks_hz));
+		}
+	}
+}
+
+static void
+print_snapshot(FILE *out, const struct stats_snapshot *snap)
+{
+	fprintf(out, "# HELP nvme_wrr_running 1 while the run is in progress, 0 once it ended.\n");
+	fprintf(out, "# TYPE nvme_wrr_running gauge\n");
+	fprintf(out, "nvme_wrr_running{pid=\"%d\"} %d\n", snap->header->pid,
+			snap->header->state == TELEMETRY_STATE_RUNNING);
+	fprintf(out, "# HELP nvme_wrr_start_time_seconds Start of the run since the epoch.\n");
+	fprintf(out, "# TYPE nvme_wrr_start_time_seconds gauge\n");
+	fprintf(out, "nvme_wrr_start_time_seconds{pid=\"%d\"} %" PRIu64 "\n", snap->header->pid,
+			snap->header->start_time);
+
+	print_counter(out, snap, "nvme_wrr_io_completed_total", "Completed commands.",
+				  offsetof(struct telemetry_slot, io_completed));
+	print_counter(out, snap, "nvme_wrr_read_ios_total", "Completed reads.",
+				  offsetof(struct telemetry_slot, read_ios));
+	print_counter(out, snap, "nvme_wrr_write_ios_total", "Completed writes.",
+				  offsetof(struct telemetry_slot, write_ios));
+	print_counter(out, snap, "nvme_wrr_bytes_total", "Bytes read and written.",
+				  offsetof(struct telemetry_slot, bytes));
+	print_counter(out, snap, "nvme_wrr_slo_missed_total", "Commands completed past their --slo deadline.",
+				  offsetof(struct telemetry_slot, slo_missed));
+	print_histogram(out, snap);
+	print_quantiles(out, snap);
+}
+
+// Mapped again at every scrape, a new run truncates and refills the file
+static int
+scrape(const char *path, FILE *out, bool *finished)
+{
+	struct stats_snapshot snap = {0};
+	const struct telemetry_header *header;
+	const struct telemetry_slot *slots;
+	struct stat st;
+	void *map;
+	int fd, rc = -1;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		perror(path);
+		return -1;
+	}
+	if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(struct telemetry_header)) {
+		fprintf(stderr, "%s: not a telemetry file\n", path);
+		close(fd);
+		return -1;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		perror("mmap");
+		return -1;
+	}
+
+	header = map;
+	if (header->magic != TELEMETRY_MAGIC || header->version != TELEMETRY_VERSION) {
+		fprintf(stderr, "%s: not a telemetry file of version %u\n", path, TELEMETRY_VERSION);
+		goto out;
+	}
+	if (__atomic_load_n(&header->state, __ATOMIC_ACQUIRE) == 0) {
+		fprintf(stderr, "%s: the run has not started yet\n", path);
+		goto out;
+	}
+	if (header->header_size != sizeof(struct telemetry_header) ||
+		header->slot_size != sizeof(struct telemetry_slot) ||
+		header->hist_buckets != TELEMETRY_HIST_BUCKETS ||
+		(size_t)st.st_size < header->header_size + (size_t)header->num_slots * header->slot_size) {
+		fprintf(stderr, "%s: unexpected layout\n", path);
+		goto out;
+	}
+
+	snap.header = header;
+	snap.num_slots = header->num_slots;
+	snap.slots = calloc(snap.num_slots, sizeof(struct telemetry_slot));
+	if (snap.slots == NULL && snap.num_slots != 0) {
+		perror("calloc");
+		goto out;
+	}
+	slots = (const struct telemetry_slot *)((const uint8_t *)map + header->header_size);
+	for (uint32_t i = 0; i < snap.num_slots; i++) {
+		if (read_slot(&slots[i], &snap.slots[i]) != 0) {
+			fprintf(stderr, "%s: slot %u keeps changing\n", path, i);
+			goto out;
+		}
+	}
+
+	print_snapshot(out, &snap);
+	*finished = header->state == TELEMETRY_STATE_FINISHED;
+	rc = 0;
+out:
+	free(snap.slots);
+	munmap(map, st.st_size);
+	return rc;
+}
+
+// The collector never sees a partly written file
+static int
+scrape_to_file(const char *path, const char *output, bool *finished)
+{
+	char tmp[4096];
+	FILE *out;
+	int rc;
+
+	snprintf(tmp, sizeof(tmp), "%s.%d.tmp", output, getpid());
+	out = fopen(tmp, "w");
+	if (out == NULL) {
+		perror(tmp);
+		return -1;
+	}
+	rc = scrape(path, out, finished);
+	if (fclose(out) != 0) {
+		rc = -1;
+	}
+	if (rc == 0 && rename(tmp, output) != 0) {
+		perror(output);
+		rc = -1;
+	}
+	if (rc != 0) {
+		unlink(tmp);
+	}
+
+	return rc;
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *output = NULL;
+	long interval_ms = 0;
+	bool finished = false;
+	struct timespec ts;
+	int op, rc;
+
+	while ((op = getopt(argc, argv, "i:o:h")) != -1) {
+		switch (op) {
+		case 'i':
+			interval_ms = strtol(optarg, NULL, 10);
+			if (interval_ms <= 0) {
+				fprintf(stderr, "-i needs a positive interval\n");
+				return 1;
+			}
+			break;
+		case 'o':
+			output = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (optind != argc - 1) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	ts.tv_sec = interval_ms / 1000;
+	ts.tv_nsec = (interval_ms % 1000) * 1000000;
+	while (1) {
+		rc = output != NULL ? scrape_to_file(argv[optind], output, &finished) :
+			 scrape(argv[optind], stdout, &finished);
+		fflush(stdout);
+		// The last scrape of a finished run holds its final counters
+		if (interval_ms == 0 || finished) {
+			break;
+		}
+		nanosleep(&ts, NULL);
+	}
+
+	return rc != 0;
+}
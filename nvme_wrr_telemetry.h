@@ -0,0 +1,107 @@
+#ifndef NVME_WRR_TELEMETRY_H
+#define NVME_WRR_TELEMETRY_H
+
+// Layout of the --telemetry file, shared by nvme_wrr_demo which writes it
+// and nvme_wrr_stats which reads it. Only standard headers, the reader
+// is built without SPDK.
+
+#include <stdint.h>
+
+// "NVMWRRTL" read as a little endian word
+#define TELEMETRY_MAGIC 0x4c54525257524d4eULL
+
+// Changed with any change of the layout below
+#define TELEMETRY_VERSION 1
+
+#define TELEMETRY_CACHE_LINE 64
+
+// Latency buckets are log-linear in backend ticks: each power of two is
+// split into 1 << TELEMETRY_HIST_SUB_BITS buckets, an error of 1/16 at most.
+// Ticks of 2^TELEMETRY_HIST_MAX_EXP and more go to the last bucket.
+#define TELEMETRY_HIST_SUB_BITS 4
+#define TELEMETRY_HIST_MAX_EXP 40
+#define TELEMETRY_HIST_BUCKETS \
+	((TELEMETRY_HIST_MAX_EXP - TELEMETRY_HIST_SUB_BITS + 1) << TELEMETRY_HIST_SUB_BITS)
+
+#define TELEMETRY_NAME_LEN 64
+
+enum telemetry_state {
+	TELEMETRY_STATE_RUNNING = 1,
+	// The run ended, the counters stay as they were last
+	TELEMETRY_STATE_FINISHED,
+};
+
+struct telemetry_header {
+	uint64_t		magic;
+	uint32_t		version;
+	uint32_t		header_size;
+	uint32_t		slot_size;
+	uint32_t		num_slots;
+	uint32_t		hist_sub_bits;
+	uint32_t		hist_buckets;
+	// Latencies and timestamps are in these ticks
+	uint64_t		ticks_hz;
+	// Wall clock of the start, seconds since the epoch
+	uint64_t		start_time;
+	int32_t			pid;
+	// enum telemetry_state, written last at start and at the end
+	uint32_t		state;
+} __attribute__((aligned(TELEMETRY_CACHE_LINE)));
+
+// One per namespace of a worker, written only by that worker. The fields
+// above seq never change once the run started. A reader copies the slot
+// and keeps the copy only if seq was the same even number before and after.
+struct telemetry_slot {
+	char			name[TELEMETRY_NAME_LEN];
+	// enum spdk_nvme_qprio
+	uint32_t		qprio;
+	uint32_t		lcore;
+	uint32_t		nsid;
+	uint32_t		reserved;
+
+	// Odd while the worker updates the slot
+	uint64_t		seq __attribute__((aligned(TELEMETRY_CACHE_LINE)));
+	uint64_t		io_completed;
+	uint64_t		read_ios;
+	uint64_t		write_ios;
+	uint64_t		bytes;
+	// Sum of the latencies, for the mean
+	uint64_t		latency_ticks;
+	uint64_t		slo_missed;
+	// Backend ticks of the last completion
+	uint64_t		last_tick;
+	uint64_t		hist[TELEMETRY_HIST_BUCKETS];
+} __attribute__((aligned(TELEMETRY_CACHE_LINE)));
+
+static inline uint32_t
+telemetry_hist_bucket(uint64_t ticks)
+{
+	uint32_t exp, bucket;
+
+	if (ticks < (1ULL << TELEMETRY_HIST_SUB_BITS)) {
+		return (uint32_t)ticks;
+	}
+	exp = 63 - __builtin_clzll(ticks);
+	bucket = ((exp - TELEMETRY_HIST_SUB_BITS + 1) << TELEMETRY_HIST_SUB_BITS) +
+			 (uint32_t)((ticks >> (exp - TELEMETRY_HIST_SUB_BITS)) &
+						((1ULL << TELEMETRY_HIST_SUB_BITS) - 1));
+
+	return bucket < TELEMETRY_HIST_BUCKETS ? bucket : TELEMETRY_HIST_BUCKETS - 1;
+}
+
+// Smallest latency of a bucket, the one of bucket + 1 bounds it above
+static inline uint64_t
+telemetry_hist_lower(uint32_t bucket)
+{
+	uint32_t exp, sub;
+
+	if (bucket < (1U << TELEMETRY_HIST_SUB_BITS)) {
+		return bucket;
+	}
+	exp = (bucket >> TELEMETRY_HIST_SUB_BITS) + TELEMETRY_HIST_SUB_BITS - 1;
+	sub = bucket & ((1U << TELEMETRY_HIST_SUB_BITS) - 1);
+
+	return ((1ULL << TELEMETRY_HIST_SUB_BITS) + sub) << (exp - TELEMETRY_HIST_SUB_BITS);
+}
+
+#endif
@@ -0,0 +1,414 @@
+#include "spdk/stdinc.h"
+#include "spdk/env.h"
+#include "spdk/util.h"
+
+#include <liburing.h>
+#include <linux/capability.h>
+#include <linux/fs.h>
+#include <sys/syscall.h>
+
+#include "nvme_wrr_backend.h"
+
+// Regions registered as fixed buffers on one ring
+#define URING_MAX_REGIONS 16
+
+// Block size of regular files, which have no logical block size of their own
+#define URING_FILE_BLOCK_SIZE 4096
+
+#define URING_IOPRIO_CLASS_SHIFT 13
+#define URING_IOPRIO_CLASS_RT 1
+#define URING_IOPRIO_CLASS_BE 2
+#define URING_IOPRIO(class, data) (((class) << URING_IOPRIO_CLASS_SHIFT) | (data))
+
+struct uring_file {
+	const char			*filename;
+	int					fd;
+	uint64_t			size;
+	uint32_t			block_size;
+};
+
+struct uring_qpair {
+	struct io_uring		ring;
+	struct uring_file	*file;
+	uint16_t			ioprio;
+	// Prepared but not yet handed to the kernel
+	uint32_t			num_unsubmitted;
+	struct iovec		regions[URING_MAX_REGIONS];
+	uint32_t			num_regions;
+};
+
+static struct uring_file *g_uring_files = NULL;
+static int g_uring_num_files = 0;
+static bool g_uring_sqpoll = false;
+// -1 until the first urgent queue pair asks
+static int g_uring_rt_allowed = -1;
+
+// The kernel fails every I/O of the real-time class, with EPERM, unless the
+// process has CAP_SYS_ADMIN or CAP_SYS_NICE
+static bool
+uring_rt_allowed(void)
+{
+	struct __user_cap_header_struct hdr = {.version = _LINUX_CAPABILITY_VERSION_3, .pid = 0};
+	struct __user_cap_data_struct data[_LINUX_CAPABILITY_U32S_3] = {};
+
+	if (syscall(SYS_capget, &hdr, data) != 0) {
+		return false;
+	}
+	return (data[CAP_SYS_ADMIN / 32].effective & (1u << (CAP_SYS_ADMIN % 32))) ||
+		   (data[CAP_SYS_NICE / 32].effective & (1u << (CAP_SYS_NICE % 32)));
+}
+
+// The kernel has no weighted arbiter, the I/O priority classes of the block
+// layer are the closest thing and only matter with a scheduler honouring them
+static uint16_t
+uring_qprio_to_ioprio(enum spdk_nvme_qprio qprio)
+{
+	switch (qprio) {
+	case SPDK_NVME_QPRIO_URGENT:
+		if (g_uring_rt_allowed < 0) {
+			g_uring_rt_allowed = uring_rt_allowed();
+			if (!g_uring_rt_allowed) {
+				printf("WARNING: the real-time I/O priority of urgent needs CAP_SYS_ADMIN or "
+					   "CAP_SYS_NICE, urgent runs as the highest best-effort priority instead\n");
+			}
+		}
+		return g_uring_rt_allowed ? URING_IOPRIO(URING_IOPRIO_CLASS_RT, 0) :
+			   URING_IOPRIO(URING_IOPRIO_CLASS_BE, 0);
+	case SPDK_NVME_QPRIO_HIGH:
+		return URING_IOPRIO(URING_IOPRIO_CLASS_BE, 0);
+	case SPDK_NVME_QPRIO_MEDIUM:
+		return URING_IOPRIO(URING_IOPRIO_CLASS_BE, 4);
+	default:
+		return URING_IOPRIO(URING_IOPRIO_CLASS_BE, 7);
+	}
+}
+
+static int
+uring_open_file(struct uring_file *file)
+{
+	struct stat st;
+
+	file->fd = open(file->filename, O_RDWR | O_DIRECT);
+	if (file->fd < 0 && errno == EINVAL) {
+		// Some file systems, e.g. tmpfs, refuse O_DIRECT
+		file->fd = open(file->filename, O_RDWR);
+	}
+	if (file->fd < 0) {
+		fprintf(stderr, "Unable to open %s: %s\n", file->filename, strerror(errno));
+		return 1;
+	}
+
+	if (fstat(file->fd, &st) != 0) {
+		fprintf(stderr, "Unable to stat %s: %s\n", file->filename, strerror(errno));
+		return 1;
+	}
+
+	if (S_ISBLK(st.st_mode)) {
+		int block_size;
+
+		if (ioctl(file->fd, BLKSSZGET, &block_size) != 0 ||
+			ioctl(file->fd, BLKGETSIZE64, &file->size) != 0) {
+			fprintf(stderr, "Unable to get the geometry of %s: %s\n", file->filename, strerror(errno));
+			return 1;
+		}
+		file->block_size = block_size;
+	} else if (S_ISREG(st.st_mode)) {
+		file->size = st.st_size;
+		file->block_size = URING_FILE_BLOCK_SIZE;
+	} else {
+		fprintf(stderr, "%s is neither a block device nor a regular file\n", file->filename);
+		return 1;
+	}
+
+	return 0;
+}
+
+static int
+uring_attach(const struct arb_backend_opts *opts, arb_backend_ns_cb ns_cb)
+{
+	struct arb_backend_ns_info info = {};
+
+	if (opts->num_filenames == 0) {
+		fprintf(stderr, "uring backend needs at least one --filename\n");
+		return 1;
+	}
+
+	g_uring_files = calloc(opts->num_filenames, sizeof(*g_uring_files));
+	if (g_uring_files == NULL) {
+		return 1;
+	}
+	g_uring_sqpoll = opts->uring_sqpoll;
+
+	printf("Initializing io_uring backend%s\n", g_uring_sqpoll ? " with SQ polling" : "");
+
+	for (int i = 0; i < opts->num_filenames; i++) {
+		struct uring_file *file = &g_uring_files[i];
+
+		file->filename = opts->filenames[i];
+		if (uring_open_file(file) != 0) {
+			if (file->fd >= 0) {
+				close(file->fd);
+			}
+			return 1;
+		}
+		g_uring_num_files++;
+
+		snprintf(info.name, sizeof(info.name), "%s", file->filename);
+		info.nsid = i + 1;
+		info.size = file->size;
+		info.block_size = file->block_size;
+		info.extended_block_size = file->block_size;
+		// Deallocate is a hole punch and write zeroes a zero range
+		info.flags = SPDK_NVME_NS_DEALLOCATE_SUPPORTED | SPDK_NVME_NS_WRITE_ZEROES_SUPPORTED;
+		info.sgl_supported = true;
+		info.wrr_supported = false;
+		ns_cb(file, &info);
+	}
+
+	return 0;
+}
+
+static void
+uring_detach(void)
+{
+	for (int i = 0; i < g_uring_num_files; i++) {
+		close(g_uring_files[i].fd);
+	}
+	free(g_uring_files);
+	g_uring_files = NULL;
+	g_uring_num_files = 0;
+}
+
+static void *
+uring_qpair_alloc(void *backend_ns, enum spdk_nvme_qprio qprio, uint32_t depth)
+{
+	struct uring_qpair *qpair;
+	struct io_uring_params params = {};
+	int rc;
+
+	qpair = calloc(1, sizeof(*qpair));
+	if (qpair == NULL) {
+		return NULL;
+	}
+	qpair->file = backend_ns;
+	qpair->ioprio = uring_qprio_to_ioprio(qprio);
+
+	if (g_uring_sqpoll) {
+		params.flags |= IORING_SETUP_SQPOLL;
+		params.sq_thread_idle = 1000;
+	}
+	rc = io_uring_queue_init_params(spdk_max(depth, 1), &qpair->ring, &params);
+	if (rc != 0) {
+		fprintf(stderr, "io_uring_queue_init_params failed: %s\n", strerror(-rc));
+		free(qpair);
+		return NULL;
+	}
+
+	// Fixed file 0, saves the file reference counting on every command
+	rc = io_uring_register_files(&qpair->ring, &qpair->file->fd, 1);
+	if (rc != 0) {
+		fprintf(stderr, "io_uring_register_files failed: %s\n", strerror(-rc));
+		io_uring_queue_exit(&qpair->ring);
+		free(qpair);
+		return NULL;
+	}
+
+	return qpair;
+}
+
+static void
+uring_qpair_free(void *ctx)
+{
+	struct uring_qpair *qpair = ctx;
+
+	if (qpair == NULL) {
+		return;
+	}
+	io_uring_queue_exit(&qpair->ring);
+	free(qpair);
+}
+
+// Pin the region once, I/O inside it skips the per command page pinning
+static int
+uring_register_buf(void *ctx, void *buf, size_t len)
+{
+	struct uring_qpair *qpair = ctx;
+	int rc;
+
+	if (buf == NULL || len == 0) {
+		return 0;
+	}
+	if (qpair->num_regions == URING_MAX_REGIONS) {
+		return -ENOSPC;
+	}
+
+	if (qpair->num_regions != 0) {
+		io_uring_unregister_buffers(&qpair->ring);
+	}
+	qpair->regions[qpair->num_regions].iov_base = buf;
+	qpair->regions[qpair->num_regions].iov_len = len;
+	qpair->num_regions++;
+
+	rc = io_uring_register_buffers(&qpair->ring, qpair->regions, qpair->num_regions);
+	if (rc != 0) {
+		// Typically RLIMIT_MEMLOCK, fall back to plain vectored I/O
+		fprintf(stderr, "io_uring_register_buffers failed: %s, fixed buffers are not used\n",
+				strerror(-rc));
+		qpair->num_regions = 0;
+		return rc;
+	}
+
+	return 0;
+}
+
+static int
+uring_find_region(struct uring_qpair *qpair, const struct iovec *iov)
+{
+	uintptr_t start = (uintptr_t)iov->iov_base;
+
+	for (uint32_t i = 0; i < qpair->num_regions; i++) {
+		uintptr_t base = (uintptr_t)qpair->regions[i].iov_base;
+
+		if (start >= base && start + iov->iov_len <= base + qpair->regions[i].iov_len) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+static int
+uring_submit(void *ctx, struct arb_cmd *cmd)
+{
+	struct uring_qpair *qpair = ctx;
+	struct uring_file *file = cmd->ns;
+	struct io_uring_sqe *sqe;
+	uint64_t offset = cmd->lba * file->block_size;
+	uint64_t len = (uint64_t)cmd->lba_count * file->block_size;
+	int region = -1;
+
+	sqe = io_uring_get_sqe(&qpair->ring);
+	if (sqe == NULL) {
+		io_uring_submit(&qpair->ring);
+		qpair->num_unsubmitted = 0;
+		sqe = io_uring_get_sqe(&qpair->ring);
+		if (sqe == NULL) {
+			return -ENOMEM;
+		}
+	}
+
+	if ((cmd->op == ARB_OP_READ || cmd->op == ARB_OP_WRITE) && cmd->iovcnt == 1) {
+		region = uring_find_region(qpair, &cmd->iovs[0]);
+	}
+
+	switch (cmd->op) {
+	case ARB_OP_READ:
+		if (region >= 0) {
+			io_uring_prep_read_fixed(sqe, 0, cmd->iovs[0].iov_base, len, offset, region);
+		} else {
+			io_uring_prep_readv(sqe, 0, cmd->iovs, cmd->iovcnt, offset);
+		}
+		sqe->ioprio = qpair->ioprio;
+		break;
+	case ARB_OP_WRITE:
+		if (region >= 0) {
+			io_uring_prep_write_fixed(sqe, 0, cmd->iovs[0].iov_base, len, offset, region);
+		} else {
+			io_uring_prep_writev(sqe, 0, cmd->iovs, cmd->iovcnt, offset);
+		}
+		sqe->ioprio = qpair->ioprio;
+		break;
+	case ARB_OP_FLUSH:
+		io_uring_prep_fsync(sqe, 0, IORING_FSYNC_DATASYNC);
+		break;
+	case ARB_OP_DSM:
+		io_uring_prep_fallocate(sqe, 0, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, len);
+		break;
+	case ARB_OP_WRITE_ZEROES:
+		io_uring_prep_fallocate(sqe, 0, FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE, offset, len);
+		break;
+	default:
+		return -EINVAL;
+	}
+	sqe->flags |= IOSQE_FIXED_FILE;
+	io_uring_sqe_set_data(sqe, cmd);
+	qpair->num_unsubmitted++;
+
+	return 0;
+}
+
+static int32_t
+uring_poll(void *ctx, uint32_t max_completions)
+{
+	struct uring_qpair *qpair = ctx;
+	struct io_uring_cqe *cqe;
+	struct spdk_nvme_cpl cpl;
+	struct arb_cmd *cmd;
+	uint64_t expected;
+	int32_t completed = 0;
+
+	// Everything prepared since the last poll goes in with one system call
+	if (qpair->num_unsubmitted != 0) {
+		io_uring_submit(&qpair->ring);
+		qpair->num_unsubmitted = 0;
+	}
+
+	while (max_completions == 0 || (uint32_t)completed < max_completions) {
+		if (io_uring_peek_cqe(&qpair->ring, &cqe) != 0) {
+			break;
+		}
+		cmd = io_uring_cqe_get_data(cqe);
+
+		memset(&cpl, 0, sizeof(cpl));
+		cpl.status.sct = SPDK_NVME_SCT_GENERIC;
+		if (cqe->res < 0) {
+			cpl.status.sc = cqe->res == -EOPNOTSUPP || cqe->res == -EINVAL ?
+							SPDK_NVME_SC_INVALID_FIELD : SPDK_NVME_SC_INTERNAL_DEVICE_ERROR;
+		} else if (cmd->op == ARB_OP_READ || cmd->op == ARB_OP_WRITE) {
+			expected = (uint64_t)cmd->lba_count * ((struct uring_file *)cmd->ns)->block_size;
+			if ((uint64_t)cqe->res != expected) {
+				cpl.status.sc = SPDK_NVME_SC_DATA_TRANSFER_ERROR;
+			}
+		}
+		io_uring_cqe_seen(&qpair->ring, cqe);
+
+		cmd->cb_fn(cmd, &cpl);
+		completed++;
+	}
+
+	return completed;
+}
+
+static void *
+uring_buf_alloc(size_t size, size_t align, int numa_id)
+{
+	void *buf;
+
+	(void)numa_id;
+	// O_DIRECT wants the logical block alignment at least
+	if (posix_memalign(&buf, spdk_max(align, (size_t)URING_FILE_BLOCK_SIZE), size) != 0) {
+		return NULL;
+	}
+	memset(buf, 0, size);
+
+	return buf;
+}
+
+static void
+uring_buf_free(void *buf)
+{
+	free(buf);
+}
+
+const struct arb_backend_ops g_arb_uring_backend = {
+	.name			= "uring",
+	.attach			= uring_attach,
+	.detach			= uring_detach,
+	.qpair_alloc	= uring_qpair_alloc,
+	.qpair_free		= uring_qpair_free,
+	.register_buf	= uring_register_buf,
+	.submit			= uring_submit,
+	.poll			= uring_poll,
+	.buf_alloc		= uring_buf_alloc,
+	.buf_free		= uring_buf_free,
+};